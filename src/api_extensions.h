@@ -26,6 +26,12 @@ static char *api_extensions[] = {
 	"cpuview_daemon",
 	"loadavg_daemon",
 	"pidfds",
+	"proc_render_cache",
+	"lifecycle_events",
+	"proc_page_cache",
+	"proc_read_buf",
+	"lxcfs_stats",
+	"reload_state",
 };
 
 static size_t nr_api_extensions = sizeof(api_extensions) / sizeof(*api_extensions);
@@ -51,15 +51,24 @@
 #include "cgroup_fuse.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
+#include "hash_table.h"
+#include "lifecycle.h"
 #include "memory_utils.h"
+#include "proc_cache.h"
 #include "proc_cpuview.h"
+#include "proc_fuse.h"
+#include "state.h"
+#include "stats.h"
 #include "syscall_numbers.h"
 #include "utils.h"
 
 static bool can_use_pidfd;
+static bool can_use_nspid;
 static bool can_use_swap;
 
 static volatile sig_atomic_t reload_successful;
+/* How long the constructor took to get the library ready. */
+static uint64_t init_usecs;
 
 bool liblxcfs_functional(void)
 {
@@ -71,6 +80,30 @@ bool liblxcfs_can_use_swap(void)
 	return can_use_swap;
 }
 
+uint64_t liblxcfs_init_usecs(void)
+{
+	return init_usecs;
+}
+
+static uint64_t init_clock_usecs(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Log how long the step started at @start took and start the next one. */
+static void init_step_done(const char *step, uint64_t *start)
+{
+	uint64_t now = init_clock_usecs();
+
+	lxcfs_info("%s took %" PRIu64 "us", step, now - *start);
+	*start = now;
+}
+
 /* Define pivot_root() if missing from the C library */
 #ifndef HAVE_PIVOT_ROOT
 static int pivot_root(const char *new_root, const char *put_old)
@@ -86,7 +119,9 @@ extern int pivot_root(const char *new_root, const char *put_old);
  * When looking up which pid is init for $qpid, we first
  * 1. Stat /proc/$qpid/ns/pid.
  * 2. Check whether the ino_t is in our store.
- *   a. if not, fork a child in qpid's ns to send us
+ *   a. if not, walk up qpid's ancestors using the NSpid
+ *	 field of /proc/<pid>/status to find init. If that
+ *	 isn't possible fork a child in qpid's ns to send us
  *	 ucred.pid = 1, and read the initpid.  Cache
  *	 initpid and creation time for /proc/initpid
  *	 in a new store entry.
@@ -100,15 +135,34 @@ struct pidns_init_store {
 	pid_t initpid; /* the pid of nit in that ns */
 	int init_pidfd;
 	int64_t ctime; /* the time at which /proc/$initpid was created */
-	struct pidns_init_store *next;
 	int64_t lastcheck;
+	/* The lifecycle tracker reports the exit of init through the pidfd. */
+	bool watched;
+	/*
+	 * Filled in on first use by lookup_reaper_info() and kept for as long
+	 * as the entry lives. The start time can't change, the cgroup can if
+	 * init is migrated, which containers don't do. A migrated init keeps
+	 * reporting the busy time of its old cgroup in /proc/uptime until the
+	 * entry is dropped.
+	 */
+	bool reaper_valid;
+	uint64_t reaper_start_ms; /* start time of init after boot */
+	char *reaper_cpuacct; /* cpuacct cgroup of init, set if valid */
 };
 
-/* lol - look at how they are allocated in the kernel */
-#define PIDNS_HASH_SIZE 4096
-#define HASH(x) ((x) % PIDNS_HASH_SIZE)
+static bool pidns_store_match(const void *item, const void *key)
+{
+	const struct pidns_init_store *entry = item;
+
+	return entry->ino == *(const ino_t *)key;
+}
+
+#define HASH(x) hash_u64(x)
 
-static struct pidns_init_store *pidns_hash_table[PIDNS_HASH_SIZE];
+/* All entries keyed on the pid namespace inode, grows as needed. */
+static struct hash_table pidns_store = {
+	.match = pidns_store_match,
+};
 static pthread_mutex_t pidns_store_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void mutex_lock(pthread_mutex_t *l)
@@ -192,33 +246,32 @@ static bool initpid_still_valid(struct pidns_init_store *entry)
 	return ret == 1;
 }
 
+static void free_initpid(struct pidns_init_store *entry)
+{
+	close_prot_errno_disarm(entry->init_pidfd);
+	free_disarm(entry->reaper_cpuacct);
+	free_disarm(entry);
+}
+
 /* Must be called under store_lock */
 static void remove_initpid(struct pidns_init_store *entry)
 {
-	struct pidns_init_store *it;
-	int ino_hash;
-
 	lxcfs_debug("Removing cached entry for pid %d from init pid cache",
 		    entry->initpid);
 
-	ino_hash = HASH(entry->ino);
-	if (pidns_hash_table[ino_hash] == entry) {
-		pidns_hash_table[ino_hash] = entry->next;
-		close_prot_errno_disarm(entry->init_pidfd);
-		free_disarm(entry);
-		return;
-	}
+	hash_table_remove(&pidns_store, HASH(entry->ino), &entry->ino);
+	free_initpid(entry);
+}
 
-	it = pidns_hash_table[ino_hash];
-	while (it) {
-		if (it->next == entry) {
-			it->next = entry->next;
-			close_prot_errno_disarm(entry->init_pidfd);
-			free_disarm(entry);
-			return;
-		}
-		it = it->next;
-	}
+/*
+ * The store is also used outside of FUSE requests, e.g. when restoring state
+ * across a reload, where there is no context to take the options from.
+ */
+static const struct lxcfs_opts *store_opts(void)
+{
+	struct fuse_context *fc = fuse_get_context();
+
+	return fc ? fc->private_data : NULL;
 }
 
 #define PURGE_SECS 5
@@ -226,7 +279,9 @@ static void remove_initpid(struct pidns_init_store *entry)
 static void prune_initpid_store(void)
 {
 	static int64_t last_prune = 0;
+	struct pidns_init_store *entry;
 	int64_t now, threshold;
+	size_t pos;
 
 	if (!last_prune) {
 		last_prune = time(NULL);
@@ -242,44 +297,64 @@ static void prune_initpid_store(void)
 	last_prune = now;
 	threshold = now - 2 * PURGE_SECS;
 
-	for (int i = 0; i < PIDNS_HASH_SIZE; i++) {
-		for (struct pidns_init_store *entry = pidns_hash_table[i], *prev = NULL; entry;) {
-			if (entry->lastcheck < threshold) {
-				struct pidns_init_store *cur = entry;
-
-				lxcfs_debug("Removed cache entry for pid %d to init pid cache", cur->initpid);
-
-				if (prev)
-					prev->next = entry->next;
-				else
-					pidns_hash_table[i] = entry->next;
-				entry = entry->next;
-				close_prot_errno_disarm(cur->init_pidfd);
-				free_disarm(cur);
-			} else {
-				prev = entry;
-				entry = entry->next;
-			}
+	hash_table_for_each(&pidns_store, pos, entry) {
+		/* These are removed by the lifecycle tracker once init exits. */
+		if (entry->watched && lifecycle_active())
+			continue;
+
+		if (entry->lastcheck < threshold) {
+			lxcfs_debug("Removed cache entry for pid %d to init pid cache", entry->initpid);
+
+			hash_table_remove(&pidns_store, HASH(entry->ino), &entry->ino);
+			free_initpid(entry);
 		}
 	}
 }
 
 static void clear_initpid_store(void)
 {
+	struct pidns_init_store *entry;
+	size_t pos;
+
 	store_lock();
-	for (int i = 0; i < PIDNS_HASH_SIZE; i++) {
-		for (struct pidns_init_store *entry = pidns_hash_table[i]; entry;) {
-			struct pidns_init_store *cur = entry;
+	hash_table_for_each(&pidns_store, pos, entry) {
+		lxcfs_debug("Removed cache entry for pid %d to init pid cache", entry->initpid);
+
+		free_initpid(entry);
+	}
+	hash_table_fini(&pidns_store);
+	store_unlock();
+}
+
+/*
+ * Have the lifecycle tracker report the exit of the init process of @entry.
+ * If that isn't possible the entry expires through prune_initpid_store().
+ * Must be called under store_lock
+ */
+static void watch_initpid(struct pidns_init_store *entry)
+{
+	const struct lxcfs_opts *opts = store_opts();
+
+	if (entry->watched)
+		return;
+
+	/* Entries restored across a reload come without a pidfd. */
+	if (entry->init_pidfd < 0) {
+		if (!opts || !opts->use_pidfd || !can_use_pidfd)
+			return;
 
-			lxcfs_debug("Removed cache entry for pid %d to init pid cache", cur->initpid);
+		entry->init_pidfd = pidfd_open(entry->initpid, 0);
+		if (entry->init_pidfd < 0)
+			return;
 
-			pidns_hash_table[i] = entry->next;
-			entry = entry->next;
-			close_prot_errno_disarm(cur->init_pidfd);
-			free_disarm(cur);
+		/* Make sure the pid hasn't been recycled in the meantime. */
+		if (!initpid_still_valid_stat(entry)) {
+			close_prot_errno_disarm(entry->init_pidfd);
+			return;
 		}
 	}
-	store_unlock();
+
+	entry->watched = lifecycle_watch_pidfd(entry->init_pidfd, entry->ino) == 0;
 }
 
 /* Must be called under store_lock */
@@ -287,10 +362,9 @@ static void save_initpid(ino_t pidns_inode, pid_t pid)
 {
 	__do_free struct pidns_init_store *entry = NULL;
 	__do_close int pidfd = -EBADF;
-	const struct lxcfs_opts *opts = fuse_get_context()->private_data;
+	const struct lxcfs_opts *opts = store_opts();
 	char path[LXCFS_PROC_PID_LEN];
 	struct stat st;
-	int ino_hash;
 
 	if (opts && opts->use_pidfd && can_use_pidfd) {
 		pidfd = pidfd_open(pid, 0);
@@ -306,18 +380,20 @@ static void save_initpid(ino_t pidns_inode, pid_t pid)
 	if (!entry)
 		return;
 
-	ino_hash = HASH(pidns_inode);
 	*entry = (struct pidns_init_store){
 		.ino		= pidns_inode,
 		.initpid	= pid,
 		.ctime		= st.st_ctime,
-		.next		= pidns_hash_table[ino_hash],
 		.lastcheck	= time(NULL),
 		.init_pidfd	= move_fd(pidfd),
 	};
-	pidns_hash_table[ino_hash] = move_ptr(entry);
+	if (hash_table_insert(&pidns_store, HASH(pidns_inode), entry)) {
+		close_prot_errno_disarm(entry->init_pidfd);
+		return;
+	}
+	watch_initpid(move_ptr(entry));
 
-	lxcfs_debug("Added cache entry %d for pid %d to init pid cache", ino_hash, pid);
+	lxcfs_debug("Added cache entry for pid %d to init pid cache", pid);
 }
 
 /*
@@ -329,24 +405,81 @@ static void save_initpid(ino_t pidns_inode, pid_t pid)
  */
 static pid_t lookup_verify_initpid(ino_t pidns_inode)
 {
-	struct pidns_init_store *entry = pidns_hash_table[HASH(pidns_inode)];
-
-	while (entry) {
-		if (entry->ino == pidns_inode) {
-			if (initpid_still_valid(entry)) {
-				entry->lastcheck = time(NULL);
-				return entry->initpid;
-			}
-
-			remove_initpid(entry);
-			return ret_errno(ESRCH);
+	struct pidns_init_store *entry;
+
+	entry = hash_table_find(&pidns_store, HASH(pidns_inode), &pidns_inode);
+	if (entry) {
+		if (initpid_still_valid(entry)) {
+			entry->lastcheck = time(NULL);
+			watch_initpid(entry);
+			return entry->initpid;
 		}
-		entry = entry->next;
+
+		remove_initpid(entry);
 	}
 
 	return ret_errno(ESRCH);
 }
 
+/* Called by the lifecycle tracker once the init pid of @pidns_inode exited. */
+void initpid_evict(ino_t pidns_inode)
+{
+	struct pidns_init_store *entry;
+
+	store_lock();
+	entry = hash_table_find(&pidns_store, HASH(pidns_inode), &pidns_inode);
+	/* The watch fires only once, it's re-armed on the next lookup. */
+	if (entry && !initpid_still_valid(entry))
+		remove_initpid(entry);
+	else if (entry)
+		entry->watched = false;
+	store_unlock();
+}
+
+void initpid_state_save(struct lxcfs_state *s)
+{
+	struct pidns_init_store *entry;
+	size_t pos;
+
+	store_lock();
+	hash_table_for_each(&pidns_store, pos, entry) {
+		struct lxcfs_state_initpid rec = {
+			.ino		= entry->ino,
+			.ctime		= entry->ctime,
+			.initpid	= entry->initpid,
+		};
+
+		state_append(s, LXCFS_STATE_INITPID, &rec, sizeof(rec), NULL);
+	}
+	store_unlock();
+}
+
+/*
+ * Re-add an entry cached by the previous library unless its init process
+ * has been replaced in the meantime.
+ */
+bool initpid_state_restore(const void *payload, size_t len)
+{
+	struct lxcfs_state_initpid rec;
+	char path[LXCFS_PROC_PID_LEN];
+	struct stat st;
+
+	if (len != sizeof(rec))
+		return false;
+	memcpy(&rec, payload, sizeof(rec));
+
+	snprintf(path, sizeof(path), "/proc/%d", rec.initpid);
+	if (stat(path, &st) || st.st_ctime != rec.ctime)
+		return false;
+
+	store_lock();
+	if (!hash_table_find(&pidns_store, HASH(rec.ino), &(ino_t){rec.ino}))
+		save_initpid(rec.ino, rec.initpid);
+	store_unlock();
+
+	return true;
+}
+
 static bool send_creds_ok(int sock_fd)
 {
 	char v = '1'; /* we are the child */
@@ -497,8 +630,9 @@ static pid_t scm_init_pid(pid_t task)
 		write_task_init_pid_exit(sock[0], task);
 		_exit(EXIT_SUCCESS);
 	}
+	stats_inc(STATS_INITPID_FORK);
 
-	if (!recv_creds(sock[1], &cred, &v))
+	if (!recv_creds(sock[1], &cred, &v, true))
 		goto out;
 
 	pid_ret = cred.pid;
@@ -512,7 +646,128 @@ out:
 	return pid_ret;
 }
 
-pid_t lookup_initpid_in_store(pid_t pid)
+#define LXCFS_PROC_PID_STATUS_LEN \
+	(STRLITERALLEN("/proc/") + INTTYPE_TO_STRLEN(pid_t) + \
+	 STRLITERALLEN("/status") + 1)
+
+/*
+ * Retrieve the PPid and NSpid fields of /proc/<pid>/status. @depth is set to
+ * the number of pid namespaces @pid is visible in and @nspid to its pid in
+ * the innermost one. Kernels without NSpid support leave @depth at 0.
+ */
+static int read_pid_status(pid_t pid, pid_t *ppid, pid_t *nspid, int *depth)
+{
+	__do_close int fd = -EBADF;
+	__do_free char *buf = NULL;
+	char path[LXCFS_PROC_PID_STATUS_LEN];
+	size_t len = 0, size = 0;
+	char *line, *eol;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	/* The Groups: line alone can be longer than a page, read it all. */
+	for (;;) {
+		ssize_t bytes;
+
+		if (size - len < 2) {
+			size = size ? size * 2 : 4096;
+			buf = must_realloc(buf, size);
+		}
+
+		bytes = read_nointr(fd, buf + len, size - len - 1);
+		if (bytes < 0)
+			return -errno;
+		if (bytes == 0)
+			break;
+
+		len += bytes;
+	}
+	if (len == 0)
+		return ret_errno(EIO);
+	buf[len] = '\0';
+
+	*depth = 0;
+	for (line = buf; *line; line = eol + 1) {
+		/* The kernel terminates every line, anything else is cut off. */
+		eol = strchr(line, '\n');
+		if (!eol)
+			return ret_errno(EIO);
+		*eol = '\0';
+
+		if (strncmp(line, "PPid:", STRLITERALLEN("PPid:")) == 0) {
+			if (sscanf(line + STRLITERALLEN("PPid:"), "%d", ppid) != 1)
+				return ret_errno(EINVAL);
+		} else if (strncmp(line, "NSpid:", STRLITERALLEN("NSpid:")) == 0) {
+			char *it = line + STRLITERALLEN("NSpid:"), *end;
+
+			for (;;) {
+				long val = strtol(it, &end, 10);
+				if (end == it)
+					break;
+
+				*nspid = val;
+				(*depth)++;
+				it = end;
+			}
+
+			/* NSpid comes after PPid. */
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Find the init process of @task's pid namespace without forking by walking
+ * up its ancestors until we find the one that is pid 1 in the namespace. All
+ * ancestors that are visible in as many pid namespaces as @task live in the
+ * same pid namespace so we can stop as soon as the depth changes. That
+ * happens for tasks that were attached via setns() and in that case we fall
+ * back to scm_init_pid().
+ */
+static pid_t nspid_init_pid(pid_t task, ino_t pidns_inode)
+{
+	char path[LXCFS_PROC_PID_NS_LEN];
+	int task_depth = -1;
+	struct stat st;
+
+	for (pid_t pid = task; pid > 0;) {
+		pid_t ppid = 0, nspid = 0;
+		int depth, ret;
+
+		ret = read_pid_status(pid, &ppid, &nspid, &depth);
+		if (ret < 0)
+			return ret;
+
+		if (depth == 0)
+			return ret_errno(ENOSYS);
+
+		if (task_depth < 0)
+			task_depth = depth;
+		else if (depth != task_depth)
+			break;
+
+		if (nspid == 1) {
+			/* Guard against pid recycling while we walked the tree. */
+			snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid);
+			if (stat(path, &st) || st.st_ino != pidns_inode)
+				break;
+
+			return pid;
+		}
+
+		pid = ppid;
+	}
+
+	return ret_errno(ESRCH);
+}
+
+/* Like lookup_initpid_in_store() but also return the inode of the pidns. */
+static pid_t __lookup_initpid_in_store(pid_t pid, ino_t *pidns_inode)
 {
 	pid_t hashed_pid = 0;
 	char path[LXCFS_PROC_PID_NS_LEN];
@@ -521,6 +776,7 @@ pid_t lookup_initpid_in_store(pid_t pid)
 	snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid);
 	if (stat(path, &st))
 		return ret_errno(ESRCH);
+	*pidns_inode = st.st_ino;
 
 	store_lock();
 
@@ -528,13 +784,20 @@ pid_t lookup_initpid_in_store(pid_t pid)
 	if (hashed_pid < 0) {
 		/* release the mutex as the following call is expensive */
 		store_unlock();
+		stats_inc(STATS_INITPID_MISS);
 
-		hashed_pid = scm_init_pid(pid);
+		hashed_pid = -1;
+		if (can_use_nspid)
+			hashed_pid = nspid_init_pid(pid, st.st_ino);
+		if (hashed_pid < 0)
+			hashed_pid = scm_init_pid(pid);
 
 		store_lock();
 
 		if (hashed_pid > 0)
 			save_initpid(st.st_ino, hashed_pid);
+	} else {
+		stats_inc(STATS_INITPID_HIT);
 	}
 
 	/*
@@ -547,6 +810,127 @@ pid_t lookup_initpid_in_store(pid_t pid)
 	return hashed_pid;
 }
 
+pid_t lookup_initpid_in_store(pid_t pid)
+{
+	ino_t pidns_inode;
+
+	return __lookup_initpid_in_store(pid, &pidns_inode);
+}
+
+/* Return the start time of @pid in milliseconds after boot. */
+static int read_start_time_ms(pid_t pid, uint64_t *start_ms)
+{
+	__do_free void *fopen_cache = NULL;
+	__do_fclose FILE *f = NULL;
+	int ret;
+	uint64_t starttime;
+	long ticks_per_sec;
+	char path[STRLITERALLEN("/proc/") + LXCFS_NUMSTRLEN64 +
+		  STRLITERALLEN("/stat") + 1];
+
+	ret = snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return ret_errno(EINVAL);
+
+	f = fopen_cached(path, "re", &fopen_cache);
+	if (!f)
+		return ret_errno(EINVAL);
+
+	/* Note that the *scanf() argument supression requires that length
+	 * modifiers such as "l" are omitted. Otherwise some compilers will yell
+	 * at us. It's like telling someone you're not married and then asking
+	 * if you can bring your wife to the party.
+	 */
+	ret = fscanf(f, "%*d "      /* (1)  pid         %d   */
+			"%*s "      /* (2)  comm        %s   */
+			"%*c "      /* (3)  state       %c   */
+			"%*d "      /* (4)  ppid        %d   */
+			"%*d "      /* (5)  pgrp        %d   */
+			"%*d "      /* (6)  session     %d   */
+			"%*d "      /* (7)  tty_nr      %d   */
+			"%*d "      /* (8)  tpgid       %d   */
+			"%*u "      /* (9)  flags       %u   */
+			"%*u "      /* (10) minflt      %lu  */
+			"%*u "      /* (11) cminflt     %lu  */
+			"%*u "      /* (12) majflt      %lu  */
+			"%*u "      /* (13) cmajflt     %lu  */
+			"%*u "      /* (14) utime       %lu  */
+			"%*u "      /* (15) stime       %lu  */
+			"%*d "      /* (16) cutime      %ld  */
+			"%*d "      /* (17) cstime      %ld  */
+			"%*d "      /* (18) priority    %ld  */
+			"%*d "      /* (19) nice        %ld  */
+			"%*d "      /* (20) num_threads %ld  */
+			"%*d "      /* (21) itrealvalue %ld  */
+			"%" PRIu64, /* (22) starttime   %llu */
+		     &starttime);
+	if (ret != 1 || !starttime)
+		return ret_errno(EINVAL);
+
+	ticks_per_sec = sysconf(_SC_CLK_TCK);
+	if (ticks_per_sec <= 0)
+		return log_debug(-EINVAL, "Failed to determine number of clock ticks in a second");
+
+	*start_ms = starttime * 1000 / ticks_per_sec;
+	return 0;
+}
+
+/*
+ * Return what /proc/uptime needs to know about the init process of @qpid's
+ * pid namespace. None of it changes while init is alive so after the first
+ * lookup it is served from the init pid cache. The caller must free
+ * @info->cpuacct_cg.
+ */
+int lookup_reaper_info(pid_t qpid, struct reaper_info *info)
+{
+	__do_free char *cg = NULL;
+	struct pidns_init_store *entry;
+	uint64_t start_ms;
+	ino_t pidns_inode;
+	pid_t initpid;
+	int ret;
+
+	*info = (struct reaper_info){};
+
+	initpid = __lookup_initpid_in_store(qpid, &pidns_inode);
+	if (initpid <= 0)
+		return ret_errno(ESRCH);
+
+	store_lock();
+	entry = hash_table_find(&pidns_store, HASH(pidns_inode), &pidns_inode);
+	if (entry && entry->initpid == initpid && entry->reaper_valid) {
+		info->start_ms = entry->reaper_start_ms;
+		info->cpuacct_cg = strdup(entry->reaper_cpuacct);
+		store_unlock();
+		return 0;
+	}
+	store_unlock();
+
+	ret = read_start_time_ms(initpid, &start_ms);
+	if (ret < 0)
+		return ret;
+
+	cg = get_pid_cgroup(initpid, "cpuacct");
+	if (cg)
+		prune_init_slice(cg);
+
+	/* Only cache complete information, a later lookup might do better. */
+	store_lock();
+	entry = hash_table_find(&pidns_store, HASH(pidns_inode), &pidns_inode);
+	if (cg && entry && entry->initpid == initpid && !entry->reaper_valid) {
+		entry->reaper_cpuacct = strdup(cg);
+		if (entry->reaper_cpuacct) {
+			entry->reaper_start_ms = start_ms;
+			entry->reaper_valid = true;
+		}
+	}
+	store_unlock();
+
+	info->start_ms = start_ms;
+	info->cpuacct_cg = move_ptr(cg);
+	return 0;
+}
+
 /*
  * Functions needed to setup cgroups in the __constructor__.
  */
@@ -839,16 +1223,19 @@ static void __attribute__((constructor)) lxcfs_init(void)
 {
 	__do_close int init_ns = -EBADF, root_fd = -EBADF,
 				  pidfd = -EBADF;
-	int i = 0;
-	pid_t pid;
+	int i = 0, nspid_depth = 0;
+	pid_t pid, ppid, nspid;
+	uint64_t start, step;
 
 	lxcfs_info("Running constructor %s to reload liblxcfs", __func__);
+	start = step = init_clock_usecs();
 
 	cgroup_ops = cgroup_init();
 	if (!cgroup_ops) {
 		lxcfs_info("Failed to initialize cgroup support");
 		goto broken_upgrade;
 	}
+	init_step_done("Detecting cgroup layout", &step);
 
 	/* Preserve initial namespace. */
 	pid = getpid();
@@ -869,11 +1256,11 @@ static void __attribute__((constructor)) lxcfs_init(void)
 		log_exit("%s - Failed to switch back to initial mount namespace", strerror(errno));
 		goto broken_upgrade;
 	}
+	init_step_done("Mounting private cgroup hierarchies", &step);
 
-	if (!init_cpuview()) {
-		log_exit("Failed to init CPU view");
-		goto broken_upgrade;
-	}
+	if (!lifecycle_init())
+		lxcfs_info("Failed to start lifecycle tracking, falling back to polling");
+	init_step_done("Starting lifecycle tracking", &step);
 
 	lxcfs_info("mount namespace: %d", cgroup_ops->mntns_fd);
 	lxcfs_info("hierarchies:");
@@ -892,6 +1279,11 @@ static void __attribute__((constructor)) lxcfs_init(void)
 		lxcfs_info("Kernel supports pidfds");
 	}
 
+	if (read_pid_status(pid, &ppid, &nspid, &nspid_depth) == 0 && nspid_depth > 0) {
+		can_use_nspid = true;
+		lxcfs_info("Kernel supports NSpid");
+	}
+
 	can_use_swap = cgroup_ops->can_use_swap(cgroup_ops);
 	if (can_use_swap)
 		lxcfs_info("Kernel supports swap accounting");
@@ -913,6 +1305,9 @@ static void __attribute__((constructor)) lxcfs_init(void)
 		goto broken_upgrade;
 	}
 
+	init_usecs = init_clock_usecs() - start;
+	lxcfs_info("Initialized liblxcfs in %" PRIu64 "us", init_usecs);
+
 	reload_successful = 1;
 	return;
 
@@ -925,7 +1320,13 @@ static void __attribute__((destructor)) lxcfs_exit(void)
 {
 	lxcfs_info("Running destructor %s", __func__);
 
+	lifecycle_exit();
 	clear_initpid_store();
+	free_idmaps();
 	free_cpuview();
+	free_proc_page_cache();
+	free_proc_cache();
+	free_buf_pool();
+	free_stats();
 	cgroup_exit(cgroup_ops);
 }
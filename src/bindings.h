@@ -68,6 +68,8 @@ enum lxcfs_virt_t {
 
 	LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE,
 #define LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE_PATH "/sys/devices/system/cpu/online"
+
+	LXC_TYPE_MAX,
 };
 
 struct file_info {
@@ -79,19 +81,36 @@ struct file_info {
 	int buflen;
 	int size; /*actual data size */
 	int cached;
+	struct proc_cache_entry *shared; /* buf references this entry */
+	bool page_cache; /* opened with the kernel's page cache enabled */
 };
 
 struct lxcfs_opts {
 	bool swap_off;
 	bool use_pidfd;
 	bool use_cfs;
+	unsigned int cache_ttl; /* milliseconds, 0 disables the render cache */
+	unsigned int page_cache_ttl; /* milliseconds, 0 forces direct_io */
+	bool fuse_clone_fd; /* one /dev/fuse fd per worker thread */
+	unsigned int fuse_max_idle_threads; /* 0 keeps the libfuse default */
+	unsigned int fuse_max_threads; /* 0 keeps the libfuse default */
+	char *fuse_cpus; /* cpus the FUSE workers run on, NULL for all */
+};
+
+/* What is known about the init process of a pid namespace. */
+struct reaper_info {
+	uint64_t start_ms; /* start time after boot */
+	char *cpuacct_cg; /* cpuacct cgroup, NULL if unknown */
 };
 
 extern pid_t lookup_initpid_in_store(pid_t qpid);
+extern int lookup_reaper_info(pid_t qpid, struct reaper_info *info);
+extern void initpid_evict(ino_t pidns_inode);
 extern void prune_init_slice(char *cg);
 extern bool supports_pidfd(void);
 extern bool liblxcfs_functional(void);
 extern bool liblxcfs_can_use_swap(void);
+extern uint64_t liblxcfs_init_usecs(void);
 
 static inline int install_signal_handler(int signo,
 					 void (*handler)(int, siginfo_t *, void *))
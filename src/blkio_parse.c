@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_FUSE3
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+#else
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blkio_parse.h"
+#include "hash_table.h"
+#include "kv_parse.h"
+#include "memory_utils.h"
+
+static const struct {
+	const char *key;
+	unsigned int len;
+	int file;
+	int op;
+} io_stat_fields[] = {
+	{ "rbytes",	6, BLKIO_SERVICE_BYTES,	BLKIO_READ	},
+	{ "wbytes",	6, BLKIO_SERVICE_BYTES,	BLKIO_WRITE	},
+	{ "dbytes",	6, BLKIO_SERVICE_BYTES,	BLKIO_DISCARD	},
+	{ "rios",	4, BLKIO_SERVICED,	BLKIO_READ	},
+	{ "wios",	4, BLKIO_SERVICED,	BLKIO_WRITE	},
+	{ "dios",	4, BLKIO_SERVICED,	BLKIO_DISCARD	},
+};
+
+static bool blkio_dev_match(const void *item, const void *key)
+{
+	const struct blkio_dev *a = item, *b = key;
+
+	return a->major == b->major && a->minor == b->minor;
+}
+
+static inline uint64_t blkio_dev_hash(unsigned int major, unsigned int minor)
+{
+	return hash_u64(((uint64_t)major << 32) | minor);
+}
+
+void free_blkio_devs(struct hash_table *devs)
+{
+	struct blkio_dev *dev;
+	size_t pos;
+
+	hash_table_for_each(devs, pos, dev)
+		free(dev);
+	hash_table_fini(devs);
+	free(devs);
+}
+
+struct hash_table *blkio_devs_new(void)
+{
+	struct hash_table *devs;
+
+	devs = zalloc(sizeof(*devs));
+	if (devs)
+		devs->match = blkio_dev_match;
+
+	return devs;
+}
+
+struct blkio_dev *blkio_dev_find(struct hash_table *devs,
+				 unsigned int major, unsigned int minor)
+{
+	struct blkio_dev key = {
+		.major = major,
+		.minor = minor,
+	};
+
+	return hash_table_find(devs, blkio_dev_hash(major, minor), &key);
+}
+
+static struct blkio_dev *blkio_dev_get(struct hash_table *devs,
+				       unsigned int major, unsigned int minor)
+{
+	struct blkio_dev *dev;
+
+	dev = blkio_dev_find(devs, major, minor);
+	if (dev)
+		return dev;
+
+	dev = zalloc(sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	dev->major = major;
+	dev->minor = minor;
+	if (hash_table_insert(devs, blkio_dev_hash(major, minor), dev) < 0) {
+		free(dev);
+		return NULL;
+	}
+
+	return dev;
+}
+
+static int blkio_op(const char *s, size_t len)
+{
+	if (len == 4 && memcmp(s, "Read", 4) == 0)
+		return BLKIO_READ;
+	if (len == 5 && memcmp(s, "Write", 5) == 0)
+		return BLKIO_WRITE;
+	if (len == 7 && memcmp(s, "Discard", 7) == 0)
+		return BLKIO_DISCARD;
+	if (len == 5 && memcmp(s, "Total", 5) == 0)
+		return BLKIO_TOTAL;
+
+	return -1;
+}
+
+/*
+ * Parse a "<major>:<minor> <op> <value>" line of a blkio file counting
+ * towards @file or a "<major>:<minor> <key>=<value> ..." line of io.stat.
+ */
+static int parse_blkio_line(struct hash_table *devs, int file,
+			    const char *line, size_t len)
+{
+	const char *end = line + len, *p;
+	struct blkio_dev *dev;
+	uint64_t major, minor, v;
+	size_t n;
+
+	n = kv_parse_u64(line, len, &major);
+	if (!n || major > UINT_MAX || line + n == end || line[n] != ':')
+		return 0;
+	p = line + n + 1;
+
+	n = kv_parse_u64(p, end - p, &minor);
+	if (!n || minor > UINT_MAX || p + n == end || p[n] != ' ')
+		return 0;
+	p += n + 1;
+
+	dev = blkio_dev_get(devs, major, minor);
+	if (!dev)
+		return ret_errno(ENOMEM);
+
+	if (!memchr(p, '=', end - p)) {
+		const char *sep;
+		int op;
+
+		sep = memchr(p, ' ', end - p);
+		if (!sep)
+			return 0;
+
+		op = blkio_op(p, sep - p);
+		if (op >= 0 && kv_parse_u64(sep + 1, end - sep - 1, &v))
+			dev->v[file][op] = v;
+
+		return 0;
+	}
+
+	while (p < end) {
+		const char *tok_end = memchr(p, ' ', end - p) ?: end;
+		const char *eq = memchr(p, '=', tok_end - p);
+
+		for (size_t i = 0; eq && i < sizeof(io_stat_fields) / sizeof(*io_stat_fields); i++) {
+			if (io_stat_fields[i].len != eq - p ||
+			    memcmp(io_stat_fields[i].key, p, eq - p) != 0)
+				continue;
+
+			if (kv_parse_u64(eq + 1, tok_end - eq - 1, &v))
+				dev->v[io_stat_fields[i].file][io_stat_fields[i].op] = v;
+			break;
+		}
+
+		p = tok_end + 1;
+	}
+
+	return 0;
+}
+
+/* A single pass over the file. */
+int blkio_parse_buf(struct hash_table *devs, int file, const char *str)
+{
+	while (str && *str) {
+		const char *eol = strchrnul(str, '\n');
+		int ret;
+
+		ret = parse_blkio_line(devs, file, str, eol - str);
+		if (ret < 0)
+			return ret;
+
+		str = *eol ? eol + 1 : eol;
+	}
+
+	return 0;
+}
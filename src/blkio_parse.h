@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_BLKIO_PARSE_H
+#define __LXCFS_BLKIO_PARSE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "hash_table.h"
+#include "macro.h"
+#include "memory_utils.h"
+
+/*
+ * Parser for the per-device io counters of a cgroup: the blkio.* files of
+ * the legacy hierarchy with their "<major>:<minor> <op> <value>" lines and
+ * io.stat of the unified hierarchy with its "<major>:<minor> <key>=<value>
+ * ..." lines. Each file is parsed once into a (major, minor) -> counters
+ * table instead of being searched for every device and counter.
+ */
+
+/* Counters shared by the blkio.* files and io.stat, see enum cgroup_io_file. */
+enum {
+	BLKIO_SERVICED,
+	BLKIO_MERGED,
+	BLKIO_SERVICE_BYTES,
+	BLKIO_WAIT_TIME,
+	BLKIO_SERVICE_TIME,
+	BLKIO_NR_FILES,
+};
+
+enum {
+	BLKIO_READ,
+	BLKIO_WRITE,
+	BLKIO_DISCARD,
+	BLKIO_TOTAL,
+	BLKIO_NR_OPS,
+};
+
+/* All io counters of a single device in a cgroup. */
+struct blkio_dev {
+	unsigned int major;
+	unsigned int minor;
+	uint64_t v[BLKIO_NR_FILES][BLKIO_NR_OPS];
+};
+
+extern struct hash_table *blkio_devs_new(void);
+extern void free_blkio_devs(struct hash_table *devs);
+define_cleanup_function(struct hash_table *, free_blkio_devs);
+extern struct blkio_dev *blkio_dev_find(struct hash_table *devs,
+					unsigned int major, unsigned int minor);
+/*
+ * Add the counters found in @str to @devs. Lines of a blkio file count
+ * towards @file, io.stat lines name their counters themselves.
+ */
+extern int blkio_parse_buf(struct hash_table *devs, int file, const char *str);
+
+#endif /* __LXCFS_BLKIO_PARSE_H */
@@ -50,6 +50,7 @@
 #include "bindings.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
+#include "hash_table.h"
 #include "lxcfs_fuse_compat.h"
 #include "memory_utils.h"
 #include "utils.h"
@@ -352,46 +353,226 @@ static struct cgfs_files *cgfs_get_key(const char *controller,
 }
 
 /*
- * Given a open file * to /proc/pid/{u,g}id_map, and an id
- * valid in the caller's namespace, return the id mapped into
- * pid's namespace.
- * Returns the mapped id, or -1 on error.
+ * Parsed uid_map of a user namespace. Permission checks on the cgroup tree
+ * map ids all the time so the ranges are cached keyed on the inode of the
+ * namespace. The entry keeps the namespace open so the inode number can't
+ * be handed to a new namespace while it is cached, entries not used for
+ * IDMAP_PRUNE_SECS are dropped again.
  */
-static unsigned int convert_id_to_ns(FILE *idfile, unsigned int in_id)
+struct id_range {
+	unsigned int hostid; // base id for a range in the caller's namespace
+	unsigned int nsid;   // base id for a range in the namespace
+	unsigned int count;  // number of ids in this range
+};
+
+struct idmap {
+	ino_t ino;
+	int nsfd;
+	time_t lastuse;
+	size_t nr;
+	struct id_range ranges[]; /* sorted by hostid */
+};
+
+#define IDMAP_PRUNE_SECS 10
+
+static bool idmap_match(const void *item, const void *key)
+{
+	const struct idmap *map = item;
+
+	return map->ino == *(const ino_t *)key;
+}
+
+static struct hash_table idmap_table = {
+	.match = idmap_match,
+};
+static pthread_mutex_t idmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t idmap_lastprune;
+
+static void free_idmap(struct idmap *map)
+{
+	close_prot_errno_disarm(map->nsfd);
+	free_disarm(map);
+}
+
+static int cmp_id_range(const void *a, const void *b)
+{
+	const struct id_range *ra = a, *rb = b;
+
+	if (ra->hostid < rb->hostid)
+		return -1;
+	return ra->hostid > rb->hostid;
+}
+
+/* Return the id @in_id maps to in the namespace of @map or -1. */
+static uid_t idmap_lookup(const struct idmap *map, uid_t in_id)
+{
+	size_t lo = 0, hi = map->nr;
+
+	/* Find the last range starting at or below @in_id. */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (map->ranges[mid].hostid <= in_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0)
+		return -1;
+
+	/*
+	 * Ranges never wrap around so since hostid <= in_id < hostid+count
+	 * nsid+(in_id-hostid) can't either.
+	 */
+	lo--;
+	if (in_id - map->ranges[lo].hostid >= map->ranges[lo].count)
+		return -1;
+
+	return (in_id - map->ranges[lo].hostid) + map->ranges[lo].nsid;
+}
+
+/* Must be called with idmap_lock held. */
+static void prune_idmaps(time_t now)
+{
+	struct idmap *map;
+	size_t pos;
+
+	if (now < idmap_lastprune + IDMAP_PRUNE_SECS)
+		return;
+	idmap_lastprune = now;
+
+	hash_table_for_each(&idmap_table, pos, map) {
+		if (map->lastuse + IDMAP_PRUNE_SECS < now) {
+			hash_table_remove(&idmap_table, hash_u64(map->ino), &map->ino);
+			free_idmap(map);
+		}
+	}
+}
+
+/* Parse /proc/@pid/uid_map into a new map for the user namespace @nsfd. */
+static struct idmap *read_idmap(pid_t pid, int nsfd, ino_t ino)
 {
-	unsigned int nsuid,   // base id for a range in the idfile's namespace
-		     hostuid, // base id for a range in the caller's namespace
-		     count;   // number of ids in this range
+	__do_free struct idmap *map = NULL;
+	__do_fclose FILE *f = NULL;
+	char path[STRLITERALLEN("/proc/") + INTTYPE_TO_STRLEN(pid_t) +
+		  STRLITERALLEN("/uid_map") + 1];
 	char line[400];
-	int ret;
+	size_t size = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/uid_map", pid);
+	f = fopen(path, "re");
+	if (!f)
+		return NULL;
+
+	map = must_realloc(NULL, sizeof(*map));
+	map->nr = 0;
+	while (fgets(line, sizeof(line), f)) {
+		struct id_range r;
 
-	fseek(idfile, 0L, SEEK_SET);
-	while (fgets(line, 400, idfile)) {
-		ret = sscanf(line, "%u %u %u\n", &nsuid, &hostuid, &count);
-		if (ret != 3)
+		if (sscanf(line, "%u %u %u\n", &r.nsid, &r.hostid, &r.count) != 3)
 			continue;
-		if (hostuid + count < hostuid || nsuid + count < nsuid) {
+
+		if (r.hostid + r.count < r.hostid || r.nsid + r.count < r.nsid) {
 			/*
 			 * uids wrapped around - unexpected as this is a procfile,
 			 * so just bail.
 			 */
 			lxcfs_error("pid wrapparound at entry %u %u %u in %s\n",
-				nsuid, hostuid, count, line);
-			return -1;
+				    r.nsid, r.hostid, r.count, line);
+			return NULL;
 		}
-		if (hostuid <= in_id && hostuid+count > in_id) {
-			/*
-			 * now since hostuid <= in_id < hostuid+count, and
-			 * hostuid+count and nsuid+count do not wrap around,
-			 * we know that nsuid+(in_id-hostuid) which must be
-			 * less that nsuid+(count) must not wrap around
-			 */
-			return (in_id - hostuid) + nsuid;
+
+		if (map->nr == size) {
+			size = size ? size * 2 : 4;
+			map = must_realloc(map, sizeof(*map) + size * sizeof(r));
 		}
+		map->ranges[map->nr++] = r;
 	}
 
-	// no answer found
-	return -1;
+	qsort(map->ranges, map->nr, sizeof(struct id_range), cmp_id_range);
+	map->ino = ino;
+	map->nsfd = nsfd;
+	return move_ptr(map);
+}
+
+/*
+ * Map the @n host ids in @in into @pid's user namespace. Ids that aren't
+ * mapped are set to -1 in @out. Returns false if the uid_map of @pid
+ * couldn't be read.
+ */
+static bool map_ids_to_ns(pid_t pid, const uid_t *in, uid_t *out, int n)
+{
+	__do_close int nsfd = -EBADF;
+	char path[STRLITERALLEN("/proc/") + INTTYPE_TO_STRLEN(pid_t) +
+		  STRLITERALLEN("/ns/user") + 1];
+	struct idmap *map;
+	struct stat st, st2;
+	time_t now = time(NULL);
+
+	snprintf(path, sizeof(path), "/proc/%d/ns/user", pid);
+	if (stat(path, &st))
+		return false;
+
+	pthread_mutex_lock(&idmap_lock);
+	prune_idmaps(now);
+	map = hash_table_find(&idmap_table, hash_u64(st.st_ino), &st.st_ino);
+	if (map) {
+		map->lastuse = now;
+		for (int i = 0; i < n; i++)
+			out[i] = idmap_lookup(map, in[i]);
+		pthread_mutex_unlock(&idmap_lock);
+		return true;
+	}
+	pthread_mutex_unlock(&idmap_lock);
+
+	nsfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (nsfd < 0 || fstat(nsfd, &st))
+		return false;
+
+	map = read_idmap(pid, nsfd, st.st_ino);
+	if (!map)
+		return false;
+	move_fd(nsfd);
+
+	for (int i = 0; i < n; i++)
+		out[i] = idmap_lookup(map, in[i]);
+
+	/* @pid might have exited and been reused while we parsed its map. */
+	if (stat(path, &st2) || st2.st_ino != st.st_ino) {
+		free_idmap(map);
+		return false;
+	}
+
+	/*
+	 * A new user namespace has no map until somebody writes it, and then
+	 * it's there for good. Don't cache the empty map of that window.
+	 */
+	if (!map->nr) {
+		free_idmap(map);
+		return true;
+	}
+
+	map->lastuse = now;
+	pthread_mutex_lock(&idmap_lock);
+	if (hash_table_find(&idmap_table, hash_u64(map->ino), &map->ino) ||
+	    hash_table_insert(&idmap_table, hash_u64(map->ino), map))
+		free_idmap(map);
+	pthread_mutex_unlock(&idmap_lock);
+
+	return true;
+}
+
+void free_idmaps(void)
+{
+	struct idmap *map;
+	size_t pos;
+
+	pthread_mutex_lock(&idmap_lock);
+	hash_table_for_each(&idmap_table, pos, map)
+		free_idmap(map);
+	hash_table_fini(&idmap_table);
+	pthread_mutex_unlock(&idmap_lock);
 }
 
 /*
@@ -402,14 +583,9 @@ static unsigned int convert_id_to_ns(FILE *idfile, unsigned int in_id)
 #define NS_ROOT_REQD true
 #define NS_ROOT_OPT false
 
-#define PROCLEN 100
-
 static bool is_privileged_over(pid_t pid, uid_t uid, uid_t victim, bool req_ns_root)
 {
-	char fpath[PROCLEN];
-	int ret;
-	bool answer = false;
-	uid_t nsuid;
+	uid_t ids[2] = {uid, victim}, nsids[2];
 
 	if (victim == -1 || uid == -1)
 		return false;
@@ -422,32 +598,22 @@ static bool is_privileged_over(pid_t pid, uid_t uid, uid_t victim, bool req_ns_r
 	if (!req_ns_root && uid == victim)
 		return true;
 
-	ret = snprintf(fpath, PROCLEN, "/proc/%d/uid_map", pid);
-	if (ret < 0 || ret >= PROCLEN)
-		return false;
-	FILE *f = fopen(fpath, "re");
-	if (!f)
+	if (!map_ids_to_ns(pid, ids, nsids, 2))
 		return false;
 
 	/* if caller's not root in his namespace, reject */
-	nsuid = convert_id_to_ns(f, uid);
-	if (nsuid)
-		goto out;
+	if (nsids[0])
+		return false;
 
 	/*
 	 * If victim is not mapped into caller's ns, reject.
 	 * XXX I'm not sure this check is needed given that fuse
 	 * will be sending requests where the vfs has converted
 	 */
-	nsuid = convert_id_to_ns(f, victim);
-	if (nsuid == -1)
-		goto out;
-
-	answer = true;
+	if (nsids[1] == -1)
+		return false;
 
-out:
-	fclose(f);
-	return answer;
+	return true;
 }
 
 static bool perms_include(int fmode, mode_t req_mode)
@@ -489,30 +655,31 @@ static void free_key(struct cgfs_files *k)
  * cgroup, because cgmanager doesn't tell us ownership/perms of cgroups
  * yet.
  */
+/* May the caller access a file owned by @uid and @gid with @perms in @mode? */
+static bool fc_may_access_perms(struct fuse_context *fc, uid_t uid, gid_t gid,
+				mode_t perms, mode_t mode)
+{
+	if (is_privileged_over(fc->pid, fc->uid, uid, NS_ROOT_OPT)) {
+		if (perms_include(perms >> 6, mode))
+			return true;
+	}
+	if (fc->gid == gid) {
+		if (perms_include(perms >> 3, mode))
+			return true;
+	}
+	return perms_include(perms, mode);
+}
+
 static bool fc_may_access(struct fuse_context *fc, const char *contrl, const char *cg, const char *file, mode_t mode)
 {
 	struct cgfs_files *k = NULL;
-	bool ret = false;
+	bool ret;
 
 	k = cgfs_get_key(contrl, cg, file);
 	if (!k)
 		return false;
 
-	if (is_privileged_over(fc->pid, fc->uid, k->uid, NS_ROOT_OPT)) {
-		if (perms_include(k->mode >> 6, mode)) {
-			ret = true;
-			goto out;
-		}
-	}
-	if (fc->gid == k->gid) {
-		if (perms_include(k->mode >> 3, mode)) {
-			ret = true;
-			goto out;
-		}
-	}
-	ret = perms_include(k->mode, mode);
-
-out:
+	ret = fc_may_access_perms(fc, k->uid, k->gid, k->mode, mode);
 	free_key(k);
 	return ret;
 }
@@ -1159,25 +1326,53 @@ out:
 #define POLLIN_SET ( EPOLLIN | EPOLLHUP | EPOLLRDHUP )
 
 /*
- * pid_to_ns - reads pids from a ucred over a socket, then writes the
- * int value back over the socket.  This shifts the pid from the
- * sender's pidns into tpid's pidns.
+ * Number of pids translated per round-trip between lxcfs and the helper
+ * living in the target pid namespace. The kernel only translates a single
+ * ucred per message so each pid is still sent separately but we only wait
+ * for an answer once per batch.
+ */
+#define PID_BATCH_SIZE 64
+
+/* Message types exchanged with the pid translation helpers. */
+#define PID_MSG_PID	'0'
+#define PID_MSG_EXIT	'1'
+#define PID_MSG_FLUSH	'2'
+
+/*
+ * pid_to_ns - reads pids from a ucred over a socket and collects them. When
+ * asked to flush it writes all pids collected so far back over the socket
+ * in a single message. This shifts the pids from the sender's pidns into
+ * tpid's pidns.
  */
 static int pid_to_ns(int sock, pid_t tpid)
 {
-	char v = '0';
+	pid_t pids[PID_BATCH_SIZE];
+	size_t nr_pids = 0;
+	char v = PID_MSG_PID;
 	struct ucred cred = {
 		.pid = -1,
 		.uid = -1,
 		.gid = -1,
 	};
 
-	while (recv_creds(sock, &cred, &v)) {
-		if (v == '1')
-			return 0;
+	while (recv_creds(sock, &cred, &v, false)) {
+		ssize_t len;
 
-		if (write_nointr(sock, &cred.pid, sizeof(pid_t)) != sizeof(pid_t))
-			return 1;
+		switch (v) {
+		case PID_MSG_EXIT:
+			return 0;
+		case PID_MSG_FLUSH:
+			len = nr_pids * sizeof(pid_t);
+			if (write_nointr(sock, pids, len) != len)
+				return 1;
+			nr_pids = 0;
+			break;
+		default:
+			if (nr_pids == PID_BATCH_SIZE)
+				return 1;
+			pids[nr_pids++] = cred.pid;
+			break;
+		}
 	}
 
 	return 0;
@@ -1265,6 +1460,36 @@ static void must_strcat_pid(char **src, size_t *sz, size_t *asz, pid_t pid)
 	must_strcat(src, sz, asz, "%d\n", (int)pid);
 }
 
+/*
+ * Ask the pid_to_ns() helper for the translations of the pids sent since the
+ * last flush and append them to @d.
+ */
+static bool flush_read_pids(int sock, char **d, size_t *sz, size_t *asz)
+{
+	pid_t pids[PID_BATCH_SIZE];
+	struct ucred cred = {
+		.pid = getpid(),
+		.uid = 0,
+		.gid = 0,
+	};
+	ssize_t ret;
+
+	if (send_creds(sock, &cred, PID_MSG_FLUSH, false) != SEND_CREDS_OK)
+		return false;
+
+	if (!wait_for_sock(sock, 2))
+		return log_error(false, "Timed out waiting for pids from child: %s.\n", strerror(errno));
+
+	ret = read(sock, pids, sizeof(pids));
+	if (ret < 0 || ret % sizeof(pid_t))
+		return log_error(false, "Error reading pids from child: %s.\n", strerror(errno));
+
+	for (size_t i = 0; i < ret / sizeof(pid_t); i++)
+		must_strcat_pid(d, sz, asz, pids[i]);
+
+	return true;
+}
+
 /*
  * To read cgroup files with a particular pid, we will setns into the child
  * pidns, open a pipe, fork a child - which will be the first to really be in
@@ -1275,20 +1500,19 @@ static bool do_read_pids(pid_t tpid, const char *contrl, const char *cg,
 {
 	int sock[2] = {-1, -1};
 	char *tmpdata = NULL;
-	int ret;
+	int ret, optval = 1;
 	pid_t qpid, cpid = -1;
 	bool answer = false;
-	char v = '0';
 	struct ucred cred;
-	size_t sz = 0, asz = 0;
+	size_t sz = 0, asz = 0, nr_pids = 0;
 
 	if (!get_cgroup_handle_named(cgroup_ops, contrl, cg, file, &tmpdata))
 		return false;
 
 	/*
-	 * Now we read the pids from returned data one by one, pass
-	 * them into a child in the target namespace, read back the
-	 * translated pids, and put them into our to-return data
+	 * Now we read the pids from returned data, pass them into a child in
+	 * the target namespace in batches, read back the translated pids, and
+	 * put them into our to-return data
 	 */
 
 	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sock) < 0) {
@@ -1297,6 +1521,14 @@ static bool do_read_pids(pid_t tpid, const char *contrl, const char *cg,
 		return false;
 	}
 
+	/*
+	 * Credentials are only attached if the receiving socket has
+	 * SO_PASSCRED set at the time they are sent. Set it before the child
+	 * exists so we don't need to wait for it before every batch.
+	 */
+	if (setsockopt(sock[1], SOL_SOCKET, SO_PASSCRED, &optval, sizeof(optval)) < 0)
+		goto out;
+
 	cpid = fork();
 	if (cpid == -1)
 		goto out;
@@ -1309,23 +1541,18 @@ static bool do_read_pids(pid_t tpid, const char *contrl, const char *cg,
 	cred.gid = 0;
 	while (sscanf(ptr, "%d\n", &qpid) == 1) {
 		cred.pid = qpid;
-		ret = send_creds(sock[0], &cred, v, true);
+		ret = send_creds(sock[0], &cred, PID_MSG_PID, false);
 
 		if (ret == SEND_CREDS_NOTSK)
 			goto next;
 		if (ret == SEND_CREDS_FAIL)
 			goto out;
 
-		// read converted results
-		if (!wait_for_sock(sock[0], 2)) {
-			lxcfs_error("Timed out waiting for pid from child: %s.\n", strerror(errno));
-			goto out;
-		}
-		if (read(sock[0], &qpid, sizeof(qpid)) != sizeof(qpid)) {
-			lxcfs_error("Error reading pid from child: %s.\n", strerror(errno));
-			goto out;
+		if (++nr_pids == PID_BATCH_SIZE) {
+			if (!flush_read_pids(sock[0], d, &sz, &asz))
+				goto out;
+			nr_pids = 0;
 		}
-		must_strcat_pid(d, &sz, &asz, qpid);
 next:
 		ptr = strchr(ptr, '\n');
 		if (!ptr)
@@ -1333,9 +1560,11 @@ next:
 		ptr++;
 	}
 
+	if (nr_pids && !flush_read_pids(sock[0], d, &sz, &asz))
+		goto out;
+
 	cred.pid = getpid();
-	v = '1';
-	if (send_creds(sock[0], &cred, v, true) != SEND_CREDS_OK) {
+	if (send_creds(sock[0], &cred, PID_MSG_EXIT, false) != SEND_CREDS_OK) {
 		// failed to ask child to exit
 		lxcfs_error("Failed to ask child to exit: %s.\n", strerror(errno));
 		goto out;
@@ -1515,12 +1744,16 @@ static FILE *open_pids_file(const char *controller, const char *cgroup)
 	return f;
 }
 
+/*
+ * pid_from_ns - reads a batch of pids in tpid's pidns from the socket and
+ * sends back one ucred per pid. A ucred carrying '1' means the pid doesn't
+ * exist. A batch consisting of a single -1 asks us to exit.
+ */
 static int pid_from_ns(int sock, pid_t tpid)
 {
-	pid_t vpid;
+	pid_t vpids[PID_BATCH_SIZE];
 	struct ucred cred;
-	char v;
-	int ret;
+	ssize_t ret;
 
 	cred.uid = 0;
 	cred.gid = 0;
@@ -1529,19 +1762,21 @@ static int pid_from_ns(int sock, pid_t tpid)
 			lxcfs_error("%s\n", "Timeout reading from parent.");
 			return 1;
 		}
-		if ((ret = read(sock, &vpid, sizeof(pid_t))) != sizeof(pid_t)) {
+		ret = read(sock, vpids, sizeof(vpids));
+		if (ret <= 0 || ret % sizeof(pid_t)) {
 			lxcfs_error("Bad read from parent: %s.\n", strerror(errno));
 			return 1;
 		}
-		if (vpid == -1) // done
+		if (ret == sizeof(pid_t) && vpids[0] == -1) // done
 			break;
-		v = '0';
-		cred.pid = vpid;
-		if (send_creds(sock, &cred, v, true) != SEND_CREDS_OK) {
-			v = '1';
-			cred.pid = getpid();
-			if (send_creds(sock, &cred, v, false) != SEND_CREDS_OK)
-				return 1;
+
+		for (size_t i = 0; i < ret / sizeof(pid_t); i++) {
+			cred.pid = vpids[i];
+			if (send_creds(sock, &cred, '0', false) != SEND_CREDS_OK) {
+				cred.pid = getpid();
+				if (send_creds(sock, &cred, '1', false) != SEND_CREDS_OK)
+					return 1;
+			}
 		}
 	}
 	return 0;
@@ -1636,16 +1871,8 @@ static void get_pid_creds(pid_t pid, uid_t *uid, gid_t *gid)
  */
 static bool hostuid_to_ns(uid_t uid, pid_t pid, uid_t *answer)
 {
-	FILE *f;
-	char line[400];
-
-	sprintf(line, "/proc/%d/uid_map", pid);
-	if ((f = fopen(line, "re")) == NULL) {
+	if (!map_ids_to_ns(pid, &uid, answer, 1))
 		return false;
-	}
-
-	*answer = convert_id_to_ns(f, uid);
-	fclose(f);
 
 	if (*answer == -1)
 		return false;
@@ -1678,13 +1905,48 @@ static bool may_move_pid(pid_t r, uid_t r_uid, pid_t v)
 	return false;
 }
 
+/*
+ * Send a batch of @nr_pids pids to the pid_from_ns() helper and move all
+ * host pids it answers with into the cgroup.
+ */
+static bool flush_write_pids(int sock, pid_t tpid, uid_t tuid,
+			     FILE *pids_file, pid_t *pids, size_t nr_pids)
+{
+	ssize_t len = nr_pids * sizeof(pid_t);
+
+	if (write(sock, pids, len) != len)
+		return log_error(false, "Error writing pids to child: %s.\n", strerror(errno));
+
+	for (size_t i = 0; i < nr_pids; i++) {
+		struct ucred cred;
+		char v;
+
+		if (!recv_creds(sock, &cred, &v, false))
+			return false;
+
+		if (v != '0')
+			continue;
+
+		if (!may_move_pid(tpid, tuid, cred.pid))
+			return false;
+
+		if (fprintf(pids_file, "%d", (int) cred.pid) < 0)
+			return false;
+	}
+
+	return true;
+}
+
 static bool do_write_pids(pid_t tpid, uid_t tuid, const char *contrl,
 			  const char *cg, const char *file, const char *buf)
 {
 	int sock[2] = {-1, -1};
 	pid_t qpid, cpid = -1;
+	pid_t pids[PID_BATCH_SIZE];
+	size_t nr_pids = 0;
 	FILE *pids_file = NULL;
 	bool answer = false, fail = false;
+	int optval = 1;
 
 	pids_file = open_pids_file(contrl, cg);
 	if (!pids_file)
@@ -1699,6 +1961,10 @@ static bool do_write_pids(pid_t tpid, uid_t tuid, const char *contrl,
 		goto out;
 	}
 
+	/* See do_read_pids(). */
+	if (setsockopt(sock[0], SOL_SOCKET, SO_PASSCRED, &optval, sizeof(optval)) < 0)
+		goto out;
+
 	cpid = fork();
 	if (cpid == -1)
 		goto out;
@@ -1709,24 +1975,16 @@ static bool do_write_pids(pid_t tpid, uid_t tuid, const char *contrl,
 	}
 
 	const char *ptr = buf;
-	while (sscanf(ptr, "%d", &qpid) == 1) {
-		struct ucred cred;
-		char v;
-
-		if (write(sock[0], &qpid, sizeof(qpid)) != sizeof(qpid)) {
-			lxcfs_error("Error writing pid to child: %s.\n", strerror(errno));
-			goto out;
-		}
+	while (!fail && sscanf(ptr, "%d", &qpid) == 1) {
+		/* A lone -1 tells the helper to exit. */
+		if (qpid == -1)
+			break;
 
-		if (recv_creds(sock[0], &cred, &v)) {
-			if (v == '0') {
-				if (!may_move_pid(tpid, tuid, cred.pid)) {
-					fail = true;
-					break;
-				}
-				if (fprintf(pids_file, "%d", (int) cred.pid) < 0)
-					fail = true;
-			}
+		pids[nr_pids++] = qpid;
+		if (nr_pids == PID_BATCH_SIZE) {
+			fail = !flush_write_pids(sock[0], tpid, tuid, pids_file,
+						 pids, nr_pids);
+			nr_pids = 0;
 		}
 
 		ptr = strchr(ptr, '\n');
@@ -1735,6 +1993,10 @@ static bool do_write_pids(pid_t tpid, uid_t tuid, const char *contrl,
 		ptr++;
 	}
 
+	if (!fail && nr_pids)
+		fail = !flush_write_pids(sock[0], tpid, tuid, pids_file, pids,
+					 nr_pids);
+
 	/* All good, write the value */
 	qpid = -1;
 	if (write(sock[0], &qpid ,sizeof(qpid)) != sizeof(qpid))
@@ -1833,127 +2095,91 @@ out:
 	return size;
 }
 
-static bool cgfs_iterate_cgroup(const char *controller, const char *cgroup,
-				bool directories, void ***list, size_t typesize,
-				void *(*iterator)(const char *, const char *, const char *))
-{
-	__do_close int fd = -EBADF;
-	__do_free char *path = NULL;
-	__do_closedir DIR *dir = NULL;
-	size_t sz = 0, asz = 0;
-	int cfd;
-	struct dirent *dirent;
+struct lxcfs_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
 
-	cfd = get_cgroup_fd_handle_named(controller);
-	*list = NULL;
-	if (cfd < 0)
-		return false;
+/*
+ * Hand the files and child cgroups of the directory @dfd to @filler. The
+ * directory is read with getdents64() into an on-stack buffer and every
+ * entry is stat()ed exactly once. The attributes are passed along with the
+ * entry and match what cg_getattr() would report, so with readdirplus the
+ * kernel doesn't need to look each entry up again.
+ */
+static int cg_fill_dir(struct fuse_context *fc, int dfd, void *buf,
+		       fuse_fill_dir_t filler)
+{
+	char dents[16384] __attribute__((aligned(8)));
+	struct timespec now;
 
-	path = must_make_path_relative(cgroup, NULL);
-	fd = openat(cfd, path, O_DIRECTORY | O_CLOEXEC);
-	if (fd < 0)
-		return false;
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+		return -EINVAL;
 
-	dir = fdopendir(fd);
-	if (!dir)
-		return false;
-	/* Transfer ownership of fd to fdopendir(). */
-	move_fd(fd);
+	for (;;) {
+		ssize_t len;
 
-	while ((dirent = readdir(dir))) {
-		int ret;
-		char pathname[MAXPATHLEN];
-		struct stat mystat;
+		len = syscall(__NR_getdents64, dfd, dents, sizeof(dents));
+		if (len < 0)
+			return -errno;
+		if (len == 0)
+			return 0;
 
-		if (strcmp(dirent->d_name, ".") == 0)
-			continue;
+		for (ssize_t off = 0; off < len;) {
+			struct lxcfs_dirent64 *dirent = (struct lxcfs_dirent64 *)(dents + off);
+			struct stat st, sb = {}, *statp = &sb;
 
-		if (strcmp(dirent->d_name, "..") == 0)
-			continue;
+			off += dirent->d_reclen;
 
-		ret = snprintf(pathname, sizeof(pathname), "%s/%s", path, dirent->d_name);
-		if (ret < 0 || ret >= sizeof(pathname)) {
-			lxcfs_error("Pathname too long under %s\n", path);
-			continue;
-		}
+			if (strcmp(dirent->d_name, ".") == 0 ||
+			    strcmp(dirent->d_name, "..") == 0)
+				continue;
 
-		ret = fstatat(cfd, pathname, &mystat, AT_SYMLINK_NOFOLLOW);
-		if (ret) {
-			lxcfs_error("Failed to stat %s: %s\n", pathname, strerror(errno));
-			continue;
-		}
+			if (dirent->d_type != DT_REG && dirent->d_type != DT_DIR &&
+			    dirent->d_type != DT_UNKNOWN)
+				continue;
 
-		if (!directories && !S_ISREG(mystat.st_mode))
-			continue;
+			if (fstatat(dfd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+				lxcfs_error("Failed to stat %s: %s\n", dirent->d_name, strerror(errno));
+				continue;
+			}
 
-		if (directories && !S_ISDIR(mystat.st_mode))
-			continue;
+			sb.st_atim = sb.st_mtim = sb.st_ctim = now;
+			sb.st_uid = st.st_uid;
+			sb.st_gid = st.st_gid;
+			if (S_ISREG(st.st_mode)) {
+				sb.st_mode = st.st_mode;
+				sb.st_nlink = 1;
+				sb.st_size = 4096;
+			} else if (S_ISDIR(st.st_mode)) {
+				sb.st_mode = S_IFDIR | 00755;
+				sb.st_nlink = 2;
+				/* Let cg_getattr() deny access as usual. */
+				if (!fc_may_access_perms(fc, st.st_uid, st.st_gid, st.st_mode, O_RDONLY))
+					statp = NULL;
+			} else {
+				continue;
+			}
 
-		if (sz + 2 >= asz) {
-			asz += BATCH_SIZE;
-			*list = must_realloc(*list, asz * typesize);
+			if (DIR_FILLER(filler, buf, dirent->d_name, statp, 0) != 0)
+				return -EIO;
 		}
-		(*list)[sz] = (*iterator)(controller, path, dirent->d_name);
-		(*list)[sz + 1] = NULL;
-		sz++;
 	}
-
-	return true;
-}
-
-static void *make_key_list_entry(const char *controller, const char *cgroup,
-				 const char *dir_entry)
-{
-	struct cgfs_files *entry;
-
-	entry = cgfs_get_key(controller, cgroup, dir_entry);
-	if (!entry)
-		lxcfs_error("Failed to retrieve files under %s:%s\n",
-			    controller, cgroup);
-	return entry;
-}
-
-static bool cgfs_list_keys(const char *controller, const char *cgroup,
-			   struct cgfs_files ***keys)
-{
-	return cgfs_iterate_cgroup(controller, cgroup, false, (void ***)keys,
-				   sizeof(*keys), &make_key_list_entry);
-}
-
-static void *make_children_list_entry(const char *controller,
-				      const char *cgroup, const char *dir_entry)
-{
-	return strdup(dir_entry);
-}
-
-static bool cgfs_list_children(const char *controller, const char *cgroup,
-			       char ***list)
-{
-	return cgfs_iterate_cgroup(controller, cgroup, true, (void ***)list,
-				   sizeof(*list), &make_children_list_entry);
-}
-
-static void free_keys(struct cgfs_files **keys)
-{
-	if (!keys)
-		return;
-
-	for (int i = 0; keys[i]; i++)
-		free_key(keys[i]);
-
-	free_disarm(keys);
 }
 
 __lxcfs_fuse_ops int cg_readdir(const char *path, void *buf,
 				fuse_fill_dir_t filler, off_t offset,
 				struct fuse_file_info *fi)
 {
+	__do_close int dfd = -EBADF;
+	__do_free char *cgpath = NULL;
 	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
-	struct cgfs_files **list = NULL;
-	int i, ret;
+	int cfd, ret;
 	char *nextcg = NULL;
 	struct fuse_context *fc = fuse_get_context();
-	char **clist = NULL;
 
 	if (!liblxcfs_functional())
 		return -EIO;
@@ -1984,10 +2210,15 @@ __lxcfs_fuse_ops int cg_readdir(const char *path, void *buf,
 		return 0;
 	}
 
-	if (!cgfs_list_keys(d->controller, d->cgroup, &list)) {
+	cfd = get_cgroup_fd_handle_named(d->controller);
+	if (cfd < 0)
+		return -EINVAL;
+
+	cgpath = must_make_path_relative(d->cgroup, NULL);
+	dfd = openat(cfd, cgpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) {
 		// not a valid cgroup
-		ret = -EINVAL;
-		goto out;
+		return -EINVAL;
 	}
 
 	pid_t initpid = lookup_initpid_in_store(fc->pid);
@@ -1997,45 +2228,16 @@ __lxcfs_fuse_ops int cg_readdir(const char *path, void *buf,
 		if (nextcg) {
 			ret = DIR_FILLER(filler, buf, nextcg,  NULL, 0);
 			free(nextcg);
-			if (ret != 0) {
-				ret = -EIO;
-				goto out;
-			}
-		}
-		ret = 0;
-		goto out;
-	}
-
-	for (i = 0; list && list[i]; i++) {
-		if (DIR_FILLER(filler, buf, list[i]->name, NULL, 0) != 0) {
-			ret = -EIO;
-			goto out;
+			if (ret != 0)
+				return -EIO;
 		}
+		return 0;
 	}
 
-	// now get the list of child cgroups
-
-	if (!cgfs_list_children(d->controller, d->cgroup, &clist)) {
-		ret = 0;
-		goto out;
-	}
-	if (clist) {
-		for (i = 0; clist[i]; i++) {
-			if (DIR_FILLER(filler, buf, clist[i], NULL, 0) != 0) {
-				ret = -EIO;
-				goto out;
-			}
-		}
-	}
-	ret = 0;
+	ret = cg_fill_dir(fc, dfd, buf, filler);
+	if (ret < 0 && ret != -EIO)
+		lxcfs_error("%s - Failed to read %s:%s", strerror(-ret), d->controller, d->cgroup);
 
-out:
-	free_keys(list);
-	if (clist) {
-		for (i = 0; clist[i]; i++)
-			free(clist[i]);
-		free(clist);
-	}
 	return ret;
 }
 
@@ -37,4 +37,6 @@ __visible extern int cg_write(const char *path, const char *buf, size_t size, of
 __visible extern int cg_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
 __visible extern int cg_access(const char *path, int mode);
 
+extern void free_idmaps(void);
+
 #endif /* __LXCFS_CGROUP_FUSE_H */
@@ -37,15 +37,19 @@
 #include <linux/kdev_t.h>
 #include <linux/types.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "../hash_table.h"
+#include "../lifecycle.h"
 #include "../macro.h"
 #include "../memory_utils.h"
 #include "../utils.h"
@@ -138,6 +142,251 @@ static void must_append_controller(char **klist, char **nlist, char ***clist,
 	(*clist)[newentry] = copy;
 }
 
+/*
+ * Cache of O_PATH file descriptors of the cgroups we read files from so a read
+ * only resolves a single path component relative to it instead of the whole
+ * cgroup path from the hierarchy root. Descriptors are only cached while the
+ * lifecycle tracker watches the cgroup's parent for its removal so a removed
+ * and recreated cgroup of the same name isn't served from a stale descriptor.
+ * Should an event still be missed, reads failing with ENOENT or ENODEV check
+ * whether the cgroup is gone and reopen it. A migrated container ends up with
+ * a different cgroup path and thus a different entry.
+ */
+struct cgroup_dirfd {
+	const struct hierarchy *h;
+	char *cgroup;
+	uint64_t hash;
+	int fd;
+};
+
+struct cgroup_dirfd_key {
+	const struct hierarchy *h;
+	const char *cgroup;
+};
+
+static bool cgroup_dirfd_match(const void *item, const void *key)
+{
+	const struct cgroup_dirfd *e = item;
+	const struct cgroup_dirfd_key *k = key;
+
+	return e->h == k->h && strcmp(e->cgroup, k->cgroup) == 0;
+}
+
+static struct hash_table cgroup_dirfds = {
+	.match = cgroup_dirfd_match,
+};
+static pthread_mutex_t cgroup_dirfds_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Leave most of RLIMIT_NOFILE to everyone else. */
+#define CGROUP_DIRFD_MAX 4096
+static size_t cgroup_dirfds_max;
+
+static uint64_t cgroup_dirfd_hash(const struct hierarchy *h, const char *cgroup)
+{
+	return hash_string(cgroup) ^ hash_u64((uintptr_t)h);
+}
+
+static void cgroup_dirfd_free(struct cgroup_dirfd *e)
+{
+	close_prot_errno_disarm(e->fd);
+	free_disarm(e->cgroup);
+	free_disarm(e);
+}
+
+/* Must be called with cgroup_dirfds_lock held. */
+static void __cgroup_dirfd_drop(const struct hierarchy *h, const char *rel)
+{
+	struct cgroup_dirfd_key key = { .h = h, .cgroup = rel };
+	struct cgroup_dirfd *e;
+
+	e = hash_table_remove(&cgroup_dirfds, cgroup_dirfd_hash(h, rel), &key);
+	if (e)
+		cgroup_dirfd_free(e);
+}
+
+/* Drop the cached descriptors for @cgroup in all hierarchies. */
+void cgroup_dirfd_evict(const char *cgroup)
+{
+	__do_free char *rel = NULL;
+
+	if (!cgroup_ops)
+		return;
+
+	rel = must_make_path_relative(cgroup, NULL);
+	pthread_mutex_lock(&cgroup_dirfds_lock);
+	for (struct hierarchy **it = cgroup_ops->hierarchies; it && *it; it++)
+		__cgroup_dirfd_drop(*it, rel);
+	pthread_mutex_unlock(&cgroup_dirfds_lock);
+}
+
+void cgroup_dirfd_flush(void)
+{
+	struct cgroup_dirfd *e;
+	size_t pos;
+
+	pthread_mutex_lock(&cgroup_dirfds_lock);
+	hash_table_for_each(&cgroup_dirfds, pos, e)
+		cgroup_dirfd_free(e);
+	hash_table_fini(&cgroup_dirfds);
+	pthread_mutex_unlock(&cgroup_dirfds_lock);
+}
+
+/*
+ * IN_DELETE_SELF for a cgroup is only generated once the last reference to
+ * its directory is dropped and the cached descriptor is one of them. So watch
+ * the parent, which reports the removal of its children right away.
+ */
+static int cgroup_dirfd_watch_parent(const struct hierarchy *h, const char *rel)
+{
+	__do_close int fd = -EBADF;
+	__do_free char *parent = NULL;
+	const char *slash;
+
+	/* The root cgroup can't be removed. */
+	if (strcmp(rel, ".") == 0 || strcmp(rel, "./") == 0)
+		return 0;
+
+	slash = strrchr(rel, '/');
+	if (!slash || slash == rel || !slash[1])
+		return ret_errno(EINVAL);
+
+	parent = strndup(rel, slash - rel);
+	if (!parent)
+		return ret_errno(ENOMEM);
+
+	fd = openat(h->fd, parent, O_DIRECTORY | O_PATH | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return -errno;
+
+	return lifecycle_watch_cgroup_fd(fd, parent, LIFECYCLE_CGROUP_CHILDREN);
+}
+
+static void cgroup_dirfd_cache(const struct hierarchy *h, const char *rel,
+			       uint64_t hash, int fd)
+{
+	__do_free struct cgroup_dirfd *new = NULL;
+	__do_close int fd_cache = -EBADF;
+	struct cgroup_dirfd_key key = { .h = h, .cgroup = rel };
+
+	if (!cgroup_dirfds_max) {
+		struct rlimit rlim;
+
+		cgroup_dirfds_max = CGROUP_DIRFD_MAX;
+		if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+		    rlim.rlim_cur / 4 < CGROUP_DIRFD_MAX)
+			cgroup_dirfds_max = rlim.rlim_cur / 4;
+	}
+
+	if (cgroup_dirfds.used >= cgroup_dirfds_max)
+		return;
+
+	fd_cache = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+	if (fd_cache < 0)
+		return;
+
+	new = zalloc(sizeof(*new));
+	if (!new)
+		return;
+
+	new->cgroup = strdup(rel);
+	if (!new->cgroup)
+		return;
+	new->h = h;
+	new->hash = hash;
+
+	pthread_mutex_lock(&cgroup_dirfds_lock);
+	if (hash_table_find(&cgroup_dirfds, hash, &key) ||
+	    hash_table_insert(&cgroup_dirfds, hash, new)) {
+		pthread_mutex_unlock(&cgroup_dirfds_lock);
+		free(new->cgroup);
+		return;
+	}
+	new->fd = move_fd(fd_cache);
+	move_ptr(new);
+	pthread_mutex_unlock(&cgroup_dirfds_lock);
+
+	/*
+	 * Watch the parent for the removal of the directory we hold and only
+	 * then check that it's still around. If it is removed afterwards the
+	 * tracker evicts the entry. The directory itself is watched as well in
+	 * case the hierarchy goes away altogether.
+	 */
+	if (cgroup_dirfd_watch_parent(h, rel) < 0 ||
+	    lifecycle_watch_cgroup_fd(fd, rel, LIFECYCLE_CGROUP_FD) < 0 ||
+	    faccessat(fd, "cgroup.procs", F_OK, 0) < 0) {
+		pthread_mutex_lock(&cgroup_dirfds_lock);
+		__cgroup_dirfd_drop(h, rel);
+		pthread_mutex_unlock(&cgroup_dirfds_lock);
+	}
+}
+
+/*
+ * Return a new O_PATH file descriptor for @cgroup in @h. The caller must
+ * close it.
+ */
+static int cgroup_dirfd(const struct hierarchy *h, const char *cgroup)
+{
+	__do_free char *rel = NULL;
+	struct cgroup_dirfd_key key;
+	struct cgroup_dirfd *e;
+	uint64_t hash;
+	int fd;
+
+	rel = must_make_path_relative(cgroup, NULL);
+	if (!lifecycle_active())
+		return openat(h->fd, rel, O_DIRECTORY | O_PATH | O_CLOEXEC | O_NOFOLLOW);
+
+	key = (struct cgroup_dirfd_key){ .h = h, .cgroup = rel };
+	hash = cgroup_dirfd_hash(h, rel);
+
+	pthread_mutex_lock(&cgroup_dirfds_lock);
+	e = hash_table_find(&cgroup_dirfds, hash, &key);
+	if (e) {
+		/* Duplicate it under the lock so it can't be closed under us. */
+		fd = fcntl(e->fd, F_DUPFD_CLOEXEC, 3);
+		pthread_mutex_unlock(&cgroup_dirfds_lock);
+		return fd;
+	}
+	pthread_mutex_unlock(&cgroup_dirfds_lock);
+
+	fd = openat(h->fd, rel, O_DIRECTORY | O_PATH | O_CLOEXEC | O_NOFOLLOW);
+	if (fd >= 0)
+		cgroup_dirfd_cache(h, rel, hash, fd);
+
+	return fd;
+}
+
+/*
+ * A read through @*dfd, returned by cgroup_dirfd(), failed with @err. If that
+ * is because the descriptor refers to a removed cgroup, drop it from the
+ * cache and open @cgroup again. Returns true if the caller should retry with
+ * the new @*dfd.
+ */
+static bool cgroup_dirfd_retry(const struct hierarchy *h, const char *cgroup,
+			       int *dfd, int err)
+{
+	__do_free char *rel = NULL;
+
+	if (err != ENOENT && err != ENODEV)
+		return false;
+
+	/* Uncached descriptors are as fresh as they get. */
+	if (!lifecycle_active())
+		return false;
+
+	/* The cgroup is still there, the file really doesn't exist. */
+	if (faccessat(*dfd, "cgroup.procs", F_OK, 0) == 0)
+		return false;
+
+	rel = must_make_path_relative(cgroup, NULL);
+	pthread_mutex_lock(&cgroup_dirfds_lock);
+	__cgroup_dirfd_drop(h, rel);
+	pthread_mutex_unlock(&cgroup_dirfds_lock);
+
+	close_prot_errno_disarm(*dfd);
+	*dfd = cgroup_dirfd(h, cgroup);
+	return *dfd >= 0;
+}
+
 /* Given a handler's cgroup data, return the struct hierarchy for the controller
  * @c, or NULL if there is none.
  */
@@ -537,22 +786,27 @@ static bool cgfsng_get_hierarchies(struct cgroup_ops *ops, int n, char ***out)
 static bool cgfsng_get(struct cgroup_ops *ops, const char *controller,
 		       const char *cgroup, const char *file, char **value)
 {
-	__do_free char *path = NULL;
+	__do_close int dfd = -EBADF;
 	struct hierarchy *h;
 
 	h = ops->get_hierarchy(ops, controller);
 	if (!h)
 		return false;
 
-	path = must_make_path_relative(cgroup, file, NULL);
-	*value = readat_file(h->fd, path);
+	dfd = cgroup_dirfd(h, cgroup);
+	if (dfd < 0)
+		return false;
+
+	*value = readat_file(dfd, file);
+	if (!*value && cgroup_dirfd_retry(h, cgroup, &dfd, errno))
+		*value = readat_file(dfd, file);
 	return *value != NULL;
 }
 
 static int cgfsng_get_memory(struct cgroup_ops *ops, const char *cgroup,
 			     const char *file, char **value)
 {
-	__do_free char *path = NULL;
+	__do_close int dfd = -EBADF;
 	struct hierarchy *h;
 	int cgroup2_root_fd, layout, ret;
 
@@ -576,8 +830,14 @@ static int cgfsng_get_memory(struct cgroup_ops *ops, const char *cgroup,
 		cgroup2_root_fd = ops->cgroup2_root_fd;
 	}
 
-	path = must_make_path_relative(cgroup, NULL);
-	ret = cgroup_walkup_to_root(cgroup2_root_fd, h->fd, path, file, value);
+	dfd = cgroup_dirfd(h, cgroup);
+	if (dfd < 0)
+		return -errno;
+
+	ret = cgroup_walkup_to_root(cgroup2_root_fd, dfd, ".", file, value);
+	/* Failed reads are reported as -EINVAL on legacy hierarchies. */
+	if (ret < 0 && cgroup_dirfd_retry(h, cgroup, &dfd, ret == -EINVAL ? ENOENT : -ret))
+		ret = cgroup_walkup_to_root(cgroup2_root_fd, dfd, ".", file, value);
 	if (ret < 0)
 		return ret;
 	if (ret == 1) {
@@ -591,15 +851,23 @@ static int cgfsng_get_memory(struct cgroup_ops *ops, const char *cgroup,
 
 static int cgfsng_get_memory_stats_fd(struct cgroup_ops *ops, const char *cgroup)
 {
-	__do_free char *path = NULL;
+	__do_close int dfd = -EBADF;
 	struct hierarchy *h;
+	int fd;
 
 	h = ops->get_hierarchy(ops, "memory");
 	if (!h)
 		return -1;
 
-	path = must_make_path_relative(cgroup, "memory.stat", NULL);
-	return openat(h->fd, path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	dfd = cgroup_dirfd(h, cgroup);
+	if (dfd < 0)
+		return -1;
+
+	fd = openat(dfd, "memory.stat", O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0 && cgroup_dirfd_retry(h, cgroup, &dfd, errno))
+		fd = openat(dfd, "memory.stat", O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+
+	return fd;
 }
 
 static int cgfsng_get_memory_current(struct cgroup_ops *ops, const char *cgroup,
@@ -703,6 +971,11 @@ static int cgfsng_get_cpuset_cpus(struct cgroup_ops *ops, const char *cgroup,
 		ret = CGROUP2_SUPER_MAGIC;
 
 	*value = NULL;
+	/*
+	 * The walk below climbs from a container-controlled path, start it
+	 * from a descriptor opened with openat_safe() rather than a cached
+	 * O_PATH one.
+	 */
 	path = must_make_path_relative(cgroup, NULL);
 	cgroup_fd = openat_safe(h->fd, path);
 	if (cgroup_fd < 0) {
@@ -737,14 +1010,33 @@ static int cgfsng_get_cpuset_cpus(struct cgroup_ops *ops, const char *cgroup,
 	return -1;
 }
 
-static int cgfsng_get_io(struct cgroup_ops *ops, const char *cgroup,
-			 const char *file, char **value)
+static const char *const cgfsng_io_files[CGROUP_IO_NR_FILES] = {
+	[CGROUP_IO_SERVICED]		= "blkio.io_serviced_recursive",
+	[CGROUP_IO_MERGED]		= "blkio.io_merged_recursive",
+	[CGROUP_IO_SERVICE_BYTES]	= "blkio.io_service_bytes_recursive",
+	[CGROUP_IO_WAIT_TIME]		= "blkio.io_wait_time_recursive",
+	[CGROUP_IO_SERVICE_TIME]	= "blkio.io_service_time_recursive",
+};
+
+/*
+ * Read all blkio statistics of @cgroup through a single directory fd. Files
+ * that can't be read are left NULL in @values. If any of them doesn't exist
+ * -EOPNOTSUPP is returned and the caller should fall back to host values.
+ * On the unified hierarchy io.stat holds all of them, it is handed out as
+ * the first value and the others are left NULL.
+ */
+static int cgfsng_get_io_stats(struct cgroup_ops *ops, const char *cgroup,
+			       char *values[CGROUP_IO_NR_FILES])
 {
-	__do_free char *path = NULL;
+	__do_close int dfd = -EBADF;
 	struct hierarchy *h;
-	int ret;
+	int ret, err = 0;
+
+	for (int i = 0; i < CGROUP_IO_NR_FILES; i++)
+		values[i] = NULL;
 
-	h = ops->get_hierarchy(ops, "blkio");
+	/* The controller is called io on the unified hierarchy. */
+	h = ops->get_hierarchy(ops, "blkio") ?: ops->get_hierarchy(ops, "io");
 	if (!h)
 		return -1;
 
@@ -753,45 +1045,38 @@ static int cgfsng_get_io(struct cgroup_ops *ops, const char *cgroup,
 	else
 		ret = CGROUP2_SUPER_MAGIC;
 
-	path = must_make_path_relative(cgroup, file, NULL);
-	*value = readat_file(h->fd, path);
-	if (!*value) {
-		if (errno == ENOENT)
-			errno = EOPNOTSUPP;
-		return ret_errno(errno);
-	}
+	dfd = cgroup_dirfd(h, cgroup);
+	if (dfd < 0)
+		return errno == ENOENT ? -EOPNOTSUPP : -errno;
 
-	return ret;
-}
+	if (ret == CGROUP2_SUPER_MAGIC) {
+		values[0] = readat_file(dfd, "io.stat");
+		if (!values[0] && cgroup_dirfd_retry(h, cgroup, &dfd, errno))
+			values[0] = readat_file(dfd, "io.stat");
+		if (!values[0])
+			return errno == ENOENT ? -EOPNOTSUPP : -errno;
 
-static int cgfsng_get_io_service_bytes(struct cgroup_ops *ops,
-				       const char *cgroup, char **value)
-{
-	return cgfsng_get_io(ops, cgroup, "blkio.io_service_bytes_recursive", value);
-}
-
-static int cgfsng_get_io_service_time(struct cgroup_ops *ops,
-				      const char *cgroup, char **value)
-{
-	return cgfsng_get_io(ops, cgroup, "blkio.io_service_time_recursive", value);
-}
+		return ret;
+	}
 
-static int cgfsng_get_io_serviced(struct cgroup_ops *ops, const char *cgroup,
-				  char **value)
-{
-	return cgfsng_get_io(ops, cgroup, "blkio.io_serviced_recursive", value);
-}
+	for (int i = 0; i < CGROUP_IO_NR_FILES; i++) {
+		values[i] = readat_file(dfd, cgfsng_io_files[i]);
+		if (!values[i] && cgroup_dirfd_retry(h, cgroup, &dfd, errno))
+			values[i] = readat_file(dfd, cgfsng_io_files[i]);
+		if (values[i])
+			continue;
 
-static int cgfsng_get_io_merged(struct cgroup_ops *ops, const char *cgroup,
-				char **value)
-{
-	return cgfsng_get_io(ops, cgroup, "blkio.io_merged_recursive", value);
-}
+		if (errno == ENOENT)
+			err = -EOPNOTSUPP;
+		else if (!err)
+			err = -errno;
+	}
+	if (err == -EOPNOTSUPP) {
+		for (int i = 0; i < CGROUP_IO_NR_FILES; i++)
+			free_disarm(values[i]);
+	}
 
-static int cgfsng_get_io_wait_time(struct cgroup_ops *ops, const char *cgroup,
-				   char **value)
-{
-	return cgfsng_get_io(ops, cgroup, "blkio.io_wait_time_recursive", value);
+	return err ?: ret;
 }
 
 static bool cgfsng_can_use_cpuview(struct cgroup_ops *ops)
@@ -1028,11 +1313,7 @@ struct cgroup_ops *cgfsng_ops_init(void)
 	cgfsng_ops->can_use_cpuview = cgfsng_can_use_cpuview;
 
 	/* blkio */
-	cgfsng_ops->get_io_service_bytes	= cgfsng_get_io_service_bytes;
-	cgfsng_ops->get_io_service_time		= cgfsng_get_io_service_time;
-	cgfsng_ops->get_io_serviced		= cgfsng_get_io_serviced;
-	cgfsng_ops->get_io_merged		= cgfsng_get_io_merged;
-	cgfsng_ops->get_io_wait_time		= cgfsng_get_io_wait_time;
+	cgfsng_ops->get_io_stats		= cgfsng_get_io_stats;
 
 
 	return move_ptr(cgfsng_ops);
@@ -62,6 +62,8 @@ void cgroup_exit(struct cgroup_ops *ops)
 	if (!ops)
 		return;
 
+	cgroup_dirfd_flush();
+
 	for (struct hierarchy **it = ops->hierarchies; it && *it; it++) {
 		for (char **p = (*it)->controllers; p && *p; p++)
 			free(*p);
@@ -31,6 +31,19 @@ typedef enum {
         CGROUP_LAYOUT_UNIFIED =  2,
 } cgroup_layout_t;
 
+/*
+ * The blkio statistics handed out by get_io_stats(). On the unified
+ * hierarchy io.stat is handed out in the first slot instead.
+ */
+enum cgroup_io_file {
+	CGROUP_IO_SERVICED,
+	CGROUP_IO_MERGED,
+	CGROUP_IO_SERVICE_BYTES,
+	CGROUP_IO_WAIT_TIME,
+	CGROUP_IO_SERVICE_TIME,
+	CGROUP_IO_NR_FILES,
+};
+
 /* A descriptor for a mounted hierarchy
  *
  * @controllers
@@ -163,16 +176,8 @@ struct cgroup_ops {
 	bool (*can_use_cpuview)(struct cgroup_ops *ops);
 
 	/* io */
-	int (*get_io_service_bytes)(struct cgroup_ops *ops, const char *cgroup,
-				    char **value);
-	int (*get_io_service_time)(struct cgroup_ops *ops, const char *cgroup,
-				   char **value);
-	int (*get_io_serviced)(struct cgroup_ops *ops, const char *cgroup,
-			       char **value);
-	int (*get_io_merged)(struct cgroup_ops *ops, const char *cgroup,
-			     char **value);
-	int (*get_io_wait_time)(struct cgroup_ops *ops, const char *cgroup,
-				char **value);
+	int (*get_io_stats)(struct cgroup_ops *ops, const char *cgroup,
+			    char *values[CGROUP_IO_NR_FILES]);
 };
 
 extern struct cgroup_ops *cgroup_ops;
@@ -180,6 +185,9 @@ extern struct cgroup_ops *cgroup_ops;
 extern struct cgroup_ops *cgroup_init(void);
 extern void cgroup_exit(struct cgroup_ops *ops);
 
+extern void cgroup_dirfd_evict(const char *cgroup);
+extern void cgroup_dirfd_flush(void);
+
 extern void prune_init_scope(char *cg);
 
 static inline void __auto_cgroup_exit__(struct cgroup_ops **ops)
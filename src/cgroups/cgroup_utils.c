@@ -18,6 +18,7 @@
 
 #define _FILE_OFFSET_BITS 64
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -678,34 +679,50 @@ char *cg_legacy_get_current_cgroup(pid_t pid, const char *controller)
 }
 
 
+/*
+ * Most cgroup files fit in a single page. Read them straight into one growing
+ * buffer instead of going through stdio which would copy them line by line
+ * and reallocate every BATCH_SIZE bytes.
+ */
+#define READAT_FILE_SIZE 4096
+
 char *readat_file(int dirfd, const char *path)
 {
 	__do_close int fd = -EBADF;
-	__do_free char *line = NULL;
-	__do_fclose FILE *f = NULL;
-	char *buf = NULL;
-	size_t len = 0, fulllen = 0;
-	ssize_t linelen;
+	__do_free char *buf = NULL;
+	size_t len = 0, size = 0;
 
 	fd = openat(dirfd, path, O_NOFOLLOW | O_RDONLY | O_CLOEXEC);
 	if (fd < 0)
 		return NULL;
 
-	f = fdopen(fd, "re");
-	if (!f)
-		return NULL;
-	/* Transfer ownership of fd */
-	move_fd(fd);
+	for (;;) {
+		ssize_t bytes;
 
-	while ((linelen = getline(&line, &len, f)) != -1) {
-		append_line(&buf, fulllen, line, linelen);
-		fulllen += linelen;
+		if (size - len < 2) {
+			size = size ? size * 2 : READAT_FILE_SIZE;
+			buf = must_realloc(buf, size);
+		}
+
+		bytes = read(fd, buf + len, size - len - 1);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return NULL;
+		}
+		if (bytes == 0)
+			break;
+
+		len += bytes;
 	}
 
-	if (buf)
-		drop_trailing_newlines(buf);
+	/* Callers treat empty files like missing values. */
+	if (len == 0)
+		return NULL;
 
-	return buf;
+	buf[len] = '\0';
+	drop_trailing_newlines(buf);
+	return move_ptr(buf);
 }
 
 bool mkdir_p(const char *dir, mode_t mode)
@@ -23,11 +23,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "bindings.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
+#include "cpuset_parse.h"
 #include "memory_utils.h"
 #include "proc_loadavg.h"
 #include "utils.h"
@@ -70,22 +72,89 @@ bool cpu_in_cpuset(int cpu, const char *cpuset)
 	return false;
 }
 
+/* Upper bound for CPU numbers, protects against bogus cpuset strings. */
+#define CPUSET_MAX_CPUS (1 << 16)
+
+static const char *cpuset_parse_cpu(const char *c, int *cpu)
+{
+	long v = 0;
+
+	while (*c == ' ' || *c == '\t')
+		c++;
+
+	if (*c < '0' || *c > '9')
+		return NULL;
+
+	while (*c >= '0' && *c <= '9') {
+		v = v * 10 + (*c++ - '0');
+		if (v >= CPUSET_MAX_CPUS)
+			return NULL;
+	}
+
+	*cpu = v;
+	return c;
+}
+
 /*
- * get cpu number in cpuset
+ * Parse a cpuset in format "1,2-3,4" into a bitmap.
+ * Malformed ranges are skipped like cpu_in_cpuset() does.
+ * Returns NULL on allocation failure, the caller must free() the bitmap.
  */
-int cpu_number_in_cpuset(const char *cpuset)
+struct cpuset_bitmap *cpuset_bitmap_parse(const char *cpuset)
 {
-	int cpu_number = 0;
+	__do_free struct cpuset_bitmap *map = NULL;
+	int max = -1, nr_words;
+
+	/* First pass to size the bitmap. */
+	for (const char *c = cpuset; c && *c; c = cpuset_nexttok(c)) {
+		int a, b;
+		const char *p;
+
+		p = cpuset_parse_cpu(*c == ',' ? c + 1 : c, &a);
+		if (!p)
+			continue;
+
+		b = a;
+		if (*p == '-' && !cpuset_parse_cpu(p + 1, &b))
+			continue;
+
+		if (a > max)
+			max = a;
+		if (b > max)
+			max = b;
+	}
 
-	for (const char *c = cpuset; c; c = cpuset_nexttok(c)) {
-		int a, b, ret;
+	nr_words = (max + 64) / 64;
+	map = zalloc(sizeof(*map) + nr_words * sizeof(uint64_t));
+	if (!map)
+		return NULL;
+	map->nr_cpus = max + 1;
 
-		ret = cpuset_getrange(c, &a, &b);
-		if (ret == 1)
-			cpu_number++;
-		else if (ret == 2)
-			cpu_number += a > b ? a - b + 1 : b - a + 1;
+	for (const char *c = cpuset; c && *c; c = cpuset_nexttok(c)) {
+		int a, b;
+		const char *p;
+
+		p = cpuset_parse_cpu(*c == ',' ? c + 1 : c, &a);
+		if (!p)
+			continue;
+
+		b = a;
+		if (*p == '-' && !cpuset_parse_cpu(p + 1, &b))
+			continue;
+
+		if (a > b) {
+			int t = a;
+
+			a = b;
+			b = t;
+		}
+
+		for (int cpu = a; cpu <= b; cpu++)
+			map->bits[cpu / 64] |= UINT64_C(1) << (cpu % 64);
 	}
 
-	return cpu_number;
+	for (int i = 0; i < nr_words; i++)
+		map->weight += __builtin_popcountll(map->bits[i]);
+
+	return move_ptr(map);
 }
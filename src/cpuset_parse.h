@@ -15,6 +15,7 @@
 
 #include <fuse.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -25,9 +26,28 @@
 #include "macro.h"
 
 extern bool cpu_in_cpuset(int cpu, const char *cpuset);
-extern int cpu_number_in_cpuset(const char *cpuset);
 extern char *get_cpuset(const char *cg);
 
+/*
+ * A cpuset parsed into a bitmap so that membership tests don't need to walk
+ * the whole cpuset string again.
+ */
+struct cpuset_bitmap {
+	int nr_cpus;	/* Number of valid bits, one past the highest CPU. */
+	int weight;	/* Number of CPUs in the set. */
+	uint64_t bits[];
+};
+
+extern struct cpuset_bitmap *cpuset_bitmap_parse(const char *cpuset);
+
+static inline bool cpuset_bitmap_test(const struct cpuset_bitmap *map, int cpu)
+{
+	if (!map || cpu < 0 || cpu >= map->nr_cpus)
+		return false;
+
+	return (map->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
 #endif /* __LXCFS_CPUSET_PARSE_H */
 
 
@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_FUSE3
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+#else
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <string.h>
+
+#include "fmt.h"
+
+/* "00" through "99", two digits at a time halves the number of divisions. */
+static const char fmt_digits[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* Number of decimal digits in @v. */
+static unsigned int fmt_u64_len(uint64_t v)
+{
+	unsigned int len = 1;
+
+	for (;;) {
+		if (v < 10)
+			return len;
+		if (v < 100)
+			return len + 1;
+		if (v < 1000)
+			return len + 2;
+		if (v < 10000)
+			return len + 3;
+		v /= 10000;
+		len += 4;
+	}
+}
+
+/* Write the @len digits of @v backwards from @p + @len. */
+static void fmt_u64_digits(char *p, uint64_t v, unsigned int len)
+{
+	char *end = p + len;
+
+	while (v >= 100) {
+		unsigned int i = (v % 100) * 2;
+
+		v /= 100;
+		*--end = fmt_digits[i + 1];
+		*--end = fmt_digits[i];
+	}
+
+	if (v >= 10) {
+		unsigned int i = v * 2;
+
+		*--end = fmt_digits[i + 1];
+		*--end = fmt_digits[i];
+	} else {
+		*--end = '0' + v;
+	}
+}
+
+char *fmt_u64(char *p, uint64_t v)
+{
+	unsigned int len = fmt_u64_len(v);
+
+	fmt_u64_digits(p, v, len);
+	return p + len;
+}
+
+char *fmt_u64_width(char *p, uint64_t v, unsigned int width)
+{
+	unsigned int len = fmt_u64_len(v);
+
+	if (width > len) {
+		memset(p, ' ', width - len);
+		p += width - len;
+	}
+
+	fmt_u64_digits(p, v, len);
+	return p + len;
+}
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_FMT_H
+#define __LXCFS_FMT_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+#include "macro.h"
+
+/*
+ * Integer formatting for the proc renderers which print thousands of
+ * numbers per read. The output is the same as printf("%" PRIu64) and
+ * printf("%*" PRIu64) but without parsing a format string every time.
+ * Callers make sure there are at least FMT_U64_MAX bytes of room, nothing
+ * gets NUL-terminated.
+ */
+#define FMT_U64_MAX INTTYPE_TO_STRLEN(uint64_t)
+
+/* Write @v in decimal to @p and return the end of the number. */
+extern char *fmt_u64(char *p, uint64_t v);
+/* Like fmt_u64() but padded with spaces to at least @width characters. */
+extern char *fmt_u64_width(char *p, uint64_t v, unsigned int width);
+
+/* Copy the string literal @s to @p and return the end of the copy. */
+#define fmt_str(p, s) ((char *)memcpy(p, s, STRLITERALLEN(s)) + STRLITERALLEN(s))
+
+#endif /* __LXCFS_FMT_H */
@@ -0,0 +1,255 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_FUSE3
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+#else
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash_table.h"
+#include "memory_utils.h"
+
+#define HASH_TABLE_MIN_SIZE 16
+
+/* Marks a slot whose item was removed. Lookups have to probe past it. */
+static char hash_table_removed;
+#define HASH_TABLE_REMOVED ((void *)&hash_table_removed)
+
+/* Finalizer of MurmurHash3, spreads all input bits over the result. */
+uint64_t hash_u64(uint64_t v)
+{
+	v ^= v >> 33;
+	v *= UINT64_C(0xff51afd7ed558ccd);
+	v ^= v >> 33;
+	v *= UINT64_C(0xc4ceb9fe1a85ec53);
+	v ^= v >> 33;
+
+	return v;
+}
+
+/* 64 bit FNV-1a. */
+uint64_t hash_string(const char *s)
+{
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+	while (*s) {
+		hash ^= (unsigned char)*s++;
+		hash *= UINT64_C(0x100000001b3);
+	}
+
+	return hash_u64(hash);
+}
+
+static struct hash_table_slots *hash_table_alloc(size_t size)
+{
+	struct hash_table_slots *slots;
+	size_t nr = HASH_TABLE_MIN_SIZE;
+
+	while (nr < size)
+		nr <<= 1;
+
+	slots = zalloc(sizeof(*slots) + nr * sizeof(struct hash_table_slot));
+	if (!slots)
+		return NULL;
+
+	slots->mask = nr - 1;
+	return slots;
+}
+
+int hash_table_init(struct hash_table *ht, size_t size,
+		    bool (*match)(const void *item, const void *key),
+		    bool deferred)
+{
+	*ht = (struct hash_table){
+		.match		= match,
+		.deferred	= deferred,
+	};
+
+	ht->slots = hash_table_alloc(size);
+	if (!ht->slots)
+		return ret_errno(ENOMEM);
+
+	return 0;
+}
+
+void hash_table_fini(struct hash_table *ht)
+{
+	hash_table_free_retired(hash_table_steal_retired(ht));
+	free_disarm(ht->slots);
+	ht->used = 0;
+	ht->filled = 0;
+}
+
+void *hash_table_find(const struct hash_table *ht, uint64_t hash,
+		      const void *key)
+{
+	struct hash_table_slots *slots;
+
+	slots = __atomic_load_n(&ht->slots, __ATOMIC_ACQUIRE);
+	if (!slots)
+		return NULL;
+
+	for (size_t i = hash & slots->mask;; i = (i + 1) & slots->mask) {
+		struct hash_table_slot *slot = &slots->slot[i];
+		void *item;
+
+		item = __atomic_load_n(&slot->item, __ATOMIC_ACQUIRE);
+		if (!item)
+			return NULL;
+
+		if (item == HASH_TABLE_REMOVED)
+			continue;
+
+		if (slot->hash == hash && ht->match(item, key))
+			return item;
+	}
+}
+
+static void hash_table_place(struct hash_table_slots *slots, uint64_t hash,
+			     void *item)
+{
+	size_t i = hash & slots->mask;
+
+	while (slots->slot[i].item)
+		i = (i + 1) & slots->mask;
+
+	slots->slot[i].hash = hash;
+	__atomic_store_n(&slots->slot[i].item, item, __ATOMIC_RELEASE);
+}
+
+/* Move all items into a new slot array sized for @ht->used + 1 items. */
+static int hash_table_rehash(struct hash_table *ht)
+{
+	struct hash_table_slots *old = ht->slots, *new;
+
+	new = hash_table_alloc((ht->used + 1) * 2);
+	if (!new)
+		return ret_errno(ENOMEM);
+
+	for (size_t i = 0; i <= old->mask; i++) {
+		void *item = old->slot[i].item;
+
+		if (item && item != HASH_TABLE_REMOVED)
+			hash_table_place(new, old->slot[i].hash, item);
+	}
+
+	__atomic_store_n(&ht->slots, new, __ATOMIC_RELEASE);
+	ht->filled = ht->used;
+
+	if (ht->deferred) {
+		old->retired = ht->retired;
+		ht->retired = old;
+	} else {
+		free(old);
+	}
+
+	return 0;
+}
+
+int hash_table_insert(struct hash_table *ht, uint64_t hash, void *item)
+{
+	/* A zeroed table with just @match set is valid and empty. */
+	if (!ht->slots) {
+		struct hash_table_slots *slots;
+
+		slots = hash_table_alloc(0);
+		if (!slots)
+			return ret_errno(ENOMEM);
+		__atomic_store_n(&ht->slots, slots, __ATOMIC_RELEASE);
+	}
+
+	/* Keep at least a quarter of the slots empty so probing stays short. */
+	if ((ht->filled + 1) * 4 > (ht->slots->mask + 1) * 3) {
+		int ret;
+
+		ret = hash_table_rehash(ht);
+		if (ret < 0)
+			return ret;
+	}
+
+	hash_table_place(ht->slots, hash, item);
+	ht->used++;
+	ht->filled++;
+
+	return 0;
+}
+
+void *hash_table_remove(struct hash_table *ht, uint64_t hash, const void *key)
+{
+	struct hash_table_slots *slots = ht->slots;
+
+	if (!slots)
+		return NULL;
+
+	for (size_t i = hash & slots->mask;; i = (i + 1) & slots->mask) {
+		struct hash_table_slot *slot = &slots->slot[i];
+		void *item = slot->item;
+
+		if (!item)
+			return NULL;
+
+		if (item == HASH_TABLE_REMOVED)
+			continue;
+
+		if (slot->hash == hash && ht->match(item, key)) {
+			__atomic_store_n(&slot->item, HASH_TABLE_REMOVED, __ATOMIC_RELEASE);
+			ht->used--;
+			return item;
+		}
+	}
+}
+
+/* Return the first item at or after *@pos and advance *@pos past it. */
+void *hash_table_next(const struct hash_table *ht, size_t *pos)
+{
+	struct hash_table_slots *slots = ht->slots;
+
+	if (!slots)
+		return NULL;
+
+	while (*pos <= slots->mask) {
+		void *item = slots->slot[(*pos)++].item;
+
+		if (item && item != HASH_TABLE_REMOVED)
+			return item;
+	}
+
+	return NULL;
+}
+
+struct hash_table_slots *hash_table_steal_retired(struct hash_table *ht)
+{
+	struct hash_table_slots *retired = ht->retired;
+
+	ht->retired = NULL;
+	return retired;
+}
+
+void hash_table_free_retired(struct hash_table_slots *slots)
+{
+	while (slots) {
+		struct hash_table_slots *next = slots->retired;
+
+		free(slots);
+		slots = next;
+	}
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_HASH_TABLE_H
+#define __LXCFS_HASH_TABLE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "macro.h"
+
+/*
+ * Open addressing hash table with linear probing that grows as needed. The
+ * table stores pointers to items together with their hash, it doesn't own
+ * the items. Callers serialize modifications. Lookups may run concurrently
+ * with a single modifier: slots only ever go from empty to used to removed
+ * and are never reused until the table is rehashed into a new slot array.
+ * A zeroed table with only @match set is a valid empty table.
+ * With @deferred set old slot arrays aren't freed on rehash but have to be
+ * taken with hash_table_steal_retired() and freed with
+ * hash_table_free_retired() once no lookup can still be walking them.
+ */
+struct hash_table_slot {
+	uint64_t hash;
+	void *item;
+};
+
+struct hash_table_slots {
+	size_t mask;
+	struct hash_table_slots *retired;
+	struct hash_table_slot slot[];
+};
+
+struct hash_table {
+	struct hash_table_slots *slots;
+	/* Number of items in the table. */
+	size_t used;
+	/* Number of items plus removed slots. */
+	size_t filled;
+	bool deferred;
+	struct hash_table_slots *retired;
+	/* Return true if @item is the one stored for @key. */
+	bool (*match)(const void *item, const void *key);
+};
+
+extern uint64_t hash_string(const char *s);
+extern uint64_t hash_u64(uint64_t v);
+
+extern int hash_table_init(struct hash_table *ht, size_t size,
+			   bool (*match)(const void *item, const void *key),
+			   bool deferred);
+extern void hash_table_fini(struct hash_table *ht);
+extern void *hash_table_find(const struct hash_table *ht, uint64_t hash,
+			     const void *key);
+extern int hash_table_insert(struct hash_table *ht, uint64_t hash, void *item);
+extern void *hash_table_remove(struct hash_table *ht, uint64_t hash,
+			       const void *key);
+extern void *hash_table_next(const struct hash_table *ht, size_t *pos);
+extern struct hash_table_slots *hash_table_steal_retired(struct hash_table *ht);
+extern void hash_table_free_retired(struct hash_table_slots *slots);
+
+/*
+ * Iterate over all items. Removing the current item while iterating is fine
+ * as removal never moves other items around.
+ */
+#define hash_table_for_each(ht, pos, item) \
+	for (pos = 0; (item = hash_table_next(ht, &pos));)
+
+#endif /* __LXCFS_HASH_TABLE_H */
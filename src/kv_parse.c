@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_FUSE3
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+#else
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kv_parse.h"
+
+size_t kv_parse_u64(const char *s, size_t len, uint64_t *ret)
+{
+	uint64_t val = 0;
+	size_t i;
+
+	for (i = 0; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+		unsigned int digit = s[i] - '0';
+
+		if (val > (UINT64_MAX - digit) / 10)
+			return 0;
+
+		val = val * 10 + digit;
+	}
+
+	if (i)
+		*ret = val;
+
+	return i;
+}
+
+/*
+ * The tables are short and a mismatch is nearly always rejected on length
+ * and first character, so a linear scan is as fast as a hashed lookup here
+ * without having to build an index for every table.
+ */
+static int kv_lookup(const struct kv_table *table, const char *key,
+		     size_t len)
+{
+	for (unsigned int i = 0; i < table->nr_keys; i++) {
+		const struct kv_key *k = &table->keys[i];
+
+		if (k->len == len && k->key[0] == key[0] &&
+		    memcmp(k->key, key, len) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Return the index of the key the line held or -1. */
+static int __kv_parse_line(const struct kv_table *table, const char *line,
+			   size_t len, void *out)
+{
+	const char *sep;
+	uint64_t val;
+	size_t klen;
+	int i;
+
+	sep = memchr(line, ' ', len);
+	if (!sep || sep == line)
+		return -1;
+
+	klen = sep - line;
+	i = kv_lookup(table, line, klen);
+	if (i < 0)
+		return -1;
+
+	if (!kv_parse_u64(sep + 1, len - klen - 1, &val))
+		return -1;
+
+	*(uint64_t *)((char *)out + table->keys[i].offset) = val;
+	return i;
+}
+
+bool kv_parse_line(const struct kv_table *table, const char *line,
+		   size_t len, void *out)
+{
+	return __kv_parse_line(table, line, len, out) >= 0;
+}
+
+/* Record key @i in @found, keys showing up more than once count once. */
+static void kv_found(uint64_t *found, int i)
+{
+	if (i >= 0 && i < KV_MAX_KEYS)
+		*found |= UINT64_C(1) << i;
+}
+
+static bool kv_all_found(const struct kv_table *table, uint64_t found)
+{
+	if (table->nr_keys > KV_MAX_KEYS)
+		return false;
+
+	return (unsigned int)__builtin_popcountll(found) == table->nr_keys;
+}
+
+int kv_parse_buf(const struct kv_table *table, const char *buf, size_t len,
+		 void *out)
+{
+	const char *end = buf + len;
+	uint64_t found = 0;
+
+	while (buf < end) {
+		const char *eol;
+
+		eol = memchr(buf, '\n', end - buf);
+		if (!eol)
+			eol = end;
+
+		kv_found(&found, __kv_parse_line(table, buf, eol - buf, out));
+		buf = eol + 1;
+	}
+
+	return __builtin_popcountll(found);
+}
+
+int kv_parse_fd(const struct kv_table *table, int fd, void *out)
+{
+	char buf[4096];
+	size_t len = 0;
+	bool skip = false;
+	uint64_t found = 0;
+
+	for (;;) {
+		size_t off = 0;
+		ssize_t ret;
+		char *eol;
+
+		ret = read(fd, buf + len, sizeof(buf) - len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+
+		while ((eol = memchr(buf + off, '\n', len - off))) {
+			if (!skip)
+				kv_found(&found, __kv_parse_line(table, buf + off,
+								 eol - (buf + off), out));
+			skip = false;
+			off = eol - buf + 1;
+		}
+
+		/* Everything asked for was found, don't bother reading on. */
+		if (kv_all_found(table, found))
+			return __builtin_popcountll(found);
+
+		/* A line longer than the buffer can't be one of ours. */
+		if (off == 0 && len == sizeof(buf)) {
+			skip = true;
+			len = 0;
+			continue;
+		}
+
+		len -= off;
+		memmove(buf, buf + off, len);
+	}
+
+	if (len && !skip)
+		kv_found(&found, __kv_parse_line(table, buf, len, out));
+
+	return __builtin_popcountll(found);
+}
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_KV_PARSE_H
+#define __LXCFS_KV_PARSE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "macro.h"
+
+/*
+ * Parser for cgroup files made up of "<key> <value>" lines such as
+ * memory.stat or cpu.stat. Callers describe the keys they are interested in
+ * with a static table mapping each key to a uint64_t member of a struct and
+ * get all of them filled in with a single pass over the file. Keys have to
+ * match exactly, so "total_rss" doesn't swallow "total_rss_huge".
+ */
+/* Tables can be longer but only this many keys count towards the result. */
+#define KV_MAX_KEYS 64
+
+struct kv_key {
+	const char *key;
+	unsigned int len;
+	size_t offset;
+};
+
+struct kv_table {
+	const struct kv_key *keys;
+	unsigned int nr_keys;
+};
+
+#define KV_KEY(name, type, member)			\
+	{						\
+		.key	= name,				\
+		.len	= STRLITERALLEN(name),		\
+		.offset	= offsetof(type, member),	\
+	}
+
+#define KV_TABLE(table)					\
+	{						\
+		.keys		= table,		\
+		.nr_keys	= sizeof(table) / sizeof(*(table)), \
+	}
+
+/* Parse a decimal number, return the number of characters consumed or 0. */
+extern size_t kv_parse_u64(const char *s, size_t len, uint64_t *ret);
+/* Parse a single line, return true if it held one of the keys. */
+extern bool kv_parse_line(const struct kv_table *table, const char *line,
+			  size_t len, void *out);
+/* Parse @len bytes at @buf, return the number of distinct keys found. */
+extern int kv_parse_buf(const struct kv_table *table, const char *buf,
+			size_t len, void *out);
+/*
+ * Parse everything readable from @fd, return the number of distinct keys
+ * found. Reading stops as soon as all keys of @table were seen.
+ */
+extern int kv_parse_fd(const struct kv_table *table, int fd, void *out);
+
+#endif /* __LXCFS_KV_PARSE_H */
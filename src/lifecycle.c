@@ -0,0 +1,384 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_FUSE3
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+#else
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "bindings.h"
+#include "cgroups/cgroup.h"
+#include "cgroups/cgroup_utils.h"
+#include "lifecycle.h"
+#include "memory_utils.h"
+#include "proc_cpuview.h"
+#include "proc_loadavg.h"
+#include "utils.h"
+
+/*
+ * Track the lifetime of containers so per-cgroup and per-pidns state can be
+ * dropped as soon as a container goes away instead of sweeping all tables
+ * periodically. Removed cgroups are reported by IN_DELETE_SELF on the cgroup
+ * directory, which works for both legacy and unified hierarchies. That event
+ * is only generated once the last reference to the directory is gone, so the
+ * cgroup fd cache, which holds one itself, additionally watches the parent
+ * for IN_DELETE of its children. A pidfd
+ * becomes readable once the process it refers to has exited which tells us
+ * when the init process of a pid namespace is gone.
+ */
+#define LIFECYCLE_HASH_SIZE 256
+#define LIFECYCLE_EV_STOP	UINT64_MAX
+#define LIFECYCLE_EV_INOTIFY	(UINT64_MAX - 1)
+
+struct lifecycle_watch {
+	int wd;
+	int subsys;
+	char *cg;
+	struct lifecycle_watch *next;
+};
+
+static struct lifecycle_watch *watches[LIFECYCLE_HASH_SIZE];
+static pthread_mutex_t watches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int epoll_fd = -EBADF;
+static int inotify_fd = -EBADF;
+static int stop_fd = -EBADF;
+static pthread_t lifecycle_thread;
+/* Set until lifecycle_exit(), cleared as well if we lost events. */
+static volatile bool active;
+
+bool lifecycle_active(void)
+{
+	return active;
+}
+
+/* Must be called with watches_lock held. */
+static struct lifecycle_watch *find_watch(int wd)
+{
+	struct lifecycle_watch *w;
+
+	for (w = watches[wd % LIFECYCLE_HASH_SIZE]; w; w = w->next)
+		if (w->wd == wd)
+			return w;
+
+	return NULL;
+}
+
+static struct lifecycle_watch *take_watch(int wd)
+{
+	struct lifecycle_watch **it;
+
+	for (it = &watches[wd % LIFECYCLE_HASH_SIZE]; *it; it = &(*it)->next) {
+		struct lifecycle_watch *w = *it;
+
+		if (w->wd == wd) {
+			*it = w->next;
+			return w;
+		}
+	}
+
+	return NULL;
+}
+
+static void free_watch(struct lifecycle_watch *w)
+{
+	free_disarm(w->cg);
+	free_disarm(w);
+}
+
+/* Watch the cgroup directory @path and report its removal as @cg. */
+static int lifecycle_watch_path(const char *path, const char *cg, int subsys)
+{
+	__do_free struct lifecycle_watch *new = NULL;
+	/* Different subsystems may watch the same directory, don't drop bits. */
+	uint32_t mask = IN_DELETE_SELF | IN_ONLYDIR | IN_MASK_ADD;
+	struct lifecycle_watch *w;
+	int wd;
+
+	if (!active)
+		return ret_errno(ENOSYS);
+
+	if (subsys & LIFECYCLE_CGROUP_CHILDREN)
+		mask |= IN_DELETE;
+
+	wd = inotify_add_watch(inotify_fd, path, mask);
+	if (wd < 0)
+		return log_debug(-errno, "Failed to watch cgroup %s", cg);
+
+	pthread_mutex_lock(&watches_lock);
+	w = find_watch(wd);
+	if (w) {
+		w->subsys |= subsys;
+		pthread_mutex_unlock(&watches_lock);
+		return 0;
+	}
+
+	new = zalloc(sizeof(*new));
+	if (new)
+		new->cg = strdup(cg);
+	if (!new || !new->cg) {
+		pthread_mutex_unlock(&watches_lock);
+		inotify_rm_watch(inotify_fd, wd);
+		if (new)
+			free(new->cg);
+		return ret_errno(ENOMEM);
+	}
+
+	new->wd = wd;
+	new->subsys = subsys;
+	new->next = watches[wd % LIFECYCLE_HASH_SIZE];
+	watches[wd % LIFECYCLE_HASH_SIZE] = move_ptr(new);
+	pthread_mutex_unlock(&watches_lock);
+
+	return 0;
+}
+
+int lifecycle_watch_cgroup(const char *controller, const char *cg, int subsys)
+{
+	__do_free char *path = NULL, *rel = NULL;
+	char fd_path[STRLITERALLEN("/proc/self/fd/") + INTTYPE_TO_STRLEN(int) + 1];
+	int cfd;
+
+	if (!active)
+		return ret_errno(ENOSYS);
+
+	cfd = get_cgroup_fd(controller);
+	if (cfd < 0)
+		return ret_errno(EBADF);
+
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", cfd);
+	rel = must_make_path_relative(cg, NULL);
+	path = must_make_path(fd_path, rel, NULL);
+
+	return lifecycle_watch_path(path, cg, subsys);
+}
+
+/* Watch the cgroup directory @fd refers to and report its removal as @cg. */
+int lifecycle_watch_cgroup_fd(int fd, const char *cg, int subsys)
+{
+	char fd_path[STRLITERALLEN("/proc/self/fd/") + INTTYPE_TO_STRLEN(int) + 1];
+
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+	return lifecycle_watch_path(fd_path, cg, subsys);
+}
+
+int lifecycle_watch_pidfd(int pidfd, ino_t pidns_inode)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN | EPOLLONESHOT,
+		.data.u64	= pidns_inode,
+	};
+
+	if (!active)
+		return ret_errno(ENOSYS);
+
+	/* Re-arm a watch that already fired. */
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) < 0 &&
+	    (errno != EEXIST || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, pidfd, &ev) < 0))
+		return -errno;
+
+	return 0;
+}
+
+static void cgroup_removed(struct lifecycle_watch *w)
+{
+	lxcfs_debug("Cgroup %s was removed", w->cg);
+
+	if (w->subsys & LIFECYCLE_LOADAVG)
+		load_evict(w->cg);
+
+	if (w->subsys & LIFECYCLE_CPUVIEW)
+		cpuview_evict(w->cg);
+
+	if (w->subsys & LIFECYCLE_CGROUP_FD)
+		cgroup_dirfd_evict(w->cg);
+}
+
+static void child_removed(int wd, const char *name)
+{
+	__do_free char *cg = NULL;
+	struct lifecycle_watch *w;
+
+	pthread_mutex_lock(&watches_lock);
+	w = find_watch(wd);
+	if (w && (w->subsys & LIFECYCLE_CGROUP_CHILDREN))
+		cg = must_make_path(w->cg, name, NULL);
+	pthread_mutex_unlock(&watches_lock);
+
+	if (cg) {
+		lxcfs_debug("Cgroup %s was removed", cg);
+		cgroup_dirfd_evict(cg);
+	}
+}
+
+static void drain_inotify(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+
+		for (char *ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + ev->len) {
+			struct lifecycle_watch *w;
+
+			ev = (const struct inotify_event *)ptr;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* Fall back to the periodic sweeps. */
+				lxcfs_info("Lost cgroup removal events, falling back to polling");
+				active = false;
+				/* Cached descriptors might refer to removed cgroups now. */
+				cgroup_dirfd_flush();
+				continue;
+			}
+
+			if (ev->mask & IN_DELETE) {
+				if ((ev->mask & IN_ISDIR) && ev->len)
+					child_removed(ev->wd, ev->name);
+				continue;
+			}
+
+			if (!(ev->mask & (IN_DELETE_SELF | IN_IGNORED)))
+				continue;
+
+			pthread_mutex_lock(&watches_lock);
+			w = take_watch(ev->wd);
+			pthread_mutex_unlock(&watches_lock);
+			if (!w)
+				continue;
+
+			cgroup_removed(w);
+			free_watch(w);
+		}
+	}
+}
+
+static void *lifecycle_worker(void *arg)
+{
+	struct epoll_event events[64];
+
+	for (;;) {
+		int nr;
+
+		nr = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(*events), -1);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+
+			lxcfs_error("%s - Failed waiting for lifecycle events", strerror(errno));
+			active = false;
+			return NULL;
+		}
+
+		for (int i = 0; i < nr; i++) {
+			switch (events[i].data.u64) {
+			case LIFECYCLE_EV_STOP:
+				return NULL;
+			case LIFECYCLE_EV_INOTIFY:
+				drain_inotify();
+				break;
+			default:
+				initpid_evict(events[i].data.u64);
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+bool lifecycle_init(void)
+{
+	__do_close int epfd = -EBADF, ifd = -EBADF, sfd = -EBADF;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+	};
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return log_error(false, "%s - Failed to create epoll instance", strerror(errno));
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd < 0)
+		return log_error(false, "%s - Failed to create inotify instance", strerror(errno));
+
+	sfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sfd < 0)
+		return log_error(false, "%s - Failed to create eventfd", strerror(errno));
+
+	ev.data.u64 = LIFECYCLE_EV_INOTIFY;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, ifd, &ev) < 0)
+		return log_error(false, "%s - Failed to add inotify fd to epoll", strerror(errno));
+
+	ev.data.u64 = LIFECYCLE_EV_STOP;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) < 0)
+		return log_error(false, "%s - Failed to add eventfd to epoll", strerror(errno));
+
+	epoll_fd = move_fd(epfd);
+	inotify_fd = move_fd(ifd);
+	stop_fd = move_fd(sfd);
+
+	active = true;
+	if (pthread_create(&lifecycle_thread, NULL, lifecycle_worker, NULL)) {
+		active = false;
+		close_prot_errno_disarm(epoll_fd);
+		close_prot_errno_disarm(inotify_fd);
+		close_prot_errno_disarm(stop_fd);
+		return log_error(false, "Failed to create lifecycle thread");
+	}
+
+	return true;
+}
+
+void lifecycle_exit(void)
+{
+	uint64_t val = 1;
+
+	if (stop_fd < 0)
+		return;
+
+	active = false;
+	if (write_nointr(stop_fd, &val, sizeof(val)) == sizeof(val))
+		pthread_join(lifecycle_thread, NULL);
+
+	for (int i = 0; i < LIFECYCLE_HASH_SIZE; i++) {
+		struct lifecycle_watch *w, *next;
+
+		for (w = watches[i]; w; w = next) {
+			next = w->next;
+			free_watch(w);
+		}
+		watches[i] = NULL;
+	}
+
+	close_prot_errno_disarm(epoll_fd);
+	close_prot_errno_disarm(inotify_fd);
+	close_prot_errno_disarm(stop_fd);
+}
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_LIFECYCLE_H
+#define __LXCFS_LIFECYCLE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "macro.h"
+
+/* Subsystems keeping per-cgroup state that want to know about removal. */
+#define LIFECYCLE_LOADAVG	(1 << 0)
+#define LIFECYCLE_CPUVIEW	(1 << 1)
+#define LIFECYCLE_CGROUP_FD	(1 << 2)
+/* Report removed child cgroups of the watched one to the cgroup fd cache. */
+#define LIFECYCLE_CGROUP_CHILDREN	(1 << 3)
+
+extern bool lifecycle_init(void);
+extern void lifecycle_exit(void);
+extern bool lifecycle_active(void);
+extern int lifecycle_watch_cgroup(const char *controller, const char *cg,
+				  int subsys);
+extern int lifecycle_watch_cgroup_fd(int fd, const char *cg, int subsys);
+extern int lifecycle_watch_pidfd(int pidfd, ino_t pidns_inode);
+
+#endif /* __LXCFS_LIFECYCLE_H */
@@ -25,9 +25,11 @@
 #include <fcntl.h>
 #include <fuse.h>
 #include <libgen.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,12 +46,31 @@
 #include "lxcfs_fuse_compat.h"
 #include "macro.h"
 #include "memory_utils.h"
+#include "proc_loadavg.h"
+#include "stats.h"
 
 void *dlopen_handle;
 
-/* Functions to keep track of number of threads using the library */
-
-static int users_count;
+/*
+ * Functions to keep track of threads using the library
+ *
+ * Every thread calling into the library owns a slot whose counter is odd
+ * while it is inside. Only the owning thread ever writes to it so entering
+ * and leaving the library doesn't touch any shared cache line. A reload
+ * raises users_reloading, waits until no slot is odd anymore and then swaps
+ * the library while holding user_count_mutex. Threads that see the flag when
+ * entering back out and wait for the reload to finish.
+ */
+struct users_slot {
+	uint64_t seq;
+	bool used;
+	struct users_slot *next;
+} __attribute__((aligned(64)));
+
+static struct users_slot *users_slots;
+static pthread_mutex_t users_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t users_slot_key;
+static int users_reloading;
 static pthread_mutex_t user_count_mutex = PTHREAD_MUTEX_INITIALIZER;
 static void lock_mutex(pthread_mutex_t *l)
 {
@@ -80,14 +101,27 @@ static inline void users_unlock(void)
 }
 
 static pthread_t loadavg_pid = 0;
+static int loadavg_threads = 1;
 
 /* Returns zero on success */
 static int start_loadavg(void)
 {
 	char *error;
 	pthread_t (*__load_daemon)(int);
+	pthread_t (*__load_daemon_v2)(int, int);
 
 	dlerror();
+	__load_daemon_v2 = (pthread_t(*)(int, int))dlsym(dlopen_handle, "load_daemon_v2");
+	error = dlerror();
+	if (!error) {
+		loadavg_pid = __load_daemon_v2(1, loadavg_threads);
+		if (!loadavg_pid)
+			return -1;
+
+		return 0;
+	}
+
+	/* Older liblxcfs.so only supports a single loadavg thread. */
 	__load_daemon = (pthread_t(*)(int))dlsym(dlopen_handle, "load_daemon");
 	error = dlerror();
 	if (error)
@@ -119,13 +153,59 @@ static int stop_loadavg(void)
 
 static volatile sig_atomic_t need_reload;
 
+/*
+ * Ask the library that is about to be unloaded to serialize its caches.
+ * Returns a file descriptor to hand to the next library or -EBADF.
+ */
+static int save_state(void)
+{
+	char *error;
+	int (*__lxcfs_state_save)(void);
+	int fd;
+
+	dlerror();
+	__lxcfs_state_save = (int (*)(void))dlsym(dlopen_handle, "lxcfs_state_save");
+	error = dlerror();
+	if (error)
+		return -EBADF;
+
+	fd = __lxcfs_state_save();
+	if (fd < 0)
+		return -EBADF;
+
+	return fd;
+}
+
+static void restore_state(int fd)
+{
+	char *error;
+	int (*__lxcfs_state_restore)(int);
+
+	dlerror();
+	__lxcfs_state_restore = (int (*)(int))dlsym(dlopen_handle, "lxcfs_state_restore");
+	error = dlerror();
+	if (error)
+		lxcfs_info("%s - Dropping state of previous liblxcfs.so", error);
+	else
+		__lxcfs_state_restore(fd);
+
+	close(fd);
+}
+
+/* Resolved once per library load, NULL if the library doesn't keep stats. */
+static void (*stats_request_fn)(int op, const char *path, int ret, uint64_t nsecs);
+
 /* do_reload - reload the dynamic library.  Done under
- * lock and when we know the user_count was 0 */
+ * lock and when we know no thread is using the library */
 static void do_reload(void)
 {
-	int ret;
+	int ret, state_fd = -EBADF;
 	char lxcfs_lib_path[PATH_MAX];
 
+	/* Taken while the loadavg daemon still has its history. */
+	if (dlopen_handle)
+		state_fd = save_state();
+
 	if (loadavg_pid > 0)
 		stop_loadavg();
 
@@ -161,28 +241,126 @@ static void do_reload(void)
 		lxcfs_debug("Opened %s", lxcfs_lib_path);
 
 good:
+	stats_request_fn = (void (*)(int, const char *, int, uint64_t))dlsym(dlopen_handle, "stats_request");
+
 	if (loadavg_pid > 0)
 		start_loadavg();
 
+	if (state_fd >= 0)
+		restore_state(state_fd);
+
 	if (need_reload)
 		lxcfs_info("Reloaded LXCFS");
 	need_reload = 0;
 }
 
-static void up_users(void)
+static void users_slot_release(void *data)
+{
+	struct users_slot *slot = data;
+
+	lock_mutex(&users_slots_mutex);
+	slot->used = false;
+	unlock_mutex(&users_slots_mutex);
+}
+
+static struct users_slot *users_slot_get(void)
+{
+	struct users_slot *slot;
+
+	slot = pthread_getspecific(users_slot_key);
+	if (slot)
+		return slot;
+
+	lock_mutex(&users_slots_mutex);
+	for (slot = users_slots; slot; slot = slot->next)
+		if (!slot->used)
+			break;
+
+	if (!slot) {
+		if (posix_memalign((void **)&slot, __alignof__(*slot), sizeof(*slot)))
+			log_exit("Failed to allocate user slot");
+		memset(slot, 0, sizeof(*slot));
+		slot->next = users_slots;
+		users_slots = slot;
+	}
+	slot->used = true;
+	unlock_mutex(&users_slots_mutex);
+
+	if (pthread_setspecific(users_slot_key, slot))
+		log_exit("Failed to register user slot");
+
+	return slot;
+}
+
+/* Wait until no thread is running a library method anymore. */
+static void wait_for_users(void)
+{
+	for (;;) {
+		bool busy = false;
+
+		lock_mutex(&users_slots_mutex);
+		for (struct users_slot *slot = users_slots; slot; slot = slot->next) {
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) & 1) {
+				busy = true;
+				break;
+			}
+		}
+		unlock_mutex(&users_slots_mutex);
+
+		if (!busy)
+			return;
+
+		usleep(1000);
+	}
+}
+
+static void reload_users(void)
 {
 	users_lock();
-	if (users_count == 0 && need_reload)
+	if (need_reload) {
+		__atomic_store_n(&users_reloading, 1, __ATOMIC_RELAXED);
+		/* Pairs with the fence in up_users(). */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		wait_for_users();
 		do_reload();
-	users_count++;
+		__atomic_store_n(&users_reloading, 0, __ATOMIC_RELEASE);
+	}
 	users_unlock();
 }
 
+static void up_users(void)
+{
+	struct users_slot *slot = users_slot_get();
+
+	for (;;) {
+		if (need_reload)
+			reload_users();
+
+		__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+		/*
+		 * Either we see the reload starting or the reload sees us
+		 * inside the library and waits for us.
+		 */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&users_reloading, __ATOMIC_RELAXED))
+			return;
+
+		/* Back out and wait for the reload to finish. */
+		__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+		users_lock();
+		users_unlock();
+	}
+}
+
 static void down_users(void)
 {
-	users_lock();
-	users_count--;
-	users_unlock();
+	struct users_slot *slot = pthread_getspecific(users_slot_key);
+
+	/* Without a slot this thread never entered through up_users(). */
+	if (!slot)
+		return;
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
 }
 
 static void sigusr1_reload(int signo, siginfo_t *info, void *extra)
@@ -190,7 +368,82 @@ static void sigusr1_reload(int signo, siginfo_t *info, void *extra)
 	need_reload = 1;
 }
 
+static inline uint64_t stats_start(void)
+{
+	struct timespec ts;
+
+	if (!stats_request_fn || clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Must be called before down_users(), the library could go away after. */
+static inline void stats_done(int op, const char *path, int ret, uint64_t start)
+{
+	if (stats_request_fn && start)
+		stats_request_fn(op, path, ret, stats_start() - start);
+}
+
 /* Functions to run the library methods */
+static int do_stats_getattr(const char *path, struct stat *sb)
+{
+	char *error;
+	int (*__stats_getattr)(const char *path, struct stat *sb);
+
+	dlerror();
+	__stats_getattr = (int (*)(const char *, struct stat *))dlsym(dlopen_handle, "stats_getattr");
+	error = dlerror();
+	if (error)
+		return -ENOENT;
+
+	return __stats_getattr(path, sb);
+}
+
+static int do_stats_open(const char *path, struct fuse_file_info *fi)
+{
+	char *error;
+	int (*__stats_open)(const char *path, struct fuse_file_info *fi);
+
+	dlerror();
+	__stats_open = (int (*)(const char *, struct fuse_file_info *))dlsym(dlopen_handle, "stats_open");
+	error = dlerror();
+	if (error)
+		return -ENOENT;
+
+	return __stats_open(path, fi);
+}
+
+static int do_stats_read(const char *path, char *buf, size_t size, off_t offset,
+			 struct fuse_file_info *fi)
+{
+	char *error;
+	int (*__stats_read)(const char *path, char *buf, size_t size,
+			    off_t offset, struct fuse_file_info *fi);
+
+	dlerror();
+	__stats_read = (int (*)(const char *, char *, size_t, off_t, struct fuse_file_info *))dlsym(dlopen_handle, "stats_read");
+	error = dlerror();
+	if (error)
+		return log_error(-1, "%s - Failed to find stats_read()", error);
+
+	return __stats_read(path, buf, size, offset, fi);
+}
+
+static int do_stats_release(const char *path, struct fuse_file_info *fi)
+{
+	char *error;
+	int (*__stats_release)(const char *path, struct fuse_file_info *fi);
+
+	dlerror();
+	__stats_release = (int (*)(const char *, struct fuse_file_info *))dlsym(dlopen_handle, "stats_release");
+	error = dlerror();
+	if (error)
+		return log_error(-1, "%s - Failed to find stats_release()", error);
+
+	return __stats_release(path, fi);
+}
+
 static int do_cg_getattr(const char *path, struct stat *sb)
 {
 	char *error;
@@ -576,6 +829,7 @@ static int lxcfs_getattr(const char *path, struct stat *sb, struct fuse_file_inf
 static int lxcfs_getattr(const char *path, struct stat *sb)
 #endif
 {
+	uint64_t start;
 	int ret;
 	struct timespec now;
 
@@ -590,23 +844,36 @@ static int lxcfs_getattr(const char *path, struct stat *sb)
 		return 0;
 	}
 
+	if (strcmp(path, LXCFS_STATS_PATH) == 0) {
+		up_users();
+		ret = do_stats_getattr(path, sb);
+		down_users();
+		return ret;
+	}
+
 	if (strncmp(path, "/cgroup", 7) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_cg_getattr(path, sb);
+		stats_done(LXCFS_OP_GETATTR, path, ret, start);
 		down_users();
 		return ret;
 	}
 
 	if (strncmp(path, "/proc", 5) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_proc_getattr(path, sb);
+		stats_done(LXCFS_OP_GETATTR, path, ret, start);
 		down_users();
 		return ret;
 	}
 
 	if (strncmp(path, "/sys", 4) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_sys_getattr(path, sb);
+		stats_done(LXCFS_OP_GETATTR, path, ret, start);
 		down_users();
 		return ret;
 	}
@@ -645,6 +912,7 @@ static int lxcfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			 off_t offset, struct fuse_file_info *fi)
 #endif
 {
+	uint64_t start;
 	int ret;
 
 	if (strcmp(path, "/") == 0) {
@@ -652,7 +920,8 @@ static int lxcfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		    DIR_FILLER(filler, buf, "..", NULL, 0) != 0 ||
 		    DIR_FILLER(filler, buf, "proc", NULL, 0) != 0 ||
 		    DIR_FILLER(filler, buf, "sys", NULL, 0) != 0 ||
-		    DIR_FILLER(filler, buf, "cgroup", NULL, 0) != 0)
+		    DIR_FILLER(filler, buf, "cgroup", NULL, 0) != 0 ||
+		    DIR_FILLER(filler, buf, LXCFS_STATS_PATH + 1, NULL, 0) != 0)
 			return -ENOMEM;
 
 		return 0;
@@ -660,21 +929,27 @@ static int lxcfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 	if (strncmp(path, "/cgroup", 7) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_cg_readdir(path, buf, filler, offset, fi);
+		stats_done(LXCFS_OP_READDIR, path, ret, start);
 		down_users();
 		return ret;
 	}
 
 	if (strcmp(path, "/proc") == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_proc_readdir(path, buf, filler, offset, fi);
+		stats_done(LXCFS_OP_READDIR, path, ret, start);
 		down_users();
 		return ret;
 	}
 
 	if (strncmp(path, "/sys", 4) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_sys_readdir(path, buf, filler, offset, fi);
+		stats_done(LXCFS_OP_READDIR, path, ret, start);
 		down_users();
 		return ret;
 	}
@@ -689,6 +964,9 @@ static int lxcfs_access(const char *path, int mode)
 	if (strcmp(path, "/") == 0 && (mode & W_OK) == 0)
 		return 0;
 
+	if (strcmp(path, LXCFS_STATS_PATH) == 0)
+		return (mode & W_OK) ? -EACCES : 0;
+
 	if (strncmp(path, "/cgroup", 7) == 0) {
 		up_users();
 		ret = do_cg_access(path, mode);
@@ -742,25 +1020,44 @@ static int lxcfs_releasedir(const char *path, struct fuse_file_info *fi)
 
 static int lxcfs_open(const char *path, struct fuse_file_info *fi)
 {
+	uint64_t start;
+	struct lxcfs_opts *opts = fuse_get_context()->private_data;
 	int ret;
 
+	/* Only proc files know how to deal with the page cache. */
+	if (opts && opts->page_cache_ttl)
+		fi->direct_io = 1;
+
+	if (strcmp(path, LXCFS_STATS_PATH) == 0) {
+		up_users();
+		ret = do_stats_open(path, fi);
+		down_users();
+		return ret;
+	}
+
 	if (strncmp(path, "/cgroup", 7) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_cg_open(path, fi);
+		stats_done(LXCFS_OP_OPEN, path, ret, start);
 		down_users();
 		return ret;
 	}
 
 	if (strncmp(path, "/proc", 5) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_proc_open(path, fi);
+		stats_done(LXCFS_OP_OPEN, path, ret, start);
 		down_users();
 		return ret;
 	}
 
 	if (strncmp(path, "/sys", 4) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_sys_open(path, fi);
+		stats_done(LXCFS_OP_OPEN, path, ret, start);
 		down_users();
 		return ret;
 	}
@@ -771,25 +1068,39 @@ static int lxcfs_open(const char *path, struct fuse_file_info *fi)
 static int lxcfs_read(const char *path, char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi)
 {
+	uint64_t start;
 	int ret;
 
+	if (strcmp(path, LXCFS_STATS_PATH) == 0) {
+		up_users();
+		ret = do_stats_read(path, buf, size, offset, fi);
+		down_users();
+		return ret;
+	}
+
 	if (strncmp(path, "/cgroup", 7) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_cg_read(path, buf, size, offset, fi);
+		stats_done(LXCFS_OP_READ, path, ret, start);
 		down_users();
 		return ret;
 	}
 
 	if (strncmp(path, "/proc", 5) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_proc_read(path, buf, size, offset, fi);
+		stats_done(LXCFS_OP_READ, path, ret, start);
 		down_users();
 		return ret;
 	}
 
 	if (strncmp(path, "/sys", 4) == 0) {
 		up_users();
+		start = stats_start();
 		ret = do_sys_read(path, buf, size, offset, fi);
+		stats_done(LXCFS_OP_READ, path, ret, start);
 		down_users();
 		return ret;
 	}
@@ -797,6 +1108,61 @@ static int lxcfs_read(const char *path, char *buf, size_t size, off_t offset,
 	return -EINVAL;
 }
 
+#ifdef HAVE_FUSE3
+static int do_proc_read_buf(const char *path, struct fuse_bufvec **bufp,
+			    size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	int (*__proc_read_buf)(const char *path, struct fuse_bufvec **bufp,
+			       size_t size, off_t offset, struct fuse_file_info *fi);
+
+	dlerror();
+	__proc_read_buf = (int (*)(const char *, struct fuse_bufvec **, size_t, off_t, struct fuse_file_info *))dlsym(dlopen_handle, "proc_read_buf");
+	/* Older libraries only know about plain reads. */
+	if (dlerror())
+		return -ENOSYS;
+
+	return __proc_read_buf(path, bufp, size, offset, fi);
+}
+
+/*
+ * Proc files shared between readers are handed to fuse as a descriptor so
+ * they can be spliced to the reader instead of being copied around.
+ */
+static int lxcfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+			  size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	__do_free struct fuse_bufvec *bufv = NULL;
+	__do_free void *mem = NULL;
+	uint64_t start;
+	int ret;
+
+	if (strncmp(path, "/proc", 5) == 0) {
+		up_users();
+		start = stats_start();
+		ret = do_proc_read_buf(path, bufp, size, offset, fi);
+		if (ret != -ENOSYS)
+			stats_done(LXCFS_OP_READ, path, ret ?: (int)(*bufp)->buf[0].size, start);
+		down_users();
+		if (ret != -ENOSYS)
+			return ret;
+	}
+
+	bufv = malloc(sizeof(*bufv));
+	mem = malloc(size);
+	if (!bufv || !mem)
+		return -ENOMEM;
+
+	ret = lxcfs_read(path, mem, size, offset, fi);
+	if (ret < 0)
+		return ret;
+
+	*bufv = FUSE_BUFVEC_INIT(ret);
+	bufv->buf[0].mem = move_ptr(mem);
+	*bufp = move_ptr(bufv);
+	return 0;
+}
+#endif
+
 int lxcfs_write(const char *path, const char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
@@ -821,6 +1187,13 @@ static int lxcfs_release(const char *path, struct fuse_file_info *fi)
 {
 	int ret;
 
+	if (strcmp(path, LXCFS_STATS_PATH) == 0) {
+		up_users();
+		ret = do_stats_release(path, fi);
+		down_users();
+		return ret;
+	}
+
 	if (strncmp(path, "/cgroup", 7) == 0) {
 		up_users();
 		ret = do_cg_release(path, fi);
@@ -954,6 +1327,9 @@ const struct fuse_operations lxcfs_ops = {
 	.open		= lxcfs_open,
 	.opendir	= lxcfs_opendir,
 	.read		= lxcfs_read,
+#ifdef HAVE_FUSE3
+	.read_buf	= lxcfs_read_buf,
+#endif
 	.readdir	= lxcfs_readdir,
 	.release	= lxcfs_release,
 	.releasedir	= lxcfs_releasedir,
@@ -1004,6 +1380,22 @@ static void usage()
 	lxcfs_info("  -v, --version        Print lxcfs version");
 	lxcfs_info("  --enable-cfs         Enable CPU virtualization via CPU shares");
 	lxcfs_info("  --enable-pidfd       Use pidfd for process tracking");
+	lxcfs_info("  --loadavg-threads N  Number of threads refreshing loadavg (default 1,");
+	lxcfs_info("                       at most %d)", LOAD_MAX_THREADS);
+	lxcfs_info("  --render-cache-ttl MS");
+	lxcfs_info("                       Share rendered proc files between readers in the");
+	lxcfs_info("                       same cgroup for MS milliseconds (e.g. 100)");
+	lxcfs_info("  --page-cache-ttl MS  Let the kernel cache proc files for MS milliseconds");
+	lxcfs_info("                       instead of forcing direct_io (e.g. 1000),");
+	lxcfs_info("                       requires FUSE 3");
+#ifdef HAVE_FUSE3
+	lxcfs_info("  --fuse-clone-fd      Give every FUSE worker its own /dev/fuse fd");
+	lxcfs_info("  --fuse-max-idle-threads N");
+	lxcfs_info("                       Number of idle FUSE workers to keep around");
+	lxcfs_info("  --fuse-max-threads N Upper bound for the number of FUSE workers");
+	lxcfs_info("                       (needs libfuse 3.12 or newer)");
+#endif
+	lxcfs_info("  --fuse-cpus LIST     Run FUSE workers on the cpus in LIST only (e.g. 0-3,8)");
 	exit(EXIT_FAILURE);
 }
 
@@ -1062,6 +1454,43 @@ static bool swallow_option(int *argcp, char *argv[], char *opt, char **v)
 	return false;
 }
 
+/* Parse a cpu list in the format "0-3,8" into @set. */
+static int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+
+	CPU_ZERO(set);
+	while (*p) {
+		unsigned long first, last;
+		char *end;
+
+		if (*p < '0' || *p > '9')
+			return -EINVAL;
+
+		errno = 0;
+		first = last = strtoul(p, &end, 10);
+		if (*end == '-') {
+			p = end + 1;
+			if (*p < '0' || *p > '9')
+				return -EINVAL;
+			last = strtoul(p, &end, 10);
+		}
+		if (errno || last < first || last >= CPU_SETSIZE)
+			return -EINVAL;
+
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, set);
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -EINVAL;
+		p = end;
+	}
+
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
 static int set_pidfile(char *pidfile)
 {
 	__do_close int fd = -EBADF;
@@ -1110,10 +1539,13 @@ int main(int argc, char *argv[])
 	bool load_use = false;
 	/*
 	 * what we pass to fuse_main is:
-	 * argv[0] -s [-f|-d] -o allow_other,directio argv[1] NULL
+	 * argv[0] [-f|-d] -o allow_other,directio [-o worker options] argv[1] NULL
 	 */
-	int nargs = 5, cnt = 0;
-	char *newargv[6];
+	int nargs, cnt = 0;
+	char *newargv[8];
+	char fuse_worker_opts[STRLITERALLEN("clone_fd,max_idle_threads=,max_threads=") +
+			      2 * INTTYPE_TO_STRLEN(unsigned int) + 1] = {};
+	cpu_set_t fuse_cpus;
 	struct lxcfs_opts *opts;
 
 	opts = malloc(sizeof(struct lxcfs_opts));
@@ -1124,6 +1556,12 @@ int main(int argc, char *argv[])
 	opts->swap_off = false;
 	opts->use_pidfd = false;
 	opts->use_cfs = false;
+	opts->cache_ttl = 0;
+	opts->page_cache_ttl = 0;
+	opts->fuse_clone_fd = false;
+	opts->fuse_max_idle_threads = 0;
+	opts->fuse_max_threads = 0;
+	opts->fuse_cpus = NULL;
 
 	/* accomodate older init scripts */
 	swallow_arg(&argc, argv, "-s");
@@ -1146,6 +1584,24 @@ int main(int argc, char *argv[])
 	if (swallow_arg(&argc, argv, "--enable-loadavg"))
 		load_use = true;
 
+	/* --loadavg-threads */
+	if (swallow_option(&argc, argv, "--loadavg-threads", &v)) {
+		char *end = NULL;
+		long nr;
+
+		errno = 0;
+		nr = strtol(v, &end, 10);
+		if (errno || !end || *end || end == v || nr < 1 || nr > LOAD_MAX_THREADS) {
+			lxcfs_error("Invalid number of loadavg threads %s, must be between 1 and %d",
+				    v, LOAD_MAX_THREADS);
+			free(v);
+			exit(EXIT_FAILURE);
+		}
+		loadavg_threads = nr;
+		free(v);
+		v = NULL;
+	}
+
 	/* -u / --disable-swap */
 	opts->swap_off = swallow_arg(&argc, argv, "-u");
 	if (swallow_arg(&argc, argv, "--disable-swap"))
@@ -1158,6 +1614,101 @@ int main(int argc, char *argv[])
 	if (swallow_arg(&argc, argv, "--enable-cfs"))
 		opts->use_cfs = true;
 
+	/* --render-cache-ttl */
+	if (swallow_option(&argc, argv, "--render-cache-ttl", &v)) {
+		char *end = NULL;
+		unsigned long ttl;
+
+		errno = 0;
+		ttl = strtoul(v, &end, 10);
+		if (errno || !end || *end || end == v || ttl > UINT_MAX) {
+			lxcfs_error("Invalid render cache ttl %s", v);
+			free(v);
+			exit(EXIT_FAILURE);
+		}
+		opts->cache_ttl = ttl;
+		free(v);
+		v = NULL;
+	}
+
+	/* --page-cache-ttl */
+	if (swallow_option(&argc, argv, "--page-cache-ttl", &v)) {
+		char *end = NULL;
+		unsigned long ttl;
+
+		errno = 0;
+		ttl = strtoul(v, &end, 10);
+		if (errno || !end || *end || end == v || ttl > UINT_MAX) {
+			lxcfs_error("Invalid page cache ttl %s", v);
+			free(v);
+			exit(EXIT_FAILURE);
+		}
+		opts->page_cache_ttl = ttl;
+		free(v);
+		v = NULL;
+#ifndef HAVE_FUSE3
+		/* FUSE 2 can't invalidate the pages of expired snapshots. */
+		if (opts->page_cache_ttl) {
+			lxcfs_info("--page-cache-ttl requires FUSE 3, using direct_io");
+			opts->page_cache_ttl = 0;
+		}
+#endif
+	}
+
+	/* --fuse-clone-fd */
+	if (swallow_arg(&argc, argv, "--fuse-clone-fd"))
+		opts->fuse_clone_fd = true;
+
+	/* --fuse-max-idle-threads */
+	if (swallow_option(&argc, argv, "--fuse-max-idle-threads", &v)) {
+		char *end = NULL;
+		unsigned long nr;
+
+		errno = 0;
+		nr = strtoul(v, &end, 10);
+		if (errno || !end || *end || end == v || nr < 1 || nr > INT_MAX) {
+			lxcfs_error("Invalid number of idle FUSE threads %s", v);
+			free(v);
+			exit(EXIT_FAILURE);
+		}
+		opts->fuse_max_idle_threads = nr;
+		free(v);
+		v = NULL;
+	}
+
+	/* --fuse-max-threads */
+	if (swallow_option(&argc, argv, "--fuse-max-threads", &v)) {
+		char *end = NULL;
+		unsigned long nr;
+
+		errno = 0;
+		nr = strtoul(v, &end, 10);
+		if (errno || !end || *end || end == v || nr < 1 || nr > INT_MAX) {
+			lxcfs_error("Invalid number of FUSE threads %s", v);
+			free(v);
+			exit(EXIT_FAILURE);
+		}
+		opts->fuse_max_threads = nr;
+		free(v);
+		v = NULL;
+	}
+
+#ifndef HAVE_FUSE3
+	if (opts->fuse_clone_fd || opts->fuse_max_idle_threads || opts->fuse_max_threads)
+		log_exit("FUSE worker options require FUSE 3");
+#endif
+
+	/* --fuse-cpus */
+	if (swallow_option(&argc, argv, "--fuse-cpus", &v)) {
+		if (parse_cpu_list(v, &fuse_cpus) < 0) {
+			lxcfs_error("Invalid FUSE worker cpu list %s", v);
+			free(v);
+			exit(EXIT_FAILURE);
+		}
+		opts->fuse_cpus = v;
+		v = NULL;
+	}
+
 	if (swallow_option(&argc, argv, "-o", &v)) {
 		/* Parse multiple values */
 		for (; (token = strtok_r(v, ",", &saveptr)); v = NULL) {
@@ -1193,6 +1744,9 @@ int main(int argc, char *argv[])
 	if (argc != 2 || is_help(argv[1]))
 		usage();
 
+	if (pthread_key_create(&users_slot_key, users_slot_release))
+		log_exit("Failed to create user slot key");
+
 	do_reload();
 	if (install_signal_handler(SIGUSR1, sigusr1_reload)) {
 		lxcfs_error("%s - Failed to install SIGUSR1 signal handler", strerror(errno));
@@ -1215,16 +1769,43 @@ int main(int argc, char *argv[])
 	 * shouldn't guarantee that we don't need more complicated access
 	 * helpers for proc and sys virtualization in the future.
 	 */
+	/*
+	 * In page cache mode direct_io is decided per open and the size
+	 * reported by getattr must not be cached, the kernel doesn't read
+	 * past it.
+	 */
 #ifdef HAVE_FUSE3
-	newargv[cnt++] = "allow_other,entry_timeout=0.5,attr_timeout=0.5";
+	if (opts->page_cache_ttl)
+		newargv[cnt++] = "allow_other,entry_timeout=0.5,attr_timeout=0";
+	else
+		newargv[cnt++] = "allow_other,entry_timeout=0.5,attr_timeout=0.5";
 #else
 	if (nonempty)
 		newargv[cnt++] = "allow_other,direct_io,entry_timeout=0.5,attr_timeout=0.5,nonempty";
 	else
 		newargv[cnt++] = "allow_other,direct_io,entry_timeout=0.5,attr_timeout=0.5";
 #endif
+	if (opts->fuse_clone_fd || opts->fuse_max_idle_threads || opts->fuse_max_threads) {
+		size_t len = 0;
+
+		if (opts->fuse_clone_fd)
+			len += snprintf(fuse_worker_opts + len, sizeof(fuse_worker_opts) - len,
+					"clone_fd,");
+		if (opts->fuse_max_idle_threads)
+			len += snprintf(fuse_worker_opts + len, sizeof(fuse_worker_opts) - len,
+					"max_idle_threads=%u,", opts->fuse_max_idle_threads);
+		if (opts->fuse_max_threads)
+			len += snprintf(fuse_worker_opts + len, sizeof(fuse_worker_opts) - len,
+					"max_threads=%u,", opts->fuse_max_threads);
+		/* Drop the trailing comma. */
+		fuse_worker_opts[len - 1] = '\0';
+
+		newargv[cnt++] = "-o";
+		newargv[cnt++] = fuse_worker_opts;
+	}
 	newargv[cnt++] = argv[1];
 	newargv[cnt++] = NULL;
+	nargs = cnt - 1;
 
 	if (!pidfile) {
 		snprintf(pidfile_buf, sizeof(pidfile_buf), "%s/lxcfs.pid", RUNTIME_PATH);
@@ -1238,6 +1819,17 @@ int main(int argc, char *argv[])
 	if (load_use && start_loadavg() != 0)
 		goto out;
 
+	/*
+	 * The FUSE workers are spawned from this thread and inherit its
+	 * affinity. Threads started before, like the loadavg workers, run
+	 * anywhere until a reload restarts them from a FUSE worker.
+	 */
+	if (opts->fuse_cpus && sched_setaffinity(0, sizeof(fuse_cpus), &fuse_cpus) < 0) {
+		lxcfs_error("%s - Failed to restrict FUSE workers to cpus %s",
+			    strerror(errno), opts->fuse_cpus);
+		goto out;
+	}
+
 	if (!fuse_main(nargs, newargv, &lxcfs_ops, opts))
 		ret = EXIT_SUCCESS;
 
@@ -1249,6 +1841,8 @@ out:
 		dlclose(dlopen_handle);
 	if (pidfile)
 		unlink(pidfile);
+	if (opts)
+		free(opts->fuse_cpus);
 	free(opts);
 	close_prot_errno_disarm(pidfile_fd);
 	exit(ret);
@@ -0,0 +1,427 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_FUSE3
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+#else
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bindings.h"
+#include "memory_utils.h"
+#include "proc_cache.h"
+#include "proc_loadavg.h"
+#include "stats.h"
+#include "utils.h"
+
+/*
+ * Cache of rendered proc files keyed on (file type, cgroup). Many readers in
+ * the same container hitting e.g. /proc/meminfo within the same TTL window
+ * will be handed the same bytes instead of re-running the renderer.
+ */
+#define PROC_CACHE_HASH_SIZE 256
+/* Entries nobody asked for in this many milliseconds are dropped. */
+#define PROC_CACHE_PRUNE_MSECS 10000
+
+/*
+ * A render in progress. Readers asking for the same file in the same cgroup
+ * meanwhile wait for it and share its result instead of rendering again.
+ */
+struct proc_cache_flight {
+	int type;
+	const char *cg;
+	bool done;
+	struct proc_cache_entry *entry;
+	/* The renderer plus all waiters. */
+	int refcount;
+	struct proc_cache_flight *next;
+};
+
+struct proc_cache_head {
+	pthread_mutex_t lock;
+	pthread_cond_t landed;
+	struct proc_cache_entry *next;
+	struct proc_cache_flight *flights;
+};
+
+static struct proc_cache_head proc_cache[PROC_CACHE_HASH_SIZE] = {
+	[0 ... PROC_CACHE_HASH_SIZE - 1] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.landed = PTHREAD_COND_INITIALIZER,
+		.next = NULL,
+		.flights = NULL,
+	},
+};
+
+/*
+ * Entry backing the last zero-copy reply of each thread, see
+ * proc_cache_pin().
+ */
+static pthread_key_t proc_cache_pin_key;
+static pthread_once_t proc_cache_pin_once = PTHREAD_ONCE_INIT;
+static bool proc_cache_pin_valid;
+
+uint64_t proc_cache_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct proc_cache_head *proc_cache_head(int type, const char *cg)
+{
+	return &proc_cache[((unsigned int)calc_hash(cg) + type) % PROC_CACHE_HASH_SIZE];
+}
+
+static void proc_cache_free(struct proc_cache_entry *entry)
+{
+	close_prot_errno_disarm(entry->memfd);
+	free_disarm(entry->cg);
+	free_disarm(entry->buf);
+	free_disarm(entry);
+}
+
+/* Must be called with the head's lock held. */
+static void __proc_cache_put(struct proc_cache_entry *entry)
+{
+	if (--entry->refcount == 0)
+		proc_cache_free(entry);
+}
+
+/*
+ * Return a referenced entry for @type and @cg if it was rendered less than
+ * @ttl milliseconds ago. The caller must release it with proc_cache_put().
+ */
+struct proc_cache_entry *proc_cache_get(int type, const char *cg,
+					unsigned int ttl)
+{
+	struct proc_cache_head *head = proc_cache_head(type, cg);
+	struct proc_cache_entry *entry, *ret = NULL;
+	uint64_t now;
+
+	if (!ttl)
+		return NULL;
+
+	now = proc_cache_now();
+
+	pthread_mutex_lock(&head->lock);
+	for (entry = head->next; entry; entry = entry->next) {
+		if (entry->type != type || strcmp(entry->cg, cg) != 0)
+			continue;
+
+		if (now - entry->stamp < ttl) {
+			entry->refcount++;
+			ret = entry;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&head->lock);
+
+	stats_inc(ret ? STATS_RENDER_CACHE_HIT : STATS_RENDER_CACHE_MISS);
+	return ret;
+}
+
+static struct proc_cache_entry *proc_cache_new(int type, const char *cg,
+					       char *buf, size_t size)
+{
+	__do_free struct proc_cache_entry *new = NULL;
+
+	new = zalloc(sizeof(*new));
+	if (!new)
+		return NULL;
+
+	new->cg = strdup(cg);
+	if (!new->cg)
+		return NULL;
+
+	new->type = type;
+	new->buf = buf;
+	new->size = size;
+	new->stamp = proc_cache_now();
+	new->memfd = -EBADF;
+	new->refcount = 1;
+
+	return move_ptr(new);
+}
+
+/*
+ * Publish a freshly rendered @buf of @size bytes for @type and @cg. On
+ * success ownership of @buf is transferred to the cache and a referenced
+ * entry is returned. On failure NULL is returned and @buf is left untouched.
+ */
+struct proc_cache_entry *proc_cache_publish(int type, const char *cg,
+					    char *buf, size_t size)
+{
+	struct proc_cache_head *head = proc_cache_head(type, cg);
+	struct proc_cache_entry *new, **it;
+
+	new = proc_cache_new(type, cg, buf, size);
+	if (!new)
+		return NULL;
+
+	/* One reference for the cache and one for the caller. */
+	new->refcount++;
+
+	pthread_mutex_lock(&head->lock);
+	it = &head->next;
+	while (*it) {
+		struct proc_cache_entry *cur = *it;
+
+		if ((cur->type == type && strcmp(cur->cg, cg) == 0) ||
+		    new->stamp - cur->stamp > PROC_CACHE_PRUNE_MSECS) {
+			*it = cur->next;
+			__proc_cache_put(cur);
+			continue;
+		}
+
+		it = &cur->next;
+	}
+	new->next = head->next;
+	head->next = new;
+	pthread_mutex_unlock(&head->lock);
+
+	return new;
+}
+
+/*
+ * Wrap @buf of @size bytes in an entry without making it visible to
+ * proc_cache_get(). This is what renders hand to proc_cache_land() when the
+ * render cache is off. Same ownership rules as proc_cache_publish().
+ */
+struct proc_cache_entry *proc_cache_wrap(int type, const char *cg, char *buf,
+					 size_t size)
+{
+	return proc_cache_new(type, cg, buf, size);
+}
+
+/*
+ * If somebody is rendering @type for @cg right now wait for them and return
+ * a referenced entry with their result, or NULL if their render failed.
+ * Otherwise register the caller as the renderer in @flight and return NULL.
+ * The caller must then hand its result to proc_cache_land(). Waiters only
+ * ever get results of renders that started before they asked so the data
+ * is as fresh as if they had rendered it themselves.
+ */
+struct proc_cache_entry *proc_cache_join(int type, const char *cg,
+					 struct proc_cache_flight **flight)
+{
+	struct proc_cache_head *head = proc_cache_head(type, cg);
+	struct proc_cache_entry *entry;
+	struct proc_cache_flight *f;
+
+	*flight = NULL;
+
+	pthread_mutex_lock(&head->lock);
+	for (f = head->flights; f; f = f->next)
+		if (f->type == type && strcmp(f->cg, cg) == 0)
+			break;
+
+	if (!f) {
+		f = zalloc(sizeof(*f));
+		if (f) {
+			f->type = type;
+			f->cg = cg;
+			f->refcount = 1;
+			f->next = head->flights;
+			head->flights = f;
+			*flight = f;
+		}
+		pthread_mutex_unlock(&head->lock);
+		return NULL;
+	}
+
+	f->refcount++;
+	while (!f->done)
+		pthread_cond_wait(&head->landed, &head->lock);
+
+	entry = f->entry;
+	if (entry)
+		entry->refcount++;
+
+	if (--f->refcount == 0) {
+		if (f->entry)
+			__proc_cache_put(f->entry);
+		free(f);
+	}
+	pthread_mutex_unlock(&head->lock);
+
+	return entry;
+}
+
+/* Hand the result of a render registered with proc_cache_join() to waiters. */
+void proc_cache_land(struct proc_cache_flight *flight,
+		     struct proc_cache_entry *entry)
+{
+	struct proc_cache_head *head;
+	struct proc_cache_flight **it;
+
+	if (!flight)
+		return;
+
+	head = proc_cache_head(flight->type, flight->cg);
+	pthread_mutex_lock(&head->lock);
+	for (it = &head->flights; *it; it = &(*it)->next) {
+		if (*it == flight) {
+			*it = flight->next;
+			break;
+		}
+	}
+
+	flight->done = true;
+	flight->entry = entry;
+	/* Waiters hold references, the flight is only needed until they woke. */
+	if (entry)
+		entry->refcount++;
+	if (--flight->refcount == 0) {
+		if (entry)
+			__proc_cache_put(entry);
+		free(flight);
+	} else {
+		pthread_cond_broadcast(&head->landed);
+	}
+	pthread_mutex_unlock(&head->lock);
+}
+
+struct proc_cache_entry *proc_cache_ref(struct proc_cache_entry *entry)
+{
+	struct proc_cache_head *head = proc_cache_head(entry->type, entry->cg);
+
+	pthread_mutex_lock(&head->lock);
+	entry->refcount++;
+	pthread_mutex_unlock(&head->lock);
+
+	return entry;
+}
+
+void proc_cache_put(struct proc_cache_entry *entry)
+{
+	struct proc_cache_head *head;
+
+	if (!entry)
+		return;
+
+	head = proc_cache_head(entry->type, entry->cg);
+	pthread_mutex_lock(&head->lock);
+	__proc_cache_put(entry);
+	pthread_mutex_unlock(&head->lock);
+}
+
+/*
+ * Return a memfd holding the contents of @entry. The descriptor belongs to
+ * the entry and stays valid for as long as the caller holds a reference.
+ */
+int proc_cache_fd(struct proc_cache_entry *entry)
+{
+	struct proc_cache_head *head;
+	__do_close int fd = -EBADF;
+	int cur;
+
+	cur = __atomic_load_n(&entry->memfd, __ATOMIC_ACQUIRE);
+	if (cur >= 0)
+		return cur;
+
+	fd = memfd_create("lxcfs", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (write_nointr(fd, entry->buf, entry->size) != (ssize_t)entry->size)
+		return ret_errno(EIO);
+
+	head = proc_cache_head(entry->type, entry->cg);
+	pthread_mutex_lock(&head->lock);
+	/* Somebody else might have been faster. */
+	if (entry->memfd < 0)
+		__atomic_store_n(&entry->memfd, move_fd(fd), __ATOMIC_RELEASE);
+	cur = entry->memfd;
+	pthread_mutex_unlock(&head->lock);
+
+	return cur;
+}
+
+static void proc_cache_unpin(void *data)
+{
+	proc_cache_put(data);
+}
+
+static void proc_cache_pin_init(void)
+{
+	proc_cache_pin_valid = pthread_key_create(&proc_cache_pin_key,
+						  proc_cache_unpin) == 0;
+}
+
+/*
+ * Keep a reference to @entry on behalf of the calling thread until it pins
+ * another entry or exits. Fuse sends the reply to a read_buf request from
+ * the thread that handled it before that thread picks up the next request,
+ * so the memfd of a pinned entry stays valid until the reply has been
+ * spliced even if the file handle drops its own reference meanwhile.
+ */
+int proc_cache_pin(struct proc_cache_entry *entry)
+{
+	struct proc_cache_entry *prev;
+
+	pthread_once(&proc_cache_pin_once, proc_cache_pin_init);
+	if (!proc_cache_pin_valid)
+		return ret_errno(ENOMEM);
+
+	prev = pthread_getspecific(proc_cache_pin_key);
+	if (prev == entry)
+		return 0;
+
+	if (pthread_setspecific(proc_cache_pin_key, proc_cache_ref(entry))) {
+		proc_cache_put(entry);
+		return log_error(-ENOMEM, "Failed to pin cache entry");
+	}
+
+	proc_cache_put(prev);
+	return 0;
+}
+
+void free_proc_cache(void)
+{
+	/*
+	 * Entries still pinned by other threads are leaked rather than
+	 * released from a destructor that is about to be unloaded.
+	 */
+	if (proc_cache_pin_valid) {
+		proc_cache_put(pthread_getspecific(proc_cache_pin_key));
+		pthread_key_delete(proc_cache_pin_key);
+		proc_cache_pin_valid = false;
+	}
+
+	for (int i = 0; i < PROC_CACHE_HASH_SIZE; i++) {
+		struct proc_cache_head *head = &proc_cache[i];
+		struct proc_cache_entry *entry, *next;
+
+		pthread_mutex_lock(&head->lock);
+		for (entry = head->next; entry; entry = next) {
+			next = entry->next;
+			__proc_cache_put(entry);
+		}
+		head->next = NULL;
+		pthread_mutex_unlock(&head->lock);
+	}
+}
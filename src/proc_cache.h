@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_PROC_CACHE_H
+#define __LXCFS_PROC_CACHE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "macro.h"
+
+/*
+ * A rendered proc file shared between all readers in the same cgroup. Once
+ * published an entry is immutable, readers only need to hold a reference.
+ */
+struct proc_cache_entry {
+	int type;
+	char *cg;
+	char *buf;
+	size_t size;
+	uint64_t stamp; /* CLOCK_MONOTONIC in milliseconds */
+	int refcount;
+	int memfd; /* copy of buf to splice from, created on demand */
+	struct proc_cache_entry *next;
+};
+
+struct proc_cache_flight;
+
+extern struct proc_cache_entry *proc_cache_get(int type, const char *cg,
+					       unsigned int ttl);
+extern struct proc_cache_entry *proc_cache_publish(int type, const char *cg,
+						   char *buf, size_t size);
+extern struct proc_cache_entry *proc_cache_wrap(int type, const char *cg,
+						char *buf, size_t size);
+extern struct proc_cache_entry *proc_cache_join(int type, const char *cg,
+						struct proc_cache_flight **flight);
+extern void proc_cache_land(struct proc_cache_flight *flight,
+			    struct proc_cache_entry *entry);
+extern struct proc_cache_entry *proc_cache_ref(struct proc_cache_entry *entry);
+extern void proc_cache_put(struct proc_cache_entry *entry);
+extern int proc_cache_fd(struct proc_cache_entry *entry);
+extern int proc_cache_pin(struct proc_cache_entry *entry);
+extern uint64_t proc_cache_now(void);
+extern void free_proc_cache(void);
+
+#endif /* __LXCFS_PROC_CACHE_H */
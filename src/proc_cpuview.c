@@ -25,6 +25,7 @@
 #include <fuse.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdarg.h>
@@ -52,80 +53,134 @@
 #include "cpuset_parse.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
+#include "fmt.h"
+#include "hash_table.h"
+#include "kv_parse.h"
+#include "lifecycle.h"
 #include "memory_utils.h"
+#include "proc_cache.h"
 #include "proc_loadavg.h"
+#include "state.h"
+#include "stats.h"
 #include "utils.h"
 
+/* Per-CPU counters of a stat node, one array per counter. */
+struct cpu_times {
+	uint64_t *user;
+	uint64_t *system;
+	uint64_t *idle;
+};
+
 /* Data for CPU view */
 struct cg_proc_stat {
 	char *cg;
-	struct cpuacct_usage *usage; 	/* Real usage as read from the host's /proc/stat. */
-	struct cpuacct_usage *view; 	/* Usage stats reported to the container. */
-	int cpu_count;
+	uint64_t hash;
+	/*
+	 * Only the CPUs the cgroup may run on are tracked. cpus[] holds their
+	 * host CPU numbers in ascending order, entry i of every counter array
+	 * belongs to cpus[i].
+	 */
+	int nr_cpus;
+	int *cpus;
+	struct cpu_times usage; 	/* Real usage as read from the host's /proc/stat. */
+	struct cpu_times view; 		/* Usage stats reported to the container. */
+	uint64_t *times; 		/* Backing store for cpus, usage and view. */
 	pthread_mutex_t lock; 		/* For node manipulation. */
-	struct cg_proc_stat *next;
+	int refcount;			/* One for the table plus one per reader. */
 };
 
-struct cg_proc_stat_head {
-	struct cg_proc_stat *next;
-	time_t lastcheck;
+static bool proc_stat_node_match(const void *item, const void *key)
+{
+	const struct cg_proc_stat *node = item;
 
-	/*
-	 * For access to the list. Reading can be parallel, pruning is exclusive.
-	 */
-	pthread_rwlock_t lock;
-};
+	return strcmp(node->cg, key) == 0;
+}
 
-#define CPUVIEW_HASH_SIZE 100
-static struct cg_proc_stat_head *proc_stat_history[CPUVIEW_HASH_SIZE];
+/*
+ * All stat nodes keyed on their cgroup. For access to the table reading can
+ * be parallel, adding and pruning is exclusive. The table is only allocated
+ * once the first container reads a cpu view.
+ */
+static struct hash_table proc_stat_table = {
+	.match = proc_stat_node_match,
+};
+static pthread_rwlock_t proc_stat_lock = PTHREAD_RWLOCK_INITIALIZER;
+static time_t proc_stat_lastcheck;
+/* Set once a node couldn't be registered with the lifecycle tracker. */
+static bool cpuview_unwatched;
 
-static void reset_proc_stat_node(struct cg_proc_stat *node,
-				 struct cpuacct_usage *usage, int cpu_count)
+/* Allocate zeroed backing store for @nr CPUs. */
+static uint64_t *alloc_cpu_times(int nr)
 {
-	lxcfs_debug("Resetting stat node for %s\n", node->cg);
-	memcpy(node->usage, usage, sizeof(struct cpuacct_usage) * cpu_count);
+	/* Six counters plus the CPU number, never allocate zero bytes. */
+	return zalloc((nr ?: 1) * (6 * sizeof(uint64_t) + sizeof(int)));
+}
 
-	for (int i = 0; i < cpu_count; i++) {
-		node->view[i].user = 0;
-		node->view[i].system = 0;
-		node->view[i].idle = 0;
-	}
+static void layout_cpu_times(struct cg_proc_stat *node, uint64_t *times, int nr)
+{
+	node->times		= times;
+	node->nr_cpus		= nr;
+	node->usage.user	= times;
+	node->usage.system	= times + nr;
+	node->usage.idle	= times + 2 * nr;
+	node->view.user		= times + 3 * nr;
+	node->view.system	= times + 4 * nr;
+	node->view.idle		= times + 5 * nr;
+	node->cpus		= (int *)(times + 6 * nr);
+}
 
-	node->cpu_count = cpu_count;
+static void copy_cpu_times(struct cpu_times *to, const struct cpu_times *from,
+			   int nr)
+{
+	memcpy(to->user, from->user, nr * sizeof(uint64_t));
+	memcpy(to->system, from->system, nr * sizeof(uint64_t));
+	memcpy(to->idle, from->idle, nr * sizeof(uint64_t));
 }
 
-static bool expand_proc_stat_node(struct cg_proc_stat *node, int cpu_count)
+static void reset_proc_stat_node(struct cg_proc_stat *node,
+				 const struct cpu_times *cur)
 {
-	__do_free struct cpuacct_usage *new_usage = NULL, *new_view = NULL;
+	lxcfs_debug("Resetting stat node for %s\n", node->cg);
+	copy_cpu_times(&node->usage, cur, node->nr_cpus);
+	memset(node->view.user, 0, 3 * node->nr_cpus * sizeof(uint64_t));
+}
 
-	/* Allocate new memory */
-	new_usage = zalloc(sizeof(struct cpuacct_usage) * cpu_count);
-	if (!new_usage)
-		return false;
+/*
+ * Switch @node over to tracking @nr @cpus, e.g. after the cpuset changed.
+ * CPUs tracked before keep their history, new ones start out at @cur.
+ */
+static bool remap_proc_stat_node(struct cg_proc_stat *node, const int *cpus,
+				 int nr, const struct cpu_times *cur)
+{
+	__do_free uint64_t *times = NULL;
+	struct cg_proc_stat new;
 
-	new_view = zalloc(sizeof(struct cpuacct_usage) * cpu_count);
-	if (!new_view)
+	times = alloc_cpu_times(nr);
+	if (!times)
 		return false;
+	layout_cpu_times(&new, times, nr);
 
-	/* Copy existing data & initialize new elements */
-	for (int i = 0; i < cpu_count; i++) {
-		if (i < node->cpu_count) {
-			new_usage[i].user 	= node->usage[i].user;
-			new_usage[i].system 	= node->usage[i].system;
-			new_usage[i].idle 	= node->usage[i].idle;
+	for (int i = 0, j = 0; i < nr; i++) {
+		while (j < node->nr_cpus && node->cpus[j] < cpus[i])
+			j++;
 
-			new_view[i].user 	= node->view[i].user;
-			new_view[i].system 	= node->view[i].system;
-			new_view[i].idle 	= node->view[i].idle;
+		new.cpus[i] = cpus[i];
+		if (j < node->nr_cpus && node->cpus[j] == cpus[i]) {
+			new.usage.user[i]	= node->usage.user[j];
+			new.usage.system[i]	= node->usage.system[j];
+			new.usage.idle[i]	= node->usage.idle[j];
+			new.view.user[i]	= node->view.user[j];
+			new.view.system[i]	= node->view.system[j];
+			new.view.idle[i]	= node->view.idle[j];
+		} else {
+			new.usage.user[i]	= cur->user[i];
+			new.usage.system[i]	= cur->system[i];
+			new.usage.idle[i]	= cur->idle[i];
 		}
 	}
 
-	free(node->usage);
-	node->usage = move_ptr(new_usage);
-
-	free(node->view);
-	node->view = move_ptr(new_view);
-	node->cpu_count = cpu_count;
+	free(node->times);
+	layout_cpu_times(node, move_ptr(times), nr);
 
 	return true;
 }
@@ -134,68 +189,68 @@ static void free_proc_stat_node(struct cg_proc_stat *node)
 {
 	if (node) {
 		/*
-		 * We're abusing the usage pointer to indicate that
+		 * We're abusing the times pointer to indicate that
 		 * pthread_mutex_init() was successful. Don't judge me.
 		 */
-		if (node->usage)
+		if (node->times)
 			pthread_mutex_destroy(&node->lock);
 		free_disarm(node->cg);
-		free_disarm(node->usage);
-		free_disarm(node->view);
+		free_disarm(node->times);
 		free_disarm(node);
 	}
 }
 
 define_cleanup_function(struct cg_proc_stat *, free_proc_stat_node);
 
-static struct cg_proc_stat *add_proc_stat_node(struct cg_proc_stat *new_node)
+/*
+ * Drop a reference to @node. Nodes removed from the table may still be in
+ * use by readers that found them before, the last one frees it.
+ */
+static void put_proc_stat_node(struct cg_proc_stat *node)
 {
-	call_cleaner(free_proc_stat_node) struct cg_proc_stat *new = new_node;
-	struct cg_proc_stat *rv = new_node;
-	int hash = calc_hash(new->cg) % CPUVIEW_HASH_SIZE;
-	struct cg_proc_stat_head *head = proc_stat_history[hash];
-	struct cg_proc_stat *cur;
-
-	pthread_rwlock_wrlock(&head->lock);
-
-	if (!head->next) {
-		head->next = move_ptr(new);
-		goto out_rwlock_unlock;
-	}
+	if (__atomic_sub_fetch(&node->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free_proc_stat_node(node);
+}
 
-	cur = head->next;
+/* Must be called with proc_stat_lock held. */
+static struct cg_proc_stat *get_proc_stat_node(struct cg_proc_stat *node)
+{
+	if (node)
+		__atomic_add_fetch(&node->refcount, 1, __ATOMIC_RELAXED);
+	return node;
+}
 
-	for (;;) {
-		/*
-		 * The node to be added is already present in the list, so
-		 * free the newly allocated one and return the one we found.
-		 */
-		if (strcmp(cur->cg, new->cg) == 0) {
-			rv = cur;
-			goto out_rwlock_unlock;
-		}
+static struct cg_proc_stat *add_proc_stat_node(struct cg_proc_stat *new_node)
+{
+	call_cleaner(free_proc_stat_node) struct cg_proc_stat *new = new_node;
+	struct cg_proc_stat *rv;
 
-		/* Keep walking. */
-		if (cur->next) {
-			cur = cur->next;
-			continue;
-		}
+	pthread_rwlock_wrlock(&proc_stat_lock);
 
-		/* Add new node to end of list. */
-		cur->next = move_ptr(new);
-		goto out_rwlock_unlock;
-	}
+	/*
+	 * The node to be added is already present in the table, so free the
+	 * newly allocated one and return the one we found. Either way the
+	 * caller gets a reference of its own.
+	 */
+	rv = hash_table_find(&proc_stat_table, new->hash, new->cg);
+	if (!rv && hash_table_insert(&proc_stat_table, new->hash, new) == 0)
+		rv = move_ptr(new);
+	get_proc_stat_node(rv);
 
-out_rwlock_unlock:
-	pthread_rwlock_unlock(&head->lock);
-	return move_ptr(rv);
+	pthread_rwlock_unlock(&proc_stat_lock);
+	return rv;
 }
 
-static struct cg_proc_stat *new_proc_stat_node(struct cpuacct_usage *usage,
-					       int cpu_count, const char *cg)
+/*
+ * Allocate a node tracking @nr @cpus of @cg. Usage starts out at @cur if
+ * given and at zero otherwise.
+ */
+static struct cg_proc_stat *new_proc_stat_node(const int *cpus, int nr,
+					       const struct cpu_times *cur,
+					       const char *cg)
 {
 	call_cleaner(free_proc_stat_node) struct cg_proc_stat *node = NULL;
-	__do_free struct cpuacct_usage *new_usage = NULL;
+	__do_free uint64_t *times = NULL;
 
 	node = zalloc(sizeof(struct cg_proc_stat));
 	if (!node)
@@ -204,24 +259,24 @@ static struct cg_proc_stat *new_proc_stat_node(struct cpuacct_usage *usage,
 	node->cg = strdup(cg);
 	if (!node->cg)
 		return NULL;
+	node->hash = hash_string(cg);
 
-	new_usage = memdup(usage, sizeof(struct cpuacct_usage) * cpu_count);
-	if (!new_usage)
+	times = alloc_cpu_times(nr);
+	if (!times)
 		return NULL;
 
-	node->view = zalloc(sizeof(struct cpuacct_usage) * cpu_count);
-	if (!node->view)
-		return NULL;
-
-	node->cpu_count = cpu_count;
-
 	if (pthread_mutex_init(&node->lock, NULL))
 		return NULL;
 	/*
-	 * We're abusing the usage pointer to indicate that
+	 * We're abusing the times pointer to indicate that
 	 * pthread_mutex_init() was successful. Don't judge me.
 	 */
-	node->usage = move_ptr(new_usage);
+	layout_cpu_times(node, move_ptr(times), nr);
+	memcpy(node->cpus, cpus, nr * sizeof(int));
+	if (cur)
+		copy_cpu_times(&node->usage, cur, nr);
+	/* The table's reference once added. */
+	node->refcount = 1;
 
 	return move_ptr(node);
 }
@@ -240,125 +295,260 @@ static bool cgroup_supports(const char *controller, const char *cgroup,
 	return faccessat(cfd, path, F_OK, 0) == 0;
 }
 
-static struct cg_proc_stat *prune_proc_stat_list(struct cg_proc_stat *node)
+#define PROC_STAT_PRUNE_INTERVAL 10
+/*
+ * Drop the nodes of cgroups that are gone. Checking a cgroup means a trip to
+ * the filesystem so that happens without holding the table lock, candidates
+ * are collected under the read lock and only unlinked under the write lock.
+ */
+static void prune_proc_stat_history(void)
 {
-	struct cg_proc_stat *first = NULL;
+	__do_free struct cg_proc_stat **nodes = NULL;
+	time_t now = time(NULL);
+	time_t last = __atomic_load_n(&proc_stat_lastcheck, __ATOMIC_RELAXED);
+	struct cg_proc_stat *node;
+	size_t nr = 0, pos;
 
-	for (struct cg_proc_stat *prev = NULL; node; ) {
-		if (!cgroup_supports("cpu", node->cg, "cpu.shares")) {
-			call_cleaner(free_proc_stat_node) struct cg_proc_stat *cur = node;
+	if ((last + PROC_STAT_PRUNE_INTERVAL) > now)
+		return;
 
-			if (prev)
-				prev->next = node->next;
-			else
-				first = node->next;
+	/* Somebody else is already pruning. */
+	if (!__atomic_compare_exchange_n(&proc_stat_lastcheck, &last, now, false,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
 
-			node = node->next;
-			lxcfs_debug("Removing stat node for %s\n", cur->cg);
-		} else {
-			if (!first)
-				first = node;
-			prev = node;
-			node = node->next;
+	pthread_rwlock_rdlock(&proc_stat_lock);
+	nodes = malloc((proc_stat_table.used ?: 1) * sizeof(*nodes));
+	if (nodes) {
+		hash_table_for_each(&proc_stat_table, pos, node)
+			nodes[nr++] = get_proc_stat_node(node);
+	}
+	pthread_rwlock_unlock(&proc_stat_lock);
+
+	for (size_t i = 0; i < nr; i++) {
+		if (cgroup_supports("cpu", nodes[i]->cg, "cpu.shares")) {
+			put_proc_stat_node(nodes[i]);
+			nodes[i] = NULL;
+		}
+	}
+
+	pthread_rwlock_wrlock(&proc_stat_lock);
+	for (size_t i = 0; i < nr; i++) {
+		node = nodes[i];
+		if (!node)
+			continue;
+
+		/* Might have been evicted meanwhile. */
+		if (hash_table_find(&proc_stat_table, node->hash, node->cg) == node) {
+			lxcfs_debug("Removing stat node for %s\n", node->cg);
+			hash_table_remove(&proc_stat_table, node->hash, node->cg);
+			put_proc_stat_node(node);
 		}
 	}
+	pthread_rwlock_unlock(&proc_stat_lock);
 
-	return first;
+	for (size_t i = 0; i < nr; i++)
+		if (nodes[i])
+			put_proc_stat_node(nodes[i]);
 }
 
-#define PROC_STAT_PRUNE_INTERVAL 10
-static void prune_proc_stat_history(void)
+static struct cg_proc_stat *find_proc_stat_node(const char *cg, uint64_t hash)
 {
-	time_t now = time(NULL);
+	struct cg_proc_stat *node;
 
-	for (int i = 0; i < CPUVIEW_HASH_SIZE; i++) {
-		pthread_rwlock_wrlock(&proc_stat_history[i]->lock);
+	pthread_rwlock_rdlock(&proc_stat_lock);
+	node = get_proc_stat_node(hash_table_find(&proc_stat_table, hash, cg));
+	pthread_rwlock_unlock(&proc_stat_lock);
 
-		if ((proc_stat_history[i]->lastcheck + PROC_STAT_PRUNE_INTERVAL) > now) {
-			pthread_rwlock_unlock(&proc_stat_history[i]->lock);
-			return;
-		}
+	if (!lifecycle_active() || cpuview_unwatched)
+		prune_proc_stat_history();
+	return node;
+}
 
-		if (proc_stat_history[i]->next) {
-			proc_stat_history[i]->next = prune_proc_stat_list(proc_stat_history[i]->next);
-			proc_stat_history[i]->lastcheck = now;
-		}
+/* Called by the lifecycle tracker when @cg has been removed. */
+void cpuview_evict(const char *cg)
+{
+	struct cg_proc_stat *node;
+
+	pthread_rwlock_wrlock(&proc_stat_lock);
+	node = hash_table_remove(&proc_stat_table, hash_string(cg), cg);
+	pthread_rwlock_unlock(&proc_stat_lock);
 
-		pthread_rwlock_unlock(&proc_stat_history[i]->lock);
+	if (node) {
+		lxcfs_debug("Removing stat node for %s\n", node->cg);
+		/* Readers that found it before still hold references. */
+		put_proc_stat_node(node);
 	}
 }
 
-static struct cg_proc_stat *find_proc_stat_node(struct cg_proc_stat_head *head,
-						const char *cg)
+size_t cpuview_nr_nodes(void)
 {
-	struct cg_proc_stat *node;
+	size_t nr;
 
-	pthread_rwlock_rdlock(&head->lock);
+	pthread_rwlock_rdlock(&proc_stat_lock);
+	nr = proc_stat_table.used;
+	pthread_rwlock_unlock(&proc_stat_lock);
 
-	if (!head->next) {
-		pthread_rwlock_unlock(&head->lock);
-		return NULL;
+	return nr;
+}
+
+void cpuview_state_save(struct lxcfs_state *s)
+{
+	__do_free struct lxcfs_state_cpuview *rec = NULL;
+	size_t rec_size = 0;
+	struct cg_proc_stat *node;
+	size_t pos;
+
+	pthread_rwlock_rdlock(&proc_stat_lock);
+	hash_table_for_each(&proc_stat_table, pos, node) {
+		struct lxcfs_state_cpu *cpus;
+		size_t len;
+
+		pthread_mutex_lock(&node->lock);
+		len = sizeof(*rec) + node->nr_cpus * sizeof(*cpus);
+		if (len > rec_size) {
+			rec = must_realloc(rec, len);
+			rec_size = len;
+		}
+
+		*rec = (struct lxcfs_state_cpuview){
+			.nr_cpus = node->nr_cpus,
+		};
+		cpus = (struct lxcfs_state_cpu *)(rec + 1);
+		for (int i = 0; i < node->nr_cpus; i++)
+			cpus[i] = (struct lxcfs_state_cpu){
+				.cpu	= node->cpus[i],
+				.usage	= {
+					node->usage.user[i],
+					node->usage.system[i],
+					node->usage.idle[i],
+				},
+				.view	= {
+					node->view.user[i],
+					node->view.system[i],
+					node->view.idle[i],
+				},
+			};
+		pthread_mutex_unlock(&node->lock);
+
+		state_append(s, LXCFS_STATE_CPUVIEW, rec, len, node->cg);
 	}
+	pthread_rwlock_unlock(&proc_stat_lock);
+}
 
-	node = head->next;
+/* Keep reporting usage deltas relative to what the old library saw. */
+bool cpuview_state_restore(const void *payload, size_t len)
+{
+	__do_free int *ids = NULL;
+	const struct lxcfs_state_cpuview *rec = payload;
+	const struct lxcfs_state_cpu *cpus;
+	struct cg_proc_stat *node, *added;
+	const char *cg;
+
+	if (len < sizeof(*rec) ||
+	    rec->nr_cpus > (len - sizeof(*rec)) / sizeof(*cpus))
+		return false;
 
-	do {
-		if (strcmp(cg, node->cg) == 0)
-			goto out;
-	} while ((node = node->next));
+	cg = state_string(payload, len, sizeof(*rec) + rec->nr_cpus * sizeof(*cpus));
+	if (!cg)
+		return false;
+	cpus = (const struct lxcfs_state_cpu *)(rec + 1);
 
-	node = NULL;
+	for (uint32_t i = 0; i < rec->nr_cpus; i++)
+		if (cpus[i].cpu > INT_MAX || (i > 0 && cpus[i].cpu <= cpus[i - 1].cpu))
+			return false;
 
-out:
-	pthread_rwlock_unlock(&head->lock);
-	prune_proc_stat_history();
-	return node;
+	ids = must_realloc(NULL, (rec->nr_cpus ?: 1) * sizeof(int));
+	for (uint32_t i = 0; i < rec->nr_cpus; i++)
+		ids[i] = cpus[i].cpu;
+
+	node = new_proc_stat_node(ids, rec->nr_cpus, NULL, cg);
+	if (!node)
+		return false;
+
+	for (uint32_t i = 0; i < rec->nr_cpus; i++) {
+		node->usage.user[i]	= cpus[i].usage[0];
+		node->usage.system[i]	= cpus[i].usage[1];
+		node->usage.idle[i]	= cpus[i].usage[2];
+		node->view.user[i]	= cpus[i].view[0];
+		node->view.system[i]	= cpus[i].view[1];
+		node->view.idle[i]	= cpus[i].view[2];
+	}
+
+	added = add_proc_stat_node(node);
+	if (!added)
+		return false;
+
+	/* If a reader beat us to it their node is already being watched. */
+	if (added == node &&
+	    lifecycle_watch_cgroup("cpuset", cg, LIFECYCLE_CPUVIEW) < 0)
+		cpuview_unwatched = true;
+	put_proc_stat_node(added);
+
+	return true;
 }
 
-static struct cg_proc_stat *find_or_create_proc_stat_node(struct cpuacct_usage *usage, int cpu_count, const char *cg)
+/*
+ * Return the node of @cg tracking @cpus locked and referenced. The caller has
+ * to unlock it and drop the reference with put_proc_stat_node().
+ */
+static struct cg_proc_stat *find_or_create_proc_stat_node(const int *cpus, int nr,
+							 const struct cpu_times *cur,
+							 const char *cg)
 {
-	int hash = calc_hash(cg) % CPUVIEW_HASH_SIZE;
-	struct cg_proc_stat_head *head = proc_stat_history[hash];
 	struct cg_proc_stat *node;
 
-	node = find_proc_stat_node(head, cg);
+	node = find_proc_stat_node(cg, hash_string(cg));
 	if (!node) {
-		node = new_proc_stat_node(usage, cpu_count, cg);
+		node = new_proc_stat_node(cpus, nr, cur, cg);
 		if (!node)
 			return NULL;
 
 		node = add_proc_stat_node(node);
-		lxcfs_debug("New stat node (%d) for %s\n", cpu_count, cg);
+		if (!node)
+			return NULL;
+		lxcfs_debug("New stat node (%d) for %s\n", nr, cg);
+
+		/* Nodes are keyed on the cpuset cgroup, watch that one. */
+		if (lifecycle_watch_cgroup("cpuset", cg, LIFECYCLE_CPUVIEW) < 0)
+			cpuview_unwatched = true;
 	}
 
 	pthread_mutex_lock(&node->lock);
 
 	/*
-	 * If additional CPUs on the host have been enabled, CPU usage counter
-	 * arrays have to be expanded.
+	 * If the cpuset changed or CPUs have been onlined or offlined the
+	 * tracked CPUs have to follow.
 	 */
-	if (node->cpu_count < cpu_count) {
-		lxcfs_debug("Expanding stat node %d->%d for %s\n",
-			    node->cpu_count, cpu_count, cg);
+	if (node->nr_cpus != nr || memcmp(node->cpus, cpus, nr * sizeof(int))) {
+		lxcfs_debug("Remapping stat node %d->%d for %s\n",
+			    node->nr_cpus, nr, cg);
 
-		if (!expand_proc_stat_node(node, cpu_count)) {
+		if (!remap_proc_stat_node(node, cpus, nr, cur)) {
+			lxcfs_debug("Unable to remap stat node %d->%d for %s",
+				    node->nr_cpus, nr, cg);
 			pthread_mutex_unlock(&node->lock);
-			return log_debug(NULL, "Unable to expand stat node %d->%d for %s", node->cpu_count, cpu_count, cg);
+			put_proc_stat_node(node);
+			return NULL;
 		}
 	}
 
 	return node;
 }
 
-static void add_cpu_usage(uint64_t *surplus, struct cpuacct_usage *usage,
-			  uint64_t *counter, uint64_t threshold)
+/*
+ * Move as much of @surplus into @counter as fits below @threshold together
+ * with @other, taking it from @idle.
+ */
+static void add_cpu_usage(uint64_t *surplus, uint64_t *counter, uint64_t other,
+			  uint64_t *idle, uint64_t threshold)
 {
 	uint64_t free_space, to_add;
 
-	free_space = threshold - usage->user - usage->system;
+	free_space = threshold - *counter - other;
 
-	if (free_space > usage->idle)
-		free_space = usage->idle;
+	if (free_space > *idle)
+		free_space = *idle;
 
 	if (free_space > *surplus)
 		to_add = *surplus;
@@ -366,48 +556,53 @@ static void add_cpu_usage(uint64_t *surplus, struct cpuacct_usage *usage,
 		to_add = free_space;
 
 	*counter += to_add;
-	usage->idle -= to_add;
+	*idle -= to_add;
 	*surplus -= to_add;
 }
 
-static uint64_t diff_cpu_usage(struct cpuacct_usage *older,
-			       struct cpuacct_usage *newer,
-			       struct cpuacct_usage *diff, int cpu_count)
+/*
+ * When cpuset is changed on the fly, the CPUs might get reordered. We could
+ * either reset all counters, or check that the substractions below will
+ * return expected results. The loops are kept branch-free so they vectorize.
+ */
+static uint64_t diff_counters(const uint64_t *older, const uint64_t *newer,
+			      uint64_t *diff, int nr)
 {
 	uint64_t sum = 0;
 
-	for (int i = 0; i < cpu_count; i++) {
-		if (!newer[i].online)
-			continue;
-
-		/*
-		 * When cpuset is changed on the fly, the CPUs might get
-		 * reordered. We could either reset all counters, or check
-		 * that the substractions below will return expected results.
-		 */
-		if (newer[i].user > older[i].user)
-			diff[i].user = newer[i].user - older[i].user;
-		else
-			diff[i].user = 0;
-
-		if (newer[i].system > older[i].system)
-			diff[i].system = newer[i].system - older[i].system;
-		else
-			diff[i].system = 0;
-
-		if (newer[i].idle > older[i].idle)
-			diff[i].idle = newer[i].idle - older[i].idle;
-		else
-			diff[i].idle = 0;
-
-		sum += diff[i].user;
-		sum += diff[i].system;
-		sum += diff[i].idle;
+	for (int i = 0; i < nr; i++) {
+		diff[i] = newer[i] > older[i] ? newer[i] - older[i] : 0;
+		sum += diff[i];
 	}
 
 	return sum;
 }
 
+static uint64_t diff_cpu_usage(const struct cpu_times *older,
+			       const struct cpu_times *newer,
+			       struct cpu_times *diff, int nr)
+{
+	return diff_counters(older->user, newer->user, diff->user, nr) +
+	       diff_counters(older->system, newer->system, diff->system, nr) +
+	       diff_counters(older->idle, newer->idle, diff->idle, nr);
+}
+
+static void add_counters(uint64_t *to, const uint64_t *from, int nr)
+{
+	for (int i = 0; i < nr; i++)
+		to[i] += from[i];
+}
+
+static uint64_t sum_counters(const uint64_t *counters, int nr)
+{
+	uint64_t sum = 0;
+
+	for (int i = 0; i < nr; i++)
+		sum += counters[i];
+
+	return sum;
+}
+
 /*
  * Read cgroup CPU quota parameters from `cpu.cfs_quota_us` or
  * `cpu.cfs_period_us`, depending on `param`. Parameter value is returned
@@ -471,6 +666,7 @@ static double exact_cpu_count(const char *cg)
 int max_cpu_count(const char *cg)
 {
 	__do_free char *cpuset = NULL;
+	__do_free struct cpuset_bitmap *cpus = NULL;
 	int rv, nprocs;
 	int64_t cfs_quota, cfs_period;
 	int nr_cpus_in_cpuset = 0;
@@ -483,7 +679,9 @@ int max_cpu_count(const char *cg)
 
 	cpuset = get_cpuset(cg);
 	if (cpuset)
-		nr_cpus_in_cpuset = cpu_number_in_cpuset(cpuset);
+		cpus = cpuset_bitmap_parse(cpuset);
+	if (cpus)
+		nr_cpus_in_cpuset = cpus->weight;
 
 	if (cfs_quota <= 0 || cfs_period <= 0) {
 		if (nr_cpus_in_cpuset > 0)
@@ -512,52 +710,119 @@ int max_cpu_count(const char *cg)
 	return rv;
 }
 
+/*
+ * Parse a "cpuN ..." line of /proc/stat into @cpu and @counters. Returns the
+ * number of counters found or -1 if @line isn't a per-cpu line.
+ */
+int proc_stat_parse_cpu(const char *line, int *cpu,
+			uint64_t counters[PROC_STAT_COUNTERS])
+{
+	const char *p = line;
+	uint64_t nr;
+	size_t len;
+	int i;
+
+	if (strncmp(p, "cpu", STRLITERALLEN("cpu")) != 0)
+		return -1;
+	p += STRLITERALLEN("cpu");
+
+	len = kv_parse_u64(p, SIZE_MAX, &nr);
+	if (!len || nr > INT_MAX)
+		return -1;
+	*cpu = nr;
+
+	/* Skip the rest of the first field. */
+	for (p += len; *p && *p != ' ' && *p != '\t' && *p != '\n'; p++)
+		;
+
+	for (i = 0; i < PROC_STAT_COUNTERS; i++) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		len = kv_parse_u64(p, SIZE_MAX, &counters[i]);
+		if (!len)
+			break;
+		p += len;
+	}
+
+	return i;
+}
+
+/*
+ * Render the /proc/stat line of @cpu into @buf which must hold at least
+ * PROC_STAT_LINE_MAX bytes, a negative @cpu renders the summary line.
+ * Returns the length of the line without the terminating NUL.
+ */
+size_t proc_stat_fmt_cpu(char *buf, int cpu,
+			 const uint64_t counters[PROC_STAT_COUNTERS])
+{
+	char *p = fmt_str(buf, "cpu");
+
+	if (cpu >= 0)
+		p = fmt_u64(p, cpu);
+	else
+		*p++ = ' ';
+
+	for (int i = 0; i < PROC_STAT_COUNTERS; i++) {
+		*p++ = ' ';
+		p = fmt_u64(p, counters[i]);
+	}
+	*p++ = '\n';
+	*p = '\0';
+
+	return p - buf;
+}
+
 int cpuview_proc_stat(const char *cg, const char *cpuset,
 		      struct cpuacct_usage *cg_cpu_usage, int cg_cpu_usage_size,
 		      FILE *f, char *buf, size_t buf_size)
 {
 	__do_free char *line = NULL;
-	__do_free struct cpuacct_usage *diff = NULL;
+	__do_free uint64_t *scratch = NULL;
+	__do_free int *online = NULL;
+	__do_free struct cpuset_bitmap *cpus = NULL;
 	size_t linelen = 0, total_len = 0;
 	int curcpu = -1; /* cpu numbering starts at 0 */
 	int physcpu, i;
 	int cpu_cnt = 0;
-	uint64_t user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0,
-		 softirq = 0, steal = 0, guest = 0, guest_nice = 0;
+	uint64_t counters[PROC_STAT_COUNTERS];
 	uint64_t user_sum = 0, system_sum = 0, idle_sum = 0;
 	uint64_t user_surplus = 0, system_surplus = 0;
-	int nprocs, max_cpus;
-	ssize_t l;
+	int nprocs, max_cpus, nr_online = 0, visible;
+	ssize_t l, linelen_read;
 	uint64_t total_sum, threshold;
+	struct cpu_times cur, diff;
 	struct cg_proc_stat *stat_node;
+	char lbuf[PROC_STAT_LINE_MAX];
 
 	nprocs = get_nprocs_conf();
 	if (cg_cpu_usage_size < nprocs)
 		nprocs = cg_cpu_usage_size;
 
+	cpus = cpuset_bitmap_parse(cpuset);
+	if (!cpus)
+		return 0;
+
 	/* Read all CPU stats and stop when we've encountered other lines */
 	while (getline(&line, &linelen, f) != -1) {
 		int ret;
-		char cpu_char[10]; /* That's a lot of cores */
 		uint64_t all_used, cg_used;
 
 		if (strlen(line) == 0)
 			continue;
 
 		/* not a ^cpuN line containing a number N */
-		if (sscanf(line, "cpu%9[^ ]", cpu_char) != 1)
+		ret = proc_stat_parse_cpu(line, &physcpu, counters);
+		if (ret < 0)
 			break;
 
-		if (sscanf(cpu_char, "%d", &physcpu) != 1)
-			continue;
-
 		if (physcpu >= cg_cpu_usage_size)
 			continue;
 
 		curcpu++;
 		cpu_cnt++;
 
-		if (!cpu_in_cpuset(physcpu, cpuset)) {
+		if (!cpuset_bitmap_test(cpus, physcpu)) {
 			for (i = curcpu; i <= physcpu; i++)
 				cg_cpu_usage[i].online = false;
 			continue;
@@ -573,30 +838,19 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 
 		cg_cpu_usage[curcpu].online = true;
 
-		ret = sscanf(line, "%*s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "lu",
-			   &user,
-			   &nice,
-			   &system,
-			   &idle,
-			   &iowait,
-			   &irq,
-			   &softirq,
-			   &steal,
-			   &guest,
-			   &guest_nice);
-		if (ret != 10)
+		if (ret != PROC_STAT_COUNTERS)
 			continue;
 
-		all_used = user + nice + system + iowait + irq + softirq + steal + guest + guest_nice;
+		all_used = proc_stat_busy(counters);
 		cg_used = cg_cpu_usage[curcpu].user + cg_cpu_usage[curcpu].system;
 
 		if (all_used >= cg_used) {
-			cg_cpu_usage[curcpu].idle = idle + (all_used - cg_used);
+			cg_cpu_usage[curcpu].idle = counters[PROC_STAT_IDLE] + (all_used - cg_used);
 
 		} else {
 			lxcfs_error("cpu%d from %s has unexpected cpu time: %" PRIu64 " in /proc/stat, %" PRIu64 " in cpuacct.usage_all; unable to determine idle time",
 				    curcpu, cg, all_used, cg_used);
-			cg_cpu_usage[curcpu].idle = idle;
+			cg_cpu_usage[curcpu].idle = counters[PROC_STAT_IDLE];
 		}
 	}
 
@@ -605,47 +859,56 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 	if (max_cpus > cpu_cnt || !max_cpus)
 		max_cpus = cpu_cnt;
 
-	stat_node = find_or_create_proc_stat_node(cg_cpu_usage, nprocs, cg);
-	if (!stat_node)
-		return log_error(0, "Failed to find/create stat node for %s", cg);
-
-	diff = zalloc(sizeof(struct cpuacct_usage) * nprocs);
-	if (!diff)
+	/* Gather the counters of the CPUs the cgroup may run on. */
+	online = malloc((nprocs ?: 1) * sizeof(int));
+	scratch = malloc((nprocs ?: 1) * 6 * sizeof(uint64_t));
+	if (!online || !scratch)
 		return 0;
 
-	/*
-	 * If the new values are LOWER than values stored in memory, it means
-	 * the cgroup has been reset/recreated and we should reset too.
-	 */
+	cur = (struct cpu_times){
+		.user	= scratch,
+		.system	= scratch + nprocs,
+		.idle	= scratch + 2 * nprocs,
+	};
+	diff = (struct cpu_times){
+		.user	= scratch + 3 * nprocs,
+		.system	= scratch + 4 * nprocs,
+		.idle	= scratch + 5 * nprocs,
+	};
 	for (curcpu = 0; curcpu < nprocs; curcpu++) {
 		if (!cg_cpu_usage[curcpu].online)
 			continue;
 
-		if (cg_cpu_usage[curcpu].user < stat_node->usage[curcpu].user)
-			reset_proc_stat_node(stat_node, cg_cpu_usage, nprocs);
-
-		break;
+		online[nr_online]	= curcpu;
+		cur.user[nr_online]	= cg_cpu_usage[curcpu].user;
+		cur.system[nr_online]	= cg_cpu_usage[curcpu].system;
+		cur.idle[nr_online]	= cg_cpu_usage[curcpu].idle;
+		nr_online++;
 	}
 
-	total_sum = diff_cpu_usage(stat_node->usage, cg_cpu_usage, diff, nprocs);
-
-	for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
-		stat_node->usage[curcpu].online = cg_cpu_usage[curcpu].online;
+	stat_node = find_or_create_proc_stat_node(online, nr_online, &cur, cg);
+	if (!stat_node)
+		return log_error(0, "Failed to find/create stat node for %s", cg);
 
-		if (!stat_node->usage[curcpu].online)
-			continue;
+	/*
+	 * If the new values are LOWER than values stored in memory, it means
+	 * the cgroup has been reset/recreated and we should reset too.
+	 */
+	if (nr_online && cur.user[0] < stat_node->usage.user[0])
+		reset_proc_stat_node(stat_node, &cur);
 
-		i++;
+	total_sum = diff_cpu_usage(&stat_node->usage, &cur, &diff, nr_online);
+	add_counters(stat_node->usage.user, diff.user, nr_online);
+	add_counters(stat_node->usage.system, diff.system, nr_online);
+	add_counters(stat_node->usage.idle, diff.idle, nr_online);
 
-		stat_node->usage[curcpu].user 	+= diff[curcpu].user;
-		stat_node->usage[curcpu].system += diff[curcpu].system;
-		stat_node->usage[curcpu].idle 	+= diff[curcpu].idle;
+	visible = nr_online;
+	if (max_cpus > 0 && max_cpus < nr_online)
+		visible = max_cpus;
 
-		if (max_cpus > 0 && i >= max_cpus) {
-			user_surplus 	+= diff[curcpu].user;
-			system_surplus 	+= diff[curcpu].system;
-		}
-	}
+	/* Usage of the CPUs the container doesn't see is spread over the others. */
+	user_surplus = sum_counters(diff.user + visible, nr_online - visible);
+	system_surplus = sum_counters(diff.system + visible, nr_online - visible);
 
 	/* Calculate usage counters of visible CPUs */
 	if (max_cpus > 0) {
@@ -653,34 +916,26 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 		uint64_t diff_system = 0;
 		uint64_t diff_idle = 0;
 		uint64_t max_diff_idle = 0;
-		uint64_t max_diff_idle_index = 0;
+		int max_diff_idle_index = 0;
 		double exact_cpus;
 
 		/* threshold = maximum usage per cpu, including idle */
 		threshold = total_sum / cpu_cnt * max_cpus;
 
-		for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
-			if (!stat_node->usage[curcpu].online)
-				continue;
-
-			i++;
-
-			if (i == max_cpus)
-				break;
-
-			if (diff[curcpu].user + diff[curcpu].system >= threshold)
+		for (i = 0; i < visible; i++) {
+			if (diff.user[i] + diff.system[i] >= threshold)
 				continue;
 
 			/* Add user */
-			add_cpu_usage(&user_surplus, &diff[curcpu],
-				      &diff[curcpu].user, threshold);
+			add_cpu_usage(&user_surplus, &diff.user[i], diff.system[i],
+				      &diff.idle[i], threshold);
 
-			if (diff[curcpu].user + diff[curcpu].system >= threshold)
+			if (diff.user[i] + diff.system[i] >= threshold)
 				continue;
 
 			/* If there is still room, add system */
-			add_cpu_usage(&system_surplus, &diff[curcpu],
-				      &diff[curcpu].system, threshold);
+			add_cpu_usage(&system_surplus, &diff.system[i], diff.user[i],
+				      &diff.idle[i], threshold);
 		}
 
 		if (user_surplus > 0)
@@ -688,38 +943,31 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 		if (system_surplus > 0)
 			lxcfs_debug("leftover system: %lu for %s\n", system_surplus, cg);
 
-		for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
-			if (!stat_node->usage[curcpu].online)
-				continue;
-
-			i++;
-
-			if (i == max_cpus)
-				break;
+		add_counters(stat_node->view.user, diff.user, visible);
+		add_counters(stat_node->view.system, diff.system, visible);
+		add_counters(stat_node->view.idle, diff.idle, visible);
 
-			stat_node->view[curcpu].user 	+= diff[curcpu].user;
-			stat_node->view[curcpu].system 	+= diff[curcpu].system;
-			stat_node->view[curcpu].idle 	+= diff[curcpu].idle;
+		user_sum	= sum_counters(stat_node->view.user, visible);
+		system_sum	= sum_counters(stat_node->view.system, visible);
+		idle_sum	= sum_counters(stat_node->view.idle, visible);
 
-			user_sum 	+= stat_node->view[curcpu].user;
-			system_sum 	+= stat_node->view[curcpu].system;
-			idle_sum 	+= stat_node->view[curcpu].idle;
+		diff_user	= sum_counters(diff.user, visible);
+		diff_system	= sum_counters(diff.system, visible);
+		diff_idle	= sum_counters(diff.idle, visible);
 
-			diff_user 	+= diff[curcpu].user;
-			diff_system 	+= diff[curcpu].system;
-			diff_idle 	+= diff[curcpu].idle;
-			if (diff[curcpu].idle > max_diff_idle) {
-				max_diff_idle 		= diff[curcpu].idle;
-				max_diff_idle_index 	= curcpu;
+		for (i = 0; i < visible; i++) {
+			if (diff.idle[i] > max_diff_idle) {
+				max_diff_idle		= diff.idle[i];
+				max_diff_idle_index	= i;
 			}
 
-			lxcfs_v("curcpu: %d, diff_user: %lu, diff_system: %lu, diff_idle: %lu\n", curcpu, diff[curcpu].user, diff[curcpu].system, diff[curcpu].idle);
+			lxcfs_v("curcpu: %d, diff_user: %lu, diff_system: %lu, diff_idle: %lu\n", stat_node->cpus[i], diff.user[i], diff.system[i], diff.idle[i]);
 		}
 		lxcfs_v("total. diff_user: %lu, diff_system: %lu, diff_idle: %lu\n", diff_user, diff_system, diff_idle);
 
 		/* revise cpu usage view to support partial cpu case. */
 		exact_cpus = exact_cpu_count(cg);
-		if (exact_cpus < (double)max_cpus){
+		if (visible && exact_cpus < (double)max_cpus){
 			uint64_t delta = (uint64_t)((double)(diff_user + diff_system + diff_idle) * (1 - exact_cpus / (double)max_cpus));
 
 			lxcfs_v("revising cpu usage view to match the exact cpu count [%f]\n", exact_cpus);
@@ -731,134 +979,480 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 				idle_sum = 0;
 			lxcfs_v("idle_sum after: %lu\n", idle_sum);
 
-			curcpu = max_diff_idle_index;
-			lxcfs_v("curcpu: %d, idle before: %lu\n", curcpu, stat_node->view[curcpu].idle);
-			if (stat_node->view[curcpu].idle > delta)
-				stat_node->view[curcpu].idle = stat_node->view[curcpu].idle - delta;
+			i = max_diff_idle_index;
+			lxcfs_v("curcpu: %d, idle before: %lu\n", stat_node->cpus[i], stat_node->view.idle[i]);
+			if (stat_node->view.idle[i] > delta)
+				stat_node->view.idle[i] = stat_node->view.idle[i] - delta;
 			else
-				stat_node->view[curcpu].idle = 0;
-			lxcfs_v("curcpu: %d, idle after: %lu\n", curcpu, stat_node->view[curcpu].idle);
+				stat_node->view.idle[i] = 0;
+			lxcfs_v("curcpu: %d, idle after: %lu\n", stat_node->cpus[i], stat_node->view.idle[i]);
 		}
 	} else {
-		for (curcpu = 0; curcpu < nprocs; curcpu++) {
-			if (!stat_node->usage[curcpu].online)
-				continue;
-
-			stat_node->view[curcpu].user 	= stat_node->usage[curcpu].user;
-			stat_node->view[curcpu].system 	= stat_node->usage[curcpu].system;
-			stat_node->view[curcpu].idle 	= stat_node->usage[curcpu].idle;
+		copy_cpu_times(&stat_node->view, &stat_node->usage, nr_online);
 
-			user_sum 	+= stat_node->view[curcpu].user;
-			system_sum 	+= stat_node->view[curcpu].system;
-			idle_sum 	+= stat_node->view[curcpu].idle;
-		}
+		user_sum	= sum_counters(stat_node->view.user, nr_online);
+		system_sum	= sum_counters(stat_node->view.system, nr_online);
+		idle_sum	= sum_counters(stat_node->view.idle, nr_online);
 	}
 
-	/* Render the file */
+	/* Render the file, only user, system and idle are virtualized. */
+	memset(counters, 0, sizeof(counters));
+
 	/* cpu-all */
-	l = snprintf(buf, buf_size,
-		     "cpu  %" PRIu64 " 0 %" PRIu64 " %" PRIu64 " 0 0 0 0 0 0\n",
-		     user_sum, system_sum, idle_sum);
-	lxcfs_v("cpu-all: %s\n", buf);
-	if (l < 0)
-		return log_error(0, "Failed to write cache");
+	counters[PROC_STAT_USER]	= user_sum;
+	counters[PROC_STAT_SYSTEM]	= system_sum;
+	counters[PROC_STAT_IDLE]	= idle_sum;
+	l = proc_stat_fmt_cpu(lbuf, -1, counters);
+	lxcfs_v("cpu-all: %s\n", lbuf);
 	if (l >= buf_size)
-		return log_error(0, "Write to cache was truncated");
+		goto out_truncated;
 
+	memcpy(buf, lbuf, l + 1);
 	buf += l;
 	buf_size -= l;
 	total_len += l;
 
 	/* Render visible CPUs */
-	for (curcpu = 0, i = -1; curcpu < nprocs; curcpu++) {
-		if (!stat_node->usage[curcpu].online)
-			continue;
-
-		i++;
-
-		if (max_cpus > 0 && i == max_cpus)
-			break;
-
-		l = snprintf(buf, buf_size, "cpu%d %" PRIu64 " 0 %" PRIu64 " %" PRIu64 " 0 0 0 0 0 0\n",
-			     i,
-			     stat_node->view[curcpu].user,
-			     stat_node->view[curcpu].system,
-			     stat_node->view[curcpu].idle);
-		lxcfs_v("cpu: %s\n", buf);
-		if (l < 0)
-			return log_error(0, "Failed to write cache");
+	for (i = 0; i < visible; i++) {
+		counters[PROC_STAT_USER]	= stat_node->view.user[i];
+		counters[PROC_STAT_SYSTEM]	= stat_node->view.system[i];
+		counters[PROC_STAT_IDLE]	= stat_node->view.idle[i];
+		l = proc_stat_fmt_cpu(lbuf, i, counters);
+		lxcfs_v("cpu: %s\n", lbuf);
 		if (l >= buf_size)
-			return log_error(0, "Write to cache was truncated");
+			goto out_truncated;
 
+		memcpy(buf, lbuf, l + 1);
 		buf += l;
 		buf_size -= l;
 		total_len += l;
 	}
 
 	/* Pass the rest of /proc/stat, start with the last line read */
-	l = snprintf(buf, buf_size, "%s", line);
-	if (l < 0)
-		return log_error(0, "Failed to write cache");
+	l = line ? strlen(line) : 0;
 	if (l >= buf_size)
-		return log_error(0, "Write to cache was truncated");
+		goto out_truncated;
 
+	memcpy(buf, line ?: "", l + 1);
 	buf += l;
 	buf_size -= l;
 	total_len += l;
 
 	/* Pass the rest of the host's /proc/stat */
-	while (getline(&line, &linelen, f) != -1) {
-		l = snprintf(buf, buf_size, "%s", line);
-		if (l < 0)
-			return log_error(0, "Failed to write cache");
+	while ((linelen_read = getline(&line, &linelen, f)) != -1) {
+		l = linelen_read;
 		if (l >= buf_size)
-			return log_error(0, "Write to cache was truncated");
+			goto out_truncated;
 
+		memcpy(buf, line, l + 1);
 		buf += l;
 		buf_size -= l;
 		total_len += l;
 	}
 
-	if (stat_node)
+	if (stat_node) {
 		pthread_mutex_unlock(&stat_node->lock);
+		put_proc_stat_node(stat_node);
+	}
 
 	return total_len;
+
+out_truncated:
+	if (stat_node) {
+		pthread_mutex_unlock(&stat_node->lock);
+		put_proc_stat_node(stat_node);
+	}
+
+	return -E2BIG;
 }
 
 /*
- * check whether this is a '^processor" line in /proc/cpuinfo
+ * The host's /proc/cpuinfo is large on big machines and its layout only
+ * changes on cpu hotplug. Read it and split it into spans so views for a
+ * cpuset can be put together without re-reading and re-parsing the host file
+ * for every reader. Rendered views are kept per (cpuset, cpu limit) as
+ * containers sharing a cpuset see the exact same file. Some lines such as
+ * "cpu MHz" change all the time so the index and the views built from it
+ * are thrown away after CPUINFO_INDEX_TTL_MSECS.
  */
-static inline bool is_processor_line(const char *line)
-{
+#define CPUINFO_INDEX_TTL_MSECS 1000
+
+enum {
+	CPUINFO_SPAN_TEXT,		/* s390x lines printed unconditionally. */
+	CPUINFO_SPAN_BODY,		/* Lines following a processor line. */
+	CPUINFO_SPAN_PROCESSOR,		/* "processor : N" */
+	CPUINFO_SPAN_S390_PROCESSOR,	/* s390x "processor N: ..." */
+};
+
+struct cpuinfo_span {
+	int type;
 	int cpu;
-	return sscanf(line, "processor       : %d", &cpu) == 1;
+	size_t start;
+	size_t len;
+};
+
+struct cpuinfo_index {
+	char *buf;
+	/* Contents of /sys/devices/system/cpu/online when @buf was read. */
+	char *online;
+	uint64_t stamp; /* CLOCK_MONOTONIC in milliseconds */
+	bool is_s390x;
+	int nr_cpus;
+	size_t nr_spans;
+	struct cpuinfo_span *spans;
+};
+
+struct cpuinfo_render {
+	char *cpuset;
+	int max_cpus;
+	uint64_t hash;
+	char *buf;
+	size_t len;
+};
+
+struct cpuinfo_key {
+	const char *cpuset;
+	int max_cpus;
+};
+
+/* Distinct cpusets are few, the limit only guards against pathologic setups. */
+#define CPUINFO_MAX_RENDERS 32
+
+static bool cpuinfo_render_match(const void *item, const void *key)
+{
+	const struct cpuinfo_render *r = item;
+	const struct cpuinfo_key *k = key;
+
+	return r->max_cpus == k->max_cpus && strcmp(r->cpuset, k->cpuset) == 0;
+}
+
+static struct cpuinfo_index *cpuinfo_index;
+static struct hash_table cpuinfo_renders = {
+	.match = cpuinfo_render_match,
+};
+static pthread_rwlock_t cpuinfo_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint64_t cpuinfo_hash(const struct cpuinfo_key *k)
+{
+	return hash_string(k->cpuset) ^ hash_u64(k->max_cpus);
 }
 
-static inline bool cpuline_in_cpuset(const char *line, const char *cpuset)
+static void free_cpuinfo_index(struct cpuinfo_index *idx)
 {
-	int cpu;
+	if (!idx)
+		return;
+
+	free(idx->buf);
+	free(idx->online);
+	free(idx->spans);
+	free(idx);
+}
+
+static void free_cpuinfo_render(struct cpuinfo_render *r)
+{
+	free(r->cpuset);
+	free(r->buf);
+	free(r);
+}
+
+/* Must be called with cpuinfo_lock held for writing. */
+static void flush_cpuinfo_renders(void)
+{
+	struct cpuinfo_render *r;
+	size_t pos;
+
+	hash_table_for_each(&cpuinfo_renders, pos, r)
+		free_cpuinfo_render(r);
+	hash_table_fini(&cpuinfo_renders);
+}
+
+static void cpuinfo_add_span(struct cpuinfo_index *idx, int type, int cpu,
+			     size_t start, size_t len)
+{
+	struct cpuinfo_span *last = idx->nr_spans ? &idx->spans[idx->nr_spans - 1] : NULL;
+
+	/* Consecutive text lines of one block end up in a single span. */
+	if (last && last->type == type &&
+	    (type == CPUINFO_SPAN_TEXT || type == CPUINFO_SPAN_BODY) &&
+	    last->start + last->len == start) {
+		last->len += len;
+		return;
+	}
+
+	if (!(idx->nr_spans & (idx->nr_spans - 1)))
+		idx->spans = must_realloc(idx->spans, (idx->nr_spans ? idx->nr_spans * 2 : 16) *
+						      sizeof(struct cpuinfo_span));
+
+	idx->spans[idx->nr_spans++] = (struct cpuinfo_span){
+		.type	= type,
+		.cpu	= cpu,
+		.start	= start,
+		.len	= len,
+	};
+}
+
+static struct cpuinfo_index *build_cpuinfo_index(char *online)
+{
+	__do_free struct cpuinfo_index *idx = NULL;
+	bool in_block = false;
+	char *line;
+
+	idx = zalloc(sizeof(*idx));
+	if (!idx)
+		return NULL;
+
+	idx->buf = read_file("/proc/cpuinfo");
+	if (!idx->buf)
+		return NULL;
+
+	for (line = idx->buf; *line;) {
+		char *end = strchrnul(line, '\n');
+		size_t len = end - line + (*end == '\n');
+		int cpu;
+
+		if (line == idx->buf && memmem(line, len, "IBM/S390", 8)) {
+			idx->is_s390x = true;
+		} else if (strncmp(line, "# processors:", 12) == 0) {
+			/* Regenerated when rendering. */
+		} else if (sscanf(line, "processor       : %d", &cpu) == 1) {
+			cpuinfo_add_span(idx, CPUINFO_SPAN_PROCESSOR, cpu, line - idx->buf, len);
+			idx->nr_cpus++;
+			in_block = true;
+		} else if (idx->is_s390x && sscanf(line, "processor %d:", &cpu) == 1) {
+			char *p = strchr(line, ':') + 1;
+
+			cpuinfo_add_span(idx, CPUINFO_SPAN_S390_PROCESSOR, cpu,
+					 p - idx->buf, len - (p - line));
+			idx->nr_cpus++;
+		} else if (in_block) {
+			cpuinfo_add_span(idx, CPUINFO_SPAN_BODY, -1, line - idx->buf, len);
+		} else if (idx->is_s390x) {
+			cpuinfo_add_span(idx, CPUINFO_SPAN_TEXT, -1, line - idx->buf, len);
+		}
+
+		line += len;
+	}
+
+	idx->online = online;
+	idx->stamp = proc_cache_now();
+	return move_ptr(idx);
+}
+
+/*
+ * Make sure the index is there, reflects the cpus currently online and is no
+ * older than CPUINFO_INDEX_TTL_MSECS.
+ */
+static int refresh_cpuinfo_index(void)
+{
+	__do_free char *online = NULL;
+	struct cpuinfo_index *idx, *old;
+	uint64_t now = proc_cache_now();
+	bool fresh, hotplug = false;
+
+	/* Without the online mask hotplug goes unnoticed, keep what we have. */
+	online = read_file_strip_newline("/sys/devices/system/cpu/online");
+
+	pthread_rwlock_rdlock(&cpuinfo_lock);
+	if (cpuinfo_index)
+		hotplug = online && (!cpuinfo_index->online ||
+				     strcmp(cpuinfo_index->online, online) != 0);
+	fresh = cpuinfo_index && !hotplug &&
+		now - cpuinfo_index->stamp < CPUINFO_INDEX_TTL_MSECS;
+	pthread_rwlock_unlock(&cpuinfo_lock);
+	if (fresh)
+		return 0;
+
+	idx = build_cpuinfo_index(online);
+	if (!idx)
+		return ret_errno(ENOMEM);
+	move_ptr(online);
+
+	pthread_rwlock_wrlock(&cpuinfo_lock);
+	/* Somebody else might have re-read it meanwhile. */
+	if (cpuinfo_index && cpuinfo_index->stamp >= idx->stamp &&
+	    !hotplug) {
+		pthread_rwlock_unlock(&cpuinfo_lock);
+		free_cpuinfo_index(idx);
+		return 0;
+	}
+	old = cpuinfo_index;
+	cpuinfo_index = idx;
+	flush_cpuinfo_renders();
+	pthread_rwlock_unlock(&cpuinfo_lock);
+
+	if (hotplug)
+		lxcfs_debug("Host cpus changed to %s, re-reading /proc/cpuinfo", idx->online);
+	free_cpuinfo_index(old);
+
+	return 0;
+}
+
+/* Must be called with cpuinfo_lock held. */
+static char *render_cpuinfo(const struct cpuinfo_index *idx,
+			    const struct cpuset_bitmap *cpus, int max_cpus,
+			    size_t *len)
+{
+	__do_free char *buf = NULL;
+	size_t pos = 0;
+	int curcpu = -1, nr_cpus = 0;
+	bool am_printing = idx->is_s390x;
+
+	buf = malloc(strlen(idx->buf) + idx->nr_cpus * (INTTYPE_TO_STRLEN(int) + 16) + 128);
+	if (!buf)
+		return NULL;
+
+	if (idx->is_s390x) {
+		for (size_t i = 0; i < idx->nr_spans; i++) {
+			const struct cpuinfo_span *span = &idx->spans[i];
+
+			if (span->type != CPUINFO_SPAN_PROCESSOR &&
+			    span->type != CPUINFO_SPAN_S390_PROCESSOR)
+				continue;
+
+			if (max_cpus > 0 && nr_cpus == max_cpus)
+				break;
+
+			if (cpuset_bitmap_test(cpus, span->cpu))
+				nr_cpus++;
+		}
+
+		pos += sprintf(buf, "vendor_id       : IBM/S390\n"
+				    "# processors    : %d\n", nr_cpus);
+	}
+
+	for (size_t i = 0; i < idx->nr_spans; i++) {
+		const struct cpuinfo_span *span = &idx->spans[i];
+
+		switch (span->type) {
+		case CPUINFO_SPAN_PROCESSOR:
+			if (max_cpus > 0 && (curcpu + 1) == max_cpus)
+				goto out;
+
+			am_printing = cpuset_bitmap_test(cpus, span->cpu);
+			if (am_printing)
+				pos += sprintf(buf + pos, "processor	: %d\n", ++curcpu);
+			break;
+		case CPUINFO_SPAN_S390_PROCESSOR:
+			if (max_cpus > 0 && (curcpu + 1) == max_cpus)
+				goto out;
+
+			if (!cpuset_bitmap_test(cpus, span->cpu))
+				break;
+
+			pos += sprintf(buf + pos, "processor %d:", ++curcpu);
+			memcpy(buf + pos, idx->buf + span->start, span->len);
+			pos += span->len;
+			break;
+		case CPUINFO_SPAN_BODY:
+			if (!am_printing)
+				break;
+
+			memcpy(buf + pos, idx->buf + span->start, span->len);
+			pos += span->len;
+			break;
+		case CPUINFO_SPAN_TEXT:
+			memcpy(buf + pos, idx->buf + span->start, span->len);
+			pos += span->len;
+			break;
+		}
+	}
 
-	if (sscanf(line, "processor       : %d", &cpu) == 1)
-		return cpu_in_cpuset(cpu, cpuset);
+out:
+	buf[pos] = '\0';
+	*len = pos;
+	return move_ptr(buf);
+}
 
-	return false;
+/*
+ * Copy the view of /proc/cpuinfo for @cpuset limited to @max_cpus cpus into
+ * @d->buf rendering it first if nobody asked for it before.
+ */
+static int cpuinfo_view(struct file_info *d, const char *cpuset, int max_cpus)
+{
+	__do_free struct cpuset_bitmap *cpus = NULL;
+	__do_free struct cpuinfo_render *new = NULL;
+	struct cpuinfo_key key = {
+		.cpuset		= cpuset,
+		.max_cpus	= max_cpus,
+	};
+	uint64_t hash = cpuinfo_hash(&key);
+	struct cpuinfo_render *r;
+	int ret;
+
+	ret = refresh_cpuinfo_index();
+	if (ret < 0)
+		return ret;
+
+	pthread_rwlock_rdlock(&cpuinfo_lock);
+	r = hash_table_find(&cpuinfo_renders, hash, &key);
+	if (r) {
+		stats_inc(STATS_CPUINFO_VIEW_HIT);
+		goto copy;
+	}
+	pthread_rwlock_unlock(&cpuinfo_lock);
+	stats_inc(STATS_CPUINFO_VIEW_MISS);
+
+	cpus = cpuset_bitmap_parse(cpuset);
+	if (!cpus)
+		return ret_errno(EINVAL);
+
+	new = zalloc(sizeof(*new));
+	if (!new)
+		return ret_errno(ENOMEM);
+
+	new->cpuset = strdup(cpuset);
+	if (!new->cpuset)
+		return ret_errno(ENOMEM);
+	new->max_cpus = max_cpus;
+	new->hash = hash;
+
+	pthread_rwlock_wrlock(&cpuinfo_lock);
+	r = hash_table_find(&cpuinfo_renders, hash, &key);
+	if (r)
+		goto copy;
+
+	new->buf = render_cpuinfo(cpuinfo_index, cpus, max_cpus, &new->len);
+	if (!new->buf) {
+		pthread_rwlock_unlock(&cpuinfo_lock);
+		free(new->cpuset);
+		return ret_errno(ENOMEM);
+	}
+
+	if (cpuinfo_renders.used >= CPUINFO_MAX_RENDERS)
+		flush_cpuinfo_renders();
+
+	r = new;
+	if (hash_table_insert(&cpuinfo_renders, hash, r) == 0)
+		move_ptr(new);
+
+copy:
+	if (r->len > d->buflen) {
+		pthread_rwlock_unlock(&cpuinfo_lock);
+		if (new)
+			free_cpuinfo_render(move_ptr(new));
+		return -E2BIG;
+	}
+
+	memcpy(d->buf, r->buf, r->len);
+	d->size = r->len;
+	pthread_rwlock_unlock(&cpuinfo_lock);
+
+	if (new)
+		free_cpuinfo_render(move_ptr(new));
+
+	return 0;
 }
 
 int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi)
 {
-	__do_free char *cg = NULL, *cpuset = NULL, *line = NULL;
-	__do_free void *fopen_cache = NULL;
-	__do_fclose FILE *f = NULL;
+	__do_free char *cg = NULL, *cpuset = NULL;
 	struct fuse_context *fc = fuse_get_context();
 	struct lxcfs_opts *opts = (struct lxcfs_opts *)fc->private_data;
 	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
-	size_t linelen = 0, total_len = 0;
-	bool am_printing = false, firstline = true, is_s390x = false;
-	int curcpu = -1, cpu, max_cpus = 0;
-	bool use_view;
-	char *cache = d->buf;
-	size_t cache_size = d->buflen;
+	size_t total_len = 0;
+	int max_cpus = 0;
+	int ret;
 
 	if (offset) {
 		int left;
@@ -871,7 +1465,7 @@ int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 
 		left = d->size - offset;
 		total_len = left > size ? size: left;
-		memcpy(buf, cache + offset, total_len);
+		memcpy(buf, d->buf + offset, total_len);
 
 		return total_len;
 	}
@@ -890,122 +1484,14 @@ int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 		return 0;
 
 	if (cgroup_ops->can_use_cpuview(cgroup_ops) && opts && opts->use_cfs)
-		use_view = true;
-	else
-		use_view = false;
-	if (use_view)
 		max_cpus = max_cpu_count(cg);
 
-	f = fopen_cached("/proc/cpuinfo", "re", &fopen_cache);
-	if (!f)
-		return 0;
-
-	while (getline(&line, &linelen, f) != -1) {
-		ssize_t l;
-		if (firstline) {
-			firstline = false;
-			if (strstr(line, "IBM/S390") != NULL) {
-				is_s390x = true;
-				am_printing = true;
-				continue;
-			}
-		}
-
-		if (strncmp(line, "# processors:", 12) == 0)
-			continue;
-
-		if (is_processor_line(line)) {
-			if (use_view && max_cpus > 0 && (curcpu + 1) == max_cpus)
-				break;
-
-			am_printing = cpuline_in_cpuset(line, cpuset);
-			if (am_printing) {
-				curcpu++;
-				l = snprintf(cache, cache_size, "processor	: %d\n", curcpu);
-				if (l < 0)
-					return log_error(0, "Failed to write cache");
-				if (l >= cache_size)
-					return log_error(0, "Write to cache was truncated");
-				cache += l;
-				cache_size -= l;
-				total_len += l;
-			}
-			continue;
-		} else if (is_s390x && sscanf(line, "processor %d:", &cpu) == 1) {
-			char *p;
-
-			if (use_view && max_cpus > 0 && (curcpu + 1) == max_cpus)
-				break;
-
-			if (!cpu_in_cpuset(cpu, cpuset))
-				continue;
-
-			curcpu ++;
-			p = strchr(line, ':');
-			if (!p || !*p)
-				return 0;
-			p++;
-
-			l = snprintf(cache, cache_size, "processor %d:%s", curcpu, p);
-			if (l < 0)
-				return log_error(0, "Failed to write cache");
-			if (l >= cache_size)
-				return log_error(0, "Write to cache was truncated");
-
-			cache += l;
-			cache_size -= l;
-			total_len += l;
-			continue;
-
-		}
-		if (am_printing) {
-			l = snprintf(cache, cache_size, "%s", line);
-			if (l < 0)
-				return log_error(0, "Failed to write cache");
-			if (l >= cache_size)
-				return log_error(0, "Write to cache was truncated");
-
-			cache += l;
-			cache_size -= l;
-			total_len += l;
-		}
-	}
-
-	if (is_s390x) {
-		__do_free char *origcache = d->buf;
-		ssize_t l;
-
-		d->buf = malloc(d->buflen);
-		if (!d->buf) {
-			d->buf = move_ptr(origcache);
-			return 0;
-		}
-
-		cache = d->buf;
-		cache_size = d->buflen;
-		total_len = 0;
-		l = snprintf(cache, cache_size, "vendor_id       : IBM/S390\n");
-		if (l < 0 || l >= cache_size)
-			return 0;
-
-		cache_size -= l;
-		cache += l;
-		total_len += l;
-		l = snprintf(cache, cache_size, "# processors    : %d\n", curcpu + 1);
-		if (l < 0 || l >= cache_size)
-			return 0;
-
-		cache_size -= l;
-		cache += l;
-		total_len += l;
-		l = snprintf(cache, cache_size, "%s", origcache);
-		if (l < 0 || l >= cache_size)
-			return 0;
-		total_len += l;
-	}
+	ret = cpuinfo_view(d, cpuset, max_cpus);
+	if (ret < 0)
+		return ret == -E2BIG ? ret : 0;
 
 	d->cached = 1;
-	d->size = total_len;
+	total_len = d->size;
 	if (total_len > size)
 		total_len = size;
 
@@ -1102,69 +1588,20 @@ int read_cpuacct_usage_all(char *cg, char *cpuset,
 	return 0;
 }
 
-static bool cpuview_init_head(struct cg_proc_stat_head **head)
-{
-	__do_free struct cg_proc_stat_head *h;
-
-	h = zalloc(sizeof(struct cg_proc_stat_head));
-	if (!h)
-		return false;
-
-	if (pthread_rwlock_init(&h->lock, NULL))
-		return false;
-
-	h->lastcheck = time(NULL);
-
-	*head = move_ptr(h);
-	return true;
-}
-
-bool init_cpuview(void)
-{
-	int i;
-
-	for (i = 0; i < CPUVIEW_HASH_SIZE; i++)
-		proc_stat_history[i] = NULL;
-
-	for (i = 0; i < CPUVIEW_HASH_SIZE; i++) {
-		if (!cpuview_init_head(&proc_stat_history[i]))
-			goto err;
-	}
-
-	return true;
-
-err:
-	for (i = 0; i < CPUVIEW_HASH_SIZE; i++) {
-		if (proc_stat_history[i])
-			free_disarm(proc_stat_history[i]);
-	}
-
-	return false;
-}
-
-static void cpuview_free_head(struct cg_proc_stat_head *head)
-{
-	struct cg_proc_stat *node;
-
-	if (head->next) {
-		node = head->next;
-
-		for (;;) {
-			struct cg_proc_stat *cur = node;
-			node = node->next;
-			free_proc_stat_node(cur);
-			if (!node)
-				break;
-		}
-	}
-
-	pthread_rwlock_destroy(&head->lock);
-	free_disarm(head);
-}
-
 void free_cpuview(void)
 {
-	for (int i = 0; i < CPUVIEW_HASH_SIZE; i++)
-		if (proc_stat_history[i])
-			cpuview_free_head(proc_stat_history[i]);
+	struct cg_proc_stat *node;
+	size_t pos;
+
+	pthread_rwlock_wrlock(&proc_stat_lock);
+	hash_table_for_each(&proc_stat_table, pos, node)
+		free_proc_stat_node(node);
+	hash_table_fini(&proc_stat_table);
+	pthread_rwlock_unlock(&proc_stat_lock);
+
+	pthread_rwlock_wrlock(&cpuinfo_lock);
+	flush_cpuinfo_renders();
+	free_cpuinfo_index(cpuinfo_index);
+	cpuinfo_index = NULL;
+	pthread_rwlock_unlock(&cpuinfo_lock);
 }
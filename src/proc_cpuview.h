@@ -21,6 +21,23 @@
 #include "config.h"
 #include "macro.h"
 
+/* Counters on a per-cpu line of /proc/stat. */
+enum {
+	PROC_STAT_USER,
+	PROC_STAT_NICE,
+	PROC_STAT_SYSTEM,
+	PROC_STAT_IDLE,
+	PROC_STAT_IOWAIT,
+	PROC_STAT_IRQ,
+	PROC_STAT_SOFTIRQ,
+	PROC_STAT_STEAL,
+	PROC_STAT_GUEST,
+	PROC_STAT_GUEST_NICE,
+	PROC_STAT_COUNTERS,
+};
+/* Longest line proc_stat_fmt_cpu() renders, including the NUL. */
+#define PROC_STAT_LINE_MAX 256
+
 struct cpuacct_usage {
 	uint64_t user;
 	uint64_t system;
@@ -36,9 +53,26 @@ extern int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 			     struct fuse_file_info *fi);
 extern int read_cpuacct_usage_all(char *cg, char *cpuset,
 				  struct cpuacct_usage **return_usage, int *size);
-extern bool init_cpuview(void);
+/* Sum of all counters but idle. */
+static inline uint64_t proc_stat_busy(const uint64_t counters[PROC_STAT_COUNTERS])
+{
+	uint64_t busy = 0;
+
+	for (int i = 0; i < PROC_STAT_COUNTERS; i++)
+		if (i != PROC_STAT_IDLE)
+			busy += counters[i];
+
+	return busy;
+}
+
+extern int proc_stat_parse_cpu(const char *line, int *cpu,
+			       uint64_t counters[PROC_STAT_COUNTERS]);
+extern size_t proc_stat_fmt_cpu(char *buf, int cpu,
+				const uint64_t counters[PROC_STAT_COUNTERS]);
 extern void free_cpuview(void);
 extern int max_cpu_count(const char *cg);
+extern void cpuview_evict(const char *cg);
+extern size_t cpuview_nr_nodes(void);
 
 #endif /* __LXCFS_PROC_CPUVIEW_FUSE_H */
 
@@ -25,6 +25,7 @@
 #include <fuse.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdarg.h>
@@ -48,12 +49,17 @@
 #include <sys/vfs.h>
 
 #include "bindings.h"
+#include "blkio_parse.h"
 #include "cgroup_fuse.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
 #include "cpuset_parse.h"
+#include "fmt.h"
+#include "hash_table.h"
+#include "kv_parse.h"
 #include "lxcfs_fuse_compat.h"
 #include "memory_utils.h"
+#include "proc_cache.h"
 #include "proc_loadavg.h"
 #include "proc_cpuview.h"
 #include "utils.h"
@@ -80,9 +86,258 @@ struct memory_stat {
 	uint64_t total_unevictable;
 };
 
+static int proc_type(const char *path)
+{
+	if (strcmp(path, "/proc/meminfo") == 0)
+		return LXC_TYPE_PROC_MEMINFO;
+	if (strcmp(path, "/proc/cpuinfo") == 0)
+		return LXC_TYPE_PROC_CPUINFO;
+	if (strcmp(path, "/proc/uptime") == 0)
+		return LXC_TYPE_PROC_UPTIME;
+	if (strcmp(path, "/proc/stat") == 0)
+		return LXC_TYPE_PROC_STAT;
+	if (strcmp(path, "/proc/diskstats") == 0)
+		return LXC_TYPE_PROC_DISKSTATS;
+	if (strcmp(path, "/proc/swaps") == 0)
+		return LXC_TYPE_PROC_SWAPS;
+	if (strcmp(path, "/proc/loadavg") == 0)
+		return LXC_TYPE_PROC_LOADAVG;
+
+	return -1;
+}
+
+/*
+ * Return the cache key for a proc file of @type, i.e. the cgroup its contents
+ * depend on. /proc/stat and /proc/cpuinfo also depend on the cpu,cpuacct
+ * cgroup for usage and quotas which need not be the same as the cpuset one
+ * on legacy layouts, there their key is "<cpuset cgroup>//<cpuacct cgroup>".
+ * A double slash never appears in a cgroup path so keys can't collide.
+ */
+/* The io controller is called blkio on the legacy hierarchy. */
+static const char *io_controller(void)
+{
+	return cgroup_ops->get_hierarchy(cgroup_ops, "blkio") ? "blkio" : "io";
+}
+
+static char *proc_cache_cgroup(int type)
+{
+	__do_free char *cg = NULL, *cpuacct_cg = NULL;
+	struct fuse_context *fc = fuse_get_context();
+	const char *controller;
+	char *key;
+	size_t len;
+	pid_t initpid;
+
+	switch (type) {
+	case LXC_TYPE_PROC_MEMINFO:
+		/* fallthrough */
+	case LXC_TYPE_PROC_SWAPS:
+		controller = "memory";
+		break;
+	case LXC_TYPE_PROC_DISKSTATS:
+		controller = io_controller();
+		break;
+	case LXC_TYPE_PROC_STAT:
+		/* fallthrough */
+	case LXC_TYPE_PROC_CPUINFO:
+		controller = "cpuset";
+		break;
+	default:
+		return NULL;
+	}
+
+	initpid = lookup_initpid_in_store(fc->pid);
+	if (initpid <= 1 || is_shared_pidns(initpid))
+		initpid = fc->pid;
+
+	/* proc_stat_read() hands out the host's file for these. */
+	if (type == LXC_TYPE_PROC_STAT && initpid == 1)
+		return NULL;
+
+	cg = get_pid_cgroup(initpid, controller);
+	if (!cg)
+		return NULL;
+	prune_init_slice(cg);
+
+	/* On a pure unified layout all controllers share the cgroup. */
+	if ((type != LXC_TYPE_PROC_STAT && type != LXC_TYPE_PROC_CPUINFO) ||
+	    pure_unified_layout(cgroup_ops))
+		return move_ptr(cg);
+
+	cpuacct_cg = get_pid_cgroup(initpid, "cpuacct");
+	if (!cpuacct_cg)
+		return NULL;
+	prune_init_slice(cpuacct_cg);
+
+	len = strlen(cg) + STRLITERALLEN("//") + strlen(cpuacct_cg) + 1;
+	key = malloc(len);
+	if (!key)
+		return NULL;
+	snprintf(key, len, "%s//%s", cg, cpuacct_cg);
+
+	return key;
+}
+
+/*
+ * With --page-cache-ttl the kernel may keep rendered proc files in its page
+ * cache and answer repeated reads without asking us. But the page cache
+ * belongs to the inode, and every container using the mount shares it. So
+ * for each file only one cgroup at a time owns the cached pages: opens from
+ * that cgroup keep the cache and everybody else gets direct_io. Ownership
+ * changes hands as soon as all of the owner's handles are closed, and the new
+ * owner opens without keep_cache, which makes the kernel drop the old pages.
+ * It can't change while the owner still has handles open, those would read
+ * the new owner's pages. All handles of an owner serve the same snapshot, so
+ * pages filled in through different handles fit together.
+ *
+ * Reads are served from the snapshot for as long as it exists. It expires in
+ * getattr, which the kernel sends whenever a read hits the end of the file,
+ * and in open. The cached pages are then invalidated and the reported mtime
+ * changes, so long-lived handles that keep seeking back to 0 don't serve
+ * stale data. The size reported while there is no snapshot is the largest a
+ * render can have, the kernel learns the real size from the short read at
+ * the end of the file. This needs FUSE 3, with FUSE 2 lxcfs always uses
+ * direct_io.
+ */
+struct proc_page_cache {
+	pthread_mutex_t lock;
+	char *owner;
+	uint64_t expires;
+	unsigned int users;
+	struct proc_cache_entry *snap;
+	/* Reported as mtime, changes whenever the cached pages are stale. */
+	struct timespec mtime;
+};
+
+static struct proc_page_cache proc_page_cache[LXC_TYPE_MAX] = {
+	[0 ... LXC_TYPE_MAX - 1] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	},
+};
+
+/* Must be called with pc->lock held. */
+static void __proc_page_cache_drop(struct proc_page_cache *pc)
+{
+	if (pc->snap)
+		proc_cache_put(move_ptr(pc->snap));
+	(void)clock_gettime(CLOCK_REALTIME, &pc->mtime);
+}
+
+/*
+ * Drop the snapshot if it expired. Returns true if the kernel's pages need to
+ * be invalidated. Must be called with pc->lock held.
+ */
+static bool __proc_page_cache_expire(struct proc_page_cache *pc, uint64_t now)
+{
+	if (!pc->snap || now < pc->expires)
+		return false;
+
+	__proc_page_cache_drop(pc);
+	return true;
+}
+
+static void proc_page_cache_open(struct file_info *info,
+				 struct fuse_file_info *fi)
+{
+	__do_free char *cg = NULL;
+	struct proc_page_cache *pc = &proc_page_cache[info->type];
+
+	/* The mount doesn't force direct_io in this mode. */
+	fi->direct_io = 1;
+
+	if (!liblxcfs_functional())
+		return;
+
+	cg = proc_cache_cgroup(info->type);
+	if (!cg)
+		return;
+
+	pthread_mutex_lock(&pc->lock);
+	if (pc->owner && strcmp(pc->owner, cg) == 0) {
+		/* Without keep_cache the kernel drops the stale pages. */
+		if (!__proc_page_cache_expire(pc, proc_cache_now()))
+			fi->keep_cache = 1;
+	} else if (!pc->users) {
+		free(pc->owner);
+		pc->owner = move_ptr(cg);
+		__proc_page_cache_drop(pc);
+	} else {
+		pthread_mutex_unlock(&pc->lock);
+		return;
+	}
+	pc->users++;
+	pthread_mutex_unlock(&pc->lock);
+
+	fi->direct_io = 0;
+	info->page_cache = true;
+}
+
+static void proc_page_cache_release(struct file_info *info)
+{
+	struct proc_page_cache *pc = &proc_page_cache[info->type];
+
+	pthread_mutex_lock(&pc->lock);
+	if (pc->users)
+		pc->users--;
+	pthread_mutex_unlock(&pc->lock);
+}
+
+/* Return a referenced snapshot to serve a read from, or NULL if there is none. */
+static struct proc_cache_entry *proc_page_cache_snap(struct proc_page_cache *pc)
+{
+	struct proc_cache_entry *entry = NULL;
+
+	pthread_mutex_lock(&pc->lock);
+	if (pc->snap)
+		entry = proc_cache_ref(pc->snap);
+	pthread_mutex_unlock(&pc->lock);
+
+	return entry;
+}
+
+/*
+ * Fill in size and mtime of @path. The kernel won't read past the size from
+ * the page cache and drops its pages when the mtime changes.
+ */
+static void proc_page_cache_attr(int type, const char *path, struct stat *sb)
+{
+	struct proc_page_cache *pc = &proc_page_cache[type];
+	bool expired;
+
+	pthread_mutex_lock(&pc->lock);
+	expired = __proc_page_cache_expire(pc, proc_cache_now());
+	sb->st_size = pc->snap ? (off_t)pc->snap->size : FILE_INFO_BUF_MAX;
+	sb->st_mtim = sb->st_ctim = pc->mtime;
+	pthread_mutex_unlock(&pc->lock);
+
+#ifdef HAVE_FUSE3
+	/* Handles that are already open would keep reading the old pages. */
+	if (expired)
+		(void)fuse_invalidate_path(fuse_get_context()->fuse, path);
+#else
+	/* Page cache mode is FUSE 3 only. */
+	(void)expired;
+#endif
+}
+
+void free_proc_page_cache(void)
+{
+	for (int i = 0; i < LXC_TYPE_MAX; i++) {
+		struct proc_page_cache *pc = &proc_page_cache[i];
+
+		pthread_mutex_lock(&pc->lock);
+		free_disarm(pc->owner);
+		if (pc->snap)
+			proc_cache_put(move_ptr(pc->snap));
+		pthread_mutex_unlock(&pc->lock);
+	}
+}
+
 __lxcfs_fuse_ops int proc_getattr(const char *path, struct stat *sb)
 {
+	struct lxcfs_opts *opts = (struct lxcfs_opts *)fuse_get_context()->private_data;
 	struct timespec now;
+	int type;
 
 	memset(sb, 0, sizeof(struct stat));
 	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
@@ -96,14 +351,12 @@ __lxcfs_fuse_ops int proc_getattr(const char *path, struct stat *sb)
 		return 0;
 	}
 
-	if (strcmp(path, "/proc/meminfo")	== 0 ||
-	    strcmp(path, "/proc/cpuinfo")	== 0 ||
-	    strcmp(path, "/proc/uptime")	== 0 ||
-	    strcmp(path, "/proc/stat")		== 0 ||
-	    strcmp(path, "/proc/diskstats")	== 0 ||
-	    strcmp(path, "/proc/swaps")		== 0 ||
-	    strcmp(path, "/proc/loadavg")	== 0) {
-		sb->st_size = 4096;
+	type = proc_type(path);
+	if (type >= 0) {
+		if (opts && opts->page_cache_ttl)
+			proc_page_cache_attr(type, path, sb);
+		else
+			sb->st_size = 4096;
 		sb->st_mode = S_IFREG | 00444;
 		sb->st_nlink = 1;
 		return 0;
@@ -130,43 +383,14 @@ __lxcfs_fuse_ops int proc_readdir(const char *path, void *buf,
 	return 0;
 }
 
-static off_t get_procfile_size(const char *path)
-{
-	__do_fclose FILE *f = NULL;
-	__do_free char *line = NULL;
-	size_t len = 0;
-	ssize_t sz, answer = 0;
-
-	f = fopen(path, "re");
-	if (!f)
-		return 0;
-
-	while ((sz = getline(&line, &len, f)) != -1)
-		answer += sz;
-
-	return answer;
-}
-
 __lxcfs_fuse_ops int proc_open(const char *path, struct fuse_file_info *fi)
 {
 	__do_free struct file_info *info = NULL;
-	int type = -1;
+	struct lxcfs_opts *opts = (struct lxcfs_opts *)fuse_get_context()->private_data;
+	int type;
 
-	if (strcmp(path, "/proc/meminfo") == 0)
-		type = LXC_TYPE_PROC_MEMINFO;
-	else if (strcmp(path, "/proc/cpuinfo") == 0)
-		type = LXC_TYPE_PROC_CPUINFO;
-	else if (strcmp(path, "/proc/uptime") == 0)
-		type = LXC_TYPE_PROC_UPTIME;
-	else if (strcmp(path, "/proc/stat") == 0)
-		type = LXC_TYPE_PROC_STAT;
-	else if (strcmp(path, "/proc/diskstats") == 0)
-		type = LXC_TYPE_PROC_DISKSTATS;
-	else if (strcmp(path, "/proc/swaps") == 0)
-		type = LXC_TYPE_PROC_SWAPS;
-	else if (strcmp(path, "/proc/loadavg") == 0)
-		type = LXC_TYPE_PROC_LOADAVG;
-	if (type == -1)
+	type = proc_type(path);
+	if (type < 0)
 		return -ENOENT;
 
 	info = zalloc(sizeof(*info));
@@ -175,14 +399,14 @@ __lxcfs_fuse_ops int proc_open(const char *path, struct fuse_file_info *fi)
 
 	info->type = type;
 
-	info->buflen = get_procfile_size(path) + BUF_RESERVE_SIZE;
-
-	info->buf = zalloc(info->buflen);
-	if (!info->buf)
-		return -ENOMEM;
+	/* The buffer is allocated on the first read. */
+	info->buflen = file_size_hint(type, path);
 	/* set actual size to buffer size */
 	info->size = info->buflen;
 
+	if (opts && opts->page_cache_ttl)
+		proc_page_cache_open(info, fi);
+
 	fi->fh = PTR_TO_UINT64(move_ptr(info));
 	return 0;
 }
@@ -201,6 +425,11 @@ __lxcfs_fuse_ops int proc_access(const char *path, int mask)
 
 __lxcfs_fuse_ops int proc_release(const char *path, struct fuse_file_info *fi)
 {
+	struct file_info *f = INTTYPE_TO_PTR(fi->fh);
+
+	if (f && f->page_cache)
+		proc_page_cache_release(f);
+
 	do_release_file_info(fi);
 	return 0;
 }
@@ -441,28 +670,10 @@ static int proc_swaps_read(char *buf, size_t size, off_t offset,
 	return total_len;
 }
 
-static void get_blkio_io_value(char *str, unsigned major, unsigned minor,
-			       char *iotype, uint64_t *v)
+static inline void free_io_stats_function(char *(*io)[BLKIO_NR_FILES])
 {
-	char *eol;
-	char key[32];
-	size_t len;
-
-	memset(key, 0, 32);
-	snprintf(key, 32, "%u:%u %s", major, minor, iotype);
-
-	*v = 0;
-	len = strlen(key);
-	while (*str) {
-		if (startswith(str, key)) {
-			sscanf(str + len, "%lu", v);
-			return;
-		}
-		eol = strchr(str, '\n');
-		if (!eol)
-			return;
-		str = eol+1;
-	}
+	for (int i = 0; i < BLKIO_NR_FILES; i++)
+		free((*io)[i]);
 }
 
 struct lxcfs_diskstats {
@@ -489,18 +700,14 @@ struct lxcfs_diskstats {
 static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 			       struct fuse_file_info *fi)
 {
-	__do_free char *cg = NULL, *io_serviced_str = NULL,
-		       *io_merged_str = NULL, *io_service_bytes_str = NULL,
-		       *io_wait_time_str = NULL, *io_service_time_str = NULL,
-		       *line = NULL;
+	__do_free char *cg = NULL, *line = NULL;
+	call_cleaner(free_io_stats) char *io[BLKIO_NR_FILES] = {};
 	__do_free void *fopen_cache = NULL;
 	__do_fclose FILE *f = NULL;
+	call_cleaner(free_blkio_devs) struct hash_table *devs = NULL;
 	struct fuse_context *fc = fuse_get_context();
 	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
 	struct lxcfs_diskstats stats = {};
-	/* helper fields */
-	uint64_t read_service_time, write_service_time, discard_service_time, read_wait_time,
-	    write_wait_time, discard_wait_time;
 	char *cache = d->buf;
 	size_t cache_size = d->buflen;
 	size_t linelen = 0, total_len = 0;
@@ -527,40 +734,22 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 	if (initpid <= 1 || is_shared_pidns(initpid))
 		initpid = fc->pid;
 
-	cg = get_pid_cgroup(initpid, "blkio");
+	cg = get_pid_cgroup(initpid, io_controller());
 	if (!cg)
 		return read_file_fuse("/proc/diskstats", buf, size, d);
 	prune_init_slice(cg);
 
-	ret = cgroup_ops->get_io_serviced(cgroup_ops, cg, &io_serviced_str);
-	if (ret < 0) {
-		if (ret == -EOPNOTSUPP)
-			return read_file_fuse("/proc/diskstats", buf, size, d);
-	}
-
-	ret = cgroup_ops->get_io_merged(cgroup_ops, cg, &io_merged_str);
-	if (ret < 0) {
-		if (ret == -EOPNOTSUPP)
-			return read_file_fuse("/proc/diskstats", buf, size, d);
-	}
-
-	ret = cgroup_ops->get_io_service_bytes(cgroup_ops, cg, &io_service_bytes_str);
-	if (ret < 0) {
-		if (ret == -EOPNOTSUPP)
-			return read_file_fuse("/proc/diskstats", buf, size, d);
-	}
+	ret = cgroup_ops->get_io_stats(cgroup_ops, cg, io);
+	if (ret == -EOPNOTSUPP)
+		return read_file_fuse("/proc/diskstats", buf, size, d);
 
-	ret = cgroup_ops->get_io_wait_time(cgroup_ops, cg, &io_wait_time_str);
-	if (ret < 0) {
-		if (ret == -EOPNOTSUPP)
-			return read_file_fuse("/proc/diskstats", buf, size, d);
-	}
+	devs = blkio_devs_new();
+	if (!devs)
+		return 0;
 
-	ret = cgroup_ops->get_io_service_time(cgroup_ops, cg, &io_service_time_str);
-	if (ret < 0) {
-		if (ret == -EOPNOTSUPP)
-			return read_file_fuse("/proc/diskstats", buf, size, d);
-	}
+	for (i = 0; i < BLKIO_NR_FILES; i++)
+		if (blkio_parse_buf(devs, i, io[i]) < 0)
+			return 0;
 
 	f = fopen_cached("/proc/diskstats", "re", &fopen_cache);
 	if (!f)
@@ -569,46 +758,39 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 	while (getline(&line, &linelen, f) != -1) {
 		ssize_t l;
 		char lbuf[256];
+		struct blkio_dev *dev;
+		uint64_t (*v)[BLKIO_NR_OPS];
 
 		i = sscanf(line, "%u %u %71s", &stats.major, &stats.minor, stats.dev_name);
 		if (i != 3)
 			continue;
 
-		get_blkio_io_value(io_serviced_str, stats.major, stats.minor, "Read", &stats.read);
-		get_blkio_io_value(io_serviced_str, stats.major, stats.minor, "Write", &stats.write);
-		get_blkio_io_value(io_serviced_str, stats.major, stats.minor, "Discard", &stats.discard);
-
-		get_blkio_io_value(io_merged_str, stats.major, stats.minor, "Read", &stats.read_merged);
-		get_blkio_io_value(io_merged_str, stats.major, stats.minor, "Write", &stats.write_merged);
-		get_blkio_io_value(io_merged_str, stats.major, stats.minor, "Discard", &stats.discard_merged);
-
-		get_blkio_io_value(io_service_bytes_str, stats.major, stats.minor, "Read", &stats.read_sectors);
-		stats.read_sectors = stats.read_sectors / 512;
-		get_blkio_io_value(io_service_bytes_str, stats.major, stats.minor, "Write", &stats.write_sectors);
-		stats.write_sectors = stats.write_sectors / 512;
-		get_blkio_io_value(io_service_bytes_str, stats.major, stats.minor, "Discard", &stats.discard_sectors);
-		stats.discard_sectors = stats.discard_sectors / 512;
-
-		get_blkio_io_value(io_service_time_str, stats.major, stats.minor, "Read", &read_service_time);
-		read_service_time = read_service_time / 1000000;
-		get_blkio_io_value(io_wait_time_str, stats.major, stats.minor, "Read", &read_wait_time);
-		read_wait_time = read_wait_time / 1000000;
-		stats.read_ticks = read_service_time + read_wait_time;
-
-		get_blkio_io_value(io_service_time_str, stats.major, stats.minor, "Write", &write_service_time);
-		write_service_time = write_service_time / 1000000;
-		get_blkio_io_value(io_wait_time_str, stats.major, stats.minor, "Write", &write_wait_time);
-		write_wait_time = write_wait_time / 1000000;
-		stats.write_ticks = write_service_time + write_wait_time;
-
-		get_blkio_io_value(io_service_time_str, stats.major, stats.minor, "Discard", &discard_service_time);
-		discard_service_time = discard_service_time / 1000000;
-		get_blkio_io_value(io_wait_time_str, stats.major, stats.minor, "Discard", &discard_wait_time);
-		discard_wait_time = discard_wait_time / 1000000;
-		stats.discard_ticks = discard_service_time + discard_wait_time;
-
-		get_blkio_io_value(io_service_time_str, stats.major, stats.minor, "Total", &stats.total_ticks);
-		stats.total_ticks = stats.total_ticks / 1000000;
+		/* Devices the cgroup never touched are all zeroes. */
+		dev = blkio_dev_find(devs, stats.major, stats.minor);
+		if (!dev)
+			continue;
+		v = dev->v;
+
+		stats.read		= v[BLKIO_SERVICED][BLKIO_READ];
+		stats.write		= v[BLKIO_SERVICED][BLKIO_WRITE];
+		stats.discard		= v[BLKIO_SERVICED][BLKIO_DISCARD];
+
+		stats.read_merged	= v[BLKIO_MERGED][BLKIO_READ];
+		stats.write_merged	= v[BLKIO_MERGED][BLKIO_WRITE];
+		stats.discard_merged	= v[BLKIO_MERGED][BLKIO_DISCARD];
+
+		stats.read_sectors	= v[BLKIO_SERVICE_BYTES][BLKIO_READ] / 512;
+		stats.write_sectors	= v[BLKIO_SERVICE_BYTES][BLKIO_WRITE] / 512;
+		stats.discard_sectors	= v[BLKIO_SERVICE_BYTES][BLKIO_DISCARD] / 512;
+
+		stats.read_ticks	= v[BLKIO_SERVICE_TIME][BLKIO_READ] / 1000000 +
+					  v[BLKIO_WAIT_TIME][BLKIO_READ] / 1000000;
+		stats.write_ticks	= v[BLKIO_SERVICE_TIME][BLKIO_WRITE] / 1000000 +
+					  v[BLKIO_WAIT_TIME][BLKIO_WRITE] / 1000000;
+		stats.discard_ticks	= v[BLKIO_SERVICE_TIME][BLKIO_DISCARD] / 1000000 +
+					  v[BLKIO_WAIT_TIME][BLKIO_DISCARD] / 1000000;
+
+		stats.total_ticks	= v[BLKIO_SERVICE_TIME][BLKIO_TOTAL] / 1000000;
 
 		memset(lbuf, 0, 256);
 		if (stats.read || stats.write || stats.read_merged || stats.write_merged ||
@@ -640,7 +822,7 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 		if (l < 0)
 			return log_error(0, "Failed to write cache");
 		if (l >= cache_size)
-			return log_error(0, "Write to cache was truncated");
+			return -E2BIG;
 
 		cache += l;
 		cache_size -= l;
@@ -671,22 +853,15 @@ static inline void iwashere(void)
  * account as well. If someone has a clever solution for this please send a
  * patch!
  */
-static double get_reaper_busy(pid_t task)
+static double get_reaper_busy(const struct reaper_info *info)
 {
-	__do_free char *cgroup = NULL, *usage_str = NULL;
+	__do_free char *usage_str = NULL;
 	uint64_t usage = 0;
-	pid_t initpid;
 
-	initpid = lookup_initpid_in_store(task);
-	if (initpid <= 0)
+	if (!info->cpuacct_cg)
 		return 0;
 
-	cgroup = get_pid_cgroup(initpid, "cpuacct");
-	if (!cgroup)
-		return 0;
-	prune_init_slice(cgroup);
-
-	if (!cgroup_ops->get(cgroup_ops, "cpuacct", cgroup, "cpuacct.usage", &usage_str))
+	if (!cgroup_ops->get(cgroup_ops, "cpuacct", info->cpuacct_cg, "cpuacct.usage", &usage_str))
 		return 0;
 
 	if (safe_uint64(usage_str, &usage, 10) < 0)
@@ -695,106 +870,24 @@ static double get_reaper_busy(pid_t task)
 	return ((double)usage / 1000000000);
 }
 
-static uint64_t get_reaper_start_time(pid_t pid)
-{
-	__do_free void *fopen_cache = NULL;
-	__do_fclose FILE *f = NULL;
-	int ret;
-	uint64_t starttime;
-	char path[STRLITERALLEN("/proc/") + LXCFS_NUMSTRLEN64 +
-		  STRLITERALLEN("/stat") + 1];
-	pid_t qpid;
-
-	qpid = lookup_initpid_in_store(pid);
-	if (qpid <= 0)
-		return ret_errno(EINVAL);
-
-	ret = snprintf(path, sizeof(path), "/proc/%d/stat", qpid);
-	if (ret < 0 || (size_t)ret >= sizeof(path))
-		return ret_errno(EINVAL);
-
-	f = fopen_cached(path, "re", &fopen_cache);
-	if (!f)
-		return ret_errno(EINVAL);
-
-	/* Note that the *scanf() argument supression requires that length
-	 * modifiers such as "l" are omitted. Otherwise some compilers will yell
-	 * at us. It's like telling someone you're not married and then asking
-	 * if you can bring your wife to the party.
-	 */
-	ret = fscanf(f, "%*d "      /* (1)  pid         %d   */
-			"%*s "      /* (2)  comm        %s   */
-			"%*c "      /* (3)  state       %c   */
-			"%*d "      /* (4)  ppid        %d   */
-			"%*d "      /* (5)  pgrp        %d   */
-			"%*d "      /* (6)  session     %d   */
-			"%*d "      /* (7)  tty_nr      %d   */
-			"%*d "      /* (8)  tpgid       %d   */
-			"%*u "      /* (9)  flags       %u   */
-			"%*u "      /* (10) minflt      %lu  */
-			"%*u "      /* (11) cminflt     %lu  */
-			"%*u "      /* (12) majflt      %lu  */
-			"%*u "      /* (13) cmajflt     %lu  */
-			"%*u "      /* (14) utime       %lu  */
-			"%*u "      /* (15) stime       %lu  */
-			"%*d "      /* (16) cutime      %ld  */
-			"%*d "      /* (17) cstime      %ld  */
-			"%*d "      /* (18) priority    %ld  */
-			"%*d "      /* (19) nice        %ld  */
-			"%*d "      /* (20) num_threads %ld  */
-			"%*d "      /* (21) itrealvalue %ld  */
-			"%" PRIu64, /* (22) starttime   %llu */
-		     &starttime);
-	if (ret != 1)
-		return ret_errno(EINVAL);
-
-	return ret_set_errno(starttime, 0);
-}
-
-static double get_reaper_start_time_in_sec(pid_t pid)
-{
-	uint64_t clockticks, ticks_per_sec;
-	int64_t ret;
-	double res = 0;
-
-	clockticks = get_reaper_start_time(pid);
-	if (clockticks <= 0)
-		return log_debug(0, "Failed to retrieve start time of pid %d", pid);
-
-	ret = sysconf(_SC_CLK_TCK);
-	if (ret < 0)
-		return log_debug(0, "Failed to determine number of clock ticks in a second");
-
-	ticks_per_sec = (uint64_t)ret;
-	res = (double)clockticks / ticks_per_sec;
-	return res;
-}
-
-static double get_reaper_age(pid_t pid)
+static double get_reaper_age(const struct reaper_info *info)
 {
 	uint64_t uptime_ms;
-	double procstart, procage;
+	struct timespec spec;
+
+	if (!info->start_ms)
+		return 0;
 
 	/*
 	 * We need to substract the time the process has started since system
 	 * boot minus the time when the system has started to get the actual
 	 * reaper age.
 	 */
-	procstart = get_reaper_start_time_in_sec(pid);
-	procage = procstart;
-	if (procstart > 0) {
-		int ret;
-		struct timespec spec;
-
-		ret = clock_gettime(CLOCK_BOOTTIME, &spec);
-		if (ret < 0)
-			return 0;
-
-		uptime_ms = (spec.tv_sec * 1000) + (spec.tv_nsec * 1e-6);
-		procage = (uptime_ms - (procstart * 1000)) / 1000;
-	}
+	if (clock_gettime(CLOCK_BOOTTIME, &spec) < 0)
+		return 0;
 
-	return procage;
+	uptime_ms = (spec.tv_sec * 1000) + (spec.tv_nsec / 1000000);
+	return ((double)uptime_ms - (double)info->start_ms) / 1000;
 }
 
 /*
@@ -810,6 +903,7 @@ static int proc_uptime_read(char *buf, size_t size, off_t offset,
 	char *cache = d->buf;
 	ssize_t total_len = 0, ret = 0;
 	double busytime, idletime, reaperage;
+	struct reaper_info info;
 
 #if RELOADTEST
 	iwashere();
@@ -831,13 +925,15 @@ static int proc_uptime_read(char *buf, size_t size, off_t offset,
 		return total_len;
 	}
 
-	reaperage = get_reaper_age(fc->pid);
+	lookup_reaper_info(fc->pid, &info);
+	reaperage = get_reaper_age(&info);
 	/*
 	 * To understand why this is done, please read the comment to the
 	 * get_reaper_busy() function.
 	 */
 	idletime = reaperage;
-	busytime = get_reaper_busy(fc->pid);
+	busytime = get_reaper_busy(&info);
+	free_disarm(info.cpuacct_cg);
 	if (reaperage >= busytime)
 		idletime = reaperage - busytime;
 
@@ -862,6 +958,7 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 	__do_free char *cg = NULL, *cpuset = NULL, *line = NULL;
 	__do_free void *fopen_cache = NULL;
 	__do_free struct cpuacct_usage *cg_cpu_usage = NULL;
+	__do_free struct cpuset_bitmap *cpus = NULL;
 	__do_fclose FILE *f = NULL;
 	struct fuse_context *fc = fuse_get_context();
 	struct lxcfs_opts *opts = (struct lxcfs_opts *)fc->private_data;
@@ -869,12 +966,9 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 	size_t linelen = 0, total_len = 0;
 	int curcpu = -1; /* cpu numbering starts at 0 */
 	int physcpu = 0;
-	uint64_t user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0,
-		 softirq = 0, steal = 0, guest = 0, guest_nice = 0;
-	uint64_t user_sum = 0, nice_sum = 0, system_sum = 0, idle_sum = 0,
-		 iowait_sum = 0, irq_sum = 0, softirq_sum = 0, steal_sum = 0,
-		 guest_sum = 0, guest_nice_sum = 0;
-	char cpuall[CPUALL_MAX_SIZE];
+	uint64_t counters[PROC_STAT_COUNTERS], sums[PROC_STAT_COUNTERS] = {};
+	char lbuf[PROC_STAT_LINE_MAX];
+	ssize_t linelen_read;
 	/* reserve for cpu all */
 	char *cache = d->buf + CPUALL_MAX_SIZE;
 	size_t cache_size = d->buflen - CPUALL_MAX_SIZE;
@@ -917,6 +1011,10 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 	if (!cpuset)
 		return 0;
 
+	cpus = cpuset_bitmap_parse(cpuset);
+	if (!cpus)
+		return 0;
+
 	f = fopen_cached("/proc/stat", "re", &fopen_cache);
 	if (!f)
 		return 0;
@@ -932,32 +1030,38 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 	 */
 	if (read_cpuacct_usage_all(cg, cpuset, &cg_cpu_usage, &cg_cpu_usage_size) == 0) {
 		if (cgroup_ops->can_use_cpuview(cgroup_ops) && opts && opts->use_cfs) {
-			total_len = cpuview_proc_stat(cg, cpuset, cg_cpu_usage,
-						      cg_cpu_usage_size, f,
-						      d->buf, d->buflen);
+			int ret;
+
+			ret = cpuview_proc_stat(cg, cpuset, cg_cpu_usage,
+						cg_cpu_usage_size, f,
+						d->buf, d->buflen);
+			if (ret < 0)
+				return ret;
+
+			total_len = ret;
 			goto out;
 		}
 	} else {
 		lxcfs_v("proc_stat_read failed to read from cpuacct, falling back to the host's /proc/stat");
 	}
 
-	while (getline(&line, &linelen, f) != -1) {
+	while ((linelen_read = getline(&line, &linelen, f)) != -1) {
 		ssize_t l;
-		char cpu_char[10]; /* That's a lot of cores */
 		char *c;
 		uint64_t all_used, cg_used, new_idle;
 		int ret;
 
 		if (strlen(line) == 0)
 			continue;
-		if (sscanf(line, "cpu%9[^ ]", cpu_char) != 1) {
+
+		ret = proc_stat_parse_cpu(line, &physcpu, counters);
+		if (ret < 0) {
 			/* not a ^cpuN line containing a number N, just print it */
-			l = snprintf(cache, cache_size, "%s", line);
-			if (l < 0)
-				return log_error(0, "Failed to write cache");
+			l = linelen_read;
 			if (l >= cache_size)
-				return log_error(0, "Write to cache was truncated");
+				return -E2BIG;
 
+			memcpy(cache, line, l + 1);
 			cache += l;
 			cache_size -= l;
 			total_len += l;
@@ -965,26 +1069,12 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 			continue;
 		}
 
-		if (sscanf(cpu_char, "%d", &physcpu) != 1)
-			continue;
-
-		if (!cpu_in_cpuset(physcpu, cpuset))
+		if (!cpuset_bitmap_test(cpus, physcpu))
 			continue;
 
 		curcpu++;
 
-		ret = sscanf(line, "%*s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-			   &user,
-			   &nice,
-			   &system,
-			   &idle,
-			   &iowait,
-			   &irq,
-			   &softirq,
-			   &steal,
-			   &guest,
-			   &guest_nice);
-		if (ret != 10 || !cg_cpu_usage) {
+		if (ret != PROC_STAT_COUNTERS || !cg_cpu_usage) {
 			c = strchr(line, ' ');
 			if (!c)
 				continue;
@@ -993,13 +1083,13 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 			if (l < 0)
 				return log_error(0, "Failed to write cache");
 			if (l >= cache_size)
-				return log_error(0, "Write to cache was truncated");
+				return -E2BIG;
 
 			cache += l;
 			cache_size -= l;
 			total_len += l;
 
-			if (ret != 10)
+			if (ret != PROC_STAT_COUNTERS)
 				continue;
 		}
 
@@ -1007,67 +1097,46 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 			if (physcpu >= cg_cpu_usage_size)
 				break;
 
-			all_used = user + nice + system + iowait + irq + softirq + steal + guest + guest_nice;
+			all_used = proc_stat_busy(counters);
 			cg_used = cg_cpu_usage[physcpu].user + cg_cpu_usage[physcpu].system;
 
 			if (all_used >= cg_used) {
-				new_idle = idle + (all_used - cg_used);
+				new_idle = counters[PROC_STAT_IDLE] + (all_used - cg_used);
 
 			} else {
 				lxcfs_error("cpu%d from %s has unexpected cpu time: %" PRIu64 " in /proc/stat, %" PRIu64 " in cpuacct.usage_all; unable to determine idle time",
 					    curcpu, cg, all_used, cg_used);
-				new_idle = idle;
+				new_idle = counters[PROC_STAT_IDLE];
 			}
 
-			l = snprintf(cache, cache_size,
-				     "cpu%d %" PRIu64 " 0 %" PRIu64 " %" PRIu64 " 0 0 0 0 0 0\n",
-				     curcpu, cg_cpu_usage[physcpu].user,
-				     cg_cpu_usage[physcpu].system, new_idle);
-			if (l < 0)
-				return log_error(0, "Failed to write cache");
+			memset(counters, 0, sizeof(counters));
+			counters[PROC_STAT_USER]	= cg_cpu_usage[physcpu].user;
+			counters[PROC_STAT_SYSTEM]	= cg_cpu_usage[physcpu].system;
+			counters[PROC_STAT_IDLE]	= new_idle;
+			l = proc_stat_fmt_cpu(lbuf, curcpu, counters);
 			if (l >= cache_size)
-				return log_error(0, "Write to cache was truncated");
+				return -E2BIG;
 
+			memcpy(cache, lbuf, l + 1);
 			cache += l;
 			cache_size -= l;
 			total_len += l;
-
-			user_sum += cg_cpu_usage[physcpu].user;
-			system_sum += cg_cpu_usage[physcpu].system;
-			idle_sum += new_idle;
-		} else {
-			user_sum += user;
-			nice_sum += nice;
-			system_sum += system;
-			idle_sum += idle;
-			iowait_sum += iowait;
-			irq_sum += irq;
-			softirq_sum += softirq;
-			steal_sum += steal;
-			guest_sum += guest;
-			guest_nice_sum += guest_nice;
 		}
+
+		for (int i = 0; i < PROC_STAT_COUNTERS; i++)
+			sums[i] += counters[i];
 	}
 
 	cache = d->buf;
 
-	int cpuall_len = snprintf(cpuall, CPUALL_MAX_SIZE, "cpu  %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu\n",
-			user_sum,
-			nice_sum,
-			system_sum,
-			idle_sum,
-			iowait_sum,
-			irq_sum,
-			softirq_sum,
-			steal_sum,
-			guest_sum,
-			guest_nice_sum);
-	if (cpuall_len > 0 && cpuall_len < CPUALL_MAX_SIZE) {
-		memcpy(cache, cpuall, cpuall_len);
+	/* CPUALL_MAX_SIZE is reserved at the start of the buffer. */
+	size_t cpuall_len = proc_stat_fmt_cpu(lbuf, -1, sums);
+	if (cpuall_len < CPUALL_MAX_SIZE) {
+		memcpy(cache, lbuf, cpuall_len);
 		cache += cpuall_len;
 	} else {
 		/* shouldn't happen */
-		lxcfs_error("proc_stat_read copy cpuall failed, cpuall_len=%d", cpuall_len);
+		lxcfs_error("proc_stat_read copy cpuall failed, cpuall_len=%zu", cpuall_len);
 		cpuall_len = 0;
 	}
 
@@ -1085,68 +1154,85 @@ out:
 }
 
 /* Note that "memory.stat" in cgroup2 is hierarchical by default. */
+static const struct kv_key memory_stat_legacy_keys[] = {
+	KV_KEY("hierarchical_memory_limit",	struct memory_stat, hierarchical_memory_limit),
+	KV_KEY("hierarchical_memsw_limit",	struct memory_stat, hierarchical_memsw_limit),
+	KV_KEY("total_cache",			struct memory_stat, total_cache),
+	KV_KEY("total_rss",			struct memory_stat, total_rss),
+	KV_KEY("total_rss_huge",		struct memory_stat, total_rss_huge),
+	KV_KEY("total_shmem",			struct memory_stat, total_shmem),
+	KV_KEY("total_mapped_file",		struct memory_stat, total_mapped_file),
+	KV_KEY("total_dirty",			struct memory_stat, total_dirty),
+	KV_KEY("total_writeback",		struct memory_stat, total_writeback),
+	KV_KEY("total_swap",			struct memory_stat, total_swap),
+	KV_KEY("total_pgpgin",			struct memory_stat, total_pgpgin),
+	KV_KEY("total_pgpgout",			struct memory_stat, total_pgpgout),
+	KV_KEY("total_pgfault",			struct memory_stat, total_pgfault),
+	KV_KEY("total_pgmajfault",		struct memory_stat, total_pgmajfault),
+	KV_KEY("total_inactive_anon",		struct memory_stat, total_inactive_anon),
+	KV_KEY("total_active_anon",		struct memory_stat, total_active_anon),
+	KV_KEY("total_inactive_file",		struct memory_stat, total_inactive_file),
+	KV_KEY("total_active_file",		struct memory_stat, total_active_file),
+	KV_KEY("total_unevictable",		struct memory_stat, total_unevictable),
+};
+
+static const struct kv_key memory_stat_unified_keys[] = {
+	KV_KEY("file",				struct memory_stat, total_cache),
+	KV_KEY("shmem",				struct memory_stat, total_shmem),
+	KV_KEY("file_mapped",			struct memory_stat, total_mapped_file),
+	KV_KEY("pgfault",			struct memory_stat, total_pgfault),
+	KV_KEY("pgmajfault",			struct memory_stat, total_pgmajfault),
+	KV_KEY("inactive_anon",			struct memory_stat, total_inactive_anon),
+	KV_KEY("active_anon",			struct memory_stat, total_active_anon),
+	KV_KEY("inactive_file",			struct memory_stat, total_inactive_file),
+	KV_KEY("active_file",			struct memory_stat, total_active_file),
+	KV_KEY("unevictable",			struct memory_stat, total_unevictable),
+};
+
+static const struct kv_table memory_stat_legacy = KV_TABLE(memory_stat_legacy_keys);
+static const struct kv_table memory_stat_unified = KV_TABLE(memory_stat_unified_keys);
+
 static bool cgroup_parse_memory_stat(const char *cgroup, struct memory_stat *mstat)
 {
 	__do_close int fd = -EBADF;
-	__do_fclose FILE *f = NULL;
-	__do_free char *line = NULL;
-	__do_free void *fdopen_cache = NULL;
-	bool unified;
-	size_t len = 0;
-	ssize_t linelen;
+	const struct kv_table *table;
 
 	fd = cgroup_ops->get_memory_stats_fd(cgroup_ops, cgroup);
 	if (fd < 0)
 		return false;
 
-	f = fdopen_cached(fd, "re", &fdopen_cache);
-	if (!f)
-		return false;
+	if (pure_unified_layout(cgroup_ops))
+		table = &memory_stat_unified;
+	else
+		table = &memory_stat_legacy;
 
-	unified = pure_unified_layout(cgroup_ops);
-	while ((linelen = getline(&line, &len, f)) != -1) {
-		if (!unified && startswith(line, "hierarchical_memory_limit")) {
-			sscanf(line, "hierarchical_memory_limit %" PRIu64, &(mstat->hierarchical_memory_limit));
-		} else if (!unified && startswith(line, "hierarchical_memsw_limit")) {
-			sscanf(line, "hierarchical_memsw_limit %" PRIu64, &(mstat->hierarchical_memsw_limit));
-		} else if (startswith(line, unified ? "file" :"total_cache")) {
-			sscanf(line, unified ? "file %" PRIu64 : "total_cache %" PRIu64, &(mstat->total_cache));
-		} else if (!unified && startswith(line, "total_rss")) {
-			sscanf(line, "total_rss %" PRIu64, &(mstat->total_rss));
-		} else if (!unified && startswith(line, "total_rss_huge")) {
-			sscanf(line, "total_rss_huge %" PRIu64, &(mstat->total_rss_huge));
-		} else if (startswith(line, unified ? "shmem" : "total_shmem")) {
-			sscanf(line, unified ? "shmem %" PRIu64 : "total_shmem %" PRIu64, &(mstat->total_shmem));
-		} else if (startswith(line, unified ? "file_mapped" : "total_mapped_file")) {
-			sscanf(line, unified ? "file_mapped %" PRIu64 : "total_mapped_file %" PRIu64, &(mstat->total_mapped_file));
-		} else if (!unified && startswith(line, "total_dirty")) {
-			sscanf(line, "total_dirty %" PRIu64, &(mstat->total_dirty));
-		} else if (!unified && startswith(line, "total_writeback")) {
-			sscanf(line, "total_writeback %" PRIu64, &(mstat->total_writeback));
-		} else if (!unified && startswith(line, "total_swap")) {
-			sscanf(line, "total_swap %" PRIu64, &(mstat->total_swap));
-		} else if (!unified && startswith(line, "total_pgpgin")) {
-			sscanf(line, "total_pgpgin %" PRIu64, &(mstat->total_pgpgin));
-		} else if (!unified && startswith(line, "total_pgpgout")) {
-			sscanf(line, "total_pgpgout %" PRIu64, &(mstat->total_pgpgout));
-		} else if (startswith(line, unified ? "pgfault" : "total_pgfault")) {
-			sscanf(line, unified ? "pgfault %" PRIu64 : "total_pgfault %" PRIu64, &(mstat->total_pgfault));
-		} else if (startswith(line, unified ? "pgmajfault" : "total_pgmajfault")) {
-			sscanf(line, unified ? "pgmajfault %" PRIu64 : "total_pgmajfault %" PRIu64, &(mstat->total_pgmajfault));
-		} else if (startswith(line, unified ? "inactive_anon" : "total_inactive_anon")) {
-			sscanf(line, unified ? "inactive_anon %" PRIu64 : "total_inactive_anon %" PRIu64, &(mstat->total_inactive_anon));
-		} else if (startswith(line, unified ? "active_anon" : "total_active_anon")) {
-			sscanf(line, unified ? "active_anon %" PRIu64 : "total_active_anon %" PRIu64, &(mstat->total_active_anon));
-		} else if (startswith(line, unified ? "inactive_file" : "total_inactive_file")) {
-			sscanf(line, unified ? "inactive_file %" PRIu64 : "total_inactive_file %" PRIu64, &(mstat->total_inactive_file));
-		} else if (startswith(line, unified ? "active_file" : "total_active_file")) {
-			sscanf(line, unified ? "active_file %" PRIu64 : "total_active_file %" PRIu64, &(mstat->total_active_file));
-		} else if (startswith(line, unified ? "unevictable" : "total_unevictable")) {
-			sscanf(line, unified ? "unevictable %" PRIu64 : "total_unevictable %" PRIu64, &(mstat->total_unevictable));
-		}
-	}
+	return kv_parse_fd(table, fd, mstat) >= 0;
+}
 
-	return true;
+/* Render "<key><value> kB" into @lbuf, @key includes the padding. */
+static char *__meminfo_line(char *lbuf, const char *key, size_t len, uint64_t v)
+{
+	char *p = lbuf;
+
+	memcpy(p, key, len);
+	p = fmt_u64_width(p + len, v, 8);
+	p = fmt_str(p, " kB\n");
+	*p = '\0';
+
+	return lbuf;
+}
+#define meminfo_line(lbuf, key, v) __meminfo_line(lbuf, key, STRLITERALLEN(key), v)
+
+/* Parse the number following the key of a /proc/meminfo line. */
+static uint64_t meminfo_value(const char *s)
+{
+	uint64_t v = 0;
+
+	while (*s == ' ')
+		s++;
+	kv_parse_u64(s, SIZE_MAX, &v);
+
+	return v;
 }
 
 static int proc_meminfo_read(char *buf, size_t size, off_t offset,
@@ -1243,27 +1329,23 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 		ssize_t l;
 		char *printme, lbuf[100];
 
-		memset(lbuf, 0, 100);
 		if (startswith(line, "MemTotal:")) {
-			sscanf(line+sizeof("MemTotal:")-1, "%" PRIu64, &hosttotal);
+			hosttotal = meminfo_value(line + STRLITERALLEN("MemTotal:"));
 			if (memlimit == 0)
 				memlimit = hosttotal;
 
 			if (hosttotal < memlimit)
 				memlimit = hosttotal;
-			snprintf(lbuf, 100, "MemTotal:       %8" PRIu64 " kB\n", memlimit);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "MemTotal:       ", memlimit);
 		} else if (startswith(line, "MemFree:")) {
-			snprintf(lbuf, 100, "MemFree:        %8" PRIu64 " kB\n", memlimit - memusage);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "MemFree:        ", memlimit - memusage);
 		} else if (startswith(line, "MemAvailable:")) {
-			snprintf(lbuf, 100, "MemAvailable:   %8" PRIu64 " kB\n", memlimit - memusage + mstat.total_cache / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "MemAvailable:   ", memlimit - memusage + mstat.total_cache / 1024);
 		} else if (startswith(line, "SwapTotal:")) {
 			if (wants_swap) {
-				uint64_t hostswtotal = 0;
+				uint64_t hostswtotal;
 
-				sscanf(line + STRLITERALLEN("SwapTotal:"), "%" PRIu64, &hostswtotal);
+				hostswtotal = meminfo_value(line + STRLITERALLEN("SwapTotal:"));
 
 				/* The total amount of swap is always reported to be the
 				   lesser of the RAM+SWAP limit or the SWAP device size.
@@ -1281,108 +1363,64 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 				}
 			}
 
-			snprintf(lbuf, 100, "SwapTotal:      %8" PRIu64 " kB\n", swtotal);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "SwapTotal:      ", swtotal);
 		} else if (startswith(line, "SwapFree:")) {
 			if (wants_swap) {
 				swfree = swtotal - swusage;
 			}
 
-			snprintf(lbuf, 100, "SwapFree:       %8" PRIu64 " kB\n", swfree);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "SwapFree:       ", swfree);
 		} else if (startswith(line, "Slab:")) {
-			snprintf(lbuf, 100, "Slab:        %8" PRIu64 " kB\n", (uint64_t)0);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Slab:        ", 0);
 		} else if (startswith(line, "Buffers:")) {
-			snprintf(lbuf, 100, "Buffers:        %8" PRIu64 " kB\n", (uint64_t)0);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Buffers:        ", 0);
 		} else if (startswith(line, "Cached:")) {
-			snprintf(lbuf, 100, "Cached:         %8" PRIu64 " kB\n",
-				 mstat.total_cache / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Cached:         ", mstat.total_cache / 1024);
 		} else if (startswith(line, "SwapCached:")) {
-			snprintf(lbuf, 100, "SwapCached:     %8" PRIu64 " kB\n", (uint64_t)0);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "SwapCached:     ", 0);
 		} else if (startswith(line, "Active:")) {
-			snprintf(lbuf, 100, "Active:         %8" PRIu64 " kB\n",
-				 (mstat.total_active_anon +
-				  mstat.total_active_file) /
-				     1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Active:         ", (mstat.total_active_anon + mstat.total_active_file) / 1024);
 		} else if (startswith(line, "Inactive:")) {
-			snprintf(lbuf, 100, "Inactive:       %8" PRIu64 " kB\n",
-				 (mstat.total_inactive_anon +
-				  mstat.total_inactive_file) /
-				     1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Inactive:       ", (mstat.total_inactive_anon + mstat.total_inactive_file) / 1024);
 		} else if (startswith(line, "Active(anon):")) {
-			snprintf(lbuf, 100, "Active(anon):   %8" PRIu64 " kB\n",
-				 mstat.total_active_anon / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Active(anon):   ", mstat.total_active_anon / 1024);
 		} else if (startswith(line, "Inactive(anon):")) {
-			snprintf(lbuf, 100, "Inactive(anon): %8" PRIu64 " kB\n",
-				 mstat.total_inactive_anon / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Inactive(anon): ", mstat.total_inactive_anon / 1024);
 		} else if (startswith(line, "Active(file):")) {
-			snprintf(lbuf, 100, "Active(file):   %8" PRIu64 " kB\n",
-				 mstat.total_active_file / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Active(file):   ", mstat.total_active_file / 1024);
 		} else if (startswith(line, "Inactive(file):")) {
-			snprintf(lbuf, 100, "Inactive(file): %8" PRIu64 " kB\n",
-				 mstat.total_inactive_file / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Inactive(file): ", mstat.total_inactive_file / 1024);
 		} else if (startswith(line, "Unevictable:")) {
-			snprintf(lbuf, 100, "Unevictable:    %8" PRIu64 " kB\n",
-				 mstat.total_unevictable / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Unevictable:    ", mstat.total_unevictable / 1024);
  		} else if (startswith(line, "Dirty:")) {
-			snprintf(lbuf, 100, "Dirty:          %8" PRIu64 " kB\n",
-				 mstat.total_dirty / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Dirty:          ", mstat.total_dirty / 1024);
  		} else if (startswith(line, "Writeback:")) {
-			snprintf(lbuf, 100, "Writeback:      %8" PRIu64 " kB\n",
-				 mstat.total_writeback / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Writeback:      ", mstat.total_writeback / 1024);
  		} else if (startswith(line, "AnonPages:")) {
-			snprintf(lbuf, 100, "AnonPages:      %8" PRIu64 " kB\n",
-				 (mstat.total_active_anon +
-				  mstat.total_inactive_anon - mstat.total_shmem) /
-				     1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "AnonPages:      ", (mstat.total_active_anon + mstat.total_inactive_anon - mstat.total_shmem) / 1024);
  		} else if (startswith(line, "Mapped:")) {
-			snprintf(lbuf, 100, "Mapped:         %8" PRIu64 " kB\n",
-				 mstat.total_mapped_file / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Mapped:         ", mstat.total_mapped_file / 1024);
 		} else if (startswith(line, "SReclaimable:")) {
-			snprintf(lbuf, 100, "SReclaimable:   %8" PRIu64 " kB\n", (uint64_t)0);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "SReclaimable:   ", 0);
 		} else if (startswith(line, "SUnreclaim:")) {
-			snprintf(lbuf, 100, "SUnreclaim:     %8" PRIu64 " kB\n", (uint64_t)0);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "SUnreclaim:     ", 0);
 		} else if (startswith(line, "Shmem:")) {
-			snprintf(lbuf, 100, "Shmem:          %8" PRIu64 " kB\n",
-				 mstat.total_shmem / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "Shmem:          ", mstat.total_shmem / 1024);
 		} else if (startswith(line, "ShmemHugePages:")) {
-			snprintf(lbuf, 100, "ShmemHugePages: %8" PRIu64 " kB\n", (uint64_t)0);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "ShmemHugePages: ", 0);
 		} else if (startswith(line, "ShmemPmdMapped:")) {
-			snprintf(lbuf, 100, "ShmemPmdMapped: %8" PRIu64 " kB\n", (uint64_t)0);
- 			printme = lbuf;
+			printme = meminfo_line(lbuf, "ShmemPmdMapped: ", 0);
  		} else if (startswith(line, "AnonHugePages:")) {
-			snprintf(lbuf, 100, "AnonHugePages:  %8" PRIu64 " kB\n",
-				 mstat.total_rss_huge / 1024);
-			printme = lbuf;
+			printme = meminfo_line(lbuf, "AnonHugePages:  ", mstat.total_rss_huge / 1024);
  		} else {
  			printme = line;
 		}
 
-		l = snprintf(cache, cache_size, "%s", printme);
-		if (l < 0)
-			return log_error(0, "Failed to write cache");
+		l = strlen(printme);
 		if (l >= cache_size)
-			return log_error(0, "Write to cache was truncated");
+			return -E2BIG;
 
+		memcpy(cache, printme, l + 1);
 		cache += l;
 		cache_size -= l;
 		total_len += l;
@@ -1397,21 +1435,202 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 	return total_len;
 }
 
-__lxcfs_fuse_ops int proc_read(const char *path, char *buf, size_t size,
-			       off_t offset, struct fuse_file_info *fi)
+/*
+ * Make sure @d has a private buffer to render into, dropping any reference
+ * to a shared render cache entry left behind by a previous read.
+ */
+static int proc_private_buf(struct file_info *d)
+{
+	if (d->shared)
+		file_info_buf_free(d);
+
+	return file_info_buf_alloc(d);
+}
+
+/*
+ * Serve a read of a handle that may be backed by the kernel's page cache.
+ * The kernel reads pages in whatever order and through whatever handle it
+ * likes, so every read, not just the first one, is served from the single
+ * snapshot of the current owner window.
+ */
+static int proc_page_cache_read(int (*render)(char *, size_t, off_t, struct fuse_file_info *),
+				char *buf, size_t size, off_t offset,
+				struct fuse_file_info *fi)
+{
+	struct lxcfs_opts *opts = (struct lxcfs_opts *)fuse_get_context()->private_data;
+	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
+	struct proc_page_cache *pc = &proc_page_cache[d->type];
+	unsigned int ttl = opts ? opts->page_cache_ttl : 0;
+	struct proc_cache_entry *entry;
+	size_t total_len;
+
+	entry = proc_page_cache_snap(pc);
+	if (!entry) {
+		__do_free char *cg = NULL;
+		struct proc_cache_entry *new;
+		uint64_t now;
+		int ret;
+
+		cg = proc_cache_cgroup(d->type);
+		if (!cg) {
+			/* Serve the handle privately from now on. */
+			proc_page_cache_release(d);
+			d->page_cache = false;
+
+			ret = proc_private_buf(d);
+			if (ret < 0)
+				return ret;
+
+			return render(buf, size, offset, fi);
+		}
+
+		ret = proc_private_buf(d);
+		if (ret < 0)
+			return ret;
+
+		ret = render(buf, size, 0, fi);
+		if (ret < 0)
+			return ret;
+
+		new = proc_cache_publish(d->type, cg, d->buf, d->size);
+		if (!new)
+			return -ENOMEM;
+		/* The entry owns the buffer now. */
+		d->shared = new;
+
+		now = proc_cache_now();
+		pthread_mutex_lock(&pc->lock);
+		if (!pc->snap) {
+			pc->snap = proc_cache_ref(new);
+			pc->expires = now + ttl;
+		}
+		/* Somebody else was faster, stick to their snapshot. */
+		entry = proc_cache_ref(pc->snap);
+		pthread_mutex_unlock(&pc->lock);
+	}
+
+	if (d->shared != entry) {
+		file_info_buf_free(d);
+
+		d->shared = entry;
+		d->buf = entry->buf;
+		d->size = entry->size;
+		d->cached = 1;
+	} else {
+		proc_cache_put(entry);
+	}
+
+	if ((size_t)offset >= d->size)
+		return 0;
+
+	total_len = d->size - offset;
+	if (total_len > size)
+		total_len = size;
+	memcpy(buf, d->buf + offset, total_len);
+
+	return total_len;
+}
+
+/*
+ * Serve a read of a per-cgroup proc file from the shared render cache if an
+ * entry younger than the configured TTL exists, or from a render for the
+ * same cgroup that is running right now. Otherwise run @render and publish
+ * its output so other readers in the same cgroup can reuse it. On success
+ * d->buf references the shared entry instead of a private copy. With a TTL
+ * of 0 nothing is published but readers still share renders in flight.
+ */
+static int proc_read_shared(int (*render)(char *, size_t, off_t, struct fuse_file_info *),
+			    char *buf, size_t size, off_t offset,
+			    struct fuse_file_info *fi)
+{
+	__do_free char *cg = NULL;
+	struct lxcfs_opts *opts = (struct lxcfs_opts *)fuse_get_context()->private_data;
+	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
+	struct proc_cache_flight *flight = NULL;
+	struct proc_cache_entry *entry;
+	unsigned int ttl = opts ? opts->cache_ttl : 0;
+	size_t total_len;
+	int ret;
+
+	if (d->page_cache)
+		return proc_page_cache_read(render, buf, size, offset, fi);
+
+	/* Subsequent chunks come from whatever the first read left in d->buf. */
+	if (offset)
+		return render(buf, size, offset, fi);
+
+	cg = proc_cache_cgroup(d->type);
+	if (!cg) {
+		ret = proc_private_buf(d);
+		if (ret < 0)
+			return ret;
+
+		return render(buf, size, offset, fi);
+	}
+
+	entry = proc_cache_get(d->type, cg, ttl);
+	/* Readers arriving while a render is running share its result. */
+	if (!entry)
+		entry = proc_cache_join(d->type, cg, &flight);
+	if (entry) {
+		file_info_buf_free(d);
+
+		d->shared = entry;
+		d->buf = entry->buf;
+		d->size = entry->size;
+		d->cached = 1;
+
+		total_len = entry->size > size ? size : entry->size;
+		memcpy(buf, entry->buf, total_len);
+		return total_len;
+	}
+
+	ret = proc_private_buf(d);
+	if (ret < 0) {
+		proc_cache_land(flight, NULL);
+		return ret;
+	}
+
+	ret = render(buf, size, offset, fi);
+	if (ret <= 0) {
+		/* Waiters render on their own. */
+		proc_cache_land(flight, NULL);
+		return ret;
+	}
+
+	if (ttl)
+		d->shared = proc_cache_publish(d->type, cg, d->buf, d->size);
+	else if (flight)
+		d->shared = proc_cache_wrap(d->type, cg, d->buf, d->size);
+	proc_cache_land(flight, d->shared);
+	return ret;
+}
+
+static int do_proc_read(char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi)
 {
 	struct file_info *f = INTTYPE_TO_PTR(fi->fh);
 
+	/*
+	 * Everything below renders into f->buf, make sure there is one and
+	 * that it's ours when the render cache isn't in charge.
+	 */
+	if (!offset && (!f->buf || (f->shared && !liblxcfs_functional())) &&
+	    proc_private_buf(f) < 0)
+		return -ENOMEM;
+
 	switch (f->type) {
 	case LXC_TYPE_PROC_MEMINFO:
 		if (liblxcfs_functional())
-			return proc_meminfo_read(buf, size, offset, fi);
+			return proc_read_shared(proc_meminfo_read, buf, size,
+						offset, fi);
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_MEMINFO_PATH,
 						  buf, size, offset, f);
 	case LXC_TYPE_PROC_CPUINFO:
 		if (liblxcfs_functional())
-			return proc_cpuinfo_read(buf, size, offset, fi);
+			return proc_read_shared(proc_cpuinfo_read, buf, size,
+						offset, fi);
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_CPUINFO_PATH,
 						  buf, size, offset, f);
@@ -1423,19 +1642,22 @@ __lxcfs_fuse_ops int proc_read(const char *path, char *buf, size_t size,
 						  buf, size, offset, f);
 	case LXC_TYPE_PROC_STAT:
 		if (liblxcfs_functional())
-			return proc_stat_read(buf, size, offset, fi);
+			return proc_read_shared(proc_stat_read, buf, size,
+						offset, fi);
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_STAT_PATH, buf,
 						  size, offset, f);
 	case LXC_TYPE_PROC_DISKSTATS:
 		if (liblxcfs_functional())
-			return proc_diskstats_read(buf, size, offset, fi);
+			return proc_read_shared(proc_diskstats_read, buf, size,
+						offset, fi);
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_DISKSTATS_PATH,
 						  buf, size, offset, f);
 	case LXC_TYPE_PROC_SWAPS:
 		if (liblxcfs_functional())
-			return proc_swaps_read(buf, size, offset, fi);
+			return proc_read_shared(proc_swaps_read, buf, size,
+						offset, fi);
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_SWAPS_PATH, buf,
 						  size, offset, f);
@@ -1449,3 +1671,122 @@ __lxcfs_fuse_ops int proc_read(const char *path, char *buf, size_t size,
 
 	return -EINVAL;
 }
+
+__lxcfs_fuse_ops int proc_read(const char *path, char *buf, size_t size,
+			       off_t offset, struct fuse_file_info *fi)
+{
+	struct file_info *f = INTTYPE_TO_PTR(fi->fh);
+	int ret;
+
+	/* Renderers return -E2BIG when the buffer sized at open was too small. */
+	do {
+		ret = do_proc_read(buf, size, offset, fi);
+	} while (ret == -E2BIG && (!offset || f->page_cache) &&
+		 file_info_buf_grow(f) == 0);
+
+	if (ret == -E2BIG)
+		return log_error(0, "Write to cache was truncated");
+
+	return ret;
+}
+
+#ifdef HAVE_FUSE3
+/*
+ * Return a referenced snapshot that can serve this read as is or NULL if the
+ * file has to be rendered.
+ */
+static struct proc_cache_entry *proc_read_snapshot(off_t offset,
+						   struct fuse_file_info *fi)
+{
+	__do_free char *cg = NULL;
+	struct lxcfs_opts *opts = (struct lxcfs_opts *)fuse_get_context()->private_data;
+	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
+
+	if (!liblxcfs_functional())
+		return NULL;
+
+	if (d->page_cache)
+		return proc_page_cache_snap(&proc_page_cache[d->type]);
+
+	if (offset)
+		return d->shared ? proc_cache_ref(d->shared) : NULL;
+
+	if (opts && opts->cache_ttl)
+		cg = proc_cache_cgroup(d->type);
+	if (!cg)
+		return NULL;
+
+	return proc_cache_get(d->type, cg, opts->cache_ttl);
+}
+
+/*
+ * Same as proc_read() but reads served from a shared snapshot don't copy
+ * the data through a userspace buffer: the reply points at the memfd of the
+ * snapshot and fuse splices from it if it can.
+ */
+__lxcfs_fuse_ops int proc_read_buf(const char *path, struct fuse_bufvec **bufp,
+				   size_t size, off_t offset,
+				   struct fuse_file_info *fi)
+{
+	__do_free struct fuse_bufvec *bufv = NULL;
+	__do_free void *mem = NULL;
+	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
+	struct proc_cache_entry *entry;
+	int ret;
+
+	bufv = malloc(sizeof(*bufv));
+	if (!bufv)
+		return -ENOMEM;
+
+	entry = proc_read_snapshot(offset, fi);
+	if (entry) {
+		int fd;
+
+		/*
+		 * A concurrent read on the same handle may replace d->shared
+		 * before fuse is done with the memfd, the pin keeps it open.
+		 */
+		fd = proc_cache_fd(entry);
+		if (fd >= 0 && proc_cache_pin(entry) < 0)
+			fd = -EBADF;
+
+		if (d->shared != entry) {
+			file_info_buf_free(d);
+
+			d->shared = entry;
+			d->buf = entry->buf;
+			d->size = entry->size;
+			d->cached = 1;
+		} else {
+			proc_cache_put(entry);
+		}
+
+		if (fd >= 0) {
+			if ((size_t)offset >= entry->size)
+				size = 0;
+			else if (size > entry->size - offset)
+				size = entry->size - offset;
+
+			*bufv = FUSE_BUFVEC_INIT(size);
+			bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			bufv->buf[0].fd = fd;
+			bufv->buf[0].pos = offset;
+			*bufp = move_ptr(bufv);
+			return 0;
+		}
+	}
+
+	mem = malloc(size);
+	if (!mem)
+		return -ENOMEM;
+
+	ret = proc_read(path, mem, size, offset, fi);
+	if (ret < 0)
+		return ret;
+
+	*bufv = FUSE_BUFVEC_INIT(ret);
+	bufv->buf[0].mem = move_ptr(mem);
+	*bufp = move_ptr(bufv);
+	return 0;
+}
+#endif
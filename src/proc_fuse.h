@@ -29,5 +29,10 @@ __visible extern int proc_open(const char *path, struct fuse_file_info *fi);
 __visible extern int proc_access(const char *path, int mask);
 __visible extern int proc_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 __visible extern int proc_release(const char *path, struct fuse_file_info *fi);
+#ifdef HAVE_FUSE3
+__visible extern int proc_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
+#endif
+
+extern void free_proc_page_cache(void);
 
 #endif /* __LXCFS_PROC_FUSE_H */
@@ -51,7 +51,11 @@
 #include "cgroup_fuse.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
+#include "hash_table.h"
+#include "lifecycle.h"
 #include "memory_utils.h"
+#include "state.h"
+#include "stats.h"
 #include "utils.h"
 
 /*
@@ -61,8 +65,13 @@
 static int loadavg = 0;
 
 /* The function of hash table.*/
-#define LOAD_SIZE 100 /*the size of hash_table */
 #define FLUSH_TIME 5  /*the flush rate */
+/*
+ * Cgroups whose loadavg nobody read for LOAD_IDLE_MSECS are only refreshed
+ * every LOAD_IDLE_PERIODS flushes. Reading them switches back to full rate.
+ */
+#define LOAD_IDLE_MSECS 60000
+#define LOAD_IDLE_PERIODS 12
 #define DEPTH_DIR 3   /*the depth of per cgroup */
 /* The function of calculate loadavg .*/
 #define FSHIFT		11		/* nr of bits of precision */
@@ -73,10 +82,34 @@ static int loadavg = 0;
 #define LOAD_INT(x) ((x) >> FSHIFT)
 #define LOAD_FRAC(x) LOAD_INT(((x) & (FIXED_1-1)) * 100)
 static volatile sig_atomic_t loadavg_stop = 0;
+/*
+ * Worker i refreshes all nodes n with n->hash % loadavg_threads == i. Worker
+ * 0 is the thread handed back by load_daemon() the others are tracked here.
+ */
+static int loadavg_threads = 1;
+static pthread_t loadavg_workers[LOAD_MAX_THREADS];
+
+/*
+ * Cgroups reported as removed by the lifecycle tracker. The workers are the
+ * only ones deleting nodes so they pick these up at the start of a cycle.
+ */
+struct load_evicted {
+	char *cg;
+	uint64_t hash;
+	struct load_evicted *next;
+};
+static struct load_evicted *load_evicted;
+static pthread_mutex_t load_evicted_lock = PTHREAD_MUTEX_INITIALIZER;
 
 struct load_node {
 	/* cgroup */
 	char *cg;
+	uint64_t hash;
+	/*
+	 * Odd while the refreshing worker updates the load averages and pid
+	 * counts below. Readers retry until they got a consistent copy.
+	 */
+	unsigned int seq;
 	/* Load averages */
 	uint64_t avenrun[3];
 	unsigned int run_pid;
@@ -84,74 +117,256 @@ struct load_node {
 	unsigned int last_pid;
 	/* The file descriptor of the mounted cgroup */
 	int cfd;
-	struct load_node *next;
-	struct load_node **pre;
+	/* When the node was last read, updated by readers without a lock. */
+	int64_t last_read;
+	/* Flush periods since the last refresh, only used by the worker. */
+	unsigned int periods;
+	/* Pids found in the cgroup during the last refresh, reused across refreshes. */
+	pid_t *pids;
+	size_t pids_size;
+	/* Link in the list of unlinked nodes waiting to be freed. */
+	struct load_node *retired;
 };
 
-struct load_head {
-	/*
-	 * The lock is about insert load_node and refresh load_node.To the first
-	 * load_node of each hash bucket, insert and refresh in this hash bucket is
-	 * mutually exclusive.
-	 */
-	pthread_mutex_t lock;
-	/*
-	 * The rdlock is about read loadavg and delete load_node.To each hash
-	 * bucket, read and delete is mutually exclusive. But at the same time, we
-	 * allow paratactic read operation. This rdlock is at list level.
-	 */
-	pthread_rwlock_t rdlock;
-	/*
-	 * The rilock is about read loadavg and insert load_node.To the first
-	 * load_node of each hash bucket, read and insert is mutually exclusive.
-	 * But at the same time, we allow paratactic read operation.
-	 */
-	pthread_rwlock_t rilock;
-	struct load_node *next;
+static bool load_node_match(const void *item, const void *key)
+{
+	const struct load_node *n = item;
+
+	return strcmp(n->cg, key) == 0;
+}
+
+/*
+ * All nodes keyed on their cgroup. Inserting and removing nodes is
+ * serialized by load_lock, lookups from proc_loadavg_read() take no lock.
+ * Slots are allocated on the first insert.
+ */
+static struct hash_table load_table = {
+	.match		= load_node_match,
+	.deferred	= true,
 };
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Readers walk the hash table without taking any lock. Each reader thread
+ * owns a slot whose counter is odd while it is walking a bucket and that is
+ * only ever written by that thread. Workers unlink deleted nodes right away
+ * but only free them once every reader that was walking at that time has
+ * left, see load_synchronize().
+ */
+struct load_reader {
+	uint64_t seq;
+	bool used;
+	struct load_reader *next;
+} __attribute__((aligned(64)));
+
+static struct load_reader *load_readers;
+static pthread_mutex_t load_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t load_reader_key;
+
+static void load_reader_release(void *data)
+{
+	struct load_reader *r = data;
+
+	pthread_mutex_lock(&load_readers_lock);
+	r->used = false;
+	pthread_mutex_unlock(&load_readers_lock);
+}
+
+static struct load_reader *load_reader_get(void)
+{
+	struct load_reader *r;
 
-static struct load_head load_hash[LOAD_SIZE]; /* hash table */
+	r = pthread_getspecific(load_reader_key);
+	if (r)
+		return r;
+
+	pthread_mutex_lock(&load_readers_lock);
+	for (r = load_readers; r; r = r->next)
+		if (!r->used)
+			break;
+
+	if (!r) {
+		if (posix_memalign((void **)&r, __alignof__(*r), sizeof(*r))) {
+			pthread_mutex_unlock(&load_readers_lock);
+			return NULL;
+		}
+		memset(r, 0, sizeof(*r));
+		r->next = load_readers;
+		load_readers = r;
+	}
+	r->used = true;
+	pthread_mutex_unlock(&load_readers_lock);
+
+	if (pthread_setspecific(load_reader_key, r)) {
+		load_reader_release(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static inline void load_read_lock(struct load_reader *r)
+{
+	__atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+	/* Order the counter update before any load from the table. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void load_read_unlock(struct load_reader *r)
+{
+	__atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Wait until all readers currently walking the hash table are done. */
+static void load_synchronize(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&load_readers_lock);
+	for (struct load_reader *r = load_readers; r; r = r->next) {
+		uint64_t seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+
+		if (!(seq & 1))
+			continue;
+
+		while (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == seq)
+			usleep(1000);
+	}
+	pthread_mutex_unlock(&load_readers_lock);
+}
+
+static void free_node(struct load_node *n)
+{
+	free_disarm(n->cg);
+	free_disarm(n->pids);
+	free_disarm(n);
+}
+
+/* Free the nodes unlinked by a worker once no reader can see them anymore. */
+static void load_reclaim(struct load_node **retired)
+{
+	if (!*retired)
+		return;
+
+	load_synchronize();
+	while (*retired) {
+		struct load_node *n = *retired;
+
+		*retired = n->retired;
+		free_node(n);
+	}
+}
 
 /*
  * locate_node() finds special node. Not return NULL means success.
- * It should be noted that rdlock isn't unlocked at the end of code
- * because this function is used to read special node. Delete is not
- * allowed before read has ended.
- * unlock rdlock only in proc_loadavg_read().
+ * Must be called between load_read_lock() and load_read_unlock() and the
+ * node must not be accessed after load_read_unlock().
  */
-static struct load_node *locate_node(char *cg, int locate)
+static struct load_node *locate_node(const char *cg, uint64_t hash)
 {
-	struct load_node *f = NULL;
-	int i = 0;
+	return hash_table_find(&load_table, hash, cg);
+}
 
-	pthread_rwlock_rdlock(&load_hash[locate].rilock);
-	pthread_rwlock_rdlock(&load_hash[locate].rdlock);
-	if (load_hash[locate].next == NULL) {
-		pthread_rwlock_unlock(&load_hash[locate].rilock);
-		return f;
-	}
-	f = load_hash[locate].next;
-	pthread_rwlock_unlock(&load_hash[locate].rilock);
-	while (f && ((i = strcmp(f->cg, cg)) != 0))
-		f = f->next;
-	return f;
+struct load_stats {
+	uint64_t avenrun[3];
+	unsigned int run_pid;
+	unsigned int total_pid;
+	unsigned int last_pid;
+};
+
+/* Take a consistent copy of the values last published for @n. */
+static void load_node_snapshot(struct load_node *n, struct load_stats *s)
+{
+	unsigned int seq;
+
+	do {
+		while ((seq = __atomic_load_n(&n->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+
+		for (int i = 0; i < 3; i++)
+			s->avenrun[i] = __atomic_load_n(&n->avenrun[i], __ATOMIC_RELAXED);
+		s->run_pid	= __atomic_load_n(&n->run_pid, __ATOMIC_RELAXED);
+		s->total_pid	= __atomic_load_n(&n->total_pid, __ATOMIC_RELAXED);
+		s->last_pid	= __atomic_load_n(&n->last_pid, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&n->seq, __ATOMIC_RELAXED) != seq);
 }
 
-static void insert_node(struct load_node **n, int locate)
+/* Publish new values for @n. Only the worker owning @n's bucket does this. */
+static void load_node_publish(struct load_node *n, const struct load_stats *s)
 {
-	struct load_node *f;
+	__atomic_store_n(&n->seq, n->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
 
-	pthread_mutex_lock(&load_hash[locate].lock);
-	pthread_rwlock_wrlock(&load_hash[locate].rilock);
-	f = load_hash[locate].next;
-	load_hash[locate].next = *n;
+	for (int i = 0; i < 3; i++)
+		__atomic_store_n(&n->avenrun[i], s->avenrun[i], __ATOMIC_RELAXED);
+	__atomic_store_n(&n->run_pid, s->run_pid, __ATOMIC_RELAXED);
+	__atomic_store_n(&n->total_pid, s->total_pid, __ATOMIC_RELAXED);
+	__atomic_store_n(&n->last_pid, s->last_pid, __ATOMIC_RELAXED);
 
-	(*n)->pre = &(load_hash[locate].next);
-	if (f)
-		f->pre = &((*n)->next);
-	(*n)->next = f;
-	pthread_mutex_unlock(&load_hash[locate].lock);
-	pthread_rwlock_unlock(&load_hash[locate].rilock);
+	__atomic_store_n(&n->seq, n->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int64_t load_now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Allocate a node for @cg taking ownership of it, starting out at @s. */
+static struct load_node *new_node(char *cg, uint64_t hash, int cfd,
+				  const struct load_stats *s)
+{
+	struct load_node *n;
+
+	n = must_realloc(NULL, sizeof(struct load_node));
+	n->cg = cg;
+	n->hash = hash;
+	n->seq = 0;
+	n->avenrun[0] = s->avenrun[0];
+	n->avenrun[1] = s->avenrun[1];
+	n->avenrun[2] = s->avenrun[2];
+	n->run_pid = s->run_pid;
+	n->total_pid = s->total_pid;
+	n->last_pid = s->last_pid;
+	n->cfd = cfd;
+	n->last_read = load_now_ms();
+	n->periods = 0;
+	n->pids = NULL;
+	n->pids_size = 0;
+	n->retired = NULL;
+
+	return n;
+}
+
+/*
+ * Hand @n over to the workers. If another reader raced us and inserted a
+ * node for the same cgroup first @n is freed.
+ */
+static void insert_node(struct load_node *n)
+{
+	struct hash_table_slots *retired;
+	bool inserted = false;
+
+	pthread_mutex_lock(&load_lock);
+	if (!hash_table_find(&load_table, n->hash, n->cg))
+		inserted = hash_table_insert(&load_table, n->hash, n) == 0;
+	retired = hash_table_steal_retired(&load_table);
+	pthread_mutex_unlock(&load_lock);
+
+	if (!inserted)
+		free_node(n);
+
+	/* Readers might still be walking the slots from before the rehash. */
+	if (retired) {
+		load_synchronize();
+		hash_table_free_retired(retired);
+	}
 }
 
 int calc_hash(const char *name)
@@ -179,8 +394,10 @@ int proc_loadavg_read(char *buf, size_t size, off_t offset,
 	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
 	pid_t initpid;
 	ssize_t total_len = 0;
+	struct load_reader *r;
 	struct load_node *n;
-	int hash;
+	struct load_stats s;
+	uint64_t hash;
 	int cfd;
 	uint64_t a, b, c;
 
@@ -210,36 +427,43 @@ int proc_loadavg_read(char *buf, size_t size, off_t offset,
 	if (!cg)
 		return read_file_fuse("/proc/loadavg", buf, size, d);
 
+	r = load_reader_get();
+	if (!r)
+		return read_file_fuse("/proc/loadavg", buf, size, d);
+
 	prune_init_slice(cg);
-	hash = calc_hash(cg) % LOAD_SIZE;
+	hash = hash_string(cg);
+
+	load_read_lock(r);
 	n = locate_node(cg, hash);
+	if (n) {
+		int64_t now = load_now_ms();
+
+		load_node_snapshot(n, &s);
+		/* Don't bounce the cacheline around for every read. */
+		if (now - __atomic_load_n(&n->last_read, __ATOMIC_RELAXED) >= 1000)
+			__atomic_store_n(&n->last_read, now, __ATOMIC_RELAXED);
+	}
+	load_read_unlock(r);
 
 	/* First time */
 	if (n == NULL) {
 		cfd = get_cgroup_fd("cpu");
-		if (cfd < 0) {
-			/*
-			 * In locate_node() above, pthread_rwlock_unlock() isn't used
-			 * because delete is not allowed before read has ended.
-			 */
-			pthread_rwlock_unlock(&load_hash[hash].rdlock);
+		if (cfd < 0)
 			return read_file_fuse("/proc/loadavg", buf, size, d);
-		}
 
-		n = must_realloc(NULL, sizeof(struct load_node));
-		n->cg = move_ptr(cg);
-		n->avenrun[0] = 0;
-		n->avenrun[1] = 0;
-		n->avenrun[2] = 0;
-		n->run_pid = 0;
-		n->total_pid = 1;
-		n->last_pid = initpid;
-		n->cfd = cfd;
-		insert_node(&n, hash);
+		lifecycle_watch_cgroup("cpu", cg, LIFECYCLE_LOADAVG);
+
+		s = (struct load_stats){
+			.total_pid	= 1,
+			.last_pid	= initpid,
+		};
+		/* The node is owned by the workers from here on. */
+		insert_node(new_node(move_ptr(cg), hash, cfd, &s));
 	}
-	a = n->avenrun[0] + (FIXED_1 / 200);
-	b = n->avenrun[1] + (FIXED_1 / 200);
-	c = n->avenrun[2] + (FIXED_1 / 200);
+	a = s.avenrun[0] + (FIXED_1 / 200);
+	b = s.avenrun[1] + (FIXED_1 / 200);
+	c = s.avenrun[2] + (FIXED_1 / 200);
 	total_len = snprintf(d->buf, d->buflen,
 			     "%lu.%02lu "
 			     "%lu.%02lu "
@@ -253,12 +477,13 @@ int proc_loadavg_read(char *buf, size_t size, off_t offset,
 			     LOAD_FRAC(b),
 			     LOAD_INT(c),
 			     LOAD_FRAC(c),
-			     n->run_pid,
-			     n->total_pid,
-			     n->last_pid);
-	pthread_rwlock_unlock(&load_hash[hash].rdlock);
-	if (total_len < 0 || total_len >= d->buflen)
+			     s.run_pid,
+			     s.total_pid,
+			     s.last_pid);
+	if (total_len < 0)
 		return log_error(0, "Failed to write to cache");
+	if (total_len >= d->buflen)
+		return -E2BIG;
 
 	d->size = (int)total_len;
 	d->cached = 1;
@@ -270,77 +495,88 @@ int proc_loadavg_read(char *buf, size_t size, off_t offset,
 	return total_len;
 }
 
+static void load_node_add_pid(struct load_node *n, size_t *nr_pids, pid_t pid)
+{
+	if (*nr_pids == n->pids_size) {
+		size_t new_size = n->pids_size ? n->pids_size * 2 : 64;
+
+		n->pids = must_realloc(n->pids, new_size * sizeof(pid_t));
+		n->pids_size = new_size;
+	}
+
+	n->pids[(*nr_pids)++] = pid;
+}
+
 /*
  * Find the process pid from cgroup path.
  * eg:from /sys/fs/cgroup/cpu/docker/containerid/cgroup.procs to find the process pid.
- * @pid_buf : put pid to pid_buf.
- * @dpath : the path of cgroup. eg: /docker/containerid or /docker/containerid/child-cgroup ...
+ * @n : the load_node whose pid vector the pids are appended to.
+ * @nr_pids : the number of pids in the vector so far.
+ * @dfd : the directory file descriptor of the cgroup. eg: /sys/fs/cgroup/cpu/docker/containerid
  * @depth : the depth of cgroup in container.
- * @sum : return the number of pid.
- * @cfd : the file descriptor of the mounted cgroup. eg: /sys/fs/cgroup/cpu
  */
-static int calc_pid(char ***pid_buf, const char *rel_path, int depth, int sum, int cfd)
+static void calc_pid(struct load_node *n, size_t *nr_pids, int dfd, int depth)
 {
-	__do_free char *line = NULL, *path = NULL;
-	__do_free void *fdopen_cache = NULL;
 	__do_close int fd = -EBADF;
-	__do_fclose FILE *f = NULL;
-	__do_closedir DIR *dir = NULL;
-	struct dirent *file;
-	size_t linelen = 0;
-	int pd;
+	char buf[4096];
+	ssize_t bytes;
+	pid_t pid = 0;
+	bool in_pid = false;
 
-	fd = openat(cfd, rel_path, O_RDONLY | O_CLOEXEC);
-	if (fd < 0)
-		return sum;
+	if (depth > 0) {
+		__do_closedir DIR *dir = NULL;
+		struct dirent *file;
 
-	dir = fdopendir(fd);
-	if (!dir)
-		return sum;
-	/* Transfer ownership to fdopendir(). */
-	move_fd(fd);
+		fd = openat(dfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return;
 
-	while (((file = readdir(dir)) != NULL) && depth > 0) {
-		if (strcmp(file->d_name, ".") == 0)
-			continue;
+		dir = fdopendir(fd);
+		if (!dir)
+			return;
+		/* Transfer ownership to fdopendir(). */
+		move_fd(fd);
 
-		if (strcmp(file->d_name, "..") == 0)
-			continue;
+		while ((file = readdir(dir)) != NULL) {
+			__do_close int child_fd = -EBADF;
+
+			if (file->d_type != DT_DIR)
+				continue;
 
-		if (file->d_type == DT_DIR) {
-			__do_free char *path_next = NULL;
-			path_next = must_make_path(rel_path, "/", file->d_name, NULL);
-			pd = depth - 1;
-			sum = calc_pid(pid_buf, path_next, pd, sum, cfd);
+			if (strcmp(file->d_name, ".") == 0)
+				continue;
+
+			if (strcmp(file->d_name, "..") == 0)
+				continue;
+
+			child_fd = openat(dfd, file->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (child_fd < 0)
+				continue;
+
+			calc_pid(n, nr_pids, child_fd, depth - 1);
 		}
 	}
 
-	path = must_make_path(rel_path, "/cgroup.procs", NULL);
-	fd = openat(cfd, path, O_RDONLY | O_CLOEXEC);
+	fd = openat(dfd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
 	if (fd < 0)
-		return sum;
-
-	f = fdopen_cached(fd, "re", &fdopen_cache);
-	if (!f)
-		return sum;
-
-	while (getline(&line, &linelen, f) != -1) {
-		__do_free char *task_pid = NULL;
-		char **pid;
-
-		task_pid = strdup(line);
-		if (!task_pid)
-			return sum;
-
-		pid = realloc(*pid_buf, sizeof(char *) * (sum + 1));
-		if (!pid)
-			return sum;
-		*pid_buf = pid;
-		*(*pid_buf + sum) = move_ptr(task_pid);
-		sum++;
+		return;
+
+	/* Parse the pids straight from the file, one per line. */
+	while ((bytes = read_nointr(fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t i = 0; i < bytes; i++) {
+			if (buf[i] >= '0' && buf[i] <= '9') {
+				pid = pid * 10 + (buf[i] - '0');
+				in_pid = true;
+			} else if (in_pid) {
+				load_node_add_pid(n, nr_pids, pid);
+				pid = 0;
+				in_pid = false;
+			}
+		}
 	}
 
-	return sum;
+	if (in_pid)
+		load_node_add_pid(n, nr_pids, pid);
 }
 
 /*
@@ -364,50 +600,123 @@ static uint64_t calc_load(uint64_t load, uint64_t exp, uint64_t active)
 	return newload / FIXED_1;
 }
 
+/* Raise the fixed-point @x to the @n-th power. */
+static uint64_t fixed_power_int(uint64_t x, unsigned int n)
+{
+	uint64_t result = FIXED_1;
+
+	while (n) {
+		if (n & 1) {
+			result *= x;
+			result += 1 << (FSHIFT - 1);
+			result >>= FSHIFT;
+		}
+		n >>= 1;
+		x *= x;
+		x += 1 << (FSHIFT - 1);
+		x >>= FSHIFT;
+	}
+
+	return result;
+}
+
 /*
+ * Apply calc_load() @n times with the same @active like the kernel does for
+ * cpus that slept through several periods.
+ */
+static uint64_t calc_load_n(uint64_t load, uint64_t exp, uint64_t active,
+			    unsigned int n)
+{
+	return calc_load(load, fixed_power_int(exp, n), active);
+}
+
+/*
+ * Return the state of thread @tid as shown in the third field of its stat
+ * file in the /proc/<pid>/task directory @task_fd or '\0' on error. The
+ * state follows the comm which is at most TASK_COMM_LEN bytes and may itself
+ * contain ')' so we look for the last one, a single short read is enough.
+ */
+static char thread_state(int task_fd, const char *tid)
+{
+	__do_close int fd = -EBADF;
+	char path[INTTYPE_TO_STRLEN(pid_t) + STRLITERALLEN("/stat") + 1];
+	char buf[128];
+	ssize_t bytes;
+	char *p;
+	int ret;
+
+	ret = snprintf(path, sizeof(path), "%s/stat", tid);
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return '\0';
+
+	fd = openat(task_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return '\0';
+
+	bytes = read_nointr(fd, buf, sizeof(buf) - 1);
+	if (bytes <= 0)
+		return '\0';
+	buf[bytes] = '\0';
+
+	p = strrchr(buf, ')');
+	if (!p || (p + 2) >= (buf + bytes) || p[1] != ' ')
+		return '\0';
+
+	return p[2];
+}
+
+/*
+ * Refresh @p which was last refreshed @periods flushes ago.
  * Return 0 means that container p->cg is closed.
  * Return -1 means that error occurred in refresh.
  * Positive num equals the total number of pid.
  */
-static int refresh_load(struct load_node *p, const char *path)
-{
-	char **idbuf = NULL;
-	char proc_path[STRLITERALLEN("/proc//task//status") +
-		       2 * INTTYPE_TO_STRLEN(pid_t) + 1];
-	int i, ret, run_pid = 0, total_pid = 0, last_pid = 0;
-	size_t linelen = 0;
-	int sum, length;
+static int refresh_load(struct load_node *p, const char *path,
+			unsigned int periods)
+{
+	__do_close int dfd = -EBADF;
+	char proc_path[STRLITERALLEN("/proc//task") +
+		       INTTYPE_TO_STRLEN(pid_t) + 1];
+	int ret, run_pid = 0, total_pid = 0, last_pid = 0;
+	size_t sum = 0;
 	struct dirent *file;
+	struct load_stats s;
 
-	idbuf = must_realloc(NULL, sizeof(char **));
+	dfd = openat(p->cfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+		return 0;
 
-	sum = calc_pid(&idbuf, path, DEPTH_DIR, 0, p->cfd);
+	calc_pid(p, &sum, dfd, DEPTH_DIR);
 	if (!sum)
-		goto out;
+		return 0;
 
-	for (i = 0; i < sum; i++) {
+	for (size_t i = 0; i < sum; i++) {
 		__do_closedir DIR *dp = NULL;
+		__do_close int task_fd = -EBADF;
 
-		length = strlen(idbuf[i]) - 1;
-		idbuf[i][length] = '\0';
-
-		ret = snprintf(proc_path, sizeof(proc_path), "/proc/%s/task", idbuf[i]);
-		if (ret < 0 || (size_t)ret > sizeof(proc_path)) {
-			i = sum;
-			sum = -1;
+		ret = snprintf(proc_path, sizeof(proc_path), "/proc/%d/task", p->pids[i]);
+		if (ret < 0 || (size_t)ret >= sizeof(proc_path)) {
 			lxcfs_error("%s\n", "snprintf() failed in refresh_load.");
-			goto err_out;
+			return -1;
+		}
+
+		task_fd = open(proc_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (task_fd < 0) {
+			lxcfs_error("Failed to open \"%s\"", proc_path);
+			continue;
 		}
 
-		dp = opendir(proc_path);
+		dp = fdopendir(task_fd);
 		if (!dp) {
 			lxcfs_error("Failed to open \"%s\"", proc_path);
 			continue;
 		}
+		/* Transfer ownership to fdopendir(). */
+		move_fd(task_fd);
 
 		while ((file = readdir(dp)) != NULL) {
-			__do_free char *line = NULL;
-			__do_fclose FILE *f = NULL;
+			char state;
+			int tid;
 
 			if (strcmp(file->d_name, ".") == 0)
 				continue;
@@ -418,218 +727,365 @@ static int refresh_load(struct load_node *p, const char *path)
 			total_pid++;
 
 			/* We make the biggest pid become last_pid. */
-			ret = atof(file->d_name);
-			last_pid = (ret > last_pid) ? ret : last_pid;
-
-			ret = snprintf(proc_path, sizeof(proc_path),
-				       "/proc/%s/task/%s/status", idbuf[i], file->d_name);
-			if (ret < 0 || (size_t)ret > sizeof(proc_path)) {
-				i = sum;
-				sum = -1;
-				lxcfs_error("%s\n", "snprintf() failed in refresh_load.");
-				goto err_out;
-			}
-
-			f = fopen(proc_path, "re");
-			if (!f)
-				continue;
+			tid = strtol(file->d_name, NULL, 10);
+			last_pid = (tid > last_pid) ? tid : last_pid;
 
-			while (getline(&line, &linelen, f) != -1)
-				if ((line[0] == 'S') && (line[1] == 't'))
-					break;
-
-			if ((line[7] == 'R') || (line[7] == 'D'))
+			state = thread_state(dirfd(dp), file->d_name);
+			if (state == 'R' || state == 'D')
 				run_pid++;
 		}
 	}
 
 	/* Calculate the loadavg. */
-	p->avenrun[0]	= calc_load(p->avenrun[0], EXP_1, run_pid);
-	p->avenrun[1]	= calc_load(p->avenrun[1], EXP_5, run_pid);
-	p->avenrun[2]	= calc_load(p->avenrun[2], EXP_15, run_pid);
-	p->run_pid	= run_pid;
-	p->total_pid	= total_pid;
-	p->last_pid	= last_pid;
-
-err_out:
-	for (; i > 0; i--)
-		free(idbuf[i - 1]);
-out:
-	free(idbuf);
+	s.avenrun[0]	= calc_load_n(p->avenrun[0], EXP_1, run_pid, periods);
+	s.avenrun[1]	= calc_load_n(p->avenrun[1], EXP_5, run_pid, periods);
+	s.avenrun[2]	= calc_load_n(p->avenrun[2], EXP_15, run_pid, periods);
+	s.run_pid	= run_pid;
+	s.total_pid	= total_pid;
+	s.last_pid	= last_pid;
+	load_node_publish(p, &s);
+
 	return sum;
 }
 
-/* Delete the load_node n and return the next node of it. */
-static struct load_node *del_node(struct load_node *n, int locate)
+/*
+ * Unlink the load_node n. The node is queued on @retired and freed by
+ * load_reclaim() as readers might still see it.
+ */
+static void del_node(struct load_node *n, struct load_node **retired)
 {
-	struct load_node *g;
+	pthread_mutex_lock(&load_lock);
+	hash_table_remove(&load_table, n->hash, n->cg);
+	pthread_mutex_unlock(&load_lock);
 
-	pthread_rwlock_wrlock(&load_hash[locate].rdlock);
-	if (n->next == NULL) {
-		*(n->pre) = NULL;
-	} else {
-		*(n->pre) = n->next;
-		n->next->pre = n->pre;
+	n->retired = *retired;
+	*retired = n;
+}
+
+size_t load_nr_nodes(void)
+{
+	size_t nr;
+
+	pthread_mutex_lock(&load_lock);
+	nr = load_table.used;
+	pthread_mutex_unlock(&load_lock);
+
+	return nr;
+}
+
+void load_state_save(struct lxcfs_state *st)
+{
+	struct load_node *n;
+	size_t pos;
+
+	if (!loadavg)
+		return;
+
+	pthread_mutex_lock(&load_lock);
+	hash_table_for_each(&load_table, pos, n) {
+		struct lxcfs_state_loadavg rec = {};
+		struct load_stats s;
+
+		load_node_snapshot(n, &s);
+		memcpy(rec.avenrun, s.avenrun, sizeof(rec.avenrun));
+		rec.run_pid = s.run_pid;
+		rec.total_pid = s.total_pid;
+		rec.last_pid = s.last_pid;
+		state_append(st, LXCFS_STATE_LOADAVG, &rec, sizeof(rec), n->cg);
 	}
-	g = n->next;
-	free_disarm(n->cg);
-	free_disarm(n);
-	pthread_rwlock_unlock(&load_hash[locate].rdlock);
-	return g;
+	pthread_mutex_unlock(&load_lock);
 }
 
 /*
- * Traverse the hash table and update it.
+ * Continue the load averages of a cgroup from where the previous library
+ * left off. Must be called after the daemon has been started.
  */
-static void *load_begin(void *arg)
+bool load_state_restore(const void *payload, size_t len)
 {
+	struct lxcfs_state_loadavg rec;
+	struct load_stats s;
+	const char *cg;
+	char *dup;
+	int cfd;
 
-	int first_node, sum;
-	struct load_node *f;
-	clock_t time1, time2;
+	if (!loadavg)
+		return false;
+
+	cg = state_string(payload, len, sizeof(rec));
+	if (!cg)
+		return false;
+	memcpy(&rec, payload, sizeof(rec));
+
+	cfd = get_cgroup_fd("cpu");
+	if (cfd < 0)
+		return false;
+
+	dup = strdup(cg);
+	if (!dup)
+		return false;
+
+	lifecycle_watch_cgroup("cpu", cg, LIFECYCLE_LOADAVG);
+
+	memcpy(s.avenrun, rec.avenrun, sizeof(s.avenrun));
+	s.run_pid = rec.run_pid;
+	s.total_pid = rec.total_pid;
+	s.last_pid = rec.last_pid;
+	insert_node(new_node(dup, hash_string(cg), cfd, &s));
+
+	return true;
+}
+
+void load_evict(const char *cg)
+{
+	struct load_evicted *e;
+
+	if (!loadavg)
+		return;
+
+	e = zalloc(sizeof(*e));
+	if (!e)
+		return;
+
+	e->cg = strdup(cg);
+	if (!e->cg) {
+		free(e);
+		return;
+	}
+	e->hash = hash_string(cg);
+
+	pthread_mutex_lock(&load_evicted_lock);
+	e->next = load_evicted;
+	load_evicted = e;
+	pthread_mutex_unlock(&load_evicted_lock);
+}
+
+/* Delete the nodes of removed cgroups in @worker's share of the buckets. */
+static void load_reap_evicted(int worker, struct load_node **retired)
+{
+	struct load_evicted *mine = NULL, **it;
+
+	pthread_mutex_lock(&load_evicted_lock);
+	for (it = &load_evicted; *it;) {
+		struct load_evicted *e = *it;
+
+		if (e->hash % loadavg_threads != worker) {
+			it = &e->next;
+			continue;
+		}
+
+		*it = e->next;
+		e->next = mine;
+		mine = e;
+	}
+	pthread_mutex_unlock(&load_evicted_lock);
+
+	while (mine) {
+		struct load_evicted *e = mine;
+		struct load_node *f;
+
+		pthread_mutex_lock(&load_lock);
+		f = hash_table_remove(&load_table, e->hash, e->cg);
+		pthread_mutex_unlock(&load_lock);
+		if (f) {
+			lxcfs_debug("Removing loadavg node for %s", f->cg);
+			f->retired = *retired;
+			*retired = f;
+		}
+
+		mine = e->next;
+		free(e->cg);
+		free(e);
+	}
+}
+
+static void load_free_evicted(void)
+{
+	pthread_mutex_lock(&load_evicted_lock);
+	while (load_evicted) {
+		struct load_evicted *e = load_evicted;
+
+		load_evicted = e->next;
+		free(e->cg);
+		free(e);
+	}
+	pthread_mutex_unlock(&load_evicted_lock);
+}
+
+/*
+ * Traverse this worker's share of the hash table and update it.
+ */
+static void *load_begin(void *arg)
+{
+	__do_free struct load_node **batch = NULL;
+	size_t batch_size = 0;
+	int worker = (int)(intptr_t)arg;
+	int sum;
+	struct load_node *f, *retired = NULL;
+	int64_t start, elapsed;
 
 	for (;;) {
+		size_t nodes = 0, pos;
+
 		if (loadavg_stop == 1)
 			return NULL;
 
-		time1 = clock();
-		for (int i = 0; i < LOAD_SIZE; i++) {
-			pthread_mutex_lock(&load_hash[i].lock);
-			if (load_hash[i].next == NULL) {
-				pthread_mutex_unlock(&load_hash[i].lock);
+		start = load_now_ms();
+		load_reap_evicted(worker, &retired);
+
+		/*
+		 * Only this worker deletes the nodes in its share so they stay
+		 * valid after dropping the lock.
+		 */
+		pthread_mutex_lock(&load_lock);
+		hash_table_for_each(&load_table, pos, f) {
+			if (f->hash % loadavg_threads != (uint64_t)worker)
 				continue;
-			}
 
-			f = load_hash[i].next;
-			first_node = 1;
-			while (f) {
-				__do_free char *path = NULL;
+			if (nodes == batch_size) {
+				batch_size = batch_size ? batch_size * 2 : 64;
+				batch = must_realloc(batch, batch_size * sizeof(*batch));
+			}
+			batch[nodes++] = f;
+		}
+		pthread_mutex_unlock(&load_lock);
 
-				path = must_make_path_relative(f->cg, NULL);
+		for (size_t i = 0; i < nodes; i++) {
+			__do_free char *path = NULL;
+			int64_t last_read;
 
-				sum = refresh_load(f, path);
-				if (sum == 0)
-					f = del_node(f, i);
-				else
-					f = f->next;
+			f = batch[i];
+			f->periods++;
 
-				/* load_hash[i].lock locks only on the first node.*/
-				if (first_node == 1) {
-					first_node = 0;
-					pthread_mutex_unlock(&load_hash[i].lock);
-				}
+			last_read = __atomic_load_n(&f->last_read, __ATOMIC_RELAXED);
+			if (start - last_read >= LOAD_IDLE_MSECS &&
+			    f->periods < LOAD_IDLE_PERIODS) {
+				stats_inc(STATS_LOADAVG_IDLE_SKIPS);
+				continue;
 			}
+
+			path = must_make_path_relative(f->cg, NULL);
+
+			sum = refresh_load(f, path, f->periods);
+			if (sum == 0)
+				del_node(f, &retired);
+			else
+				f->periods = 0;
 		}
 
+		load_reclaim(&retired);
+
 		if (loadavg_stop == 1)
 			return NULL;
 
-		time2 = clock();
-		usleep(FLUSH_TIME * 1000000 -
-		       (int)((time2 - time1) * 1000000 / CLOCKS_PER_SEC));
+		elapsed = load_now_ms() - start;
+		stats_inc(STATS_LOADAVG_CYCLES);
+		stats_add(STATS_LOADAVG_CYCLE_MSECS, elapsed);
+		if (elapsed >= FLUSH_TIME * 1000) {
+			lxcfs_info("loadavg worker %d: refreshing %zu cgroups took %" PRId64 "ms, longer than the %ds period",
+				   worker, nodes, elapsed, FLUSH_TIME);
+			continue;
+		}
+
+		lxcfs_debug("loadavg worker %d: refreshed %zu cgroups in %" PRId64 "ms",
+			    worker, nodes, elapsed);
+		usleep((FLUSH_TIME * 1000 - elapsed) * 1000);
 	}
 }
 
 /*
- * init_load initialize the hash table.
+ * init_load prepares the reader slots, the hash table itself is allocated
+ * on first use.
  * Return 0 on success, return -1 on failure.
  */
 static int init_load(void)
 {
-	int i;
 	int ret;
 
-	for (i = 0; i < LOAD_SIZE; i++) {
-		load_hash[i].next = NULL;
-		ret = pthread_mutex_init(&load_hash[i].lock, NULL);
-		if (ret) {
-			lxcfs_error("Failed to initialize lock");
-			goto out3;
-		}
-
-		ret = pthread_rwlock_init(&load_hash[i].rdlock, NULL);
-		if (ret) {
-			lxcfs_error("Failed to initialize rdlock");
-			goto out2;
-		}
-
-		ret = pthread_rwlock_init(&load_hash[i].rilock, NULL);
-		if (ret) {
-			lxcfs_error("Failed to initialize rilock");
-			goto out1;
-		}
+	ret = pthread_key_create(&load_reader_key, load_reader_release);
+	if (ret) {
+		lxcfs_error("Failed to create reader key");
+		return -1;
 	}
 
 	return 0;
-
-out1:
-	pthread_rwlock_destroy(&load_hash[i].rdlock);
-out2:
-	pthread_mutex_destroy(&load_hash[i].lock);
-out3:
-	while (i > 0) {
-		i--;
-		pthread_mutex_destroy(&load_hash[i].lock);
-		pthread_rwlock_destroy(&load_hash[i].rdlock);
-		pthread_rwlock_destroy(&load_hash[i].rilock);
-	}
-
-	return -1;
 }
 
 static void load_free(void)
 {
-	struct load_node *f, *p;
-
-	for (int i = 0; i < LOAD_SIZE; i++) {
-		pthread_mutex_lock(&load_hash[i].lock);
-		pthread_rwlock_wrlock(&load_hash[i].rilock);
-		pthread_rwlock_wrlock(&load_hash[i].rdlock);
-		if (load_hash[i].next == NULL) {
-			pthread_mutex_unlock(&load_hash[i].lock);
-			pthread_mutex_destroy(&load_hash[i].lock);
-			pthread_rwlock_unlock(&load_hash[i].rilock);
-			pthread_rwlock_destroy(&load_hash[i].rilock);
-			pthread_rwlock_unlock(&load_hash[i].rdlock);
-			pthread_rwlock_destroy(&load_hash[i].rdlock);
-			continue;
-		}
+	struct load_node *f;
+	size_t pos;
 
-		for (f = load_hash[i].next; f;) {
-			free_disarm(f->cg);
-			p = f->next;
-			free_disarm(f);
-			f = p;
-		}
+	/* Stop handing out nodes before freeing them. */
+	loadavg = 0;
+	load_synchronize();
+
+	pthread_mutex_lock(&load_lock);
+	hash_table_for_each(&load_table, pos, f)
+		free_node(f);
+	hash_table_fini(&load_table);
+	pthread_mutex_unlock(&load_lock);
 
-		pthread_mutex_unlock(&load_hash[i].lock);
-		pthread_mutex_destroy(&load_hash[i].lock);
-		pthread_rwlock_unlock(&load_hash[i].rilock);
-		pthread_rwlock_destroy(&load_hash[i].rilock);
-		pthread_rwlock_unlock(&load_hash[i].rdlock);
-		pthread_rwlock_destroy(&load_hash[i].rdlock);
+	pthread_key_delete(load_reader_key);
+	pthread_mutex_lock(&load_readers_lock);
+	while (load_readers) {
+		struct load_reader *r = load_readers;
+
+		load_readers = r->next;
+		free(r);
 	}
+	pthread_mutex_unlock(&load_readers_lock);
 }
 
-/* Return a positive number on success, return 0 on failure.*/
-pthread_t load_daemon(int load_use)
+static void join_load_workers(int nr_workers)
+{
+	/* Worker 0 is joined by the caller of stop_load_daemon(). */
+	for (int i = nr_workers - 1; i > 0; i--)
+		pthread_join(loadavg_workers[i], NULL);
+}
+
+/*
+ * Start @nr_threads threads refreshing the loadavg hash table. Each thread
+ * owns a fixed share of the buckets so a slow cgroup only delays the
+ * containers hashed into the same share.
+ * Return a positive number on success, return 0 on failure.
+ */
+pthread_t load_daemon_v2(int load_use, int nr_threads)
 {
 	int ret;
-	pthread_t pid;
+
+	if (nr_threads < 1)
+		nr_threads = 1;
+	else if (nr_threads > LOAD_MAX_THREADS)
+		nr_threads = LOAD_MAX_THREADS;
 
 	ret = init_load();
 	if (ret == -1)
 		return log_error(0, "Initialize hash_table fails in load_daemon!");
 
-	ret = pthread_create(&pid, NULL, load_begin, NULL);
-	if (ret != 0) {
-		load_free();
-		return log_error(0, "Create pthread fails in load_daemon!");
+	loadavg_threads = nr_threads;
+	for (int i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&loadavg_workers[i], NULL, load_begin,
+				     (void *)(intptr_t)i);
+		if (ret != 0) {
+			loadavg_stop = 1;
+			if (i > 0)
+				pthread_join(loadavg_workers[0], NULL);
+			join_load_workers(i);
+			loadavg_stop = 0;
+			load_free();
+			return log_error(0, "Create pthread fails in load_daemon!");
+		}
 	}
 
 	/* use loadavg, here loadavg = 1*/
 	loadavg = load_use;
-	return pid;
+	return loadavg_workers[0];
+}
+
+/* Return a positive number on success, return 0 on failure.*/
+pthread_t load_daemon(int load_use)
+{
+	return load_daemon_v2(load_use, 1);
 }
 
 /* Returns 0 on success. */
@@ -644,7 +1100,11 @@ int stop_load_daemon(pthread_t pid)
 	if (s)
 		return log_error(-1, "stop_load_daemon error: failed to join");
 
+	join_load_workers(loadavg_threads);
+	loadavg_threads = 1;
+
 	load_free();
+	load_free_evicted();
 	loadavg_stop = 0;
 
 	return 0;
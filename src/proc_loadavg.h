@@ -23,11 +23,17 @@
 #include "config.h"
 #include "macro.h"
 
+/* Upper bound for the number of threads refreshing the hash table. */
+#define LOAD_MAX_THREADS 32
+
 __visible extern pthread_t load_daemon(int load_use);
+__visible extern pthread_t load_daemon_v2(int load_use, int nr_threads);
 __visible extern int stop_load_daemon(pthread_t pid);
 
 extern int proc_loadavg_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 extern int calc_hash(const char *name);
+extern void load_evict(const char *cg);
+extern size_t load_nr_nodes(void);
 
 #endif /* __LXCFS_PROC_LOADAVG_FUSE_H */
 
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cgroups/cgroup_utils.h"
+#include "memory_utils.h"
+#include "state.h"
+#include "utils.h"
+
+/* Records start 8 byte aligned so payloads can be accessed in place. */
+#define STATE_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+static void state_reserve(struct lxcfs_state *s, size_t len)
+{
+	if (s->len + len <= s->size)
+		return;
+
+	s->size = STATE_ALIGN((s->len + len) * 2);
+	s->buf = must_realloc(s->buf, s->size);
+}
+
+void state_append(struct lxcfs_state *s, uint32_t type, const void *rec,
+		  size_t len, const char *str)
+{
+	size_t slen = str ? strlen(str) + 1 : 0;
+	struct lxcfs_state_record hdr = {
+		.type	= type,
+		.len	= len + slen,
+	};
+	size_t total = sizeof(hdr) + STATE_ALIGN(len + slen);
+
+	state_reserve(s, total);
+	memset(s->buf + s->len, 0, total);
+	memcpy(s->buf + s->len, &hdr, sizeof(hdr));
+	memcpy(s->buf + s->len + sizeof(hdr), rec, len);
+	if (str)
+		memcpy(s->buf + s->len + sizeof(hdr) + len, str, slen);
+	s->len += total;
+}
+
+/*
+ * Serialize everything worth keeping across a reload into a memfd. Called by
+ * lxcfs right before this library is unloaded while no request is running.
+ * Returns the file descriptor on success and a negative errno on failure.
+ */
+int lxcfs_state_save(void)
+{
+	__do_free char *buf = NULL;
+	__do_close int fd = -EBADF;
+	struct lxcfs_state s = {};
+	struct lxcfs_state_header hdr = {
+		.magic		= LXCFS_STATE_MAGIC,
+		.version	= LXCFS_STATE_VERSION,
+	};
+
+	state_reserve(&s, sizeof(hdr));
+	memcpy(s.buf, &hdr, sizeof(hdr));
+	s.len = sizeof(hdr);
+
+	initpid_state_save(&s);
+	load_state_save(&s);
+	cpuview_state_save(&s);
+	buf = s.buf;
+
+	fd = memfd_create("lxcfs-state", MFD_CLOEXEC);
+	if (fd < 0)
+		return log_error_errno(-errno, errno, "Failed to create state memfd");
+
+	if (write_nointr(fd, buf, s.len) != (ssize_t)s.len)
+		return log_error_errno(-EIO, EIO, "Failed to write state memfd");
+
+	lxcfs_info("Saved %zu bytes of state", s.len);
+	return move_fd(fd);
+}
+
+static bool state_restore_record(uint32_t type, const void *payload, size_t len)
+{
+	switch (type) {
+	case LXCFS_STATE_INITPID:
+		return initpid_state_restore(payload, len);
+	case LXCFS_STATE_LOADAVG:
+		return load_state_restore(payload, len);
+	case LXCFS_STATE_CPUVIEW:
+		return cpuview_state_restore(payload, len);
+	}
+
+	/* Written by a newer library, nothing we know how to use. */
+	return true;
+}
+
+/*
+ * Adopt the state left behind by the previous library in @fd. Called by
+ * lxcfs after this library has been loaded and the loadavg daemon has been
+ * started. The caller keeps ownership of @fd.
+ */
+int lxcfs_state_restore(int fd)
+{
+	__do_free char *buf = NULL;
+	struct lxcfs_state_header hdr;
+	size_t pos, nr = 0, bad = 0;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return log_error_errno(-errno, errno, "Failed to stat state memfd");
+
+	if ((size_t)st.st_size < sizeof(hdr))
+		return log_error(-EINVAL, "Ignoring truncated state");
+
+	buf = malloc(st.st_size);
+	if (!buf)
+		return ret_errno(ENOMEM);
+
+	if (pread(fd, buf, st.st_size, 0) != st.st_size)
+		return log_error_errno(-EIO, EIO, "Failed to read state memfd");
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != LXCFS_STATE_MAGIC || hdr.version != LXCFS_STATE_VERSION)
+		return log_error(-EINVAL, "Ignoring state with version %u", hdr.version);
+
+	for (pos = sizeof(hdr); pos + sizeof(struct lxcfs_state_record) <= (size_t)st.st_size;) {
+		struct lxcfs_state_record rec;
+
+		memcpy(&rec, buf + pos, sizeof(rec));
+		pos += sizeof(rec);
+		if (rec.len > (size_t)st.st_size - pos)
+			return log_error(-EINVAL, "Ignoring truncated state record");
+
+		if (state_restore_record(rec.type, buf + pos, rec.len))
+			nr++;
+		else
+			bad++;
+		pos += STATE_ALIGN(rec.len);
+	}
+
+	lxcfs_info("Restored %zu state records, skipped %zu", nr, bad);
+	return 0;
+}
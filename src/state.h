@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_STATE_H
+#define __LXCFS_STATE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "macro.h"
+
+/*
+ * State handed from one liblxcfs.so to the next across a reload. The old
+ * library serializes it into a memfd before it is unloaded and the new one
+ * adopts whatever it understands. Record layouts may only ever be extended
+ * by adding new record types; changing an existing layout requires bumping
+ * LXCFS_STATE_VERSION which makes the new library discard old snapshots.
+ */
+#define LXCFS_STATE_MAGIC 0x4c584653 /* LXFS */
+#define LXCFS_STATE_VERSION 2
+
+enum lxcfs_state_type {
+	LXCFS_STATE_INITPID	= 1,
+	LXCFS_STATE_LOADAVG	= 2,
+	LXCFS_STATE_CPUVIEW	= 3,
+};
+
+struct lxcfs_state_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct lxcfs_state_record {
+	uint32_t type;
+	/* Length of the payload following the record header. */
+	uint32_t len;
+};
+
+/* Payloads, variable sized ones end in a NUL-terminated cgroup. */
+struct lxcfs_state_initpid {
+	uint64_t ino;
+	int64_t ctime;
+	int32_t initpid;
+	uint32_t __pad;
+};
+
+struct lxcfs_state_loadavg {
+	uint64_t avenrun[3];
+	uint32_t run_pid;
+	uint32_t total_pid;
+	uint32_t last_pid;
+	uint32_t __pad;
+};
+
+/* Counters are stored as user, system, idle. */
+struct lxcfs_state_cpu {
+	uint32_t cpu;
+	uint32_t __pad;
+	uint64_t usage[3];
+	uint64_t view[3];
+};
+
+/* Followed by nr_cpus entries in ascending cpu order. */
+struct lxcfs_state_cpuview {
+	uint32_t nr_cpus;
+	uint32_t __pad;
+};
+
+struct lxcfs_state {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+/* Append a record made of @rec followed by @str (may be NULL) to @s. */
+extern void state_append(struct lxcfs_state *s, uint32_t type, const void *rec,
+			 size_t len, const char *str);
+
+/*
+ * Return the NUL-terminated string stored at offset @off of a @len bytes
+ * long @payload or NULL if there is none.
+ */
+static inline const char *state_string(const void *payload, size_t len,
+				       size_t off)
+{
+	const char *str = (const char *)payload + off;
+
+	if (len <= off || str[len - off - 1] != '\0')
+		return NULL;
+
+	return str;
+}
+
+/* Subsystem hooks, a restore returns false on malformed payloads. */
+extern void initpid_state_save(struct lxcfs_state *s);
+extern bool initpid_state_restore(const void *payload, size_t len);
+extern void load_state_save(struct lxcfs_state *s);
+extern bool load_state_restore(const void *payload, size_t len);
+extern void cpuview_state_save(struct lxcfs_state *s);
+extern bool cpuview_state_restore(const void *payload, size_t len);
+
+__visible extern int lxcfs_state_save(void);
+__visible extern int lxcfs_state_restore(int fd);
+
+#endif /* __LXCFS_STATE_H */
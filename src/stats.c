@@ -0,0 +1,522 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_FUSE3
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+#else
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fuse.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bindings.h"
+#include "cgroups/cgroup_utils.h"
+#include "memory_utils.h"
+#include "proc_cpuview.h"
+#include "proc_loadavg.h"
+#include "stats.h"
+#include "utils.h"
+
+/*
+ * Request and subsystem counters. Every thread bumps its own copy so the
+ * hot paths never write to a shared cache line, reading the stats file adds
+ * them all up. Slots of exited threads are handed to new threads, nothing
+ * is ever lost or reset.
+ */
+
+/*
+ * Log-linear latency histogram in microseconds: four linear buckets per
+ * power of two, the last bucket catches everything from ~16s on.
+ */
+#define STATS_HIST_SUB 4
+#define STATS_HIST_BUCKETS 96
+
+static const char *const stats_ops[LXCFS_OP_MAX] = {
+	[LXCFS_OP_GETATTR]	= "getattr",
+	[LXCFS_OP_READDIR]	= "readdir",
+	[LXCFS_OP_OPEN]		= "open",
+	[LXCFS_OP_READ]		= "read",
+};
+
+/* Files we know about by name, everything else is counted per subtree. */
+static const char *const stats_paths[] = {
+	LXC_TYPE_PROC_MEMINFO_PATH,
+	LXC_TYPE_PROC_CPUINFO_PATH,
+	LXC_TYPE_PROC_UPTIME_PATH,
+	LXC_TYPE_PROC_STAT_PATH,
+	LXC_TYPE_PROC_DISKSTATS_PATH,
+	LXC_TYPE_PROC_SWAPS_PATH,
+	LXC_TYPE_PROC_LOADAVG_PATH,
+	LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE_PATH,
+	"/proc",
+	"/sys",
+	"/cgroup",
+	"other",
+};
+#define STATS_PATH_NAMED 8
+#define STATS_PATH_MAX (sizeof(stats_paths) / sizeof(*stats_paths))
+
+struct stats_req {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t nsecs;
+	uint64_t hist[STATS_HIST_BUCKETS];
+};
+
+struct stats_slot {
+	struct stats_req req[LXCFS_OP_MAX][STATS_PATH_MAX];
+	uint64_t counters[STATS_COUNTER_MAX];
+	bool used;
+	struct stats_slot *next;
+};
+
+static struct stats_slot *stats_slots;
+static pthread_mutex_t stats_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_slot_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static bool stats_key_valid;
+
+static void stats_slot_release(void *data)
+{
+	struct stats_slot *slot = data;
+
+	pthread_mutex_lock(&stats_slots_lock);
+	slot->used = false;
+	pthread_mutex_unlock(&stats_slots_lock);
+}
+
+static void stats_init(void)
+{
+	stats_key_valid = pthread_key_create(&stats_slot_key, stats_slot_release) == 0;
+}
+
+static struct stats_slot *stats_slot(void)
+{
+	struct stats_slot *slot;
+
+	pthread_once(&stats_once, stats_init);
+	if (!stats_key_valid)
+		return NULL;
+
+	slot = pthread_getspecific(stats_slot_key);
+	if (slot)
+		return slot;
+
+	pthread_mutex_lock(&stats_slots_lock);
+	for (slot = stats_slots; slot; slot = slot->next)
+		if (!slot->used)
+			break;
+
+	if (!slot) {
+		slot = zalloc(sizeof(*slot));
+		if (!slot) {
+			pthread_mutex_unlock(&stats_slots_lock);
+			return NULL;
+		}
+		slot->next = stats_slots;
+		stats_slots = slot;
+	}
+	slot->used = true;
+	pthread_mutex_unlock(&stats_slots_lock);
+
+	if (pthread_setspecific(stats_slot_key, slot)) {
+		stats_slot_release(slot);
+		return NULL;
+	}
+
+	return slot;
+}
+
+/* Only the owning thread writes, readers just need to see whole values. */
+static inline void stats_bump(uint64_t *v, uint64_t add)
+{
+	__atomic_store_n(v, *v + add, __ATOMIC_RELAXED);
+}
+
+void stats_add(enum lxcfs_stats_counter counter, uint64_t v)
+{
+	struct stats_slot *slot = stats_slot();
+
+	if (slot)
+		stats_bump(&slot->counters[counter], v);
+}
+
+static size_t stats_path(const char *path)
+{
+	for (size_t i = 0; i < STATS_PATH_NAMED; i++)
+		if (strcmp(path, stats_paths[i]) == 0)
+			return i;
+
+	for (size_t i = STATS_PATH_NAMED; i < STATS_PATH_MAX - 1; i++) {
+		size_t len = strlen(stats_paths[i]);
+
+		if (strncmp(path, stats_paths[i], len) == 0 &&
+		    (path[len] == '\0' || path[len] == '/'))
+			return i;
+	}
+
+	return STATS_PATH_MAX - 1;
+}
+
+static size_t stats_bucket(uint64_t usecs)
+{
+	size_t bucket;
+	int order;
+
+	if (usecs < STATS_HIST_SUB)
+		return usecs;
+
+	order = 63 - __builtin_clzll(usecs);
+	bucket = (order - 1) * STATS_HIST_SUB + ((usecs >> (order - 2)) & (STATS_HIST_SUB - 1));
+	if (bucket >= STATS_HIST_BUCKETS)
+		bucket = STATS_HIST_BUCKETS - 1;
+
+	return bucket;
+}
+
+/*
+ * Inclusive upper bound of @bucket in microseconds, as Prometheus expects for
+ * its "le" label. Bucket @bucket holds everything below the next bucket's
+ * lower bound, hence the - 1.
+ */
+static uint64_t stats_bucket_le(size_t bucket)
+{
+	int order;
+
+	if (bucket < STATS_HIST_SUB)
+		return bucket;
+
+	order = bucket / STATS_HIST_SUB + 1;
+	return ((uint64_t)(STATS_HIST_SUB + 1 + bucket % STATS_HIST_SUB) << (order - 2)) - 1;
+}
+
+/* Called by the dispatchers in lxcfs.c after each request. */
+void stats_request(int op, const char *path, int ret, uint64_t nsecs)
+{
+	struct stats_slot *slot;
+	struct stats_req *req;
+
+	if (op < 0 || op >= LXCFS_OP_MAX)
+		return;
+
+	slot = stats_slot();
+	if (!slot)
+		return;
+
+	req = &slot->req[op][stats_path(path)];
+	stats_bump(&req->count, 1);
+	if (ret < 0)
+		stats_bump(&req->errors, 1);
+	else if (op == LXCFS_OP_READ)
+		stats_bump(&req->bytes, ret);
+	stats_bump(&req->nsecs, nsecs);
+	stats_bump(&req->hist[stats_bucket(nsecs / 1000)], 1);
+}
+
+static void stats_sum(struct stats_slot *sum)
+{
+	pthread_mutex_lock(&stats_slots_lock);
+	for (struct stats_slot *slot = stats_slots; slot; slot = slot->next) {
+		const uint64_t *src = (const uint64_t *)slot;
+		uint64_t *dst = (uint64_t *)sum;
+
+		/* Both structs start with nothing but counters. */
+		for (size_t i = 0; i < offsetof(struct stats_slot, used) / sizeof(uint64_t); i++)
+			dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&stats_slots_lock);
+}
+
+struct stats_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void stats_printf(struct stats_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	for (;;) {
+		va_start(ap, fmt);
+		ret = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+		if (ret < 0)
+			return;
+
+		if ((size_t)ret < b->size - b->len) {
+			b->len += ret;
+			return;
+		}
+
+		b->size = b->size * 2 + ret;
+		b->buf = must_realloc(b->buf, b->size);
+	}
+}
+
+static void stats_counter(struct stats_buf *b, const char *name,
+			  const char *type, const char *help, uint64_t v)
+{
+	stats_printf(b, "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n",
+		     name, help, name, type, name, v);
+}
+
+/* The worker setup lxcfs handed to libfuse, 0 means the libfuse default. */
+static void stats_fuse_config(struct stats_buf *b)
+{
+	const struct lxcfs_opts *opts = fuse_get_context()->private_data;
+
+	if (!opts)
+		return;
+
+	stats_counter(b, "lxcfs_fuse_clone_fd", "gauge",
+		      "Whether every FUSE worker has its own /dev/fuse fd.",
+		      opts->fuse_clone_fd);
+	stats_counter(b, "lxcfs_fuse_max_idle_threads", "gauge",
+		      "Idle FUSE workers kept around.",
+		      opts->fuse_max_idle_threads);
+	stats_counter(b, "lxcfs_fuse_max_threads", "gauge",
+		      "Upper bound for the number of FUSE workers.",
+		      opts->fuse_max_threads);
+	if (opts->fuse_cpus)
+		stats_printf(b, "# HELP lxcfs_fuse_worker_cpus_info CPUs the FUSE workers run on.\n"
+				"# TYPE lxcfs_fuse_worker_cpus_info gauge\n"
+				"lxcfs_fuse_worker_cpus_info{cpus=\"%s\"} 1\n",
+			     opts->fuse_cpus);
+}
+
+static char *stats_render(size_t *len)
+{
+	__do_free struct stats_slot *sum = NULL;
+	struct stats_buf b = {
+		.size = 16384,
+	};
+
+	sum = zalloc(sizeof(*sum));
+	if (!sum)
+		return NULL;
+	stats_sum(sum);
+
+	b.buf = must_realloc(NULL, b.size);
+	b.buf[0] = '\0';
+
+	stats_printf(&b, "# HELP lxcfs_requests_total Requests handled.\n"
+			 "# TYPE lxcfs_requests_total counter\n");
+	for (int op = 0; op < LXCFS_OP_MAX; op++)
+		for (size_t p = 0; p < STATS_PATH_MAX; p++)
+			if (sum->req[op][p].count)
+				stats_printf(&b, "lxcfs_requests_total{op=\"%s\",path=\"%s\"} %" PRIu64 "\n",
+					     stats_ops[op], stats_paths[p], sum->req[op][p].count);
+
+	stats_printf(&b, "# HELP lxcfs_request_errors_total Requests that failed.\n"
+			 "# TYPE lxcfs_request_errors_total counter\n");
+	for (int op = 0; op < LXCFS_OP_MAX; op++)
+		for (size_t p = 0; p < STATS_PATH_MAX; p++)
+			if (sum->req[op][p].errors)
+				stats_printf(&b, "lxcfs_request_errors_total{op=\"%s\",path=\"%s\"} %" PRIu64 "\n",
+					     stats_ops[op], stats_paths[p], sum->req[op][p].errors);
+
+	stats_printf(&b, "# HELP lxcfs_read_bytes_total Bytes returned by reads.\n"
+			 "# TYPE lxcfs_read_bytes_total counter\n");
+	for (size_t p = 0; p < STATS_PATH_MAX; p++)
+		if (sum->req[LXCFS_OP_READ][p].count)
+			stats_printf(&b, "lxcfs_read_bytes_total{path=\"%s\"} %" PRIu64 "\n",
+				     stats_paths[p], sum->req[LXCFS_OP_READ][p].bytes);
+
+	stats_printf(&b, "# HELP lxcfs_request_duration_seconds Time spent handling requests.\n"
+			 "# TYPE lxcfs_request_duration_seconds histogram\n");
+	for (int op = 0; op < LXCFS_OP_MAX; op++) {
+		for (size_t p = 0; p < STATS_PATH_MAX; p++) {
+			const struct stats_req *req = &sum->req[op][p];
+			uint64_t cumulative = 0;
+
+			if (!req->count)
+				continue;
+
+			/* Empty buckets don't add information, leave them out. */
+			for (size_t i = 0; i < STATS_HIST_BUCKETS - 1; i++) {
+				if (!req->hist[i])
+					continue;
+
+				cumulative += req->hist[i];
+				stats_printf(&b, "lxcfs_request_duration_seconds_bucket{op=\"%s\",path=\"%s\",le=\"%" PRIu64 "e-06\"} %" PRIu64 "\n",
+					     stats_ops[op], stats_paths[p], stats_bucket_le(i), cumulative);
+			}
+			stats_printf(&b, "lxcfs_request_duration_seconds_bucket{op=\"%s\",path=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+				     stats_ops[op], stats_paths[p], req->count);
+			stats_printf(&b, "lxcfs_request_duration_seconds_sum{op=\"%s\",path=\"%s\"} %" PRIu64 ".%09" PRIu64 "\n",
+				     stats_ops[op], stats_paths[p], req->nsecs / 1000000000, req->nsecs % 1000000000);
+			stats_printf(&b, "lxcfs_request_duration_seconds_count{op=\"%s\",path=\"%s\"} %" PRIu64 "\n",
+				     stats_ops[op], stats_paths[p], req->count);
+		}
+	}
+
+	stats_printf(&b, "# HELP lxcfs_library_init_seconds Time it took to initialize the loaded liblxcfs.\n"
+			 "# TYPE lxcfs_library_init_seconds gauge\n"
+			 "lxcfs_library_init_seconds %" PRIu64 ".%06" PRIu64 "\n",
+		     liblxcfs_init_usecs() / 1000000,
+		     liblxcfs_init_usecs() % 1000000);
+	stats_counter(&b, "lxcfs_initpid_store_hits_total", "counter",
+		      "Init pid lookups answered from the store.",
+		      sum->counters[STATS_INITPID_HIT]);
+	stats_counter(&b, "lxcfs_initpid_store_misses_total", "counter",
+		      "Init pid lookups that had to search for the init process.",
+		      sum->counters[STATS_INITPID_MISS]);
+	stats_counter(&b, "lxcfs_initpid_forks_total", "counter",
+		      "Children forked to find an init pid.",
+		      sum->counters[STATS_INITPID_FORK]);
+	stats_counter(&b, "lxcfs_loadavg_cycles_total", "counter",
+		      "Completed loadavg refresh cycles.",
+		      sum->counters[STATS_LOADAVG_CYCLES]);
+	stats_printf(&b, "# HELP lxcfs_loadavg_cycle_seconds_total Time spent in loadavg refresh cycles.\n"
+			 "# TYPE lxcfs_loadavg_cycle_seconds_total counter\n"
+			 "lxcfs_loadavg_cycle_seconds_total %" PRIu64 ".%03" PRIu64 "\n",
+		     sum->counters[STATS_LOADAVG_CYCLE_MSECS] / 1000,
+		     sum->counters[STATS_LOADAVG_CYCLE_MSECS] % 1000);
+	stats_counter(&b, "lxcfs_loadavg_idle_skips_total", "counter",
+		      "Refreshes of unread loadavg cgroups that were skipped.",
+		      sum->counters[STATS_LOADAVG_IDLE_SKIPS]);
+	stats_counter(&b, "lxcfs_loadavg_nodes", "gauge",
+		      "Cgroups tracked by loadavg.", load_nr_nodes());
+	stats_counter(&b, "lxcfs_cpuview_nodes", "gauge",
+		      "Cgroups tracked by the cpu view.", cpuview_nr_nodes());
+	stats_counter(&b, "lxcfs_render_cache_hits_total", "counter",
+		      "Reads served from the render cache.",
+		      sum->counters[STATS_RENDER_CACHE_HIT]);
+	stats_counter(&b, "lxcfs_render_cache_misses_total", "counter",
+		      "Reads the render cache couldn't serve.",
+		      sum->counters[STATS_RENDER_CACHE_MISS]);
+	stats_counter(&b, "lxcfs_cpuinfo_view_hits_total", "counter",
+		      "cpuinfo reads served from a rendered view.",
+		      sum->counters[STATS_CPUINFO_VIEW_HIT]);
+	stats_counter(&b, "lxcfs_cpuinfo_view_misses_total", "counter",
+		      "cpuinfo reads that had to render a view.",
+		      sum->counters[STATS_CPUINFO_VIEW_MISS]);
+
+	stats_fuse_config(&b);
+
+	*len = b.len;
+	return b.buf;
+}
+
+int stats_getattr(const char *path, struct stat *sb)
+{
+	struct timespec now;
+
+	if (strcmp(path, LXCFS_STATS_PATH) != 0)
+		return -ENOENT;
+
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+		return -EINVAL;
+
+	memset(sb, 0, sizeof(struct stat));
+	sb->st_uid = sb->st_gid = 0;
+	sb->st_atim = sb->st_mtim = sb->st_ctim = now;
+	sb->st_mode = S_IFREG | 00400;
+	sb->st_nlink = 1;
+	/* The size changes with every read, see proc_getattr(). */
+	sb->st_size = 4096;
+
+	return 0;
+}
+
+/* Render at open so all reads through a handle see the same snapshot. */
+int stats_open(const char *path, struct fuse_file_info *fi)
+{
+	__do_free struct file_info *info = NULL;
+	size_t len;
+
+	if (strcmp(path, LXCFS_STATS_PATH) != 0)
+		return -ENOENT;
+
+	if (fuse_get_context()->uid != 0)
+		return -EACCES;
+
+	info = zalloc(sizeof(*info));
+	if (!info)
+		return -ENOMEM;
+
+	info->type = -1;
+	info->buf = stats_render(&len);
+	if (!info->buf)
+		return -ENOMEM;
+	info->buflen = len;
+	info->size = len;
+
+	fi->fh = PTR_TO_UINT64(move_ptr(info));
+	fi->direct_io = 1;
+	return 0;
+}
+
+int stats_read(const char *path, char *buf, size_t size, off_t offset,
+	       struct fuse_file_info *fi)
+{
+	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
+	size_t left;
+
+	if (offset < 0 || offset >= d->size)
+		return 0;
+
+	left = d->size - offset;
+	if (left > size)
+		left = size;
+	memcpy(buf, d->buf + offset, left);
+
+	return left;
+}
+
+int stats_release(const char *path, struct fuse_file_info *fi)
+{
+	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
+
+	if (d) {
+		free_disarm(d->buf);
+		free(d);
+	}
+	fi->fh = 0;
+
+	return 0;
+}
+
+void free_stats(void)
+{
+	struct stats_slot *slot, *next;
+
+	if (stats_key_valid) {
+		pthread_key_delete(stats_slot_key);
+		stats_key_valid = false;
+	}
+
+	pthread_mutex_lock(&stats_slots_lock);
+	for (slot = stats_slots; slot; slot = next) {
+		next = slot->next;
+		free(slot);
+	}
+	stats_slots = NULL;
+	pthread_mutex_unlock(&stats_slots_lock);
+}
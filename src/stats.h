@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_STATS_H
+#define __LXCFS_STATS_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <fuse.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "macro.h"
+
+#define LXCFS_STATS_PATH "/lxcfs-stats"
+
+/* Requests timed by the dispatchers in lxcfs.c. */
+enum lxcfs_stats_op {
+	LXCFS_OP_GETATTR,
+	LXCFS_OP_READDIR,
+	LXCFS_OP_OPEN,
+	LXCFS_OP_READ,
+	LXCFS_OP_MAX,
+};
+
+/* Counters bumped by the subsystems. */
+enum lxcfs_stats_counter {
+	STATS_INITPID_HIT,
+	STATS_INITPID_MISS,
+	STATS_INITPID_FORK,
+	STATS_LOADAVG_CYCLES,
+	STATS_LOADAVG_CYCLE_MSECS,
+	STATS_LOADAVG_IDLE_SKIPS,
+	STATS_RENDER_CACHE_HIT,
+	STATS_RENDER_CACHE_MISS,
+	STATS_CPUINFO_VIEW_HIT,
+	STATS_CPUINFO_VIEW_MISS,
+	STATS_COUNTER_MAX,
+};
+
+extern void stats_add(enum lxcfs_stats_counter counter, uint64_t v);
+static inline void stats_inc(enum lxcfs_stats_counter counter)
+{
+	stats_add(counter, 1);
+}
+extern void free_stats(void);
+
+__visible extern void stats_request(int op, const char *path, int ret,
+				    uint64_t nsecs);
+__visible extern int stats_getattr(const char *path, struct stat *sb);
+__visible extern int stats_open(const char *path, struct fuse_file_info *fi);
+__visible extern int stats_read(const char *path, char *buf, size_t size,
+				off_t offset, struct fuse_file_info *fi);
+__visible extern int stats_release(const char *path, struct fuse_file_info *fi);
+
+#endif /* __LXCFS_STATS_H */
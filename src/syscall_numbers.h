@@ -115,4 +115,38 @@
 	#endif
 #endif
 
+#ifndef __NR_memfd_create
+	#if defined __i386__
+		#define __NR_memfd_create 356
+	#elif defined __x86_64__
+		#define __NR_memfd_create 319
+	#elif defined __arm__
+		#define __NR_memfd_create 385
+	#elif defined __aarch64__
+		#define __NR_memfd_create 279
+	#elif defined __s390__
+		#define __NR_memfd_create 350
+	#elif defined __powerpc__
+		#define __NR_memfd_create 360
+	#elif defined __sparc__
+		#define __NR_memfd_create 348
+	#elif defined __ia64__
+		#define __NR_memfd_create 1340
+	#elif defined __alpha__
+		#define __NR_memfd_create 512
+	#elif defined _MIPS_SIM
+		#if _MIPS_SIM == _MIPS_SIM_ABI32	/* o32 */
+			#define __NR_memfd_create 4354
+		#endif
+		#if _MIPS_SIM == _MIPS_SIM_NABI32	/* n32 */
+			#define __NR_memfd_create 6318
+		#endif
+		#if _MIPS_SIM == _MIPS_SIM_ABI64	/* n64 */
+			#define __NR_memfd_create 5314
+		#endif
+	#else
+		#define __NR_memfd_create 279
+	#endif
+#endif
+
 #endif /* __LXCFS_SYSCALL_NUMBERS_H */
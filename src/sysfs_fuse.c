@@ -112,8 +112,10 @@ static int sys_devices_system_cpu_online_read(char *buf, size_t size,
 	} else {
 		total_len = snprintf(d->buf, d->buflen, "%s\n", cpuset);
 	}
-	if (total_len < 0 || total_len >= d->buflen)
+	if (total_len < 0)
 		return log_error(0, "Failed to write to cache");
+	if (total_len >= d->buflen)
+		return -E2BIG;
 
 	d->size = (int)total_len;
 	d->cached = 1;
@@ -126,23 +128,6 @@ static int sys_devices_system_cpu_online_read(char *buf, size_t size,
 	return total_len;
 }
 
-static off_t get_sysfile_size(const char *which)
-{
-	__do_fclose FILE *f = NULL;
-	__do_free char *line = NULL;
-	size_t len = 0;
-	ssize_t sz, answer = 0;
-
-	f = fopen(which, "re");
-	if (!f)
-		return 0;
-
-	while ((sz = getline(&line, &len, f)) != -1)
-		answer += sz;
-
-	return answer;
-}
-
 __lxcfs_fuse_ops int sys_getattr(const char *path, struct stat *sb)
 {
 	struct timespec now;
@@ -250,13 +235,8 @@ __lxcfs_fuse_ops int sys_open(const char *path, struct fuse_file_info *fi)
 	memset(info, 0, sizeof(*info));
 	info->type = type;
 
-	info->buflen = get_sysfile_size(path) + BUF_RESERVE_SIZE;
-
-	info->buf = malloc(info->buflen);
-	if (!info->buf)
-		return -ENOMEM;
-
-	memset(info->buf, 0, info->buflen);
+	/* The buffer is allocated on the first read. */
+	info->buflen = file_size_hint(type, path);
 	/* set actual size to buffer size */
 	info->size = info->buflen;
 
@@ -298,11 +278,14 @@ __lxcfs_fuse_ops int sys_releasedir(const char *path, struct fuse_file_info *fi)
 	return 0;
 }
 
-__lxcfs_fuse_ops int sys_read(const char *path, char *buf, size_t size,
-			      off_t offset, struct fuse_file_info *fi)
+static int do_sys_read(char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi)
 {
 	struct file_info *f = INTTYPE_TO_PTR(fi->fh);
 
+	if (!offset && file_info_buf_alloc(f) < 0)
+		return -ENOMEM;
+
 	switch (f->type) {
 	case LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE:
 		if (liblxcfs_functional())
@@ -320,3 +303,19 @@ __lxcfs_fuse_ops int sys_read(const char *path, char *buf, size_t size,
 
 	return -EINVAL;
 }
+
+__lxcfs_fuse_ops int sys_read(const char *path, char *buf, size_t size,
+			      off_t offset, struct fuse_file_info *fi)
+{
+	struct file_info *f = INTTYPE_TO_PTR(fi->fh);
+	int ret;
+
+	do {
+		ret = do_sys_read(buf, size, offset, fi);
+	} while (ret == -E2BIG && !offset && file_info_buf_grow(f) == 0);
+
+	if (ret == -E2BIG)
+		return log_error(0, "Write to cache was truncated");
+
+	return ret;
+}
@@ -23,6 +23,7 @@
 #include <fcntl.h>
 #include <fuse.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -39,6 +40,7 @@
 #include "bindings.h"
 #include "macro.h"
 #include "memory_utils.h"
+#include "proc_cache.h"
 #include "utils.h"
 
 /*
@@ -68,12 +70,18 @@ char *must_strcat(char **src, size_t *sz, size_t *asz, const char *format, ...)
 	va_end(args);
 
 	if (!*src || tmplen + *sz + 1 >= *asz) {
+		/* Grow geometrically so appending n entries stays linear. */
+		size_t new_asz = *asz ? *asz * 2 : BUF_RESERVE_SIZE;
 		char *str;
+
+		while (tmplen + *sz + 1 >= new_asz)
+			new_asz *= 2;
+
 		do {
-			str = realloc(*src, *asz + BUF_RESERVE_SIZE);
+			str = realloc(*src, new_asz);
 		} while (!str);
 		*src = str;
-		*asz += BUF_RESERVE_SIZE;
+		*asz = new_asz;
 	}
 	memcpy((*src) +*sz , tmp, tmplen+1); /* include the \0 */
 	*sz += tmplen;
@@ -165,6 +173,194 @@ int preserve_ns(const int pid, const char *ns)
 	return open(path, O_RDONLY | O_CLOEXEC);
 }
 
+/*
+ * Render buffers come in power of two size classes and are recycled when a
+ * file is released so opening a file rarely has to go back to malloc() or,
+ * for the large ones, mmap(). Anything bigger than the largest class is
+ * plain malloc()ed memory. Every buffer can be handed to free().
+ */
+#define BUF_POOL_MIN_SHIFT 12
+#define BUF_POOL_CLASSES 10
+#define BUF_POOL_DEPTH 4
+
+struct buf_pool_class {
+	pthread_mutex_t lock;
+	unsigned int nr;
+	char *bufs[BUF_POOL_DEPTH];
+};
+
+static struct buf_pool_class buf_pool[BUF_POOL_CLASSES] = {
+	[0 ... BUF_POOL_CLASSES - 1] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	},
+};
+
+/*
+ * Buffer sizes by file type so opening a file doesn't have to read the
+ * host's file just to find out how much room rendering it takes. Raised
+ * whenever a render didn't fit.
+ */
+static int file_size_hints[LXC_TYPE_MAX];
+
+static inline size_t buf_pool_size(int class)
+{
+	return (size_t)1 << (class + BUF_POOL_MIN_SHIFT);
+}
+
+static int buf_pool_class(size_t size)
+{
+	int class = 0;
+
+	while (class < BUF_POOL_CLASSES && buf_pool_size(class) < size)
+		class++;
+
+	return class;
+}
+
+static char *buf_pool_get(size_t *size)
+{
+	int class = buf_pool_class(*size);
+	char *buf = NULL;
+
+	if (class < BUF_POOL_CLASSES) {
+		struct buf_pool_class *c = &buf_pool[class];
+
+		*size = buf_pool_size(class);
+		pthread_mutex_lock(&c->lock);
+		if (c->nr)
+			buf = c->bufs[--c->nr];
+		pthread_mutex_unlock(&c->lock);
+		if (buf)
+			return buf;
+	}
+
+	return malloc(*size);
+}
+
+static void buf_pool_put(char *buf, size_t size)
+{
+	int class;
+
+	if (!buf)
+		return;
+
+	class = buf_pool_class(size);
+	if (class < BUF_POOL_CLASSES && buf_pool_size(class) == size) {
+		struct buf_pool_class *c = &buf_pool[class];
+
+		pthread_mutex_lock(&c->lock);
+		if (c->nr < BUF_POOL_DEPTH)
+			c->bufs[c->nr++] = move_ptr(buf);
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	free(buf);
+}
+
+void free_buf_pool(void)
+{
+	for (int i = 0; i < BUF_POOL_CLASSES; i++) {
+		struct buf_pool_class *c = &buf_pool[i];
+
+		pthread_mutex_lock(&c->lock);
+		while (c->nr)
+			free(c->bufs[--c->nr]);
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+static off_t get_file_size(const char *path)
+{
+	__do_fclose FILE *f = NULL;
+	__do_free char *line = NULL;
+	size_t len = 0;
+	ssize_t sz, answer = 0;
+
+	f = fopen(path, "re");
+	if (!f)
+		return 0;
+
+	while ((sz = getline(&line, &len, f)) != -1)
+		answer += sz;
+
+	return answer;
+}
+
+/* Initial buffer size for a file of @type backed by host file @path. */
+int file_size_hint(int type, const char *path)
+{
+	int hint;
+
+	hint = __atomic_load_n(&file_size_hints[type], __ATOMIC_RELAXED);
+	if (!hint) {
+		/* Only the first open of each type measures the host file. */
+		hint = get_file_size(path) + BUF_RESERVE_SIZE;
+		__atomic_store_n(&file_size_hints[type], hint, __ATOMIC_RELAXED);
+	}
+
+	return hint;
+}
+
+static void file_size_hint_raise(int type, int size)
+{
+	int hint;
+
+	hint = __atomic_load_n(&file_size_hints[type], __ATOMIC_RELAXED);
+	while (hint < size &&
+	       !__atomic_compare_exchange_n(&file_size_hints[type], &hint, size,
+					    true, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+/* Make sure @d has a buffer of at least @d->buflen bytes to render into. */
+int file_info_buf_alloc(struct file_info *d)
+{
+	size_t size = d->buflen;
+
+	if (d->buf)
+		return 0;
+
+	d->buf = buf_pool_get(&size);
+	if (!d->buf)
+		return -ENOMEM;
+	d->buflen = size;
+
+	return 0;
+}
+
+/*
+ * Called when rendering into @d->buf ran out of space. Replace the buffer
+ * with one twice the size and remember that files of this type need it.
+ * Returns 0 if rendering should be retried.
+ */
+int file_info_buf_grow(struct file_info *d)
+{
+	if (d->buflen >= FILE_INFO_BUF_MAX)
+		return -E2BIG;
+
+	file_info_buf_free(d);
+	d->buflen *= 2;
+	if (file_info_buf_alloc(d) < 0)
+		return -ENOMEM;
+
+	if (d->type >= 0 && d->type < LXC_TYPE_MAX)
+		file_size_hint_raise(d->type, d->buflen);
+
+	return 0;
+}
+
+void file_info_buf_free(struct file_info *d)
+{
+	if (d->shared) {
+		proc_cache_put(move_ptr(d->shared));
+		d->buf = NULL;
+		return;
+	}
+
+	buf_pool_put(move_ptr(d->buf), d->buflen);
+}
+
 void do_release_file_info(struct fuse_file_info *fi)
 {
 	struct file_info *f;
@@ -178,7 +374,7 @@ void do_release_file_info(struct fuse_file_info *fi)
 	free_disarm(f->controller);
 	free_disarm(f->cgroup);
 	free_disarm(f->file);
-	free_disarm(f->buf);
+	file_info_buf_free(f);
 	free_disarm(f);
 }
 
@@ -220,7 +416,7 @@ again:
 	return true;
 }
 
-bool recv_creds(int sock, struct ucred *cred, char *v)
+bool recv_creds(int sock, struct ucred *cred, char *v, bool pingfirst)
 {
 	struct msghdr msg = {};
 	struct iovec iov;
@@ -246,9 +442,11 @@ bool recv_creds(int sock, struct ucred *cred, char *v)
 	if (ret < 0)
 		return log_error(false, "Failed to set passcred: %s\n", strerror(errno));
 
-	ret = write_nointr(sock, &buf, sizeof(buf));
-	if (ret != sizeof(buf))
-		return log_error(false, "Failed to start write on scm fd: %s\n", strerror(errno));
+	if (pingfirst) {
+		ret = write_nointr(sock, &buf, sizeof(buf));
+		if (ret != sizeof(buf))
+			return log_error(false, "Failed to start write on scm fd: %s\n", strerror(errno));
+	}
 
 	if (!wait_for_sock(sock, 2))
 		return log_error(false, "Timed out waiting for scm_cred: %s\n", strerror(errno));
@@ -335,7 +533,7 @@ int read_file_fuse(const char *path, char *buf, size_t size, struct file_info *d
 		if (l < 0)
 			return log_error(0, "Failed to write cache");
 		if (l >= cache_size)
-			return log_error(0, "Write to cache was truncated");
+			return -E2BIG;
 
 		cache += l;
 		cache_size -= l;
@@ -418,7 +616,7 @@ again:
 	return 0;
 }
 
-static ssize_t read_nointr(int fd, void *buf, size_t count)
+ssize_t read_nointr(int fd, void *buf, size_t count)
 {
 	ssize_t ret;
 again:
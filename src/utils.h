@@ -16,6 +16,7 @@
 #include <fuse.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -28,6 +29,8 @@
 
 /* Reserve buffer size to account for file size changes. */
 #define BUF_RESERVE_SIZE 512
+/* Give up growing a file_info buffer beyond this size. */
+#define FILE_INFO_BUF_MAX (64 * 1024 * 1024)
 
 #define SEND_CREDS_OK 0
 #define SEND_CREDS_NOTSK 1
@@ -39,7 +42,12 @@ __attribute__((__format__(__printf__, 4, 5))) extern char *must_strcat(char **sr
 extern bool is_shared_pidns(pid_t pid);
 extern int preserve_ns(const int pid, const char *ns);
 extern void do_release_file_info(struct fuse_file_info *fi);
-extern bool recv_creds(int sock, struct ucred *cred, char *v);
+extern int file_info_buf_alloc(struct file_info *d);
+extern int file_info_buf_grow(struct file_info *d);
+extern void file_info_buf_free(struct file_info *d);
+extern void free_buf_pool(void);
+extern int file_size_hint(int type, const char *path);
+extern bool recv_creds(int sock, struct ucred *cred, char *v, bool pingfirst);
 extern int send_creds(int sock, struct ucred *cred, char v, bool pingfirst);
 extern bool wait_for_sock(int sock, int timeout);
 extern int read_file_fuse(const char *path, char *buf, size_t size,
@@ -56,6 +64,17 @@ static inline int pidfd_open(pid_t pid, unsigned int flags)
 }
 #endif
 
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef HAVE_MEMFD_CREATE
+static inline int memfd_create(const char *name, unsigned int flags)
+{
+	return syscall(__NR_memfd_create, name, flags);
+}
+#endif
+
 #ifndef HAVE_PIDFD_SEND_SIGNAL
 static inline int pidfd_send_signal(int pidfd, int sig, siginfo_t *info,
 				    unsigned int flags)
@@ -67,6 +86,7 @@ static inline int pidfd_send_signal(int pidfd, int sig, siginfo_t *info,
 extern FILE *fopen_cached(const char *path, const char *mode,
 			  void **caller_freed_buffer);
 extern FILE *fdopen_cached(int fd, const char *mode, void **caller_freed_buffer);
+extern ssize_t read_nointr(int fd, void *buf, size_t count);
 extern ssize_t write_nointr(int fd, const void *buf, size_t count);
 extern int safe_uint64(const char *numstr, uint64_t *converted, int base);
 extern char *trim_whitespace_in_place(char *buffer);
@@ -0,0 +1,629 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+/*
+ * Concurrent reader benchmark for a mounted lxcfs.
+ *
+ * Spawns a number of simulated containers, each in its own pid namespace
+ * and cgroup, with a number of reader threads each. Every thread keeps
+ * opening, reading and closing the benchmarked files round robin until the
+ * time is up. Reports throughput and latency percentiles per file and the
+ * CPU time lxcfs used meanwhile.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_FILES 16
+#define MAX_HIERARCHIES 16
+/* Log-linear latency histogram in nanoseconds, four buckets per power of two. */
+#define HIST_SUB 4
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct result {
+	uint64_t ops;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t hist[HIST_BUCKETS];
+};
+
+/*
+ * What a container reports back through memory shared with the parent, one
+ * slot per container. The cgroup file always comes last.
+ */
+struct report {
+	int nr_paths;
+	struct result results[MAX_FILES + 1];
+};
+
+static const char *lxcfs_dir = "/var/lib/lxcfs";
+static int nr_containers = 4;
+static int nr_threads = 4;
+static int seconds = 10;
+static bool use_namespaces = true;
+static pid_t lxcfs_pid = -1;
+
+static char *files[MAX_FILES];
+static int nr_files;
+
+static char *hierarchies[MAX_HIERARCHIES];
+static bool hierarchy_is_cpuset[MAX_HIERARCHIES];
+static int nr_hierarchies;
+
+static volatile bool stop;
+
+static const char *const default_files[] = {
+	"proc/meminfo",
+	"proc/stat",
+	"proc/cpuinfo",
+	"proc/loadavg",
+	"proc/uptime",
+	"sys/devices/system/cpu/online",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t hist_bucket(uint64_t ns)
+{
+	int order;
+
+	if (ns < HIST_SUB)
+		return ns;
+
+	order = 63 - __builtin_clzll(ns);
+	return (order - 1) * HIST_SUB + ((ns >> (order - 2)) & (HIST_SUB - 1));
+}
+
+/* Exclusive upper bound of @bucket in nanoseconds. */
+static uint64_t hist_bucket_le(size_t bucket)
+{
+	int order;
+
+	if (bucket < HIST_SUB)
+		return bucket + 1;
+
+	order = bucket / HIST_SUB + 1;
+	return (uint64_t)(HIST_SUB + 1 + bucket % HIST_SUB) << (order - 2);
+}
+
+static uint64_t percentile(const struct result *r, double q)
+{
+	uint64_t want = (uint64_t)(r->ops * q), seen = 0;
+
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		seen += r->hist[i];
+		if (seen > want)
+			return hist_bucket_le(i);
+	}
+
+	return 0;
+}
+
+static void result_add(struct result *dst, const struct result *src)
+{
+	dst->ops += src->ops;
+	dst->errors += src->errors;
+	dst->bytes += src->bytes;
+	for (size_t i = 0; i < HIST_BUCKETS; i++)
+		dst->hist[i] += src->hist[i];
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, p, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		p += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static bool write_file(const char *path, const char *buf)
+{
+	int fd;
+	bool ret;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	ret = write_all(fd, buf, strlen(buf));
+	close(fd);
+	return ret;
+}
+
+static bool copy_file(const char *from, const char *to)
+{
+	char buf[4096];
+	ssize_t len;
+	int fd;
+
+	fd = open(from, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+
+	return write_file(to, buf);
+}
+
+/* Find all mounted cgroup hierarchies. */
+static void find_hierarchies(void)
+{
+	char line[4096];
+	FILE *f;
+
+	f = fopen("/proc/self/mounts", "re");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f) && nr_hierarchies < MAX_HIERARCHIES) {
+		char dev[256], mnt[PATH_MAX], type[64], opts[1024];
+
+		if (sscanf(line, "%255s %4095s %63s %1023s", dev, mnt, type, opts) != 4)
+			continue;
+
+		if (strcmp(type, "cgroup2") != 0 && strcmp(type, "cgroup") != 0)
+			continue;
+
+		/* Named hierarchies without controllers don't matter to lxcfs. */
+		if (strcmp(type, "cgroup") == 0 && strstr(opts, "name="))
+			continue;
+
+		hierarchy_is_cpuset[nr_hierarchies] = strcmp(type, "cgroup") == 0 &&
+						     strstr(opts, "cpuset");
+		hierarchies[nr_hierarchies++] = strdup(mnt);
+	}
+
+	fclose(f);
+}
+
+static void cgroup_name(char *buf, size_t len, const char *hierarchy, int container)
+{
+	snprintf(buf, len, "%s/lxcfs-bench.%d.%d", hierarchy, getpid(), container);
+}
+
+/* Move the calling process into a fresh cgroup for @container. */
+static void join_cgroups(pid_t ppid, int container)
+{
+	char path[PATH_MAX], file[PATH_MAX + 32], parent[PATH_MAX + 32], pid[32];
+
+	snprintf(pid, sizeof(pid), "%d", getpid());
+	for (int i = 0; i < nr_hierarchies; i++) {
+		snprintf(path, sizeof(path), "%s/lxcfs-bench.%d.%d", hierarchies[i], ppid, container);
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+			continue;
+
+		/* Legacy cpusets start out empty, inherit the parent's. */
+		if (hierarchy_is_cpuset[i]) {
+			snprintf(parent, sizeof(parent), "%s/cpuset.cpus", hierarchies[i]);
+			snprintf(file, sizeof(file), "%s/cpuset.cpus", path);
+			copy_file(parent, file);
+			snprintf(parent, sizeof(parent), "%s/cpuset.mems", hierarchies[i]);
+			snprintf(file, sizeof(file), "%s/cpuset.mems", path);
+			copy_file(parent, file);
+		}
+
+		snprintf(file, sizeof(file), "%s/cgroup.procs", path);
+		if (!write_file(file, pid))
+			fprintf(stderr, "Failed to join %s: %s\n", path, strerror(errno));
+	}
+}
+
+static void remove_cgroups(void)
+{
+	char path[PATH_MAX];
+
+	for (int c = 0; c < nr_containers; c++) {
+		for (int i = 0; i < nr_hierarchies; i++) {
+			cgroup_name(path, sizeof(path), hierarchies[i], c);
+			rmdir(path);
+		}
+	}
+}
+
+/*
+ * The tasks file of our own memory cgroup as seen through lxcfs. lxcfs shows
+ * the cgroup of a container's init as the root so depending on where our
+ * init lives the path to it differs. Pure unified layouts have no /cgroup.
+ */
+static char *own_tasks_file(void)
+{
+	char line[4096], path[PATH_MAX], *ret = NULL;
+	FILE *f;
+
+	f = fopen("/proc/self/cgroup", "re");
+	if (!f)
+		return NULL;
+
+	while (fgets(line, sizeof(line), f)) {
+		char *controllers, *cg;
+
+		line[strcspn(line, "\n")] = '\0';
+		controllers = strchr(line, ':');
+		if (!controllers)
+			continue;
+		cg = strchr(++controllers, ':');
+		if (!cg)
+			continue;
+		*cg++ = '\0';
+
+		if (!strstr(controllers, "memory"))
+			continue;
+
+		snprintf(path, sizeof(path), "cgroup/memory%s/tasks", cg);
+		if (access(path, R_OK) == 0)
+			ret = strdup(path);
+		else if (access("cgroup/memory/tasks", R_OK) == 0)
+			ret = strdup("cgroup/memory/tasks");
+		break;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+struct reader {
+	pthread_t thread;
+	int idx;
+	char **paths;
+	int nr_paths;
+	struct result results[MAX_FILES + 1];
+};
+
+static void *reader(void *arg)
+{
+	struct reader *r = arg;
+	char buf[65536];
+
+	for (int i = r->idx; !stop; i++) {
+		int file = i % r->nr_paths;
+		struct result *res = &r->results[file];
+		uint64_t start, bytes = 0;
+		ssize_t len;
+		int fd;
+
+		start = now_ns();
+		fd = open(r->paths[file], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			res->errors++;
+			continue;
+		}
+
+		while ((len = read(fd, buf, sizeof(buf))) > 0)
+			bytes += len;
+		close(fd);
+		if (len < 0) {
+			res->errors++;
+			continue;
+		}
+
+		res->ops++;
+		res->bytes += bytes;
+		res->hist[hist_bucket(now_ns() - start)]++;
+	}
+
+	return NULL;
+}
+
+/* Runs as the init process of a simulated container. */
+static int run_container(struct report *out)
+{
+	char *paths[MAX_FILES + 1];
+	struct reader *readers;
+	int nr_paths = 0;
+	char *tasks;
+
+	for (int i = 0; i < nr_files; i++)
+		if (asprintf(&paths[nr_paths++], "%s/%s", lxcfs_dir, files[i]) < 0)
+			return EXIT_FAILURE;
+
+	if (chdir(lxcfs_dir) < 0)
+		return EXIT_FAILURE;
+
+	tasks = own_tasks_file();
+	if (tasks && asprintf(&paths[nr_paths++], "%s/%s", lxcfs_dir, tasks) < 0)
+		return EXIT_FAILURE;
+
+	readers = calloc(nr_threads, sizeof(*readers));
+	if (!readers)
+		return EXIT_FAILURE;
+
+	for (int i = 0; i < nr_threads; i++) {
+		readers[i].idx = i;
+		readers[i].paths = paths;
+		readers[i].nr_paths = nr_paths;
+		if (pthread_create(&readers[i].thread, NULL, reader, &readers[i]))
+			return EXIT_FAILURE;
+	}
+
+	sleep(seconds);
+	stop = true;
+
+	for (int i = 0; i < nr_threads; i++) {
+		pthread_join(readers[i].thread, NULL);
+		for (int f = 0; f < nr_paths; f++)
+			result_add(&out->results[f], &readers[i].results[f]);
+	}
+	out->nr_paths = nr_paths;
+
+	return EXIT_SUCCESS;
+}
+
+static pid_t spawn_container(int container, struct report *out)
+{
+	pid_t ppid = getpid(), pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (pid > 0)
+		return pid;
+
+	join_cgroups(ppid, container);
+
+	if (use_namespaces) {
+		pid_t init;
+		int status;
+
+		if (unshare(CLONE_NEWPID) < 0) {
+			fprintf(stderr, "Failed to create pid namespace: %s\n", strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+
+		init = fork();
+		if (init < 0)
+			_exit(EXIT_FAILURE);
+
+		if (init == 0)
+			_exit(run_container(out));
+
+		if (waitpid(init, &status, 0) < 0 || !WIFEXITED(status))
+			_exit(EXIT_FAILURE);
+		_exit(WEXITSTATUS(status));
+	}
+
+	_exit(run_container(out));
+}
+
+static pid_t find_lxcfs(void)
+{
+	struct dirent *d;
+	pid_t pid = -1;
+	DIR *dir;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return -1;
+
+	while ((d = readdir(dir))) {
+		char path[PATH_MAX], comm[64] = {};
+		ssize_t len;
+		int fd;
+
+		if (d->d_name[0] < '0' || d->d_name[0] > '9')
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%s/comm", d->d_name);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		len = read(fd, comm, sizeof(comm) - 1);
+		close(fd);
+
+		if (len > 0 && strcmp(comm, "lxcfs\n") == 0) {
+			pid = atoi(d->d_name);
+			break;
+		}
+	}
+
+	closedir(dir);
+	return pid;
+}
+
+/* User plus system time of @pid in clock ticks. */
+static uint64_t cpu_ticks(pid_t pid)
+{
+	unsigned long long utime, stime;
+	char path[64], buf[4096], *p;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	/* Skip past the command name, it may contain spaces. */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+			 &utime, &stime) != 2)
+		return 0;
+
+	return utime + stime;
+}
+
+static void print_result(const char *name, const struct result *r, double wall)
+{
+	printf("%-36s %10.0f %9.2f %9.1f %9.1f %9.1f %8" PRIu64 "\n", name,
+	       r->ops / wall, r->bytes / wall / (1024 * 1024),
+	       percentile(r, 0.5) / 1000.0, percentile(r, 0.99) / 1000.0,
+	       percentile(r, 0.999) / 1000.0, r->errors);
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "Usage: %s [options]\n", me);
+	fprintf(stderr, "  -d DIR   lxcfs mountpoint (default /var/lib/lxcfs)\n");
+	fprintf(stderr, "  -c N     number of simulated containers (default 4)\n");
+	fprintf(stderr, "  -t N     reader threads per container (default 4)\n");
+	fprintf(stderr, "  -s N     seconds to run (default 10)\n");
+	fprintf(stderr, "  -f FILE  file to read relative to DIR, may be repeated\n");
+	fprintf(stderr, "  -p PID   pid of lxcfs to report CPU usage for, 0 to disable\n");
+	fprintf(stderr, "  -n       don't create pid namespaces and cgroups\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct result total = {}, per_file[MAX_FILES + 1] = {};
+	uint64_t start, ticks_before = 0, ticks_after = 0;
+	int opt, nr_paths = 0, failed = 0;
+	struct report *reports;
+	pid_t *pids;
+	double wall;
+
+	while ((opt = getopt(argc, argv, "d:c:t:s:f:p:nh")) != -1) {
+		switch (opt) {
+		case 'd':
+			lxcfs_dir = optarg;
+			break;
+		case 'c':
+			nr_containers = atoi(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'f':
+			if (nr_files == MAX_FILES)
+				usage(argv[0]);
+			files[nr_files++] = optarg;
+			break;
+		case 'p':
+			lxcfs_pid = atoi(optarg);
+			break;
+		case 'n':
+			use_namespaces = false;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nr_containers <= 0 || nr_threads <= 0 || seconds <= 0)
+		usage(argv[0]);
+
+	if (!nr_files)
+		for (size_t i = 0; i < sizeof(default_files) / sizeof(*default_files); i++)
+			files[nr_files++] = (char *)default_files[i];
+
+	if (use_namespaces)
+		find_hierarchies();
+
+	if (lxcfs_pid < 0)
+		lxcfs_pid = find_lxcfs();
+
+	pids = calloc(nr_containers, sizeof(*pids));
+	if (!pids)
+		return EXIT_FAILURE;
+
+	reports = mmap(NULL, nr_containers * sizeof(*reports), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (reports == MAP_FAILED)
+		return EXIT_FAILURE;
+
+	if (lxcfs_pid > 0)
+		ticks_before = cpu_ticks(lxcfs_pid);
+	start = now_ns();
+
+	for (int i = 0; i < nr_containers; i++) {
+		pids[i] = spawn_container(i, &reports[i]);
+		if (pids[i] < 0) {
+			fprintf(stderr, "Failed to spawn container %d: %s\n", i, strerror(errno));
+			failed++;
+		}
+	}
+
+	for (int i = 0; i < nr_containers; i++) {
+		int status;
+
+		if (pids[i] < 0)
+			continue;
+
+		/* Only containers that ran to completion filled in their report. */
+		if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status)) {
+			failed++;
+			continue;
+		}
+
+		if (reports[i].nr_paths > nr_paths)
+			nr_paths = reports[i].nr_paths;
+		for (int f = 0; f < reports[i].nr_paths; f++)
+			result_add(&per_file[f], &reports[i].results[f]);
+	}
+
+	wall = (now_ns() - start) / 1e9;
+	if (lxcfs_pid > 0)
+		ticks_after = cpu_ticks(lxcfs_pid);
+	if (use_namespaces)
+		remove_cgroups();
+
+	printf("%d containers x %d threads for %.1fs\n\n", nr_containers, nr_threads, wall);
+	printf("%-36s %10s %9s %9s %9s %9s %8s\n", "file", "ops/s", "MiB/s",
+	       "p50 us", "p99 us", "p999 us", "errors");
+	for (int f = 0; f < nr_paths; f++) {
+		print_result(f < nr_files ? files[f] : "cgroup tasks", &per_file[f], wall);
+		result_add(&total, &per_file[f]);
+	}
+	print_result("total", &total, wall);
+
+	if (lxcfs_pid > 0 && ticks_after >= ticks_before)
+		printf("\nlxcfs (pid %d) CPU usage: %.1f%% of one CPU\n", lxcfs_pid,
+		       100.0 * (ticks_after - ticks_before) / sysconf(_SC_CLK_TCK) / wall);
+
+	if (failed) {
+		fprintf(stderr, "%d containers failed\n", failed);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
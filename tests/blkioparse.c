@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "../src/blkio_parse.h"
+
+static void verify(bool condition) {
+	if (condition) {
+		printf(" PASS\n");
+	} else {
+		printf(" FAIL!\n");
+		exit(1);
+	}
+}
+
+int main() {
+	/* blkio.io_service_bytes_recursive */
+	const char *blkio = "8:0 Read 4096\n8:0 Write 8192\n8:0 Discard 0\n"
+			    "8:0 Total 12288\n253:1 Read 512\nTotal 12800\n";
+	/* io.stat */
+	const char *io_stat = "8:0 rbytes=1048576 wbytes=2097152 rios=16 wios=32 dbytes=0 dios=0\n"
+			      "259:3 rbytes=4096 wbytes=0 rios=1 wios=0 dbytes=8192 dios=2 unknown=7\n"
+			      "7:1 rbytes=x rios=5";
+	struct hash_table *devs;
+	struct blkio_dev *dev;
+
+	devs = blkio_devs_new();
+	printf("blkio file parses");
+	verify(devs && blkio_parse_buf(devs, BLKIO_SERVICE_BYTES, blkio) == 0);
+	dev = blkio_dev_find(devs, 8, 0);
+	printf("8:0 read and write bytes");
+	verify(dev && dev->v[BLKIO_SERVICE_BYTES][BLKIO_READ] == 4096 &&
+	       dev->v[BLKIO_SERVICE_BYTES][BLKIO_WRITE] == 8192 &&
+	       dev->v[BLKIO_SERVICE_BYTES][BLKIO_TOTAL] == 12288);
+	printf("8:0 counts towards the given file only");
+	verify(dev->v[BLKIO_SERVICED][BLKIO_READ] == 0);
+	dev = blkio_dev_find(devs, 253, 1);
+	printf("253:1 read bytes");
+	verify(dev && dev->v[BLKIO_SERVICE_BYTES][BLKIO_READ] == 512);
+	printf("untouched device is missing");
+	verify(!blkio_dev_find(devs, 8, 16));
+	free_blkio_devs(devs);
+
+	devs = blkio_devs_new();
+	printf("io.stat parses");
+	verify(devs && blkio_parse_buf(devs, 0, io_stat) == 0);
+	dev = blkio_dev_find(devs, 8, 0);
+	printf("8:0 bytes and ios");
+	verify(dev && dev->v[BLKIO_SERVICE_BYTES][BLKIO_READ] == 1048576 &&
+	       dev->v[BLKIO_SERVICE_BYTES][BLKIO_WRITE] == 2097152 &&
+	       dev->v[BLKIO_SERVICED][BLKIO_READ] == 16 &&
+	       dev->v[BLKIO_SERVICED][BLKIO_WRITE] == 32);
+	dev = blkio_dev_find(devs, 259, 3);
+	printf("259:3 discards and unknown keys");
+	verify(dev && dev->v[BLKIO_SERVICE_BYTES][BLKIO_DISCARD] == 8192 &&
+	       dev->v[BLKIO_SERVICED][BLKIO_DISCARD] == 2 &&
+	       dev->v[BLKIO_SERVICED][BLKIO_READ] == 1);
+	dev = blkio_dev_find(devs, 7, 1);
+	printf("7:1 skips the bad value");
+	verify(dev && dev->v[BLKIO_SERVICE_BYTES][BLKIO_READ] == 0 &&
+	       dev->v[BLKIO_SERVICED][BLKIO_READ] == 5);
+	free_blkio_devs(devs);
+}
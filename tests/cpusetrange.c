@@ -26,6 +26,38 @@ static void verify(bool condition) {
 	}
 }
 
+/* Check that @cpuset parses into exactly the @nr CPUs in @cpus. */
+static void verify_bitmap(const char *cpuset, const int *cpus, int nr)
+{
+	struct cpuset_bitmap *map;
+	int max = nr ? cpus[nr - 1] : -1;
+
+	map = cpuset_bitmap_parse(cpuset);
+	printf("bitmap of \"%s\" parses", cpuset);
+	verify(map != NULL);
+
+	printf("bitmap of \"%s\" has weight %d", cpuset, nr);
+	verify(map->weight == nr);
+
+	printf("bitmap of \"%s\" has %d bits", cpuset, max + 1);
+	verify(map->nr_cpus == max + 1);
+
+	for (int cpu = -1, i = 0; cpu <= max + 64; cpu++) {
+		bool want = i < nr && cpus[i] == cpu;
+
+		if (want)
+			i++;
+		if (cpuset_bitmap_test(map, cpu) != want) {
+			printf("%s%d in bitmap of \"%s\"", want ? "" : "NOT ", cpu, cpuset);
+			verify(false);
+		}
+	}
+	printf("bitmap of \"%s\" contains exactly its CPUs", cpuset);
+	verify(true);
+
+	free(map);
+}
+
 int main() {
 	char *a = "1,2";
 	char *b = "1-3,5";
@@ -55,4 +87,17 @@ int main() {
 	verify(!cpu_in_cpuset(6, d));
 	printf("NOT 6 in empty set(2)");
 	verify(!cpu_in_cpuset(6, e));
+
+	verify_bitmap(a, (int[]){1, 2}, 2);
+	verify_bitmap(b, (int[]){1, 2, 3, 5}, 4);
+	verify_bitmap(c, (int[]){1, 4, 5}, 3);
+	verify_bitmap(d, NULL, 0);
+	verify_bitmap(e, NULL, 0);
+	/* Overlapping ranges only count once, reversed ones still count. */
+	verify_bitmap("0-2,1-3", (int[]){0, 1, 2, 3}, 4);
+	verify_bitmap("3-1", (int[]){1, 2, 3}, 3);
+	/* Crossing word boundaries. */
+	verify_bitmap("63-65,127,128", (int[]){63, 64, 65, 127, 128}, 5);
+	/* Malformed ranges are skipped. */
+	verify_bitmap("1,x-3,5-", (int[]){1}, 1);
 }
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "../src/fmt.h"
+
+static void verify(bool condition) {
+	if (condition) {
+		printf(" PASS\n");
+	} else {
+		printf(" FAIL!\n");
+		exit(1);
+	}
+}
+
+/* Compare against printf for @v and its neighbours. */
+static bool check(uint64_t v)
+{
+	for (uint64_t d = 0; d < 3; d++) {
+		char want[64], got[64], *end;
+		uint64_t n = v + d - 1;
+
+		snprintf(want, sizeof(want), "%" PRIu64, n);
+		end = fmt_u64(got, n);
+		*end = '\0';
+		if (strcmp(want, got) != 0)
+			return false;
+
+		snprintf(want, sizeof(want), "%8" PRIu64, n);
+		end = fmt_u64_width(got, n, 8);
+		*end = '\0';
+		if (strcmp(want, got) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+int main() {
+	bool ok = true;
+	uint64_t p = 1;
+	char buf[64], *end;
+
+	printf("0 through 100000 match printf");
+	for (uint64_t v = 1; v <= 100001; v++)
+		ok &= check(v);
+	verify(ok);
+
+	printf("powers of ten match printf");
+	for (int i = 0; i < 20; i++, p *= 10)
+		ok &= check(p);
+	verify(ok);
+
+	printf("UINT64_MAX matches printf");
+	end = fmt_u64(buf, UINT64_MAX);
+	*end = '\0';
+	verify(strcmp(buf, "18446744073709551615") == 0);
+
+	printf("fmt_str appends literals");
+	end = fmt_str(buf, "cpu");
+	end = fmt_u64(end, 12);
+	end = fmt_str(end, " kB\n");
+	*end = '\0';
+	verify(strcmp(buf, "cpu12 kB\n") == 0);
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../src/kv_parse.h"
+
+struct stat_values {
+	uint64_t rss;
+	uint64_t rss_huge;
+	uint64_t cache;
+};
+
+static const struct kv_key keys[] = {
+	KV_KEY("total_rss",		struct stat_values, rss),
+	KV_KEY("total_rss_huge",	struct stat_values, rss_huge),
+	KV_KEY("total_cache",		struct stat_values, cache),
+};
+
+static const struct kv_table table = KV_TABLE(keys);
+
+static void verify(bool condition) {
+	if (condition) {
+		printf(" PASS\n");
+	} else {
+		printf(" FAIL!\n");
+		exit(1);
+	}
+}
+
+int main() {
+	const char *a = "cache 1\ntotal_rss_huge 2097152\ntotal_rss 4096\n"
+			"total_cache 18446744073709551615\ntotal_rss_hugepages 7";
+	const char *b = "total_rss 99999999999999999999\ntotal_cache x\n";
+	const char *c = "total_rss 1\ntotal_rss 2\ntotal_cache 3\ntotal_rss_huge 4\n";
+	struct stat_values v = {};
+	uint64_t val;
+	int fds[2];
+
+	printf("three keys in a");
+	verify(kv_parse_buf(&table, a, strlen(a), &v) == 3);
+	printf("total_rss is 4096");
+	verify(v.rss == 4096);
+	printf("total_rss_huge is 2097152");
+	verify(v.rss_huge == 2097152);
+	printf("total_cache is UINT64_MAX");
+	verify(v.cache == UINT64_MAX);
+
+	memset(&v, 0, sizeof(v));
+	printf("no keys in b");
+	verify(kv_parse_buf(&table, b, strlen(b), &v) == 0);
+	printf("overflow leaves total_rss alone");
+	verify(v.rss == 0);
+
+	memset(&v, 0, sizeof(v));
+	printf("duplicate key counts once in c");
+	verify(kv_parse_buf(&table, c, strlen(c), &v) == 3);
+
+	memset(&v, 0, sizeof(v));
+	printf("duplicate key doesn't stop reading c early");
+	verify(pipe(fds) == 0 &&
+	       write(fds[1], c, strlen(c)) == (ssize_t)strlen(c) &&
+	       close(fds[1]) == 0 &&
+	       kv_parse_fd(&table, fds[0], &v) == 3 && v.rss_huge == 4);
+	close(fds[0]);
+
+	printf("123abc parses as 123");
+	verify(kv_parse_u64("123abc", 6, &val) == 3 && val == 123);
+	printf("abc doesn't parse");
+	verify(kv_parse_u64("abc", 3, &val) == 0);
+}
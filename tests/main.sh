@@ -89,8 +89,16 @@ TESTCASE="test_read_proc.sh"
 RUNTEST ${dirname}/test_read_proc.sh
 TESTCASE="cpusetrange"
 RUNTEST ${dirname}/cpusetrange
+TESTCASE="kvparse"
+RUNTEST ${dirname}/kvparse
+TESTCASE="blkioparse"
+RUNTEST ${dirname}/blkioparse
+TESTCASE="fmt"
+RUNTEST ${dirname}/fmt
 TESTCASE="meminfo hierarchy"
 RUNTEST ${dirname}/test_meminfo_hierarchy.sh
+TESTCASE="recreated cgroup"
+RUNTEST ${dirname}/test_cgroup_recreate.sh
 TESTCASE="liblxcfs reloading"
 UNSHARE=0 RUNTEST ${dirname}/test_reload.sh
 TESTCASE="SIGUSR2 virtualization mode switching"
@@ -0,0 +1,452 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+/*
+ * In-process renderer benchmark for liblxcfs.
+ *
+ * Loads liblxcfs.so the way lxcfs does and calls the open, read and release
+ * handlers of the virtualized files directly, without FUSE or a mount in
+ * between. Host files the renderers read can be replaced by recorded
+ * fixtures so numbers are comparable across machines and commits:
+ *
+ *   DIR/proc/{meminfo,stat,cpuinfo,diskstats,swaps}
+ *   DIR/proc/cgroup                   our own /proc/<pid>/cgroup
+ *   DIR/sys/devices/system/cpu/online
+ *
+ * Missing fixtures leave the host file in place. The fixtures are bind
+ * mounted over the host files in a private mount namespace before the
+ * library is loaded, so this has to run as root. Cgroup files are read from
+ * the live hierarchies, a recorded /proc/cgroup must name a cgroup that
+ * exists on the host. Use -R DIR to record the current host files.
+ *
+ * Reports ns/op, allocations/op and bytes rendered per op for each file.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_FUSE3
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+#endif
+#else
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "bindings.h"
+
+#define READ_SIZE (128 * 1024)
+
+typedef int (*open_fn)(const char *, struct fuse_file_info *);
+typedef int (*read_fn)(const char *, char *, size_t, off_t, struct fuse_file_info *);
+typedef int (*release_fn)(const char *, struct fuse_file_info *);
+
+struct renderer {
+	const char *name;
+	const char *path;
+	/* Handlers prefix, "proc" or "sys". */
+	const char *ops;
+	open_fn open;
+	read_fn read;
+	release_fn release;
+};
+
+static struct renderer renderers[] = {
+	{ "meminfo",	"/proc/meminfo",			"proc" },
+	{ "stat",	"/proc/stat",				"proc" },
+	{ "cpuinfo",	"/proc/cpuinfo",			"proc" },
+	{ "diskstats",	"/proc/diskstats",			"proc" },
+	{ "swaps",	"/proc/swaps",				"proc" },
+	{ "online",	"/sys/devices/system/cpu/online",	"sys"  },
+};
+
+#define NR_RENDERERS (sizeof(renderers) / sizeof(*renderers))
+
+static struct lxcfs_opts opts = {
+	/* Every op has to render, the render cache would hide the work. */
+	.cache_ttl = 0,
+};
+
+static struct fuse_context context;
+
+/*
+ * liblxcfs resolves fuse_get_context() against its global scope, which
+ * starts with this executable when linked with -rdynamic.
+ */
+struct fuse_context *fuse_get_context(void)
+{
+	return &context;
+}
+
+/* Allocations made by the benchmarking thread while counting. */
+static __thread bool counting;
+static __thread uint64_t nr_allocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	if (counting)
+		nr_allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (counting)
+		nr_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (counting)
+		nr_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool copy_file(const char *from, const char *to)
+{
+	char buf[4096];
+	bool ret = true;
+	int in, out;
+
+	in = open(from, O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return false;
+
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) {
+		close(in);
+		return false;
+	}
+
+	for (;;) {
+		ssize_t len = read(in, buf, sizeof(buf));
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			ret = len == 0;
+			break;
+		}
+
+		if (write(out, buf, len) != len) {
+			ret = false;
+			break;
+		}
+	}
+
+	close(in);
+	if (close(out) < 0)
+		ret = false;
+	return ret;
+}
+
+static bool mkdir_p(const char *dir)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s", dir);
+	for (char *p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+			return false;
+		*p = '/';
+	}
+
+	return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static int record(const char *dir)
+{
+	char path[PATH_MAX];
+
+	for (size_t i = 0; i < NR_RENDERERS; i++) {
+		/* Fixtures mirror the host paths below @dir. */
+		snprintf(path, sizeof(path), "%s%s", dir, renderers[i].path);
+		*strrchr(path, '/') = '\0';
+		if (!mkdir_p(path)) {
+			fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		snprintf(path, sizeof(path), "%s%s", dir, renderers[i].path);
+		if (!copy_file(renderers[i].path, path)) {
+			fprintf(stderr, "Failed to record %s: %s\n", renderers[i].path,
+				strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/proc/cgroup", dir);
+	if (!copy_file("/proc/self/cgroup", path)) {
+		fprintf(stderr, "Failed to record /proc/self/cgroup: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	printf("Recorded fixtures in %s\n", dir);
+	return EXIT_SUCCESS;
+}
+
+static bool bind_fixture(const char *fixture, const char *target)
+{
+	if (access(fixture, R_OK) < 0)
+		return true;
+
+	if (mount(fixture, target, NULL, MS_BIND, NULL) < 0) {
+		fprintf(stderr, "Failed to bind %s over %s: %s\n", fixture, target,
+			strerror(errno));
+		return false;
+	}
+
+	printf("Using %s for %s\n", fixture, target);
+	return true;
+}
+
+static bool setup_fixtures(const char *dir)
+{
+	char path[PATH_MAX], self[64];
+
+	if (unshare(CLONE_NEWNS) < 0) {
+		fprintf(stderr, "Failed to create mount namespace: %s\n", strerror(errno));
+		return false;
+	}
+
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
+		fprintf(stderr, "Failed to make mounts private: %s\n", strerror(errno));
+		return false;
+	}
+
+	for (size_t i = 0; i < NR_RENDERERS; i++) {
+		snprintf(path, sizeof(path), "%s%s", dir, renderers[i].path);
+		if (!bind_fixture(path, renderers[i].path))
+			return false;
+	}
+
+	snprintf(path, sizeof(path), "%s/proc/cgroup", dir);
+	snprintf(self, sizeof(self), "/proc/%d/cgroup", getpid());
+	return bind_fixture(path, self);
+}
+
+static bool load_library(const char *lib)
+{
+	char sym[64];
+	void *handle;
+
+	handle = dlopen(lib, RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "Failed to load %s: %s\n", lib, dlerror());
+		return false;
+	}
+
+	for (size_t i = 0; i < NR_RENDERERS; i++) {
+		struct renderer *r = &renderers[i];
+
+		snprintf(sym, sizeof(sym), "%s_open", r->ops);
+		r->open = (open_fn)dlsym(handle, sym);
+		snprintf(sym, sizeof(sym), "%s_read", r->ops);
+		r->read = (read_fn)dlsym(handle, sym);
+		snprintf(sym, sizeof(sym), "%s_release", r->ops);
+		r->release = (release_fn)dlsym(handle, sym);
+		if (!r->open || !r->read || !r->release) {
+			fprintf(stderr, "Failed to find %s handlers: %s\n", r->ops, dlerror());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Open, read until EOF and release @r once. Returns the rendered size. */
+static ssize_t render(const struct renderer *r, char *buf)
+{
+	struct fuse_file_info fi = {
+		.flags = O_RDONLY,
+	};
+	ssize_t total = 0;
+	int ret;
+
+	ret = r->open(r->path, &fi);
+	if (ret < 0)
+		return ret;
+
+	for (;;) {
+		ret = r->read(r->path, buf, READ_SIZE, total, &fi);
+		if (ret <= 0)
+			break;
+		total += ret;
+		if (ret < READ_SIZE)
+			break;
+	}
+
+	r->release(r->path, &fi);
+	return ret < 0 ? ret : total;
+}
+
+static bool bench(const struct renderer *r, int iterations, char *buf)
+{
+	uint64_t start, ns, allocs;
+	ssize_t size;
+
+	/* Warm up lazily allocated tables and the initpid store. */
+	size = render(r, buf);
+	if (size < 0) {
+		printf("%-12s %s\n", r->name, strerror(-size));
+		return false;
+	}
+
+	nr_allocs = 0;
+	counting = true;
+	start = now_ns();
+	for (int i = 0; i < iterations; i++) {
+		size = render(r, buf);
+		if (size < 0)
+			break;
+	}
+	ns = now_ns() - start;
+	counting = false;
+	allocs = nr_allocs;
+
+	if (size < 0) {
+		printf("%-12s %s\n", r->name, strerror(-size));
+		return false;
+	}
+
+	printf("%-12s %12.0f %12.1f %12zd\n", r->name, (double)ns / iterations,
+	       (double)allocs / iterations, size);
+	return true;
+}
+
+static bool selected(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+
+	if (!list)
+		return true;
+
+	for (const char *p = list; *p;) {
+		const char *end = strchrnul(p, ',');
+
+		if ((size_t)(end - p) == len && strncmp(p, name, len) == 0)
+			return true;
+		p = *end ? end + 1 : end;
+	}
+
+	return false;
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "Usage: %s [options]\n", me);
+	fprintf(stderr, "  -l LIB   liblxcfs to load (default liblxcfs.so)\n");
+	fprintf(stderr, "  -f DIR   read host files from recorded fixtures in DIR\n");
+	fprintf(stderr, "  -R DIR   record the current host files to DIR and exit\n");
+	fprintf(stderr, "  -n N     iterations per file (default 10000)\n");
+	fprintf(stderr, "  -r LIST  comma separated files to render (default all)\n");
+	fprintf(stderr, "  -c       render with CFS quota based cpu views (like --enable-cfs)\n");
+	fprintf(stderr, "  -s       render with swap accounting turned off (like -u)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *lib = "liblxcfs.so", *fixtures = NULL, *only = NULL;
+	int opt, iterations = 10000, failed = 0;
+	char *buf;
+
+	while ((opt = getopt(argc, argv, "l:f:R:n:r:csh")) != -1) {
+		switch (opt) {
+		case 'l':
+			lib = optarg;
+			break;
+		case 'f':
+			fixtures = optarg;
+			break;
+		case 'R':
+			return record(optarg);
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'r':
+			only = optarg;
+			break;
+		case 'c':
+			opts.use_cfs = true;
+			break;
+		case 's':
+			opts.swap_off = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (iterations <= 0)
+		usage(argv[0]);
+
+	if (fixtures && !setup_fixtures(fixtures))
+		return EXIT_FAILURE;
+
+	context.pid = getpid();
+	context.uid = getuid();
+	context.gid = getgid();
+	context.private_data = &opts;
+
+	if (!load_library(lib))
+		return EXIT_FAILURE;
+
+	buf = malloc(READ_SIZE);
+	if (!buf)
+		return EXIT_FAILURE;
+
+	printf("\n%d iterations per file\n\n", iterations);
+	printf("%-12s %12s %12s %12s\n", "file", "ns/op", "allocs/op", "bytes");
+	for (size_t i = 0; i < NR_RENDERERS; i++) {
+		if (!selected(only, renderers[i].name))
+			continue;
+
+		if (!bench(&renderers[i], iterations, buf))
+			failed++;
+	}
+
+	free(buf);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
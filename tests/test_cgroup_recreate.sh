@@ -0,0 +1,48 @@
+#!/bin/sh
+# SPDX-License-Identifier: LGPL-2.1+
+
+set -eu
+[ -n "${DEBUG:-}" ] && set -x
+
+LXCFSDIR=${LXCFSDIR:-/var/lib/lxcfs}
+
+cg=$(uuidgen).$$
+
+cleanup() {
+	if [ $FAILED -eq 1 ]; then
+		exit 1
+	fi
+	exit 0
+}
+
+FAILED=1
+trap cleanup EXIT HUP INT TERM
+
+[ ! -d /sys/fs/cgroup/memory ] && exit 0
+echo "==> Setting up memory cgroup"
+initmemory=`awk -F: '/memory/ { print $3 }' /proc/1/cgroup`
+mempath=/sys/fs/cgroup/memory/${initmemory}
+rmdir ${mempath}/${cg} 2>/dev/null || true
+
+echo "==> Reading /proc/meminfo in the first cgroup"
+mkdir ${mempath}/${cg}
+echo 500000000 > ${mempath}/${cg}/memory.limit_in_bytes
+echo 1 > ${mempath}/${cg}/tasks
+m1=`awk '/^MemTotal:/ { print $2 }' ${LXCFSDIR}/proc/meminfo`
+
+echo "==> Recreating the cgroup with a different limit"
+echo 1 > ${mempath}/tasks
+rmdir ${mempath}/${cg}
+mkdir ${mempath}/${cg}
+echo 300000000 > ${mempath}/${cg}/memory.limit_in_bytes
+echo 1 > ${mempath}/${cg}/tasks
+m2=`awk '/^MemTotal:/ { print $2 }' ${LXCFSDIR}/proc/meminfo`
+
+echo "==> Confirming the new limit is used"
+[ $m1 -ne $m2 ]
+[ $m2 -eq $((300000000 / 1024)) ]
+
+echo 1 > ${mempath}/tasks
+rmdir ${mempath}/${cg}
+
+FAILED=0